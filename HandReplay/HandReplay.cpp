@@ -0,0 +1,204 @@
+// HandReplay.cpp : scans, dumps or replays hand history segments.
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include "../Poker/HandHistory.h"
+#include "../Poker/HandEvaluator.h"
+#include "../Poker/TableState.h"
+
+using namespace poker;
+
+namespace {
+
+struct Totals
+{
+	uint64_t hands = 0;
+	uint64_t bytes = 0;
+	uint64_t failed = 0;
+};
+
+std::string cardText(int card)
+{
+	static const char ranks[] = "23456789TJQKA";
+	static const char suits[] = "cdhs";
+	return std::string(1, ranks[cardRank(static_cast<Card>(card))]) + suits[cardSuit(static_cast<Card>(card))];
+}
+
+std::string cardsText(const std::vector<int>& cards)
+{
+	std::string text;
+	for (int card : cards)
+		text += (text.empty() ? "" : " ") + cardText(card);
+	return text;
+}
+
+void dump(const HandRecord& hand)
+{
+	static const char* actions[] = { "folds", "checks", "calls", "bets", "posts" };
+	static const char* streets[] = { "", "preflop", "flop", "turn", "river", "" };
+
+	std::cout << "hand " << hand.handId << " table " << hand.tableId << " blinds " << hand.smallBlind
+		<< "/" << hand.bigBlind << " button " << hand.button << "\n";
+	for (size_t seat = 0; seat < hand.players.size(); ++seat)
+	{
+		if (!hand.players[seat].empty())
+			std::cout << "  seat " << seat << " " << hand.players[seat] << " " << hand.stacks[seat]
+				<< " [" << cardsText(hand.holes[seat]) << "]\n";
+	}
+	for (auto& action : hand.actions)
+	{
+		bool known = action.action >= 0 && action.action <= action_post && action.street >= 0 && action.street <= street_showdown;
+		std::cout << "  " << (known ? streets[action.street] : "?") << " seat " << action.seat << " "
+			<< (known ? actions[action.action] : "?") << " " << action.amount << "\n";
+	}
+	std::cout << "  board [" << cardsText(hand.board) << "]\n";
+	if (!hand.deckSeed.empty())
+		std::cout << "  deck " << hand.deckSeed << "\n";
+	for (size_t seat = 0; seat < hand.results.size(); ++seat)
+	{
+		if (hand.results[seat])
+			std::cout << "  seat " << seat << " " << (hand.results[seat] > 0 ? "+" : "") << hand.results[seat] << "\n";
+	}
+}
+
+/// replays the chips of a hand, returns what does not add up or an empty string
+std::string verify(const HandRecord& hand)
+{
+	size_t seats = hand.players.size();
+	if (hand.stacks.size() != seats || hand.holes.size() != seats || hand.results.size() != seats)
+		return "seat vectors differ in size";
+	if (!hand.deckSeed.empty())
+	{
+		std::string error = verifyDeal(hand);
+		if (!error.empty())
+			return error;
+	}
+
+	std::vector<int64_t> paid(seats, 0);
+	std::vector<bool> folded(seats, false);
+	for (auto& action : hand.actions)
+	{
+		if (action.seat < 0 || static_cast<size_t>(action.seat) >= seats || hand.players[action.seat].empty())
+			return "action by an empty seat";
+		if (action.amount < 0)
+			return "negative amount";
+		paid[action.seat] += action.amount;
+		if (paid[action.seat] > hand.stacks[action.seat])
+			return "seat " + std::to_string(action.seat) + " paid more than its stack";
+		if (action.action == action_fold)
+			folded[action.seat] = true;
+	}
+
+	int64_t sum = 0;
+	int live = 0;
+	for (size_t seat = 0; seat < seats; ++seat)
+	{
+		sum += hand.results[seat];
+		if (hand.results[seat] + paid[seat] < 0)
+			return "seat " + std::to_string(seat) + " lost more than it paid";
+		if (!hand.players[seat].empty() && !folded[seat])
+			++live;
+	}
+	if (sum)
+		return "results do not sum to zero";
+
+	// at a showdown the best hand takes at least the main pot
+	if (live >= 2 && hand.board.size() == 5)
+	{
+		HandMask board = 0;
+		for (int card : hand.board)
+			board |= cardMask(static_cast<Card>(card));
+		HandRank best = 0;
+		for (size_t seat = 0; seat < seats; ++seat)
+		{
+			if (hand.players[seat].empty() || folded[seat])
+				continue;
+			HandMask hole = 0;
+			for (int card : hand.holes[seat])
+				hole |= cardMask(static_cast<Card>(card));
+			best = std::max(best, HandEvaluator::evaluate(hole | board));
+		}
+		for (size_t seat = 0; seat < seats; ++seat)
+		{
+			if (hand.players[seat].empty() || folded[seat])
+				continue;
+			HandMask hole = 0;
+			for (int card : hand.holes[seat])
+				hole |= cardMask(static_cast<Card>(card));
+			if (HandEvaluator::evaluate(hole | board) == best && hand.results[seat] + paid[seat] <= 0)
+				return "best hand at seat " + std::to_string(seat) + " won nothing";
+		}
+	}
+	return std::string();
+}
+
+}
+
+int main(int argc, char* argv[])
+{
+	if (argc < 3)
+	{
+		std::cerr << "usage: HandReplay <directory> scan|dump|replay|find <handId>" << std::endl;
+		return 2;
+	}
+	std::string directory = argv[1];
+	std::string mode = argv[2];
+	uint64_t wanted = mode == "find" && argc > 3 ? std::strtoull(argv[3], nullptr, 10) : 0;
+	bool convert = mode != "scan";
+
+	Totals totals;
+	auto begin = std::chrono::steady_clock::now();
+	for (uint32_t index = 1; segment::exists(directory, index); ++index)
+	{
+		try
+		{
+			SegmentReader reader(segment::path(directory, index));
+			const char* data;
+			uint32_t size;
+			uint32_t offset;
+			while (reader.next(data, size, offset))
+			{
+				++totals.hands;
+				totals.bytes += size;
+				if (!convert)
+					continue;
+
+				HandRecord hand;
+				msgpack::unpacked unpacked;
+				msgpack::unpack(unpacked, data, size);
+				unpacked.get().convert(&hand);
+
+				if (mode == "dump" || (mode == "find" && hand.handId == wanted))
+					dump(hand);
+				if (mode == "replay")
+				{
+					std::string error = verify(hand);
+					if (!error.empty())
+					{
+						++totals.failed;
+						std::cout << "hand " << hand.handId << " segment " << index << " offset " << offset << ": " << error << "\n";
+					}
+				}
+			}
+			if (reader.isTorn())
+				std::cout << "segment " << index << " torn at " << reader.getEnd() << "\n";
+		}
+		catch (std::exception& ex)
+		{
+			std::cerr << "segment " << index << ": " << ex.what() << std::endl;
+			++totals.failed;
+		}
+	}
+
+	double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+	std::cout << totals.hands << " hands, " << totals.bytes / (1024.0 * 1024.0) << " MB in " << seconds << " s, "
+		<< (seconds > 0 ? totals.bytes / seconds / (1024.0 * 1024.0) : 0) << " MB/s";
+	if (mode == "replay")
+		std::cout << ", " << totals.failed << " failed";
+	std::cout << std::endl;
+	return totals.failed ? 1 : 0;
+}
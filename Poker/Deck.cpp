@@ -0,0 +1,243 @@
+#include "Deck.h"
+#include <random>
+
+namespace poker {
+
+namespace {
+
+inline uint32_t rotl(uint32_t value, int shift)
+{
+	return (value << shift) | (value >> (32 - shift));
+}
+
+inline void quarterRound(uint32_t& a, uint32_t& b, uint32_t& c, uint32_t& d)
+{
+	a += b; d ^= a; d = rotl(d, 16);
+	c += d; b ^= c; b = rotl(b, 12);
+	a += b; d ^= a; d = rotl(d, 8);
+	c += d; b ^= c; b = rotl(b, 7);
+}
+
+}
+
+Seed randomSeed()
+{
+	// random_device is the OS source on MSVC and on libstdc++ with /dev/urandom
+	std::random_device device;
+	Seed seed;
+	for (size_t i = 0; i < seed.size(); i += 4)
+	{
+		uint32_t word = device();
+		for (size_t j = 0; j < 4; ++j)
+			seed[i + j] = static_cast<uint8_t>(word >> (8 * j));
+	}
+	return seed;
+}
+
+std::string seedToHex(const Seed& seed)
+{
+	static const char digits[] = "0123456789abcdef";
+	std::string hex;
+	for (uint8_t byte : seed)
+	{
+		hex += digits[byte >> 4];
+		hex += digits[byte & 15];
+	}
+	return hex;
+}
+
+bool seedFromHex(const std::string& hex, Seed& seed)
+{
+	if (hex.size() != seed.size() * 2)
+		return false;
+	for (size_t i = 0; i < seed.size(); ++i)
+	{
+		int value = 0;
+		for (size_t j = 0; j < 2; ++j)
+		{
+			char c = hex[i * 2 + j];
+			int digit = c >= '0' && c <= '9' ? c - '0' : c >= 'a' && c <= 'f' ? c - 'a' + 10 : -1;
+			if (digit < 0)
+				return false;
+			value = value * 16 + digit;
+		}
+		seed[i] = static_cast<uint8_t>(value);
+	}
+	return true;
+}
+
+ChaCha20::ChaCha20(const Seed& key, uint64_t nonce):
+	_pos(16)
+{
+	// "expand 32-byte k", key, 64 bit block counter, 64 bit nonce
+	_state[0] = 0x61707865;
+	_state[1] = 0x3320646e;
+	_state[2] = 0x79622d32;
+	_state[3] = 0x6b206574;
+	for (int i = 0; i < 8; ++i)
+	{
+		_state[4 + i] = key[i * 4] | (key[i * 4 + 1] << 8) | (key[i * 4 + 2] << 16)
+			| (static_cast<uint32_t>(key[i * 4 + 3]) << 24);
+	}
+	_state[12] = 0;
+	_state[13] = 0;
+	_state[14] = static_cast<uint32_t>(nonce);
+	_state[15] = static_cast<uint32_t>(nonce >> 32);
+}
+
+void ChaCha20::refill()
+{
+	uint32_t x[16];
+	for (int i = 0; i < 16; ++i)
+		x[i] = _state[i];
+	for (int round = 0; round < 10; ++round)
+	{
+		quarterRound(x[0], x[4], x[8], x[12]);
+		quarterRound(x[1], x[5], x[9], x[13]);
+		quarterRound(x[2], x[6], x[10], x[14]);
+		quarterRound(x[3], x[7], x[11], x[15]);
+		quarterRound(x[0], x[5], x[10], x[15]);
+		quarterRound(x[1], x[6], x[11], x[12]);
+		quarterRound(x[2], x[7], x[8], x[13]);
+		quarterRound(x[3], x[4], x[9], x[14]);
+	}
+	for (int i = 0; i < 16; ++i)
+		_block[i] = x[i] + _state[i];
+
+	if (!++_state[12])
+		++_state[13];
+	_pos = 0;
+}
+
+Deck makeDeck(const Seed& seed)
+{
+	Deck deck;
+	deck.seed = seed;
+	for (size_t i = 0; i < deck.cards.size(); ++i)
+		deck.cards[i] = static_cast<Card>(i);
+
+	ChaCha20 rng(seed, 0);
+	for (uint32_t i = static_cast<uint32_t>(deck.cards.size()) - 1; i > 0; --i)
+		std::swap(deck.cards[i], deck.cards[rng.below(i + 1)]);
+	return deck;
+}
+
+DeckStream::DeckStream(const Seed& tableSeed):
+	_seeds(tableSeed, 1),
+	_head(0),
+	_tail(0)
+{
+}
+
+bool DeckStream::take(Deck& deck)
+{
+	size_t head = _head.load(std::memory_order_relaxed);
+	if (head == _tail.load(std::memory_order_acquire))
+		return false;
+	deck = _ring[head % CAPACITY];
+	_head.store(head + 1, std::memory_order_release);
+	return true;
+}
+
+size_t DeckStream::fill(size_t count)
+{
+	size_t made = 0;
+	size_t tail = _tail.load(std::memory_order_relaxed);
+	while (made < count && tail - _head.load(std::memory_order_acquire) < CAPACITY)
+	{
+		Seed seed;
+		for (size_t i = 0; i < seed.size(); i += 4)
+		{
+			uint32_t word = _seeds.next();
+			for (size_t j = 0; j < 4; ++j)
+				seed[i + j] = static_cast<uint8_t>(word >> (8 * j));
+		}
+		_ring[tail % CAPACITY] = makeDeck(seed);
+		_tail.store(++tail, std::memory_order_release);
+		++made;
+	}
+	return made;
+}
+
+DeckService::DeckService(size_t batch):
+	_batch(batch),
+	_stopping(false),
+	_woken(false)
+{
+	_thread = std::thread([this]() { run(); });
+}
+
+DeckService::~DeckService()
+{
+	{
+		std::lock_guard<std::mutex> lock(_mtx);
+		_stopping = true;
+	}
+	_cond.notify_one();
+	_thread.join();
+}
+
+std::shared_ptr<DeckStream> DeckService::open()
+{
+	auto stream = std::make_shared<DeckStream>(randomSeed());
+	{
+		std::lock_guard<std::mutex> lock(_mtx);
+		_streams.push_back(stream);
+	}
+	wake();
+	return stream;
+}
+
+void DeckService::wake()
+{
+	{
+		std::lock_guard<std::mutex> lock(_mtx);
+		if (_woken)
+			return;
+		_woken = true;
+	}
+	_cond.notify_one();
+}
+
+void DeckService::run()
+{
+	std::vector<std::shared_ptr<DeckStream>> streams;
+	while (true)
+	{
+		{
+			std::unique_lock<std::mutex> lock(_mtx);
+			// a periodic pass too, wake() is only a hint
+			_cond.wait_for(lock, std::chrono::milliseconds(50), [this]() { return _stopping || _woken; });
+			if (_stopping)
+				return;
+			_woken = false;
+
+			streams.clear();
+			auto it = _streams.begin();
+			while (it != _streams.end())
+			{
+				if (auto stream = it->lock())
+				{
+					streams.push_back(stream);
+					++it;
+				}
+				else
+					it = _streams.erase(it);
+			}
+		}
+
+		// top up by batches, round robin so a busy table can not starve the rest
+		bool more = true;
+		while (more)
+		{
+			more = false;
+			for (auto& stream : streams)
+			{
+				if (stream->fill(_batch) == _batch)
+					more = true;
+			}
+		}
+	}
+}
+
+}
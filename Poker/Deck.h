@@ -0,0 +1,138 @@
+#pragma once
+#include <array>
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "HandEvaluator.h"
+
+namespace poker {
+
+typedef std::array<uint8_t, 32> Seed;
+
+/// fresh seed from the system's entropy source
+Seed randomSeed();
+
+std::string seedToHex(const Seed& seed);
+bool seedFromHex(const std::string& hex, Seed& seed);
+
+/// ChaCha20 keystream as 32 bit words, one independent stream per nonce.
+class ChaCha20
+{
+public:
+	ChaCha20(const Seed& key, uint64_t nonce);
+
+	uint32_t next();
+
+	/// uniform in [0, range), multiply and shift with rejection so there is no modulo bias
+	uint32_t below(uint32_t range);
+
+private:
+	void refill();
+
+	uint32_t _state[16];
+	uint32_t _block[16];
+	size_t _pos;
+};
+
+/// A shuffled deck and the seed that replays it.
+struct Deck
+{
+	Seed seed;
+	std::array<Card, 52> cards;
+};
+
+/// Fisher-Yates over the ChaCha20 stream of seed. Same seed, same deck,
+/// which is what an audit replays.
+Deck makeDeck(const Seed& seed);
+
+/// Decks of one table, made ahead by the DeckService. Each deck seed is
+/// drawn from the table's own stream, so a logged deck seed replays that
+/// deck without giving away the others.
+/// take() is for one consumer, the table strand.
+class DeckStream
+{
+public:
+	static const size_t CAPACITY = 16;
+
+	explicit DeckStream(const Seed& tableSeed);
+
+	/// false if none is ready, the caller makes one itself
+	bool take(Deck& deck);
+
+	size_t ready() const;
+
+private:
+	friend class DeckService;
+
+	/// service thread, adds up to count decks
+	size_t fill(size_t count);
+
+	ChaCha20 _seeds;
+	std::array<Deck, CAPACITY> _ring;
+	std::atomic<size_t> _head;		// next to take
+	std::atomic<size_t> _tail;		// next to fill
+};
+
+/// Refills the deck streams of all tables on a background thread, so
+/// dealing is a copy out of a ring instead of a shuffle.
+class DeckService
+{
+public:
+	explicit DeckService(size_t batch = DeckStream::CAPACITY);
+	~DeckService();
+
+	/// a new stream with a fresh table seed, kept full from now on
+	std::shared_ptr<DeckStream> open();
+
+	/// ask for a refill, cheap enough to call after each take
+	void wake();
+
+private:
+	DeckService(const DeckService&) = delete;
+	DeckService& operator=(const DeckService&) = delete;
+
+	void run();
+
+	size_t _batch;
+	std::mutex _mtx;
+	std::condition_variable _cond;
+	bool _stopping;
+	bool _woken;
+	std::vector<std::weak_ptr<DeckStream>> _streams;
+	std::thread _thread;
+};
+
+inline uint32_t ChaCha20::next()
+{
+	if (_pos == 16)
+		refill();
+	return _block[_pos++];
+}
+
+inline uint32_t ChaCha20::below(uint32_t range)
+{
+	uint64_t product = static_cast<uint64_t>(next()) * range;
+	uint32_t low = static_cast<uint32_t>(product);
+	if (low < range)
+	{
+		// reject the few values that would make some results more likely
+		uint32_t threshold = (0u - range) % range;
+		while (low < threshold)
+		{
+			product = static_cast<uint64_t>(next()) * range;
+			low = static_cast<uint32_t>(product);
+		}
+	}
+	return static_cast<uint32_t>(product >> 32);
+}
+
+inline size_t DeckStream::ready() const
+{
+	return _tail.load(std::memory_order_acquire) - _head.load(std::memory_order_relaxed);
+}
+
+}
@@ -0,0 +1,266 @@
+#include "EquityCalculator.h"
+#include <algorithm>
+#include <future>
+#include <random>
+
+namespace poker {
+
+namespace {
+
+struct Tally
+{
+	explicit Tally(size_t hands) : wins(hands), ties(hands), shares(hands) { }
+
+	std::vector<uint64_t> wins;
+	std::vector<uint64_t> ties;
+	std::vector<double> shares;
+	uint64_t samples = 0;
+};
+
+struct Job
+{
+	std::vector<HandMask> hands;
+	HandMask board;
+	int missing;
+	std::vector<Card> deck;			// cards left to complete the board from
+	bool exhaustive;
+
+	std::mutex mtx;
+	Tally total;
+	std::atomic<size_t> pending;
+	std::function<void(EquityResult)> done;
+
+	explicit Job(size_t hands) : total(hands), pending(0) { }
+};
+
+/// xorshift64*, one per thread so sampling tasks never share state
+class Rng
+{
+public:
+	Rng()
+	{
+		std::random_device rd;
+		_state = (uint64_t(rd()) << 32) ^ rd() ^ std::hash<std::thread::id>()(std::this_thread::get_id());
+		if (!_state)
+			_state = 0x9E3779B97F4A7C15ull;
+	}
+
+	uint64_t next()
+	{
+		_state ^= _state >> 12;
+		_state ^= _state << 25;
+		_state ^= _state >> 27;
+		return _state * 0x2545F4914F6CDD1Dull;
+	}
+
+	/// [0, range) by multiply and shift instead of a division
+	uint32_t below(uint32_t range)
+	{
+		return static_cast<uint32_t>(((next() >> 32) * range) >> 32);
+	}
+
+private:
+	uint64_t _state;
+};
+
+Rng& threadRng()
+{
+	thread_local Rng rng;
+	return rng;
+}
+
+inline void score(const std::vector<HandMask>& hands, HandMask board, Tally& tally)
+{
+	HandRank ranks[EquityCalculator::MAX_HANDS];
+	HandRank best = 0;
+	size_t winners = 0;
+	for (size_t i = 0; i < hands.size(); ++i)
+	{
+		ranks[i] = HandEvaluator::evaluate(hands[i] | board);
+		if (ranks[i] > best)
+		{
+			best = ranks[i];
+			winners = 1;
+		}
+		else if (ranks[i] == best)
+			++winners;
+	}
+
+	for (size_t i = 0; i < hands.size(); ++i)
+	{
+		if (ranks[i] != best)
+			continue;
+		if (winners == 1)
+		{
+			++tally.wins[i];
+			tally.shares[i] += 1.0;
+		}
+		else
+		{
+			++tally.ties[i];
+			tally.shares[i] += 1.0 / winners;
+		}
+	}
+	++tally.samples;
+}
+
+void enumerate(const Job& job, size_t start, int left, HandMask board, Tally& tally)
+{
+	if (!left)
+	{
+		score(job.hands, board, tally);
+		return;
+	}
+	for (size_t i = start; i + left <= job.deck.size(); ++i)
+		enumerate(job, i + 1, left - 1, board | cardMask(job.deck[i]), tally);
+}
+
+void sample(const Job& job, uint64_t count, Tally& tally)
+{
+	std::vector<Card> deck(job.deck);
+	uint32_t size = static_cast<uint32_t>(deck.size());
+	Rng& rng = threadRng();
+	for (uint64_t n = 0; n < count; ++n)
+	{
+		// partial Fisher-Yates, the deck stays a permutation between samples
+		HandMask board = job.board;
+		for (int j = 0; j < job.missing; ++j)
+		{
+			uint32_t k = j + rng.below(size - j);
+			std::swap(deck[j], deck[k]);
+			board |= cardMask(deck[j]);
+		}
+		score(job.hands, board, tally);
+	}
+}
+
+uint64_t combinations(uint64_t n, int k)
+{
+	uint64_t result = 1;
+	for (int i = 0; i < k; ++i)
+		result = result * (n - i) / (i + 1);
+	return result;
+}
+
+int countCards(HandMask mask)
+{
+	int count = 0;
+	for (; mask; mask &= mask - 1)
+		++count;
+	return count;
+}
+
+void finish(const std::shared_ptr<Job>& job, const Tally& tally)
+{
+	{
+		std::lock_guard<std::mutex> lock(job->mtx);
+		for (size_t i = 0; i < job->hands.size(); ++i)
+		{
+			job->total.wins[i] += tally.wins[i];
+			job->total.ties[i] += tally.ties[i];
+			job->total.shares[i] += tally.shares[i];
+		}
+		job->total.samples += tally.samples;
+	}
+	if (job->pending.fetch_sub(1) != 1)
+		return;
+
+	// last task out reports
+	EquityResult result;
+	result.samples = job->total.samples;
+	result.exhaustive = job->exhaustive;
+	double samples = result.samples ? static_cast<double>(result.samples) : 1.0;
+	for (size_t i = 0; i < job->hands.size(); ++i)
+	{
+		result.equity.push_back(job->total.shares[i] / samples);
+		result.win.push_back(job->total.wins[i] / samples);
+		result.tie.push_back(job->total.ties[i] / samples);
+	}
+	job->done(std::move(result));
+}
+
+}
+
+EquityCalculator::EquityCalculator(WorkStealingPool& pool, uint64_t exhaustiveLimit):
+	_pool(pool),
+	_exhaustiveLimit(exhaustiveLimit)
+{
+}
+
+void EquityCalculator::asyncCalculate(const std::vector<HandMask>& hands, HandMask board, HandMask dead, uint64_t samples,
+	std::function<void(EquityResult)> done)
+{
+	auto job = std::make_shared<Job>(hands.size());
+	job->hands = hands;
+	job->board = board;
+	job->missing = 5 - countCards(board);
+	job->done = done;
+
+	HandMask used = board | dead;
+	for (auto hand : hands)
+		used |= hand;
+	for (int card = 0; card < 52; ++card)
+	{
+		if (!(used & cardMask(static_cast<Card>(card))))
+			job->deck.push_back(static_cast<Card>(card));
+	}
+
+	uint64_t boards = combinations(job->deck.size(), job->missing);
+	// what the caller asks for does not decide the work, a client sends samples
+	job->exhaustive = boards <= _exhaustiveLimit;
+	if (!samples)
+		samples = DEFAULT_SAMPLES;
+	else if (samples > MAX_SAMPLES)
+		samples = MAX_SAMPLES;
+
+	if (job->exhaustive && job->missing > 0)
+	{
+		// one task per lowest card of the completion, stealing evens out their sizes
+		size_t tasks = job->deck.size() - job->missing + 1;
+		job->pending = tasks;
+		for (size_t first = 0; first < tasks; ++first)
+		{
+			_pool.submit([job, first]()
+			{
+				Tally tally(job->hands.size());
+				enumerate(*job, first + 1, job->missing - 1, job->board | cardMask(job->deck[first]), tally);
+				finish(job, tally);
+			});
+		}
+	}
+	else if (job->exhaustive)
+	{
+		job->pending = 1;
+		_pool.submit([job]()
+		{
+			Tally tally(job->hands.size());
+			score(job->hands, job->board, tally);
+			finish(job, tally);
+		});
+	}
+	else
+	{
+		size_t tasks = std::max<size_t>(_pool.size() * 4, 1);
+		job->pending = tasks;
+		for (size_t i = 0; i < tasks; ++i)
+		{
+			uint64_t count = samples / tasks + (i < samples % tasks ? 1 : 0);
+			_pool.submit([job, count]()
+			{
+				Tally tally(job->hands.size());
+				sample(*job, count, tally);
+				finish(job, tally);
+			});
+		}
+	}
+}
+
+EquityResult EquityCalculator::calculate(const std::vector<HandMask>& hands, HandMask board, HandMask dead, uint64_t samples)
+{
+	auto promise = std::make_shared<std::promise<EquityResult>>();
+	auto future = promise->get_future();
+	asyncCalculate(hands, board, dead, samples, [promise](EquityResult result) { promise->set_value(std::move(result)); });
+	return future.get();
+}
+
+}
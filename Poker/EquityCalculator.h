@@ -0,0 +1,47 @@
+#pragma once
+#include <functional>
+#include <vector>
+#include <msgpack.hpp>
+#include "HandEvaluator.h"
+#include "WorkStealingPool.h"
+
+namespace poker {
+
+/// per hand, in the order of the request
+struct EquityResult
+{
+	std::vector<double> equity;		// pot share, ties split
+	std::vector<double> win;		// boards won outright
+	std::vector<double> tie;		// boards shared
+	uint64_t samples = 0;
+	bool exhaustive = false;
+	MSGPACK_DEFINE(equity, win, tie, samples, exhaustive);
+};
+
+/// Hold'em all-in equity. Boards are enumerated when there are few enough,
+/// sampled otherwise, and the work is split over a WorkStealingPool.
+class EquityCalculator
+{
+public:
+	static const size_t MAX_HANDS = 10;
+	static const uint64_t DEFAULT_EXHAUSTIVE_LIMIT = 50000;	// every flop and turn, never preflop
+	static const uint64_t DEFAULT_SAMPLES = 100000;
+	static const uint64_t MAX_SAMPLES = 2000000;
+
+	explicit EquityCalculator(WorkStealingPool& pool, uint64_t exhaustiveLimit = DEFAULT_EXHAUSTIVE_LIMIT);
+
+	/// hands hold 2 cards each, all masks disjoint. Every board completion is
+	/// tried if there are no more than exhaustiveLimit, else samples random
+	/// ones, DEFAULT_SAMPLES for 0 and at most MAX_SAMPLES. done runs on a pool thread.
+	void asyncCalculate(const std::vector<HandMask>& hands, HandMask board, HandMask dead, uint64_t samples,
+		std::function<void(EquityResult)> done);
+
+	/// blocking form of asyncCalculate, not for the io thread
+	EquityResult calculate(const std::vector<HandMask>& hands, HandMask board, HandMask dead, uint64_t samples);
+
+private:
+	WorkStealingPool& _pool;
+	uint64_t _exhaustiveLimit;
+};
+
+}
@@ -0,0 +1,218 @@
+#include "HandEvaluator.h"
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define POKER_EVAL_SSE2
+#endif
+
+namespace poker {
+
+namespace {
+
+const uint32_t RANK_BITS = 0x1FFF;
+
+struct Tables
+{
+	uint8_t bitCount[8192];
+	uint8_t straightHigh[8192];		// 1 + rank of the top card of the best straight, 0 if none
+	uint16_t topBits[6][8192];		// the n highest bits of a mask
+
+	Tables()
+	{
+		for (uint32_t mask = 0; mask < 8192; ++mask)
+		{
+			int count = 0;
+			for (int r = 0; r < 13; ++r)
+				count += (mask >> r) & 1;
+			bitCount[mask] = static_cast<uint8_t>(count);
+
+			straightHigh[mask] = 0;
+			for (int high = 12; high >= 4; --high)
+			{
+				uint32_t run = 0x1Fu << (high - 4);
+				if ((mask & run) == run)
+				{
+					straightHigh[mask] = static_cast<uint8_t>(high + 1);
+					break;
+				}
+			}
+			// the wheel, A2345
+			if (!straightHigh[mask] && (mask & 0x100F) == 0x100F)
+				straightHigh[mask] = 3 + 1;
+
+			for (int n = 0; n < 6; ++n)
+			{
+				uint32_t kept = 0;
+				int left = n;
+				for (int r = 12; r >= 0 && left; --r)
+				{
+					if (mask & (1u << r))
+					{
+						kept |= 1u << r;
+						--left;
+					}
+				}
+				topBits[n][mask] = static_cast<uint16_t>(kept);
+			}
+		}
+	}
+};
+
+const Tables s_tables;
+
+inline HandRank makeRank(HandCategory category, uint32_t major, uint32_t kicker)
+{
+	return (static_cast<uint32_t>(category) << 26) | (major << 13) | kicker;
+}
+
+}
+
+HandRank HandEvaluator::rankHand(uint32_t s0, uint32_t s1, uint32_t s2, uint32_t s3,
+	uint32_t any, uint32_t two, uint32_t three, uint32_t four)
+{
+	// 7 cards can not hold a flush and a full house or quads, so flush goes first
+	uint32_t suited = s_tables.bitCount[s0] >= 5 ? s0
+		: s_tables.bitCount[s1] >= 5 ? s1
+		: s_tables.bitCount[s2] >= 5 ? s2
+		: s_tables.bitCount[s3] >= 5 ? s3 : 0;
+	if (suited)
+	{
+		uint32_t high = s_tables.straightHigh[suited];
+		if (high)
+			return makeRank(straight_flush, 1u << (high - 1), 0);
+		return makeRank(flush, 0, s_tables.topBits[5][suited]);
+	}
+
+	if (four)
+		return makeRank(four_of_a_kind, four, s_tables.topBits[1][any & ~four]);
+
+	uint32_t trips = three ? s_tables.topBits[1][three] : 0;
+	if (trips)
+	{
+		// a second trips counts as the pair
+		uint32_t pair = two & ~trips;
+		if (pair)
+			return makeRank(full_house, trips, s_tables.topBits[1][pair]);
+	}
+
+	uint32_t high = s_tables.straightHigh[any];
+	if (high)
+		return makeRank(straight, 1u << (high - 1), 0);
+
+	if (trips)
+		return makeRank(three_of_a_kind, trips, s_tables.topBits[2][any & ~trips]);
+
+	if (two)
+	{
+		if (s_tables.bitCount[two] >= 2)
+		{
+			uint32_t pairs = s_tables.topBits[2][two];
+			return makeRank(two_pair, pairs, s_tables.topBits[1][any & ~pairs]);
+		}
+		return makeRank(one_pair, two, s_tables.topBits[3][any & ~two]);
+	}
+
+	return makeRank(high_card, 0, s_tables.topBits[5][any]);
+}
+
+HandRank HandEvaluator::evaluate(HandMask hand)
+{
+	uint32_t s0 = static_cast<uint32_t>(hand) & RANK_BITS;
+	uint32_t s1 = static_cast<uint32_t>(hand >> 16) & RANK_BITS;
+	uint32_t s2 = static_cast<uint32_t>(hand >> 32) & RANK_BITS;
+	uint32_t s3 = static_cast<uint32_t>(hand >> 48) & RANK_BITS;
+
+	// bit sliced rank counts: ranks held at least 1, 2, 3 and 4 times
+	uint32_t any = s0 | s1 | s2 | s3;
+	uint32_t two = (s0 & s1) | (s2 & s3) | ((s0 | s1) & (s2 | s3));
+	uint32_t three = (s0 & s1 & (s2 | s3)) | (s2 & s3 & (s0 | s1));
+	uint32_t four = s0 & s1 & s2 & s3;
+
+	return rankHand(s0, s1, s2, s3, any, two, three, four);
+}
+
+HandRank HandEvaluator::evaluate(const Card* cards, size_t count)
+{
+	HandMask hand = 0;
+	for (size_t i = 0; i < count; ++i)
+		hand |= cardMask(cards[i]);
+	return evaluate(hand);
+}
+
+void HandEvaluator::evaluateBatch(const HandMask* hands, HandRank* ranks, size_t count)
+{
+	size_t i = 0;
+
+#ifdef POKER_EVAL_SSE2
+	const __m128i rankBits = _mm_set1_epi16(static_cast<short>(RANK_BITS));
+	for (; i + 8 <= count; i += 8)
+	{
+		// 2 hands per register, 4 x 16 bit suit masks each
+		__m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(hands + i));
+		__m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(hands + i + 2));
+		__m128i c = _mm_loadu_si128(reinterpret_cast<const __m128i*>(hands + i + 4));
+		__m128i d = _mm_loadu_si128(reinterpret_cast<const __m128i*>(hands + i + 6));
+
+		// transpose to one register per suit, lanes hold hands 0 2 4 6 1 3 5 7
+		__m128i ab0 = _mm_unpacklo_epi16(a, b);
+		__m128i ab1 = _mm_unpackhi_epi16(a, b);
+		__m128i cd0 = _mm_unpacklo_epi16(c, d);
+		__m128i cd1 = _mm_unpackhi_epi16(c, d);
+		__m128i lo0 = _mm_unpacklo_epi32(ab0, cd0);
+		__m128i hi0 = _mm_unpackhi_epi32(ab0, cd0);
+		__m128i lo1 = _mm_unpacklo_epi32(ab1, cd1);
+		__m128i hi1 = _mm_unpackhi_epi32(ab1, cd1);
+		__m128i s0 = _mm_and_si128(_mm_unpacklo_epi64(lo0, lo1), rankBits);
+		__m128i s1 = _mm_and_si128(_mm_unpackhi_epi64(lo0, lo1), rankBits);
+		__m128i s2 = _mm_and_si128(_mm_unpacklo_epi64(hi0, hi1), rankBits);
+		__m128i s3 = _mm_and_si128(_mm_unpackhi_epi64(hi0, hi1), rankBits);
+
+		__m128i s01 = _mm_or_si128(s0, s1);
+		__m128i s23 = _mm_or_si128(s2, s3);
+		__m128i both01 = _mm_and_si128(s0, s1);
+		__m128i both23 = _mm_and_si128(s2, s3);
+		__m128i any = _mm_or_si128(s01, s23);
+		__m128i two = _mm_or_si128(_mm_or_si128(both01, both23), _mm_and_si128(s01, s23));
+		__m128i three = _mm_or_si128(_mm_and_si128(both01, s23), _mm_and_si128(both23, s01));
+		__m128i four = _mm_and_si128(both01, both23);
+
+		alignas(16) uint16_t lanes[8][8];
+		_mm_store_si128(reinterpret_cast<__m128i*>(lanes[0]), s0);
+		_mm_store_si128(reinterpret_cast<__m128i*>(lanes[1]), s1);
+		_mm_store_si128(reinterpret_cast<__m128i*>(lanes[2]), s2);
+		_mm_store_si128(reinterpret_cast<__m128i*>(lanes[3]), s3);
+		_mm_store_si128(reinterpret_cast<__m128i*>(lanes[4]), any);
+		_mm_store_si128(reinterpret_cast<__m128i*>(lanes[5]), two);
+		_mm_store_si128(reinterpret_cast<__m128i*>(lanes[6]), three);
+		_mm_store_si128(reinterpret_cast<__m128i*>(lanes[7]), four);
+
+		static const int order[8] = { 0, 2, 4, 6, 1, 3, 5, 7 };
+		for (int lane = 0; lane < 8; ++lane)
+		{
+			ranks[i + order[lane]] = rankHand(lanes[0][lane], lanes[1][lane], lanes[2][lane], lanes[3][lane],
+				lanes[4][lane], lanes[5][lane], lanes[6][lane], lanes[7][lane]);
+		}
+	}
+#endif
+
+	for (; i < count; ++i)
+		ranks[i] = evaluate(hands[i]);
+}
+
+const char* HandEvaluator::categoryName(HandCategory category)
+{
+	static const char* names[] = {
+		"high card",
+		"one pair",
+		"two pair",
+		"three of a kind",
+		"straight",
+		"flush",
+		"full house",
+		"four of a kind",
+		"straight flush",
+	};
+	return category <= straight_flush ? names[category] : "?";
+}
+
+}
@@ -0,0 +1,56 @@
+#pragma once
+#include <cstdint>
+#include <cstddef>
+#include <string>
+#include <vector>
+
+namespace poker {
+
+/// Card is rank * 4 + suit, rank 0 is a deuce and 12 an ace.
+typedef uint8_t Card;
+
+inline Card makeCard(int rank, int suit) { return static_cast<Card>(rank * 4 + suit); }
+inline int cardRank(Card card) { return card >> 2; }
+inline int cardSuit(Card card) { return card & 3; }
+
+/// A hand is a set of cards, one 13 bit rank mask per suit in 16 bit fields.
+typedef uint64_t HandMask;
+
+inline HandMask cardMask(Card card) { return HandMask(1) << (cardSuit(card) * 16 + cardRank(card)); }
+
+/// Higher is better. Category in bit 26 and up, then the ranks that
+/// decide within the category as 13 bit masks, major first.
+typedef uint32_t HandRank;
+
+enum HandCategory
+{
+	high_card,
+	one_pair,
+	two_pair,
+	three_of_a_kind,
+	straight,
+	flush,
+	full_house,
+	four_of_a_kind,
+	straight_flush,
+};
+
+/// Ranks 5 to 7 card hands with 8K entry lookup tables, a few loads and no loops.
+class HandEvaluator
+{
+public:
+	static HandRank evaluate(HandMask hand);
+	static HandRank evaluate(const Card* cards, size_t count);
+
+	/// rank count hands at once, SSE2 does the rank counting of 8 hands per step
+	static void evaluateBatch(const HandMask* hands, HandRank* ranks, size_t count);
+
+	static HandCategory category(HandRank rank) { return static_cast<HandCategory>(rank >> 26); }
+	static const char* categoryName(HandCategory category);
+
+private:
+	static HandRank rankHand(uint32_t s0, uint32_t s1, uint32_t s2, uint32_t s3,
+		uint32_t any, uint32_t two, uint32_t three, uint32_t four);
+};
+
+}
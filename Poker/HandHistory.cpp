@@ -0,0 +1,299 @@
+#include "HandHistory.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <stdexcept>
+#include <boost/crc.hpp>
+#include "Deck.h"
+
+namespace poker {
+
+namespace bip = boost::interprocess;
+
+namespace {
+
+uint32_t crc32(const char* data, size_t size)
+{
+	boost::crc_32_type crc;
+	crc.process_bytes(data, size);
+	return crc.checksum();
+}
+
+}
+
+std::string verifyDeal(const HandRecord& hand)
+{
+	Seed seed;
+	if (!seedFromHex(hand.deckSeed, seed))
+		return "bad deck seed";
+	Deck deck = makeDeck(seed);
+	size_t next = 0;
+	for (size_t seat = 0; seat < hand.players.size() && seat < hand.holes.size(); ++seat)
+	{
+		if (hand.players[seat].empty())
+			continue;
+		std::vector<int> dealt = { deck.cards[next], deck.cards[next + 1] };
+		std::vector<int> hole = hand.holes[seat];
+		next += 2;
+		std::sort(dealt.begin(), dealt.end());
+		std::sort(hole.begin(), hole.end());
+		if (hole != dealt)
+			return "seat " + std::to_string(seat) + " was not dealt its hole cards from the deck";
+	}
+	for (size_t i = 0; i < hand.board.size(); ++i)
+	{
+		if (next >= deck.cards.size() || hand.board[i] != deck.cards[next++])
+			return "board was not dealt from the deck";
+	}
+	return std::string();
+}
+
+std::string segment::path(const std::string& directory, uint32_t index)
+{
+	char name[32];
+	std::snprintf(name, sizeof(name), "hands-%06u.log", index);
+	return directory + "/" + name;
+}
+
+bool segment::exists(const std::string& directory, uint32_t index)
+{
+	return std::ifstream(path(directory, index), std::ios::binary).good();
+}
+
+SegmentReader::SegmentReader(const std::string& path):
+	_file(path.c_str(), bip::read_only),
+	_region(_file, bip::read_only),
+	_pos(segment::HEADER_SIZE),
+	_torn(false)
+{
+	if (_region.get_size() < segment::HEADER_SIZE
+		|| std::memcmp(_region.get_address(), segment::MAGIC, sizeof(segment::MAGIC)))
+		throw std::runtime_error("not a hand history segment: " + path);
+}
+
+bool SegmentReader::next(const char*& data, uint32_t& size, uint32_t& offset)
+{
+	const char* base = static_cast<const char*>(_region.get_address());
+	if (_torn || _pos + segment::FRAME_SIZE > _region.get_size())
+		return false;
+
+	uint32_t length;
+	uint32_t crc;
+	std::memcpy(&length, base + _pos, sizeof(length));
+	std::memcpy(&crc, base + _pos + 4, sizeof(crc));
+	if (!length)
+		return false;
+	if (_pos + segment::FRAME_SIZE + length > _region.get_size()
+		|| crc32(base + _pos + segment::FRAME_SIZE, length) != crc)
+	{
+		_torn = true;
+		return false;
+	}
+
+	data = base + _pos + segment::FRAME_SIZE;
+	size = length;
+	offset = static_cast<uint32_t>(_pos);
+	_pos += segment::FRAME_SIZE + length;
+	return true;
+}
+
+HandHistory::HandHistory(const HandHistoryOptions& options):
+	_options(options),
+	_lastHandId(0),
+	_written(0),
+	_stopping(false),
+	_segment(0),
+	_writePos(0),
+	_flushedPos(0),
+	_tornTail(false)
+{
+	if (_options.segmentSize <= segment::HEADER_SIZE + segment::FRAME_SIZE)
+		throw std::invalid_argument("segment size too small");
+
+	scan();
+	_thread = std::thread([this]() { run(); });
+}
+
+HandHistory::~HandHistory()
+{
+	_stopping = true;
+	_wakeCond.notify_one();
+	_thread.join();
+}
+
+void HandHistory::append(HandRecord record)
+{
+	// the writer polls, waking it here would cost a lock per hand
+	_queue.push(std::move(record));
+}
+
+bool HandHistory::find(uint64_t handId, Location& location)
+{
+	std::lock_guard<std::mutex> lock(_indexMtx);
+	auto found = _index.find(handId);
+	if (found == _index.end())
+		return false;
+	location = found->second;
+	return true;
+}
+
+bool HandHistory::read(uint64_t handId, HandRecord& record)
+{
+	Location location;
+	if (!find(handId, location))
+		return false;
+
+	bip::file_mapping file(segment::path(_options.directory, location.segment).c_str(), bip::read_only);
+	bip::mapped_region region(file, bip::read_only);
+	const char* base = static_cast<const char*>(region.get_address()) + location.offset;
+	uint32_t size;
+	std::memcpy(&size, base, sizeof(size));
+
+	msgpack::unpacked unpacked;
+	msgpack::unpack(unpacked, base + segment::FRAME_SIZE, size);
+	unpacked.get().convert(&record);
+	return true;
+}
+
+void HandHistory::scan()
+{
+	for (uint32_t index = 1; segment::exists(_options.directory, index); ++index)
+	{
+		SegmentReader reader(segment::path(_options.directory, index));
+		const char* data;
+		uint32_t size;
+		uint32_t offset;
+		while (reader.next(data, size, offset))
+		{
+			// hand id is the first field, no need to convert the rest
+			msgpack::unpacked unpacked;
+			msgpack::unpack(unpacked, data, size);
+			const msgpack::object& fields = unpacked.get();
+			if (fields.type != msgpack::type::ARRAY || !fields.via.array.size)
+				continue;
+			uint64_t handId = fields.via.array.ptr[0].as<uint64_t>();
+			_index[handId] = Location{ index, offset };
+			if (handId > _lastHandId)
+				_lastHandId = handId;
+		}
+		if (reader.isTorn())
+			std::cerr << "hand history: torn record in segment " << index << " at " << reader.getEnd() << std::endl;
+
+		_segment = index;
+		_writePos = reader.getEnd();
+		_tornTail = reader.isTorn();
+	}
+}
+
+void HandHistory::run()
+{
+	auto lastFlush = std::chrono::steady_clock::now();
+	HandRecord record;
+	while (true)
+	{
+		bool stopping = _stopping;
+		while (_queue.pop(record))
+		{
+			try
+			{
+				write(record);
+			}
+			catch (std::exception& ex)
+			{
+				std::cerr << "hand history: hand " << record.handId << " lost, " << ex.what() << std::endl;
+			}
+		}
+
+		auto now = std::chrono::steady_clock::now();
+		if (stopping || now - lastFlush >= std::chrono::milliseconds(_options.flushIntervalMs))
+		{
+			flush();
+			lastFlush = now;
+		}
+		if (stopping)
+			break;
+
+		std::unique_lock<std::mutex> lock(_wakeMtx);
+		_wakeCond.wait_for(lock, std::chrono::milliseconds(10));
+	}
+}
+
+void HandHistory::write(const HandRecord& record)
+{
+	_buffer.clear();
+	msgpack::pack(_buffer, record);
+	size_t need = segment::FRAME_SIZE + _buffer.size();
+	if (need > _options.segmentSize - segment::HEADER_SIZE)
+		throw std::length_error("record larger than a segment");
+
+	// carry on in the last segment found by scan, then rotate when full
+	if (!_region)
+		openSegment(std::max<uint32_t>(_segment, 1));
+	if (_writePos + need > _region->get_size())
+		openSegment(_segment + 1);
+
+	char* base = static_cast<char*>(_region->get_address()) + _writePos;
+	uint32_t size = static_cast<uint32_t>(_buffer.size());
+	uint32_t crc = crc32(_buffer.data(), _buffer.size());
+	std::memcpy(base + segment::FRAME_SIZE, _buffer.data(), _buffer.size());
+	std::memcpy(base + 4, &crc, sizeof(crc));
+	// the size goes last, a reader never sees a record before its bytes
+	std::atomic_thread_fence(std::memory_order_release);
+	std::memcpy(base, &size, sizeof(size));
+
+	{
+		std::lock_guard<std::mutex> lock(_indexMtx);
+		_index[record.handId] = Location{ _segment, static_cast<uint32_t>(_writePos) };
+	}
+	_writePos += need;
+	_written.fetch_add(1, std::memory_order_relaxed);
+}
+
+void HandHistory::openSegment(uint32_t index)
+{
+	flush();
+	_region.reset();
+	_file.reset();
+
+	std::string path = segment::path(_options.directory, index);
+	bool created = !segment::exists(_options.directory, index);
+	if (created)
+	{
+		// full size up front, zero filled, so the mapping never grows
+		std::ofstream out(path, std::ios::binary | std::ios::trunc);
+		out.seekp(_options.segmentSize - 1);
+		out.put(0);
+		if (!out)
+			throw std::runtime_error("can not create " + path);
+	}
+
+	_file.reset(new bip::file_mapping(path.c_str(), bip::read_write));
+	_region.reset(new bip::mapped_region(*_file, bip::read_write));
+	if (created)
+	{
+		std::memcpy(_region->get_address(), segment::MAGIC, sizeof(segment::MAGIC));
+		_writePos = segment::HEADER_SIZE;
+	}
+	else if (_tornTail)
+	{
+		// the last segment of the scan, _writePos is behind its good records.
+		// clear what a crash left there so it is never read as a record
+		std::memset(static_cast<char*>(_region->get_address()) + _writePos, 0, _region->get_size() - _writePos);
+		_tornTail = false;
+	}
+	_segment = index;
+	_flushedPos = 0;
+}
+
+void HandHistory::flush()
+{
+	if (!_region || _flushedPos == _writePos)
+		return;
+	_region->flush(_flushedPos, _writePos - _flushedPos, true);
+	_flushedPos = _writePos;
+}
+
+}
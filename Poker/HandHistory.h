@@ -0,0 +1,176 @@
+#pragma once
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include <boost/interprocess/file_mapping.hpp>
+#include <boost/interprocess/mapped_region.hpp>
+#include <msgpack.hpp>
+#include "MpscQueue.h"
+
+namespace poker {
+
+struct HandAction
+{
+	int seat = 0;
+	int street = 0;
+	int action = 0;			// TableAction
+	int64_t amount = 0;		// chips put in by this action
+	MSGPACK_DEFINE(seat, street, action, amount);
+};
+
+/// one finished hand, by seat where it is a vector
+struct HandRecord
+{
+	uint64_t handId = 0;
+	uint32_t tableId = 0;
+	uint64_t startedMs = 0;				// unix time
+	int button = -1;
+	int64_t smallBlind = 0;
+	int64_t bigBlind = 0;
+	std::vector<std::string> players;	// empty for seats not in the hand
+	std::vector<int64_t> stacks;		// before the blinds
+	std::vector<std::vector<int>> holes;
+	std::vector<HandAction> actions;
+	std::vector<int> board;
+	std::vector<int64_t> results;		// chips won less chips put in
+	std::string deckSeed;				// hex, makeDeck of it deals the hand again
+	MSGPACK_DEFINE(handId, tableId, startedMs, button, smallBlind, bigBlind, players, stacks,
+		holes, actions, board, results, deckSeed);
+};
+
+/// Deals the logged deck of hand again, holes in seat order and then the
+/// board. Empty if the hand was dealt that way, else what was not.
+/// Hole cards compare in any order, older records hold them sorted.
+std::string verifyDeal(const HandRecord& hand);
+
+/// Segment layout: a 16 byte header, then records of
+/// [uint32 size][uint32 crc32][size bytes of msgpack HandRecord].
+/// The file is created at full size, a zero size ends the written part.
+namespace segment {
+	const char MAGIC[8] = { 'H', 'H', 'S', 'E', 'G', '0', '0', '1' };
+	const size_t HEADER_SIZE = 16;
+	const size_t FRAME_SIZE = 8;
+
+	/// directory/hands-000001.log
+	std::string path(const std::string& directory, uint32_t index);
+	bool exists(const std::string& directory, uint32_t index);
+}
+
+/// Walks the records of one segment in file order.
+class SegmentReader
+{
+public:
+	/// throws boost::interprocess::interprocess_exception or std::runtime_error
+	explicit SegmentReader(const std::string& path);
+
+	/// false at the end of the written part or at a torn record
+	bool next(const char*& data, uint32_t& size, uint32_t& offset);
+
+	/// true once next stopped at a record failing its crc
+	bool isTorn() const;
+
+	size_t getEnd() const;
+
+private:
+	boost::interprocess::file_mapping _file;
+	boost::interprocess::mapped_region _region;
+	size_t _pos;
+	bool _torn;
+};
+
+struct HandHistoryOptions
+{
+	std::string directory = ".";
+	size_t segmentSize = 64 * 1024 * 1024;
+	uint32_t flushIntervalMs = 200;		// how stale the file may get behind memory
+};
+
+/// Append only hand log. Tables hand their records over through a lock
+/// free queue and a background thread packs them into memory mapped,
+/// size rotated segments, so no table ever waits for the disk.
+/// Existing segments are scanned at startup to rebuild the hand index.
+class HandHistory
+{
+public:
+	struct Location
+	{
+		uint32_t segment;
+		uint32_t offset;
+	};
+
+	explicit HandHistory(const HandHistoryOptions& options);
+
+	/// writes whatever is still queued
+	~HandHistory();
+
+	/// unique over restarts, continues after the highest hand on disk
+	uint64_t nextHandId();
+
+	/// any thread, never blocks
+	void append(HandRecord record);
+
+	/// false if the hand is not written (yet)
+	bool find(uint64_t handId, Location& location);
+	bool read(uint64_t handId, HandRecord& record);
+
+	uint64_t getWritten() const;
+
+private:
+	HandHistory(const HandHistory&) = delete;
+	HandHistory& operator=(const HandHistory&) = delete;
+
+	void scan();
+	void run();
+	void write(const HandRecord& record);
+	void openSegment(uint32_t index);
+	void flush();
+
+	HandHistoryOptions _options;
+	std::atomic<uint64_t> _lastHandId;
+	std::atomic<uint64_t> _written;
+
+	MpscQueue<HandRecord> _queue;
+	std::atomic<bool> _stopping;
+	std::mutex _wakeMtx;
+	std::condition_variable _wakeCond;
+	std::thread _thread;
+
+	// writer thread only
+	std::unique_ptr<boost::interprocess::file_mapping> _file;
+	std::unique_ptr<boost::interprocess::mapped_region> _region;
+	uint32_t _segment;
+	size_t _writePos;
+	size_t _flushedPos;
+	bool _tornTail;
+	msgpack::sbuffer _buffer;
+
+	std::mutex _indexMtx;
+	std::unordered_map<uint64_t, Location> _index;
+};
+
+inline uint64_t HandHistory::nextHandId()
+{
+	return _lastHandId.fetch_add(1, std::memory_order_relaxed) + 1;
+}
+
+inline uint64_t HandHistory::getWritten() const
+{
+	return _written.load(std::memory_order_relaxed);
+}
+
+inline bool SegmentReader::isTorn() const
+{
+	return _torn;
+}
+
+inline size_t SegmentReader::getEnd() const
+{
+	return _pos;
+}
+
+}
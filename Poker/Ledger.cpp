@@ -0,0 +1,316 @@
+#include "Ledger.h"
+#include <chrono>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+#include <boost/crc.hpp>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include "Asio.h"
+
+#ifdef _WIN32
+#include <io.h>
+#define POKER_OPEN _open
+#define POKER_WRITE _write
+#define POKER_CLOSE _close
+#define POKER_SYNC _commit
+#define POKER_TRUNCATE _chsize_s
+#define POKER_SEEK_END(fd) _lseeki64(fd, 0, SEEK_END)
+#define POKER_SEEK_SET(fd, offset) _lseeki64(fd, offset, SEEK_SET)
+#define POKER_OPEN_FLAGS (_O_WRONLY | _O_CREAT | _O_BINARY)
+#define POKER_OPEN_MODE (_S_IREAD | _S_IWRITE)
+#else
+#include <unistd.h>
+#define POKER_OPEN ::open
+#define POKER_WRITE ::write
+#define POKER_CLOSE ::close
+#define POKER_TRUNCATE ::ftruncate
+#define POKER_SEEK_END(fd) ::lseek(fd, 0, SEEK_END)
+#define POKER_SEEK_SET(fd, offset) ::lseek(fd, offset, SEEK_SET)
+#define POKER_OPEN_FLAGS (O_WRONLY | O_CREAT)
+#define POKER_OPEN_MODE 0644
+#if defined(__APPLE__)
+#define POKER_SYNC ::fsync
+#else
+#define POKER_SYNC ::fdatasync
+#endif
+#endif
+
+namespace poker {
+
+using msgpack::rpc::msgerror;
+using msgpack::rpc::error_illegal_action;
+using msgpack::rpc::error_handler_failed;
+
+const char Ledger::MAGIC[8] = { 'L', 'E', 'D', 'G', 'E', 'R', '0', '1' };
+
+namespace {
+
+const size_t FRAME_SIZE = 8;
+
+uint32_t crc32(const char* data, size_t size)
+{
+	boost::crc_32_type crc;
+	crc.process_bytes(data, size);
+	return crc.checksum();
+}
+
+bool writeAll(int fd, const char* data, size_t size)
+{
+	while (size)
+	{
+		auto written = POKER_WRITE(fd, data, static_cast<unsigned int>(size));
+		if (written <= 0)
+			return false;
+		data += written;
+		size -= written;
+	}
+	return true;
+}
+
+}
+
+Ledger::Ledger(const LedgerOptions& options):
+	_options(options),
+	_fd(-1),
+	_end(0),
+	_stopping(false),
+	_readOnly(false),
+	_nextSeq(1)
+{
+	replay();
+	_thread = std::thread([this]() { run(); });
+}
+
+Ledger::~Ledger()
+{
+	{
+		std::lock_guard<std::mutex> lock(_mtx);
+		_stopping = true;
+	}
+	_cond.notify_one();
+	_thread.join();
+	POKER_CLOSE(_fd);
+}
+
+bool Ledger::isWalletMove(int kind)
+{
+	return kind == ledger_deposit || kind == ledger_withdraw || kind == ledger_buy_in || kind == ledger_cash_out;
+}
+
+void Ledger::replay()
+{
+	std::string data;
+	{
+		std::ifstream in(_options.path, std::ios::binary);
+		data.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+	}
+
+	size_t end = 0;
+	if (data.size() >= sizeof(MAGIC))
+	{
+		if (std::memcmp(data.data(), MAGIC, sizeof(MAGIC)))
+			throw std::runtime_error("not a ledger: " + _options.path);
+		end = sizeof(MAGIC);
+		while (end + FRAME_SIZE <= data.size())
+		{
+			uint32_t size;
+			uint32_t crc;
+			std::memcpy(&size, data.data() + end, sizeof(size));
+			std::memcpy(&crc, data.data() + end + 4, sizeof(crc));
+			if (!size || end + FRAME_SIZE + size > data.size() || crc32(data.data() + end + FRAME_SIZE, size) != crc)
+				break;
+
+			LedgerEntry entry;
+			msgpack::unpacked unpacked;
+			msgpack::unpack(unpacked, data.data() + end + FRAME_SIZE, size);
+			unpacked.get().convert(&entry);
+			if (isWalletMove(entry.kind))
+				_balances[entry.account] += entry.amount;
+			_nextSeq = entry.seq + 1;
+			end += FRAME_SIZE + size;
+		}
+	}
+
+	_fd = POKER_OPEN(_options.path.c_str(), POKER_OPEN_FLAGS, POKER_OPEN_MODE);
+	if (_fd < 0)
+		throw std::runtime_error("can not open ledger: " + _options.path);
+
+	// a crash mid write leaves a torn frame, later appends go in its place
+	if (end < data.size() && POKER_TRUNCATE(_fd, static_cast<long>(end)) != 0)
+		throw std::runtime_error("can not cut the torn tail of " + _options.path);
+	POKER_SEEK_END(_fd);
+	if (!end && (!writeAll(_fd, MAGIC, sizeof(MAGIC)) || POKER_SYNC(_fd) != 0))
+		throw std::runtime_error("can not write " + _options.path);
+	_end = end ? end : sizeof(MAGIC);
+}
+
+uint64_t Ledger::append(LedgerEntry entry, DurableHandler onDurable)
+{
+	bool wake;
+	{
+		std::lock_guard<std::mutex> lock(_mtx);
+		if (_readOnly)
+			throw msgerror("ledger is read only after a failed write", error_handler_failed);
+		if (isWalletMove(entry.kind))
+		{
+			int64_t& balance = _balances[entry.account];
+			if (entry.amount < 0 && balance + entry.amount < 0)
+				throw msgerror("insufficient funds", error_illegal_action);
+			balance += entry.amount;
+		}
+		entry.seq = _nextSeq++;
+		if (!entry.timeMs)
+		{
+			entry.timeMs = std::chrono::duration_cast<std::chrono::milliseconds>(
+				std::chrono::system_clock::now().time_since_epoch()).count();
+		}
+
+		wake = _pending.empty();
+		if (wake)
+			_pendingSince = std::chrono::steady_clock::now();
+		_pending.push_back(Pending{ true, entry, std::move(onDurable) });
+		wake = wake || _pending.size() >= _options.maxBatch;
+	}
+	if (wake)
+		_cond.notify_one();
+	return entry.seq;
+}
+
+void Ledger::whenDurable(DurableHandler onDurable)
+{
+	bool wake;
+	bool readOnly;
+	{
+		std::lock_guard<std::mutex> lock(_mtx);
+		// nothing after the failure is durable, nor anything queued before it
+		readOnly = _readOnly;
+		if (readOnly)
+			wake = false;
+		else
+		{
+			wake = _pending.empty();
+			if (wake)
+				_pendingSince = std::chrono::steady_clock::now();
+			_pending.push_back(Pending{ false, LedgerEntry(), std::move(onDurable) });
+		}
+	}
+	if (readOnly && onDurable)
+		onDurable(false);
+	if (wake)
+		_cond.notify_one();
+}
+
+int64_t Ledger::getBalance(const std::string& account)
+{
+	std::lock_guard<std::mutex> lock(_mtx);
+	auto found = _balances.find(account);
+	return found == _balances.end() ? 0 : found->second;
+}
+
+LedgerStats Ledger::getStats()
+{
+	std::lock_guard<std::mutex> lock(_mtx);
+	LedgerStats stats = _stats;
+	stats.readOnly = _readOnly;
+	return stats;
+}
+
+void Ledger::run()
+{
+	std::vector<Pending> batch;
+	while (true)
+	{
+		{
+			std::unique_lock<std::mutex> lock(_mtx);
+			_cond.wait(lock, [this]() { return _stopping || !_pending.empty(); });
+			if (_pending.empty())
+				return;
+
+			// the window opens with the first entry, whoever comes in it rides along
+			auto deadline = _pendingSince + std::chrono::microseconds(_options.commitWindowUs);
+			_cond.wait_until(lock, deadline, [this]() { return _stopping || _pending.size() >= _options.maxBatch; });
+			batch.swap(_pending);
+		}
+
+		bool durable = commit(batch);
+		{
+			std::lock_guard<std::mutex> lock(_mtx);
+			++_stats.commits;
+			if (durable)
+			{
+				for (auto& pending : batch)
+					_stats.entries += pending.hasEntry ? 1 : 0;
+			}
+			else
+			{
+				// what queued meanwhile may spend what just failed, it fails with it
+				++_stats.failures;
+				batch.insert(batch.end(), std::make_move_iterator(_pending.begin()), std::make_move_iterator(_pending.end()));
+				_pending.clear();
+				rollBack(batch);
+			}
+		}
+		for (auto& pending : batch)
+		{
+			if (pending.onDurable)
+				pending.onDurable(durable);
+		}
+		batch.clear();
+	}
+}
+
+bool Ledger::commit(const std::vector<Pending>& batch)
+{
+	msgpack::sbuffer frames;
+	msgpack::sbuffer body;
+	for (auto& pending : batch)
+	{
+		if (!pending.hasEntry)
+			continue;
+		body.clear();
+		msgpack::pack(body, pending.entry);
+
+		char frame[FRAME_SIZE];
+		uint32_t size = static_cast<uint32_t>(body.size());
+		uint32_t crc = crc32(body.data(), body.size());
+		std::memcpy(frame, &size, sizeof(size));
+		std::memcpy(frame + 4, &crc, sizeof(crc));
+		frames.write(frame, sizeof(frame));
+		frames.write(body.data(), body.size());
+	}
+	if (!frames.size())
+		return true;
+	bool failed = _options.failWrite && _options.failWrite();
+	if (!failed && writeAll(_fd, frames.data(), frames.size()) && POKER_SYNC(_fd) == 0)
+	{
+		_end += frames.size();
+		return true;
+	}
+
+	// a short write leaves a torn frame, entries after it would be lost on
+	// replay; a restart cuts what is left if this fails too
+	if (POKER_TRUNCATE(_fd, static_cast<long>(_end)) == 0)
+	{
+		POKER_SEEK_SET(_fd, static_cast<long>(_end));
+		POKER_SYNC(_fd);
+	}
+	return false;
+}
+
+void Ledger::rollBack(std::vector<Pending>& batch)
+{
+	// under _mtx, balances go back to what the log holds
+	_readOnly = true;
+	for (auto& pending : batch)
+	{
+		if (!pending.hasEntry)
+			continue;
+		if (isWalletMove(pending.entry.kind))
+			_balances[pending.entry.account] -= pending.entry.amount;
+		if (pending.entry.seq < _nextSeq)
+			_nextSeq = pending.entry.seq;
+	}
+}
+
+}
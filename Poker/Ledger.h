@@ -0,0 +1,128 @@
+#pragma once
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include <msgpack.hpp>
+
+namespace poker {
+
+enum LedgerKind
+{
+	ledger_deposit,
+	ledger_withdraw,
+	ledger_buy_in,		// wallet to table
+	ledger_cash_out,	// table to wallet
+	ledger_pot_award,	// net result of a hand, chips stay on the table
+};
+
+/// One chip movement. amount is signed from the account's point of view.
+struct LedgerEntry
+{
+	uint64_t seq = 0;
+	uint64_t timeMs = 0;		// unix time
+	int kind = ledger_deposit;
+	std::string account;
+	int64_t amount = 0;
+	uint32_t tableId = 0;
+	uint64_t handId = 0;
+	MSGPACK_DEFINE(seq, timeMs, kind, account, amount, tableId, handId);
+};
+
+struct LedgerOptions
+{
+	std::string path = "ledger.wal";
+	uint32_t commitWindowUs = 200;		// how long the first entry of a batch waits for company
+	size_t maxBatch = 4096;				// commit at once when this many are waiting
+	std::function<bool()> failWrite;	// for tests, a commit fails as on a full disk while this says so
+};
+
+struct LedgerStats
+{
+	uint64_t entries = 0;
+	uint64_t commits = 0;		// one write and one sync each
+	uint64_t failures = 0;
+	bool readOnly = false;		// a commit failed, appends are refused
+};
+
+/// Write ahead log of chip movements with group commit. Appends from any
+/// thread queue up, a committer thread writes what gathered within the
+/// commit window and syncs it to disk once for all of them. Callers are
+/// told when their entry is durable. Wallet balances are kept in memory
+/// and rebuilt from the log at startup.
+///
+/// File layout: 8 byte magic, then [uint32 size][uint32 crc32][msgpack
+/// LedgerEntry] frames. A torn tail from a crash is cut off at startup.
+///
+/// A failed write or sync cuts the log back to the last durable frame and
+/// undoes the balances of every entry that did not make it, then the ledger
+/// turns read only: after a failed sync the disk can not be trusted to hold
+/// what a later sync reports, so no more chips move until a restart.
+class Ledger
+{
+public:
+	typedef std::function<void(bool durable)> DurableHandler;
+
+	static const char MAGIC[8];
+
+	/// throws std::runtime_error if the log can not be opened
+	explicit Ledger(const LedgerOptions& options);
+
+	/// commits whatever is still queued
+	~Ledger();
+
+	/// Queue entry, onDurable runs on the committer thread once it is on disk.
+	/// Returns the sequence number; throws msgerror if a wallet would go
+	/// negative or the ledger is read only.
+	uint64_t append(LedgerEntry entry, DurableHandler onDurable = DurableHandler());
+
+	/// runs once everything appended so far is on disk
+	void whenDurable(DurableHandler onDurable);
+
+	/// wallet balance, including entries not yet durable
+	int64_t getBalance(const std::string& account);
+
+	LedgerStats getStats();
+
+	/// does kind move chips in or out of the wallet
+	static bool isWalletMove(int kind);
+
+private:
+	struct Pending
+	{
+		bool hasEntry;
+		LedgerEntry entry;
+		DurableHandler onDurable;
+	};
+
+	Ledger(const Ledger&) = delete;
+	Ledger& operator=(const Ledger&) = delete;
+
+	void replay();
+	void run();
+	bool commit(const std::vector<Pending>& batch);
+	void rollBack(std::vector<Pending>& batch);
+
+	LedgerOptions _options;
+	int _fd;
+	uint64_t _end;		// file size up to the last durable frame, committer thread only
+
+	std::mutex _mtx;
+	std::condition_variable _cond;
+	std::vector<Pending> _pending;
+	std::chrono::steady_clock::time_point _pendingSince;
+	bool _stopping;
+	bool _readOnly;
+	uint64_t _nextSeq;
+	std::unordered_map<std::string, int64_t> _balances;
+	LedgerStats _stats;
+
+	std::thread _thread;
+};
+
+}
@@ -0,0 +1,107 @@
+#include "Lobby.h"
+#include <algorithm>
+
+namespace poker {
+
+Lobby::Key Lobby::keyOf(const LobbyEntry& entry)
+{
+	return Key(entry.game, entry.bigBlind, entry.smallBlind, entry.tableId);
+}
+
+Lobby::Stakes Lobby::stakesOf(const LobbyEntry& entry)
+{
+	return Stakes(entry.game, entry.bigBlind, entry.smallBlind);
+}
+
+void Lobby::update(const LobbyEntry& entry)
+{
+	std::lock_guard<std::mutex> lock(_mtx);
+	auto found = _keys.find(entry.tableId);
+	if (found != _keys.end())
+	{
+		LobbyEntry old = _tables[found->second];
+		erase(old);
+	}
+
+	Key key = keyOf(entry);
+	_tables[key] = entry;
+	_keys[entry.tableId] = key;
+	if (entry.players < entry.seats)
+		_open[stakesOf(entry)].insert(std::make_pair(-static_cast<int64_t>(entry.players), entry.tableId));
+}
+
+void Lobby::remove(uint32_t tableId)
+{
+	std::lock_guard<std::mutex> lock(_mtx);
+	auto found = _keys.find(tableId);
+	if (found == _keys.end())
+		return;
+	LobbyEntry old = _tables[found->second];
+	erase(old);
+}
+
+void Lobby::erase(const LobbyEntry& entry)
+{
+	auto open = _open.find(stakesOf(entry));
+	if (open != _open.end())
+	{
+		open->second.erase(std::make_pair(-static_cast<int64_t>(entry.players), entry.tableId));
+		if (open->second.empty())
+			_open.erase(open);
+	}
+	_keys.erase(entry.tableId);
+	_tables.erase(keyOf(entry));
+}
+
+bool Lobby::findBest(const std::string& game, int64_t smallBlind, int64_t bigBlind, LobbyEntry& entry)
+{
+	std::lock_guard<std::mutex> lock(_mtx);
+	auto open = _open.find(Stakes(game, bigBlind, smallBlind));
+	if (open == _open.end())
+		return false;
+
+	// fuller tables first, games start sooner and empty tables can close
+	uint32_t tableId = open->second.begin()->second;
+	entry = _tables[_keys[tableId]];
+	return true;
+}
+
+LobbyPage Lobby::list(const std::string& game, const LobbyCursor& after, uint32_t limit)
+{
+	if (!limit || limit > MAX_PAGE)
+		limit = MAX_PAGE;
+	// every table listed is of game, so each packs to the same most
+	size_t fits = (MAX_PAGE_BYTES - PAGE_PACKED_BYTES) / (ENTRY_PACKED_BYTES + game.size());
+	if (limit > fits)
+		limit = fits ? static_cast<uint32_t>(fits) : 1;
+
+	LobbyPage page;
+	std::lock_guard<std::mutex> lock(_mtx);
+	auto it = _tables.upper_bound(Key(game, after.bigBlind, after.smallBlind, after.tableId));
+	for (; it != _tables.end() && std::get<0>(it->first) == game; ++it)
+	{
+		if (page.tables.size() == limit)
+		{
+			page.more = true;
+			break;
+		}
+		page.tables.push_back(it->second);
+	}
+
+	if (!page.tables.empty())
+	{
+		const LobbyEntry& last = page.tables.back();
+		page.next.bigBlind = last.bigBlind;
+		page.next.smallBlind = last.smallBlind;
+		page.next.tableId = last.tableId;
+	}
+	return page;
+}
+
+size_t Lobby::size()
+{
+	std::lock_guard<std::mutex> lock(_mtx);
+	return _tables.size();
+}
+
+}
@@ -0,0 +1,85 @@
+#pragma once
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <set>
+#include <string>
+#include <tuple>
+#include <unordered_map>
+#include <vector>
+#include <msgpack.hpp>
+
+namespace poker {
+
+/// what the lobby shows of one table
+struct LobbyEntry
+{
+	uint32_t tableId = 0;
+	std::string game;
+	int64_t smallBlind = 0;
+	int64_t bigBlind = 0;
+	uint32_t seats = 0;
+	uint32_t players = 0;
+	MSGPACK_DEFINE(tableId, game, smallBlind, bigBlind, seats, players);
+};
+
+/// position in a listing, tables come in stakes then table id order
+struct LobbyCursor
+{
+	int64_t bigBlind = 0;
+	int64_t smallBlind = 0;
+	uint32_t tableId = 0;
+	MSGPACK_DEFINE(bigBlind, smallBlind, tableId);
+};
+
+struct LobbyPage
+{
+	std::vector<LobbyEntry> tables;
+	bool more = false;
+	LobbyCursor next;		// pass back for the following page
+	MSGPACK_DEFINE(tables, more, next);
+};
+
+/// Tables indexed by game and stakes. Tables push their changes, lookups
+/// and listings are O(log n) plus the page they return. Thread safe.
+class Lobby
+{
+public:
+	static const uint32_t MAX_PAGE = 100;
+	/// a page is a bulk reply and packs to at most this with its response, so it
+	/// has fewer tables than limit when their game name is long. A page has at
+	/// least one table, only a name longer than this alone goes over.
+	static const uint32_t MAX_PAGE_BYTES = 16 * 1024;
+
+	/// add or change a table
+	void update(const LobbyEntry& entry);
+	void remove(uint32_t tableId);
+
+	/// the fullest table of the game and stakes that still has a free seat
+	bool findBest(const std::string& game, int64_t smallBlind, int64_t bigBlind, LobbyEntry& entry);
+
+	/// up to limit tables of game after cursor, within MAX_PAGE_BYTES
+	LobbyPage list(const std::string& game, const LobbyCursor& after, uint32_t limit);
+
+	size_t size();
+
+private:
+	typedef std::tuple<std::string, int64_t, int64_t, uint32_t> Key;	// game, big blind, small blind, table
+	typedef std::tuple<std::string, int64_t, int64_t> Stakes;
+	typedef std::set<std::pair<int64_t, uint32_t>> OpenTables;			// -players, table
+
+	enum { PAGE_PACKED_BYTES = 64 };		// most a response and page pack to without the tables
+	enum { ENTRY_PACKED_BYTES = 39 };		// most an entry packs to without its game name
+
+	static Key keyOf(const LobbyEntry& entry);
+	static Stakes stakesOf(const LobbyEntry& entry);
+
+	void erase(const LobbyEntry& entry);
+
+	std::mutex _mtx;
+	std::map<Key, LobbyEntry> _tables;
+	std::unordered_map<uint32_t, Key> _keys;
+	std::map<Stakes, OpenTables> _open;		// only tables with a free seat
+};
+
+}
@@ -0,0 +1,40 @@
+#include "Login.h"
+#include "Asio.h"
+#include "Hmac.h"
+
+namespace poker {
+
+using msgpack::rpc::msgerror;
+using msgpack::rpc::error_not_authorized;
+
+std::string makeLoginToken(const std::string& secret, const std::string& account, uint64_t expiresMs)
+{
+	std::string signedPart = account + ":" + std::to_string(expiresMs);
+	return signedPart + ":" + msgpack::rpc::hmacSha256(secret, signedPart);
+}
+
+std::string checkLoginToken(const std::string& secret, const std::string& token, uint64_t nowMs)
+{
+	// the account may hold colons, the expiry and the mac do not
+	auto macAt = token.rfind(':');
+	auto expiresAt = macAt == std::string::npos || macAt == 0 ? std::string::npos : token.rfind(':', macAt - 1);
+	if (secret.empty() || expiresAt == std::string::npos || expiresAt == 0)
+		throw msgerror("invalid login token", error_not_authorized);
+
+	std::string signedPart = token.substr(0, macAt);
+	if (!msgpack::rpc::macEquals(token.substr(macAt + 1), msgpack::rpc::hmacSha256(secret, signedPart)))
+		throw msgerror("invalid login token", error_not_authorized);
+
+	uint64_t expiresMs = 0;
+	for (size_t i = expiresAt + 1; i < macAt; ++i)
+	{
+		if (token[i] < '0' || token[i] > '9')
+			throw msgerror("invalid login token", error_not_authorized);
+		expiresMs = expiresMs * 10 + (token[i] - '0');
+	}
+	if (expiresMs <= nowMs)
+		throw msgerror("login token expired", error_not_authorized);
+	return token.substr(0, expiresAt);
+}
+
+}
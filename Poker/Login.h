@@ -0,0 +1,17 @@
+#pragma once
+#include <cstdint>
+#include <string>
+
+namespace poker {
+
+/// Players log in with a token from the account service, which shares a
+/// secret with the servers: "account:expiresMs:mac", mac being the hex
+/// HMAC-SHA256 of "account:expiresMs" under the secret, expiresMs unix time.
+/// The servers keep no passwords and trust whoever holds a valid token.
+std::string makeLoginToken(const std::string& secret, const std::string& account, uint64_t expiresMs);
+
+/// the account of token, throws msgerror with error_not_authorized if it is
+/// malformed, signed with another secret or expired at nowMs
+std::string checkLoginToken(const std::string& secret, const std::string& token, uint64_t nowMs);
+
+}
@@ -0,0 +1,67 @@
+#pragma once
+#include <atomic>
+#include <utility>
+
+namespace poker {
+
+/// Unbounded lock free queue, any number of producers and one consumer.
+/// push is a single exchange, so producers never wait on each other or on
+/// the consumer. T must be default constructible.
+template<typename T>
+class MpscQueue
+{
+public:
+	MpscQueue() :
+		_head(new Node()),
+		_tail(_head.load(std::memory_order_relaxed))
+	{
+	}
+
+	~MpscQueue()
+	{
+		T value;
+		while (pop(value))
+			;
+		delete _tail;
+	}
+
+	/// any thread
+	void push(T value)
+	{
+		Node* node = new Node();
+		node->value = std::move(value);
+		Node* prev = _head.exchange(node, std::memory_order_acq_rel);
+		prev->next.store(node, std::memory_order_release);
+	}
+
+	/// consumer thread only, false if empty. a push still linking in may
+	/// be seen on the next call.
+	bool pop(T& value)
+	{
+		Node* tail = _tail;
+		Node* next = tail->next.load(std::memory_order_acquire);
+		if (!next)
+			return false;
+		value = std::move(next->value);
+		_tail = next;
+		delete tail;
+		return true;
+	}
+
+private:
+	MpscQueue(const MpscQueue&) = delete;
+	MpscQueue& operator=(const MpscQueue&) = delete;
+
+	struct Node
+	{
+		Node() : next(nullptr) { }
+
+		std::atomic<Node*> next;
+		T value;
+	};
+
+	std::atomic<Node*> _head;		// last pushed
+	Node* _tail;					// already consumed, its next is the oldest
+};
+
+}
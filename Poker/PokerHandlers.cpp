@@ -0,0 +1,629 @@
+#include "PokerHandlers.h"
+#include <atomic>
+#include <chrono>
+#include "Dispatcher.h"
+#include "Cluster.h"
+#include "HandEvaluator.h"
+#include "EquityCalculator.h"
+#include "TableManager.h"
+#include "Tournament.h"
+#include "Login.h"
+
+namespace poker {
+
+using msgpack::rpc::msgerror;
+using msgpack::rpc::error_invalid_argument;
+using msgpack::rpc::error_node_unavailable;
+using msgpack::rpc::error_not_authorized;
+using msgpack::rpc::AsyncReply;
+using msgpack::rpc::ArrayView;
+
+namespace {
+
+inline int cardAt(const std::vector<int>& cards, size_t i)
+{
+	return cards[i];
+}
+
+inline int cardAt(const ArrayView& cards, size_t i)
+{
+	return cards.as<int>(i);
+}
+
+template<typename Cards>
+HandMask toHandMask(const Cards& cards, size_t begin, size_t count)
+{
+	HandMask hand = 0;
+	for (size_t i = begin; i < begin + count; ++i)
+	{
+		int card = cardAt(cards, i);
+		if (card < 0 || card >= 52)
+			throw msgerror("invalid card", error_invalid_argument);
+		HandMask bit = cardMask(static_cast<Card>(card));
+		if (hand & bit)
+			throw msgerror("duplicate card", error_invalid_argument);
+		hand |= bit;
+	}
+	return hand;
+}
+
+/// the account connection logged in as, players act only for their own
+const std::string& accountOf(const Table::ConnectionPtr& connection)
+{
+	if (!connection || connection->getIdentity().empty())
+		throw msgerror("log in first", error_not_authorized);
+	return connection->getIdentity();
+}
+
+/// run fn on the actor's thread and reply with what it returns
+template<typename A, typename R, typename F>
+void postReply(A& actor, AsyncReply<R> reply, F fn)
+{
+	actor.post([reply, fn](A& self)
+	{
+		try
+		{
+			reply.result(fn(self));
+		}
+		catch (msgerror& ex)
+		{
+			reply.error(ex);
+		}
+	});
+}
+
+template<typename R, typename F>
+void onTable(TableManager& tables, uint32_t tableId, AsyncReply<R> reply, F fn)
+{
+	auto table = tables.find(tableId);
+	if (!table)
+		throw msgerror("no such table", error_invalid_argument);
+	postReply(*table, reply, fn);
+}
+
+/// reply with result(table) once the buy in or cash out of seat is durable where the wallet is
+template<typename R, typename G>
+void replySettled(Table& table, int seat, AsyncReply<R> reply, G result)
+{
+	table.whenSettled(seat, [reply, result](Table& table, msgpack::rpc::ServerSideError error)
+	{
+		if (error == msgpack::rpc::success)
+			reply.result(result(table));
+		else
+			reply.error(error, Wallets::describe(error));
+	});
+}
+
+/// onTable for calls that move chips in or out of a wallet, fn returns the seat
+template<typename R, typename F, typename G>
+void onTableSettled(TableManager& tables, uint32_t tableId, AsyncReply<R> reply, F fn, G result)
+{
+	auto table = tables.find(tableId);
+	if (!table)
+		throw msgerror("no such table", error_invalid_argument);
+
+	table->post([reply, fn, result](Table& table)
+	{
+		try
+		{
+			replySettled(table, fn(table), reply, result);
+		}
+		catch (msgerror& ex)
+		{
+			reply.error(ex);
+		}
+	});
+}
+
+/// the reply of calls that seat a player
+TableState stateOf(Table& table)
+{
+	return table.getState();
+}
+
+/// the balance of account from the node its wallet is on
+void replyBalance(Wallets& wallets, const std::string& account, AsyncReply<int64_t> reply)
+{
+	wallets.balance(account, [reply](msgpack::rpc::ServerSideError error, int64_t balance)
+	{
+		if (error == msgpack::rpc::success)
+			reply.result(balance);
+		else
+			reply.error(error, Wallets::describe(error));
+	});
+}
+
+/// seat at the best table of the stakes, retried when it fills up in the meantime
+void seatPlayer(std::shared_ptr<TableManager> tables, const TableConfig& config, Table::ConnectionPtr connection,
+	const std::string& player, int64_t buyIn, AsyncReply<TableState> reply, int attempts)
+{
+	LobbyEntry best;
+	std::shared_ptr<Table> table;
+	if (tables->getLobby().findBest(config.game, config.smallBlind, config.bigBlind, best))
+		table = tables->find(best.tableId);
+	if (!table)
+		table = tables->create(config);
+
+	table->post([tables, config, connection, player, buyIn, reply, attempts](Table& table)
+	{
+		try
+		{
+			int seat = table.joinAny(connection, player, buyIn);
+			if (seat >= 0)
+				replySettled(table, seat, reply, stateOf);
+			else if (attempts > 1)
+				seatPlayer(tables, config, connection, player, buyIn, reply, attempts - 1);
+			else
+				reply.error(msgpack::rpc::error_illegal_action, "no free seat");
+		}
+		catch (msgerror& ex)
+		{
+			reply.error(ex);
+		}
+	});
+}
+
+}
+
+void addEvaluatorHandlers(msgpack::rpc::Dispatcher& disp)
+{
+	disp.add_handler("eval_hand", [](std::vector<int> cards)->uint32_t
+	{
+		if (cards.size() < 5 || cards.size() > 7)
+			throw msgerror("5 to 7 cards expected", error_invalid_argument);
+		return HandEvaluator::evaluate(toHandMask(cards, 0, cards.size()));
+	});
+
+	// batches run to thousands of cards, they are read in place
+	disp.add_handler("eval_batch", [](ArrayView cards, int cardsPerHand)->std::vector<uint32_t>
+	{
+		if (cardsPerHand < 5 || cardsPerHand > 7 || cards.size() % cardsPerHand)
+			throw msgerror("cards must hold whole hands of 5 to 7 cards", error_invalid_argument);
+
+		size_t count = cards.size() / cardsPerHand;
+		std::vector<HandMask> hands(count);
+		for (size_t i = 0; i < count; ++i)
+			hands[i] = toHandMask(cards, i * cardsPerHand, cardsPerHand);
+
+		std::vector<uint32_t> ranks(count);
+		HandEvaluator::evaluateBatch(hands.data(), ranks.data(), count);
+		return ranks;
+	});
+}
+
+void addEquityHandlers(msgpack::rpc::Dispatcher& disp, std::shared_ptr<EquityCalculator> calculator)
+{
+	std::function<void(AsyncReply<EquityResult>, std::vector<std::vector<int>>, std::vector<int>, std::vector<int>, uint32_t)> equity =
+		[calculator](AsyncReply<EquityResult> reply, std::vector<std::vector<int>> holes, std::vector<int> board,
+			std::vector<int> dead, uint32_t samples)
+	{
+		if (holes.size() < 2 || holes.size() > EquityCalculator::MAX_HANDS)
+			throw msgerror("2 to 10 hands expected", error_invalid_argument);
+		if (board.size() > 5 || board.size() == 1 || board.size() == 2)
+			throw msgerror("board must hold 0 or 3 to 5 cards", error_invalid_argument);
+
+		std::vector<HandMask> hands;
+		HandMask used = toHandMask(board, 0, board.size());
+		HandMask boardMask = used;
+		for (auto& hole : holes)
+		{
+			if (hole.size() != 2)
+				throw msgerror("2 hole cards per hand expected", error_invalid_argument);
+			HandMask hand = toHandMask(hole, 0, 2);
+			if (used & hand)
+				throw msgerror("duplicate card", error_invalid_argument);
+			used |= hand;
+			hands.push_back(hand);
+		}
+		HandMask deadMask = toHandMask(dead, 0, dead.size());
+		if (used & deadMask)
+			throw msgerror("duplicate card", error_invalid_argument);
+		if (52 - holes.size() * 2 - board.size() - dead.size() < 5 - board.size())
+			throw msgerror("not enough cards left to deal the board", error_invalid_argument);
+
+		calculator->asyncCalculate(hands, boardMask, deadMask, samples, [reply](EquityResult result)
+		{
+			reply.result(result);
+		});
+	};
+	disp.add_async_handler("equity", equity);
+}
+
+void addTableHandlers(msgpack::rpc::Dispatcher& disp, std::shared_ptr<TableManager> tables)
+{
+	std::function<void(AsyncReply<uint32_t>, std::string, int64_t, int64_t, uint32_t)> create =
+		[tables](AsyncReply<uint32_t> reply, std::string game, int64_t smallBlind, int64_t bigBlind, uint32_t seats)
+	{
+		TableConfig config;
+		config.game = game;
+		config.smallBlind = smallBlind;
+		config.bigBlind = bigBlind;
+		config.seats = seats;
+
+		// in a cluster the table goes to the node the placement ring puts its id on
+		auto cluster = tables->getCluster();
+		uint32_t tableId = tables->reserveId();
+		uint32_t node = cluster ? cluster->placement(TableManager::clusterKey(tableId)) : 0;
+		if (!node || node == cluster->getNodeId())
+		{
+			reply.result(tables->create(config, tableId)->getId());
+			return;
+		}
+
+		bool sent = cluster->call(node, [reply](msgpack::rpc::AsyncCallCtx* ctx)
+		{
+			uint32_t created = 0;
+			if (ctx->isError())
+				reply.error(ctx->getErrorCode(), ctx->getErrorMessage());
+			else
+				reply.result(ctx->convert(&created));
+		}, "table_create_at", tableId, std::make_tuple(game, smallBlind, bigBlind, seats));
+		if (!sent)
+			reply.error(error_node_unavailable, "node unavailable");
+	};
+	disp.add_async_handler("table_create", create);
+
+	std::function<void(AsyncReply<TableState>, uint32_t, int, int64_t)> join =
+		[tables](AsyncReply<TableState> reply, uint32_t tableId, int seat, int64_t buyIn)
+	{
+		auto connection = reply.connection();
+		// forwarded from another node the buy in goes to the wallet wherever it is, see Wallets
+		std::string player = accountOf(connection);
+		onTableSettled(*tables, tableId, reply, [connection, seat, player, buyIn](Table& table)
+		{
+			return table.join(connection, seat, player, buyIn);
+		}, stateOf);
+	};
+	disp.add_async_handler("table_join", join);
+
+	std::function<void(AsyncReply<bool>, uint32_t, int, int64_t)> act =
+		[tables](AsyncReply<bool> reply, uint32_t tableId, int action, int64_t amount)
+	{
+		auto connection = reply.connection();
+		onTable(*tables, tableId, reply, [connection, action, amount](Table& table)
+		{
+			table.act(connection, static_cast<TableAction>(action), amount);
+			return true;
+		});
+	};
+	disp.add_async_handler("table_act", act);
+	disp.set_reply_priority("table_act", msgpack::rpc::priority_high);
+
+	std::function<void(AsyncReply<bool>, uint32_t)> leave = [tables](AsyncReply<bool> reply, uint32_t tableId)
+	{
+		auto connection = reply.connection();
+		onTableSettled(*tables, tableId, reply, [connection](Table& table)
+		{
+			return table.leave(connection);
+		}, [](Table&) { return true; });
+	};
+	disp.add_async_handler("table_leave", leave);
+
+	std::function<void(AsyncReply<TableState>, uint32_t)> state = [tables](AsyncReply<TableState> reply, uint32_t tableId)
+	{
+		onTable(*tables, tableId, reply, [](Table& table)
+		{
+			return table.getState();
+		});
+	};
+	disp.add_async_handler("table_state", state);
+
+	std::function<void(AsyncReply<TableState>, uint32_t)> watch = [tables](AsyncReply<TableState> reply, uint32_t tableId)
+	{
+		auto connection = reply.connection();
+		onTable(*tables, tableId, reply, [connection](Table& table)
+		{
+			table.watch(connection);
+			return table.getState();
+		});
+	};
+	disp.add_async_handler("table_watch", watch);
+
+	std::function<void(AsyncReply<bool>, uint32_t)> unwatch = [tables](AsyncReply<bool> reply, uint32_t tableId)
+	{
+		auto connection = reply.connection();
+		onTable(*tables, tableId, reply, [connection](Table& table)
+		{
+			table.unwatch(connection);
+			return true;
+		});
+	};
+	disp.add_async_handler("table_unwatch", unwatch);
+
+	std::function<void(AsyncReply<bool>, uint32_t, uint64_t)> ack =
+		[tables](AsyncReply<bool> reply, uint32_t tableId, uint64_t version)
+	{
+		auto connection = reply.connection();
+		onTable(*tables, tableId, reply, [connection, version](Table& table)
+		{
+			table.ack(connection, version);
+			return true;
+		});
+	};
+	disp.add_async_handler("table_ack", ack);
+}
+
+void addLobbyHandlers(msgpack::rpc::Dispatcher& disp, std::shared_ptr<TableManager> tables)
+{
+	disp.add_handler("lobby_list", [tables](std::string game, LobbyCursor after, uint32_t limit)->LobbyPage
+	{
+		return tables->getLobby().list(game, after, limit);
+	});
+	disp.set_reply_priority("lobby_list", msgpack::rpc::priority_bulk);
+	static_assert(Lobby::MAX_PAGE_BYTES <= msgpack::rpc::TcpConnection::BULK_MESSAGE_BYTES,
+		"a lobby page must not hold a high priority write back");
+
+	disp.add_handler("lobby_find", [tables](std::string game, int64_t smallBlind, int64_t bigBlind)->uint32_t
+	{
+		LobbyEntry best;
+		return tables->getLobby().findBest(game, smallBlind, bigBlind, best) ? best.tableId : 0;
+	});
+
+	std::function<void(AsyncReply<TableState>, std::string, int64_t, int64_t, int64_t)> seat =
+		[tables](AsyncReply<TableState> reply, std::string game, int64_t smallBlind, int64_t bigBlind, int64_t buyIn)
+	{
+		TableConfig config;
+		config.game = game;
+		config.smallBlind = smallBlind;
+		config.bigBlind = bigBlind;
+		seatPlayer(tables, config, reply.connection(), accountOf(reply.connection()), buyIn, reply, 3);
+	};
+	disp.add_async_handler("lobby_seat", seat);
+}
+
+void addResumeHandlers(msgpack::rpc::Dispatcher& disp, std::shared_ptr<TableManager> tables)
+{
+	std::function<void(AsyncReply<uint32_t>, std::string)> resume = [tables](AsyncReply<uint32_t> reply, std::string token)
+	{
+		auto seats = tables->getBindings().take(token);
+		if (seats.empty())
+		{
+			reply.result(0);
+			return;
+		}
+
+		// replied when the last table is done
+		struct Progress
+		{
+			std::atomic<size_t> left;
+			std::atomic<uint32_t> resumed;
+		};
+		auto progress = std::make_shared<Progress>();
+		progress->left = seats.size();
+		progress->resumed = 0;
+		auto done = [reply, progress](bool resumed)
+		{
+			if (resumed)
+				++progress->resumed;
+			if (--progress->left == 0)
+				reply.result(progress->resumed);
+		};
+
+		auto connection = reply.connection();
+		for (auto& seat : seats)
+		{
+			auto table = tables->find(seat.tableId);
+			if (!table)
+			{
+				done(false);
+				continue;
+			}
+			table->post([seat, connection, done](Table& table)
+			{
+				done(table.resume(seat.seat, seat.player, connection));
+			});
+		}
+	};
+	disp.add_async_handler("session_resume", resume);
+}
+
+void addTournamentHandlers(msgpack::rpc::Dispatcher& disp, std::shared_ptr<TournamentScheduler> scheduler)
+{
+	std::function<void(AsyncReply<uint32_t>, uint32_t)> enroll = [scheduler](AsyncReply<uint32_t> reply, uint32_t tournamentId)
+	{
+		auto connection = reply.connection();
+		std::string player = accountOf(connection);
+		postReply(*scheduler, reply, [tournamentId, player, connection](TournamentScheduler& scheduler)
+		{
+			return scheduler.enroll(tournamentId, player, connection);
+		});
+	};
+	disp.add_async_handler("tournament_register", enroll);
+
+	std::function<void(AsyncReply<TournamentInfo>, uint32_t)> info =
+		[scheduler](AsyncReply<TournamentInfo> reply, uint32_t tournamentId)
+	{
+		postReply(*scheduler, reply, [tournamentId](TournamentScheduler& scheduler)
+		{
+			return scheduler.getInfo(tournamentId);
+		});
+	};
+	disp.add_async_handler("tournament_info", info);
+}
+
+void addTournamentAdminHandlers(msgpack::rpc::Dispatcher& disp, std::shared_ptr<TournamentScheduler> scheduler)
+{
+	std::function<void(AsyncReply<uint32_t>, std::string, uint32_t, int64_t, std::vector<BlindLevel>)> create =
+		[scheduler](AsyncReply<uint32_t> reply, std::string name, uint32_t seatsPerTable, int64_t startingStack,
+			std::vector<BlindLevel> levels)
+	{
+		TournamentConfig config;
+		config.name = name;
+		config.seatsPerTable = seatsPerTable;
+		config.startingStack = startingStack;
+		config.levels = levels;
+		postReply(*scheduler, reply, [config](TournamentScheduler& scheduler)
+		{
+			return scheduler.create(config);
+		});
+	};
+	disp.add_async_handler("tournament_create", create);
+
+	std::function<void(AsyncReply<bool>, uint32_t)> start = [scheduler](AsyncReply<bool> reply, uint32_t tournamentId)
+	{
+		postReply(*scheduler, reply, [tournamentId](TournamentScheduler& scheduler)
+		{
+			scheduler.start(tournamentId);
+			return true;
+		});
+	};
+	disp.add_async_handler("tournament_start", start);
+}
+
+void addLoginHandlers(msgpack::rpc::Dispatcher& disp, const std::string& secret)
+{
+	std::function<void(AsyncReply<std::string>, std::string)> login =
+		[secret](AsyncReply<std::string> reply, std::string token)
+	{
+		if (secret.empty())
+			throw msgerror("logins are not enabled", error_not_authorized);
+		uint64_t nowMs = std::chrono::duration_cast<std::chrono::milliseconds>(
+			std::chrono::system_clock::now().time_since_epoch()).count();
+		std::string account = checkLoginToken(secret, token, nowMs);
+		reply.connection()->setIdentity(account);
+		reply.result(account);
+	};
+	disp.add_async_handler("session_login", login);
+}
+
+void addWalletHandlers(msgpack::rpc::Dispatcher& disp, std::shared_ptr<Wallets> wallets)
+{
+	std::function<void(AsyncReply<int64_t>)> balance = [wallets](AsyncReply<int64_t> reply)
+	{
+		replyBalance(*wallets, accountOf(reply.connection()), reply);
+	};
+	disp.add_async_handler("wallet_balance", balance);
+}
+
+void addWalletAdminHandlers(msgpack::rpc::Dispatcher& disp, std::shared_ptr<Wallets> wallets)
+{
+	auto move = [wallets](AsyncReply<int64_t> reply, LedgerKind kind, const std::string& account, int64_t amount)
+	{
+		if (account.empty() || amount <= 0)
+			throw msgerror("account and a positive amount required", error_invalid_argument);
+
+		LedgerEntry entry;
+		entry.kind = kind;
+		entry.account = account;
+		entry.amount = kind == ledger_withdraw ? -amount : amount;
+		wallets->move(entry, [wallets, reply, account](msgpack::rpc::ServerSideError error)
+		{
+			if (error != msgpack::rpc::success)
+			{
+				reply.error(error, Wallets::describe(error));
+				return;
+			}
+			try
+			{
+				replyBalance(*wallets, account, reply);
+			}
+			catch (msgerror& ex)
+			{
+				reply.error(ex);
+			}
+		});
+	};
+
+	std::function<void(AsyncReply<int64_t>, std::string, int64_t)> deposit =
+		[move](AsyncReply<int64_t> reply, std::string account, int64_t amount)
+	{
+		move(reply, ledger_deposit, account, amount);
+	};
+	disp.add_async_handler("wallet_deposit", deposit);
+
+	std::function<void(AsyncReply<int64_t>, std::string, int64_t)> withdraw =
+		[move](AsyncReply<int64_t> reply, std::string account, int64_t amount)
+	{
+		move(reply, ledger_withdraw, account, amount);
+	};
+	disp.add_async_handler("wallet_withdraw", withdraw);
+
+	std::function<void(AsyncReply<int64_t>, std::string)> balance = [wallets](AsyncReply<int64_t> reply, std::string account)
+	{
+		replyBalance(*wallets, account, reply);
+	};
+	disp.add_async_handler("wallet_balance", balance);
+}
+
+void addClusterRoutes(msgpack::rpc::Cluster& cluster)
+{
+	// the table id comes first, a request without one runs where it is and fails there
+	auto byTable = [](const msgpack::object& params) -> std::string
+	{
+		if (params.type != msgpack::type::ARRAY || params.via.array.size == 0 ||
+			params.via.array.ptr[0].type != msgpack::type::POSITIVE_INTEGER)
+			return std::string();
+		return TableManager::clusterKey(static_cast<uint32_t>(params.via.array.ptr[0].via.u64));
+	};
+	for (auto method : { "table_join", "table_act", "table_leave", "table_state", "table_watch", "table_unwatch", "table_ack" })
+		cluster.route(method, byTable);
+}
+
+void addClusterHandlers(msgpack::rpc::Dispatcher& disp, std::shared_ptr<TableManager> tables)
+{
+	// the params of table_create
+	typedef std::tuple<std::string, int64_t, int64_t, uint32_t> CreateParams;
+	disp.add_handler("table_create_at", [tables](uint32_t tableId, CreateParams params)->uint32_t
+	{
+		TableConfig config;
+		config.game = std::get<0>(params);
+		config.smallBlind = std::get<1>(params);
+		config.bigBlind = std::get<2>(params);
+		config.seats = std::get<3>(params);
+		return tables->create(config, tableId)->getId();
+	});
+
+	disp.add_handler("table_adopt", [tables](TableHandoff handoff)->bool
+	{
+		tables->adopt(handoff);
+		return true;
+	});
+
+	disp.add_handler("table_evict", [tables](uint32_t tableId)->bool
+	{
+		tables->evict(tableId);
+		return true;
+	});
+
+	// the wallets the placement ring puts on this node, moved by the tables of every node
+	auto wallets = tables->getWallets();
+	if (!wallets)
+		return;
+	std::function<void(AsyncReply<bool>, LedgerEntry)> append = [wallets](AsyncReply<bool> reply, LedgerEntry entry)
+	{
+		if (!Ledger::isWalletMove(entry.kind) || wallets->nodeOf(entry.account))
+			throw msgerror("not a move of a wallet of this node", error_invalid_argument);
+		entry.seq = 0;
+		wallets->getLedger()->append(entry, [reply](bool durable)
+		{
+			if (durable)
+				reply.result(true);
+			else
+				reply.error(msgpack::rpc::error_handler_failed, "ledger write failed");
+		});
+	};
+	disp.add_async_handler("ledger_append", append);
+
+	disp.add_handler("ledger_balance", [wallets](std::string account)->int64_t
+	{
+		return wallets->getLedger()->getBalance(account);
+	});
+}
+
+void addClusterAdminHandlers(msgpack::rpc::Dispatcher& disp, std::shared_ptr<TableManager> tables, uint32_t maxPauseMs)
+{
+	std::function<void(AsyncReply<bool>, uint32_t, uint32_t)> migrate =
+		[tables, maxPauseMs](AsyncReply<bool> reply, uint32_t tableId, uint32_t node)
+	{
+		tables->migrate(tableId, node, maxPauseMs, [reply](const std::string& error)
+		{
+			if (error.empty())
+				reply.result(true);
+			else
+				reply.error(error_node_unavailable, error);
+		});
+	};
+	disp.add_async_handler("table_migrate", migrate);
+}
+
+}
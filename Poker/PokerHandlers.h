@@ -0,0 +1,86 @@
+#pragma once
+#include <cstdint>
+#include <memory>
+#include <string>
+
+namespace msgpack {
+namespace rpc {
+class Dispatcher;
+class Cluster;
+} }
+
+namespace poker {
+
+class EquityCalculator;
+class TableManager;
+class TournamentScheduler;
+class Wallets;
+
+/// eval_hand(cards) and eval_batch(cards, cardsPerHand), cards are 0..51
+void addEvaluatorHandlers(msgpack::rpc::Dispatcher& disp);
+
+/// equity(holes, board, dead, samples) replied from the calculator's pool,
+/// holes is one 2 card array per player
+void addEquityHandlers(msgpack::rpc::Dispatcher& disp, std::shared_ptr<EquityCalculator> calculator);
+
+/// table_create(game, smallBlind, bigBlind, seats), on the node the placement
+/// ring puts the new id on when in a cluster, then table_join(tableId, seat, buyIn)
+/// for the account the session logged in as, from whichever node the client is on,
+/// table_act(tableId, action, amount), table_leave(tableId) and table_state(tableId).
+/// table_watch(tableId) and table_unwatch(tableId) for spectators, table_ack(tableId, version)
+/// after applying an update. players and spectators get table_state or table_delta
+/// notifies, players also hole_cards.
+void addTableHandlers(msgpack::rpc::Dispatcher& disp, std::shared_ptr<TableManager> tables);
+
+/// lobby_list(game, cursor, limit) pages through the tables of a game,
+/// lobby_find(game, smallBlind, bigBlind) gives the best table or 0, and
+/// lobby_seat(game, smallBlind, bigBlind, buyIn) joins it, opening a table
+/// when all are full, for the account the session logged in as.
+void addLobbyHandlers(msgpack::rpc::Dispatcher& disp, std::shared_ptr<TableManager> tables);
+
+/// session_resume(token) puts the caller back in the seats held by the
+/// session that was issued token, replies how many. The token is spent,
+/// the new session's token holds the seats from then on.
+void addResumeHandlers(msgpack::rpc::Dispatcher& disp, std::shared_ptr<TableManager> tables);
+
+/// tournament_register(id) enrolls the account the session logged in as,
+/// tournament_info(id). Seated players get tournament_level and
+/// tournament_finished notifies.
+void addTournamentHandlers(msgpack::rpc::Dispatcher& disp, std::shared_ptr<TournamentScheduler> scheduler);
+
+/// For the operator's dispatcher only: tournament_create(name, seatsPerTable,
+/// startingStack, levels), levels as [smallBlind, bigBlind, durationMs, isBreak]
+/// arrays, and tournament_start(id).
+void addTournamentAdminHandlers(msgpack::rpc::Dispatcher& disp, std::shared_ptr<TournamentScheduler> scheduler);
+
+/// session_login(token) checks a token made by makeLoginToken with secret and
+/// replies the account, which the session then plays as. No secret, no logins.
+void addLoginHandlers(msgpack::rpc::Dispatcher& disp, const std::string& secret);
+
+/// wallet_balance() of the account the session logged in as.
+/// With wallets, table_join, table_leave and lobby_seat reply only once
+/// the buy in or cash out is durable too, on the node of the wallet.
+void addWalletHandlers(msgpack::rpc::Dispatcher& disp, std::shared_ptr<Wallets> wallets);
+
+/// For the operator's dispatcher only, never one clients reach:
+/// wallet_deposit(account, amount) and wallet_withdraw(account, amount) reply
+/// the new balance once the move is on disk, wallet_balance(account). Any node
+/// takes them for any wallet.
+void addWalletAdminHandlers(msgpack::rpc::Dispatcher& disp, std::shared_ptr<Wallets> wallets);
+
+/// table_ calls for a table of another node go to that node, the lobby
+/// and session_resume stay with the node the client is on
+void addClusterRoutes(msgpack::rpc::Cluster& cluster);
+
+/// table_create_at, table_adopt and table_evict are what nodes call on each other,
+/// and with wallets ledger_append(entry) and ledger_balance(account) for the
+/// wallets the placement ring puts on this node.
+/// For the peer dispatcher of the cluster, which clients cannot reach.
+void addClusterHandlers(msgpack::rpc::Dispatcher& disp, std::shared_ptr<TableManager> tables);
+
+/// For the operator's dispatcher only: table_migrate(tableId, node) moves a
+/// table to node, 0 for where the placement ring puts it, pausing it for up
+/// to maxPauseMs once no hand runs.
+void addClusterAdminHandlers(msgpack::rpc::Dispatcher& disp, std::shared_ptr<TableManager> tables, uint32_t maxPauseMs = 2000);
+
+}
@@ -0,0 +1,158 @@
+#include "SessionResume.h"
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <boost/crc.hpp>
+#include <boost/interprocess/file_mapping.hpp>
+#include <boost/interprocess/mapped_region.hpp>
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <io.h>
+#include <windows.h>
+#define POKER_SYNC _commit
+#define POKER_FILENO _fileno
+#else
+#include <unistd.h>
+#define POKER_SYNC ::fsync
+#define POKER_FILENO ::fileno
+#endif
+
+namespace poker {
+
+namespace bip = boost::interprocess;
+
+namespace {
+
+uint32_t crc32(const char* data, size_t size)
+{
+	boost::crc_32_type crc;
+	crc.process_bytes(data, size);
+	return crc.checksum();
+}
+
+/// the whole file on disk, not only in the cache, before it is renamed into place
+bool writeDurably(const std::string& path, const char* header, size_t headerSize, const msgpack::sbuffer& body)
+{
+	std::FILE* file = std::fopen(path.c_str(), "wb");
+	if (!file)
+		return false;
+	bool written = std::fwrite(header, 1, headerSize, file) == headerSize
+		&& std::fwrite(body.data(), 1, body.size(), file) == body.size()
+		&& std::fflush(file) == 0
+		&& POKER_SYNC(POKER_FILENO(file)) == 0;
+	return std::fclose(file) == 0 && written;
+}
+
+}
+
+void SeatBindings::bind(const std::string& token, const SeatBinding& binding)
+{
+	if (token.empty())
+		return;
+	std::lock_guard<std::mutex> lock(_mtx);
+	auto& seats = _byToken[token];
+	for (auto& seat : seats)
+	{
+		if (seat.tableId == binding.tableId)
+		{
+			seat = binding;
+			return;
+		}
+	}
+	seats.push_back(binding);
+}
+
+void SeatBindings::unbind(const std::string& token, uint32_t tableId)
+{
+	std::lock_guard<std::mutex> lock(_mtx);
+	auto found = _byToken.find(token);
+	if (found == _byToken.end())
+		return;
+	auto& seats = found->second;
+	seats.erase(std::remove_if(seats.begin(), seats.end(), [tableId](const SeatBinding& seat)
+	{
+		return seat.tableId == tableId;
+	}), seats.end());
+	if (seats.empty())
+		_byToken.erase(found);
+}
+
+std::vector<SeatBinding> SeatBindings::take(const std::string& token)
+{
+	std::lock_guard<std::mutex> lock(_mtx);
+	std::vector<SeatBinding> seats;
+	auto found = _byToken.find(token);
+	if (found != _byToken.end())
+	{
+		seats.swap(found->second);
+		_byToken.erase(found);
+	}
+	return seats;
+}
+
+size_t SeatBindings::size()
+{
+	std::lock_guard<std::mutex> lock(_mtx);
+	return _byToken.size();
+}
+
+bool snapshot::save(const std::string& path, const ServerSnapshot& snapshot)
+{
+	msgpack::sbuffer body;
+	msgpack::pack(body, snapshot);
+
+	char header[HEADER_SIZE];
+	uint32_t size = static_cast<uint32_t>(body.size());
+	uint32_t crc = crc32(body.data(), body.size());
+	std::memcpy(header, MAGIC, sizeof(MAGIC));
+	std::memcpy(header + 8, &size, sizeof(size));
+	std::memcpy(header + 12, &crc, sizeof(crc));
+
+	std::string temp = path + ".tmp";
+	if (!writeDurably(temp, header, sizeof(header), body))
+	{
+		std::remove(temp.c_str());
+		return false;
+	}
+	// replaced in one step, there is no moment without a snapshot
+#ifdef _WIN32
+	return MoveFileExA(temp.c_str(), path.c_str(), MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH) != 0;
+#else
+	return std::rename(temp.c_str(), path.c_str()) == 0;
+#endif
+}
+
+bool snapshot::load(const std::string& path, ServerSnapshot& snapshot)
+{
+	if (!std::ifstream(path, std::ios::binary).good())
+		return false;
+	try
+	{
+		bip::file_mapping file(path.c_str(), bip::read_only);
+		bip::mapped_region region(file, bip::read_only);
+		const char* base = static_cast<const char*>(region.get_address());
+		if (region.get_size() < HEADER_SIZE || std::memcmp(base, MAGIC, sizeof(MAGIC)))
+			return false;
+
+		uint32_t size;
+		uint32_t crc;
+		std::memcpy(&size, base + 8, sizeof(size));
+		std::memcpy(&crc, base + 12, sizeof(crc));
+		if (HEADER_SIZE + size > region.get_size() || crc32(base + HEADER_SIZE, size) != crc)
+			return false;
+
+		msgpack::unpacked unpacked;
+		msgpack::unpack(unpacked, base + HEADER_SIZE, size);
+		unpacked.get().convert(&snapshot);
+		return true;
+	}
+	catch (std::exception&)
+	{
+		return false;
+	}
+}
+
+}
@@ -0,0 +1,84 @@
+#pragma once
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <msgpack.hpp>
+
+namespace poker {
+
+/// A seat held by the session with a resume token.
+struct SeatBinding
+{
+	uint32_t tableId;
+	int seat;
+	std::string player;
+};
+
+/// The seats of each resume token, so a reconnecting client is put back
+/// in its seats with one lookup. Any thread.
+class SeatBindings
+{
+public:
+	void bind(const std::string& token, const SeatBinding& binding);
+	void unbind(const std::string& token, uint32_t tableId);
+
+	/// removes and returns the seats of token, a token resumes once
+	std::vector<SeatBinding> take(const std::string& token);
+
+	size_t size();
+
+private:
+	std::mutex _mtx;
+	std::unordered_map<std::string, std::vector<SeatBinding>> _byToken;
+};
+
+struct SeatSnapshot
+{
+	int seat = -1;
+	std::string player;
+	int64_t stack = 0;
+	std::string token;
+	MSGPACK_DEFINE(seat, player, stack, token);
+};
+
+struct TableSnapshot
+{
+	uint32_t tableId = 0;
+	std::string game;
+	uint32_t seats = 0;
+	int64_t smallBlind = 0;
+	int64_t bigBlind = 0;
+	uint32_t actionTimeoutMs = 0;
+	uint32_t nextHandDelayMs = 0;
+	int button = -1;
+	std::vector<SeatSnapshot> players;
+	uint64_t version = 0;		// of the state, a table that moved carries on from it
+	MSGPACK_DEFINE(tableId, game, seats, smallBlind, bigBlind, actionTimeoutMs, nextHandDelayMs,
+		button, players, version);
+};
+
+/// Tables and who sits where, taken at drain so a restart can pick up
+/// where it stopped.
+struct ServerSnapshot
+{
+	uint64_t savedMs = 0;		// unix time
+	std::vector<TableSnapshot> tables;
+	MSGPACK_DEFINE(savedMs, tables);
+};
+
+/// File layout: magic, uint32 size, uint32 crc32, then size bytes of
+/// msgpack ServerSnapshot.
+namespace snapshot {
+	const char MAGIC[8] = { 'R', 'S', 'N', 'A', 'P', '0', '0', '1' };
+	const size_t HEADER_SIZE = 16;
+
+	/// written next to path and renamed over it, a crash leaves the old one
+	bool save(const std::string& path, const ServerSnapshot& snapshot);
+
+	/// maps path and unpacks in place, false if there is none or it fails its crc
+	bool load(const std::string& path, ServerSnapshot& snapshot);
+}
+
+}
@@ -0,0 +1,970 @@
+#include "Table.h"
+#include <algorithm>
+#include <chrono>
+
+namespace poker {
+
+using msgpack::rpc::msgerror;
+using msgpack::rpc::error_invalid_argument;
+using msgpack::rpc::error_illegal_action;
+using msgpack::rpc::WriteHandler;
+using msgpack::rpc::priority_high;
+
+namespace {
+
+std::vector<int> maskCards(HandMask mask)
+{
+	std::vector<int> cards;
+	for (int card = 0; card < 52; ++card)
+	{
+		if (mask & cardMask(static_cast<Card>(card)))
+			cards.push_back(card);
+	}
+	return cards;
+}
+
+}
+
+Table::Table(boost::asio::io_service& ios, uint32_t id, const TableConfig& config,
+	const TableServices& services):
+	_strand(ios),
+	_timer(ios),
+	_timerSeq(0),
+	_config(config),
+	_connections(config.seats),
+	_acked(config.seats, 0),
+	_leaving(config.seats, false),
+	_settling(config.seats, settled),
+	_settledHandlers(config.seats),
+	_acted(config.seats, false),
+	_committed(config.seats, 0),
+	_holes(config.seats, 0),
+	_history(services.history),
+	_lobby(services.lobby),
+	_bindings(services.bindings),
+	_wallets(config.assignedSeats ? nullptr : services.wallets),
+	_tokens(config.seats),
+	_paused(false),
+	_moving(false),
+	_deckService(services.decks),
+	_decks(services.decks ? services.decks->open() : nullptr),
+	_deckPos(0),
+	_presetDeck(false)
+{
+	_state.tableId = id;
+	_state.smallBlind = config.smallBlind;
+	_state.bigBlind = config.bigBlind;
+	_state.minRaise = config.bigBlind;
+	_state.seats.resize(config.seats);
+	updateLobby();
+}
+
+int Table::join(ConnectionPtr connection, int seat, const std::string& player, int64_t buyIn)
+{
+	if (seat < 0 || seat >= static_cast<int>(_state.seats.size()))
+		throw msgerror("no such seat", error_invalid_argument);
+	if (player.empty() || buyIn <= 0)
+		throw msgerror("player name and buy in required", error_invalid_argument);
+	if (_moving)
+		throw msgerror("table is moving", error_illegal_action);
+	if (seatOf(connection) >= 0)
+		throw msgerror("already seated", error_illegal_action);
+	if (!_state.seats[seat].player.empty())
+		throw msgerror("seat taken", error_illegal_action);
+	if (_config.assignedSeats)
+		throw msgerror("seats are assigned at this table", error_illegal_action);
+	if (_wallets)
+		moveWallet(seat, ledger_buy_in, player, -buyIn);
+
+	SeatState& state = _state.seats[seat];
+	state = SeatState();
+	state.player = player;
+	state.stack = buyIn;
+	_connections[seat] = connection;
+	_acked[seat] = 0;
+	_leaving[seat] = false;
+	_tokens[seat] = connection->getResumeToken();
+	if (_bindings)
+		_bindings->bind(_tokens[seat], SeatBinding{ _state.tableId, seat, player });
+	updateLobby();
+
+	if (_state.street == street_waiting)
+		startHand();
+	else
+		broadcast();
+	return seat;
+}
+
+int Table::joinAny(ConnectionPtr connection, const std::string& player, int64_t buyIn)
+{
+	for (size_t seat = 0; seat < _state.seats.size(); ++seat)
+	{
+		if (_state.seats[seat].player.empty())
+			return join(connection, static_cast<int>(seat), player, buyIn);
+	}
+	return -1;
+}
+
+int Table::leave(const ConnectionPtr& connection)
+{
+	int seat = seatOf(connection);
+	if (seat < 0)
+		throw msgerror("not seated", error_illegal_action);
+	if (_moving)
+		throw msgerror("table is moving", error_illegal_action);
+	if (_settling[seat] != settled)
+		throw msgerror("buy in or cash out still pending", error_illegal_action);
+
+	bool running = _state.street >= street_preflop && _state.street <= street_river;
+	if (running && _leaving[seat] && _state.seats[seat].inHand)
+		throw msgerror("leaving once the hand is over", error_illegal_action);
+	if (!running || !isLive(seat))
+	{
+		freeSeat(seat);
+		broadcast();
+		return seat;
+	}
+
+	_leaving[seat] = true;
+	if (_state.toAct == seat)
+	{
+		applyAction(seat, action_fold, 0);
+		return seat;
+	}
+
+	// folding out of turn, the player to act keeps the turn
+	_state.seats[seat].folded = true;
+	record(seat, action_fold, 0);
+	int live = 0;
+	int last = -1;
+	for (int s = 0; s < static_cast<int>(_state.seats.size()); ++s)
+	{
+		if (isLive(s))
+		{
+			++live;
+			last = s;
+		}
+	}
+	if (live == 1)
+		awardAll(last);
+	else
+		broadcast();
+	return seat;
+}
+
+void Table::whenSettled(int seat, SettledHandler fn)
+{
+	if (seat < 0 || seat >= static_cast<int>(_settling.size()) || _settling[seat] == settled)
+		fn(*this, msgpack::rpc::success);
+	else
+		_settledHandlers[seat].push_back(fn);
+}
+
+void Table::act(const ConnectionPtr& connection, TableAction action, int64_t amount)
+{
+	int seat = seatOf(connection);
+	if (seat < 0)
+		throw msgerror("not seated", error_illegal_action);
+	if (_state.street < street_preflop || _state.street > street_river || _state.toAct != seat)
+		throw msgerror("not your turn", error_illegal_action);
+	applyAction(seat, action, amount);
+}
+
+void Table::watch(ConnectionPtr connection)
+{
+	if (_moving)
+		throw msgerror("table is moving", error_illegal_action);
+	for (auto& spectator : _spectators)
+	{
+		if (spectator.connection.lock() == connection)
+		{
+			spectator.acked = _state.version;
+			return;
+		}
+	}
+	_spectators.push_back(Spectator{ connection, _state.version });
+}
+
+void Table::unwatch(const ConnectionPtr& connection)
+{
+	_spectators.erase(std::remove_if(_spectators.begin(), _spectators.end(), [&connection](const Spectator& spectator)
+	{
+		return spectator.connection.lock() == connection;
+	}), _spectators.end());
+}
+
+void Table::ack(const ConnectionPtr& connection, uint64_t version)
+{
+	if (version > _state.version)
+		throw msgerror("version from the future", error_invalid_argument);
+
+	int seat = seatOf(connection);
+	if (seat >= 0)
+	{
+		_acked[seat] = std::max(_acked[seat], version);
+		return;
+	}
+	for (auto& spectator : _spectators)
+	{
+		if (spectator.connection.lock() == connection)
+		{
+			spectator.acked = std::max(spectator.acked, version);
+			return;
+		}
+	}
+	throw msgerror("not at this table", error_illegal_action);
+}
+
+void Table::setBlinds(int64_t smallBlind, int64_t bigBlind)
+{
+	_config.smallBlind = smallBlind;
+	_config.bigBlind = bigBlind;
+	_state.smallBlind = smallBlind;
+	_state.bigBlind = bigBlind;
+	updateLobby();
+	broadcast();
+}
+
+void Table::setNextDeck(const Deck& deck)
+{
+	_deck = deck;
+	_presetDeck = true;
+}
+
+void Table::setPaused(bool paused)
+{
+	_paused = paused;
+	if (!paused && _state.street == street_waiting)
+		startHand();
+}
+
+void Table::setHandEndHandler(std::function<void(Table&)> handler)
+{
+	_onHandEnd = handler;
+}
+
+bool Table::isBetweenHands() const
+{
+	return _state.street == street_waiting || _state.street == street_showdown;
+}
+
+void Table::whenIdle(std::function<void(Table&)> fn)
+{
+	if (isBetweenHands() && isSettled())
+		fn(*this);
+	else
+		_onIdle = fn;
+}
+
+void Table::setMoving(bool moving)
+{
+	_moving = moving;
+}
+
+std::vector<std::pair<int, Table::ConnectionPtr>> Table::followers() const
+{
+	std::vector<std::pair<int, ConnectionPtr>> result;
+	for (size_t seat = 0; seat < _connections.size(); ++seat)
+	{
+		auto connection = _connections[seat].lock();
+		if (connection && !_leaving[seat])
+			result.emplace_back(static_cast<int>(seat), connection);
+	}
+	for (auto& spectator : _spectators)
+	{
+		if (auto connection = spectator.connection.lock())
+			result.emplace_back(-1, connection);
+	}
+	return result;
+}
+
+void Table::retire()
+{
+	_paused = true;
+	_moving = true;
+	++_timerSeq;		// a wait already armed finds itself stale
+	for (size_t seat = 0; seat < _state.seats.size(); ++seat)
+	{
+		if (_bindings && !_tokens[seat].empty())
+			_bindings->unbind(_tokens[seat], _state.tableId);
+		_tokens[seat].clear();
+		_connections[seat].reset();
+	}
+	_spectators.clear();
+	if (_lobby)
+		_lobby->remove(_state.tableId);
+}
+
+SeatSnapshot Table::unseat(int seat, ConnectionPtr& connection)
+{
+	SeatSnapshot player;
+	if (!isBetweenHands() || seat < 0 || seat >= static_cast<int>(_state.seats.size())
+		|| _state.seats[seat].player.empty() || _settling[seat] != settled)
+		throw msgerror("no player to unseat", error_illegal_action);
+
+	player.seat = seat;
+	player.player = _state.seats[seat].player;
+	player.stack = _state.seats[seat].stack;
+	player.token = _tokens[seat];
+	connection = _connections[seat].lock();
+	freeSeat(seat, false);
+	broadcast();
+	return player;
+}
+
+int Table::seatMoved(const SeatSnapshot& player, ConnectionPtr connection)
+{
+	for (size_t seat = 0; seat < _state.seats.size(); ++seat)
+	{
+		if (!_state.seats[seat].player.empty())
+			continue;
+		SeatState& state = _state.seats[seat];
+		state = SeatState();
+		state.player = player.player;
+		state.stack = player.stack;
+		_connections[seat] = connection;
+		_acked[seat] = 0;
+		_leaving[seat] = false;
+		_tokens[seat] = player.token;
+		if (_bindings)
+			_bindings->bind(_tokens[seat], SeatBinding{ _state.tableId, static_cast<int>(seat), player.player });
+		updateLobby();
+
+		if (_state.street == street_waiting)
+			startHand();
+		else
+			broadcast();
+		return static_cast<int>(seat);
+	}
+	return -1;
+}
+
+void Table::sendToAll(std::shared_ptr<msgpack::sbuffer> msg)
+{
+	for (auto& weak : _connections)
+	{
+		if (auto connection = weak.lock())
+			connection->postWrite(msg, WriteHandler(), priority_high);
+	}
+	for (auto& spectator : _spectators)
+	{
+		if (auto connection = spectator.connection.lock())
+			connection->postWrite(msg, WriteHandler(), priority_high);
+	}
+}
+
+bool Table::resume(int seat, const std::string& player, ConnectionPtr connection)
+{
+	if (seat < 0 || seat >= static_cast<int>(_state.seats.size()) || _state.seats[seat].player != player)
+		return false;
+
+	_connections[seat] = connection;
+	_acked[seat] = 0;
+	_tokens[seat] = connection->getResumeToken();
+	if (_bindings)
+		_bindings->bind(_tokens[seat], SeatBinding{ _state.tableId, seat, player });
+
+	if (_state.street == street_waiting)
+	{
+		startHand();
+		return true;
+	}
+	// acked 0 gets the full state
+	broadcast();
+	if (_state.seats[seat].inHand && !_state.seats[seat].folded)
+		sendHoleCards(seat);
+	return true;
+}
+
+TableSnapshot Table::capture() const
+{
+	TableSnapshot snapshot;
+	snapshot.tableId = _state.tableId;
+	snapshot.game = _config.game;
+	snapshot.seats = _config.seats;
+	snapshot.smallBlind = _config.smallBlind;
+	snapshot.bigBlind = _config.bigBlind;
+	snapshot.actionTimeoutMs = _config.actionTimeoutMs;
+	snapshot.nextHandDelayMs = _config.nextHandDelayMs;
+	snapshot.button = _state.button;
+	snapshot.version = _state.version;
+
+	bool running = _state.street >= street_preflop && _state.street <= street_river;
+	for (size_t seat = 0; seat < _state.seats.size(); ++seat)
+	{
+		const SeatState& state = _state.seats[seat];
+		if (state.player.empty() || _settling[seat] != settled)
+			continue;
+		SeatSnapshot player;
+		player.seat = static_cast<int>(seat);
+		player.player = state.player;
+		player.stack = state.stack + (running ? _committed[seat] : 0);
+		player.token = _tokens[seat];
+		snapshot.players.push_back(player);
+	}
+	return snapshot;
+}
+
+void Table::restore(const TableSnapshot& snapshot)
+{
+	_state.button = snapshot.button;
+	_state.version = snapshot.version;
+	for (auto& player : snapshot.players)
+	{
+		if (player.seat < 0 || player.seat >= static_cast<int>(_state.seats.size()) || player.stack <= 0)
+			continue;
+		SeatState& state = _state.seats[player.seat];
+		state = SeatState();
+		state.player = player.player;
+		state.stack = player.stack;
+		_tokens[player.seat] = player.token;
+		if (_bindings)
+			_bindings->bind(player.token, SeatBinding{ _state.tableId, player.seat, player.player });
+	}
+	updateLobby();
+}
+
+int Table::seatOf(const ConnectionPtr& connection) const
+{
+	for (size_t seat = 0; seat < _connections.size(); ++seat)
+	{
+		if (!_state.seats[seat].player.empty() && _connections[seat].lock() == connection)
+			return static_cast<int>(seat);
+	}
+	return -1;
+}
+
+int Table::nextSeat(int from, bool (Table::*pred)(int) const) const
+{
+	int seats = static_cast<int>(_state.seats.size());
+	for (int i = 1; i <= seats; ++i)
+	{
+		int seat = (from + i + seats) % seats;
+		if ((this->*pred)(seat))
+			return seat;
+	}
+	return -1;
+}
+
+bool Table::isEligible(int seat) const
+{
+	const SeatState& state = _state.seats[seat];
+	return !state.player.empty() && state.stack > 0 && !_leaving[seat] && _settling[seat] == settled;
+}
+
+bool Table::isLive(int seat) const
+{
+	return _state.seats[seat].inHand && !_state.seats[seat].folded;
+}
+
+bool Table::needsToAct(int seat) const
+{
+	const SeatState& state = _state.seats[seat];
+	return isLive(seat) && !state.allIn && (!_acted[seat] || state.bet < _state.currentBet);
+}
+
+bool Table::isSettled() const
+{
+	return std::all_of(_settling.begin(), _settling.end(), [](Settling settling) { return settling == settled; });
+}
+
+void Table::startHand()
+{
+	int players = 0;
+	for (int s = 0; s < static_cast<int>(_state.seats.size()); ++s)
+		players += isEligible(s) ? 1 : 0;
+	if (players < 2 || _paused)
+	{
+		_state.street = street_waiting;
+		_state.toAct = -1;
+		broadcast();
+		return;
+	}
+
+	_state.handId = _history ? _history->nextHandId() : _state.handId + 1;
+	_state.board.clear();
+	_state.pot = 0;
+	_state.currentBet = 0;
+	_state.minRaise = _config.bigBlind;
+	for (int s = 0; s < static_cast<int>(_state.seats.size()); ++s)
+	{
+		SeatState& state = _state.seats[s];
+		state.inHand = isEligible(s);
+		state.folded = false;
+		state.allIn = false;
+		state.bet = 0;
+		state.shown.clear();
+		_acted[s] = false;
+		_committed[s] = 0;
+		_holes[s] = 0;
+	}
+
+	// heads up the button posts the small blind
+	_state.button = nextSeat(_state.button, &Table::isEligible);
+	int smallBlind = players == 2 ? _state.button : nextSeat(_state.button, &Table::isEligible);
+	int bigBlind = nextSeat(smallBlind, &Table::isEligible);
+
+	if (_presetDeck)
+		_presetDeck = false;
+	else if (_decks && _decks->take(_deck))
+		_deckService->wake();
+	else
+		_deck = makeDeck(randomSeed());	// the service fell behind
+	_deckPos = 0;
+	size_t seats = _state.seats.size();
+	_record = HandRecord();
+	_record.holes.resize(seats);
+	for (int s = 0; s < static_cast<int>(seats); ++s)
+	{
+		if (!_state.seats[s].inHand)
+			continue;
+		// the record keeps them in deal order, the audit deals them again that way
+		_record.holes[s] = { _deck.cards[_deckPos], _deck.cards[_deckPos + 1] };
+		_holes[s] = cardMask(_deck.cards[_deckPos++]);
+		_holes[s] |= cardMask(_deck.cards[_deckPos++]);
+		sendHoleCards(s);
+	}
+
+	_record.handId = _state.handId;
+	_record.tableId = _state.tableId;
+	_record.startedMs = std::chrono::duration_cast<std::chrono::milliseconds>(
+		std::chrono::system_clock::now().time_since_epoch()).count();
+	_record.button = _state.button;
+	_record.smallBlind = _config.smallBlind;
+	_record.bigBlind = _config.bigBlind;
+	_record.deckSeed = seedToHex(_deck.seed);
+	_record.players.resize(seats);
+	_record.stacks.resize(seats);
+	_record.results.resize(seats);
+	for (size_t s = 0; s < seats; ++s)
+	{
+		if (!_state.seats[s].inHand)
+			continue;
+		_record.players[s] = _state.seats[s].player;
+		_record.stacks[s] = _state.seats[s].stack;
+	}
+
+	_state.street = street_preflop;
+	record(smallBlind, action_post, postChips(smallBlind, _config.smallBlind));
+	record(bigBlind, action_post, postChips(bigBlind, _config.bigBlind));
+	_state.currentBet = _config.bigBlind;
+
+	// first to act is the one after the big blind
+	_state.toAct = bigBlind;
+	advance();
+}
+
+int64_t Table::postChips(int seat, int64_t amount)
+{
+	SeatState& state = _state.seats[seat];
+	amount = std::min(amount, state.stack);
+	state.stack -= amount;
+	state.bet += amount;
+	_committed[seat] += amount;
+	if (!state.stack)
+		state.allIn = true;
+	return amount;
+}
+
+void Table::record(int seat, TableAction action, int64_t amount)
+{
+	HandAction entry;
+	entry.seat = seat;
+	entry.street = _state.street;
+	entry.action = action;
+	entry.amount = amount;
+	_record.actions.push_back(entry);
+}
+
+void Table::applyAction(int seat, TableAction action, int64_t amount)
+{
+	SeatState& state = _state.seats[seat];
+	int64_t toCall = _state.currentBet - state.bet;
+	int64_t committed = _committed[seat];
+	switch (action)
+	{
+	case action_fold:
+		state.folded = true;
+		break;
+	case action_check:
+		if (toCall > 0)
+			throw msgerror("can not check facing a bet", error_illegal_action);
+		break;
+	case action_call:
+		postChips(seat, toCall);
+		break;
+	case action_bet:
+	{
+		int64_t most = state.bet + state.stack;
+		if (amount <= _state.currentBet || amount > most)
+			throw msgerror("bet out of range", error_illegal_action);
+		int64_t raise = amount - _state.currentBet;
+		// all in for less is allowed but does not reopen the betting
+		if (raise < _state.minRaise && amount < most)
+			throw msgerror("raise below the minimum", error_illegal_action);
+		postChips(seat, amount - state.bet);
+		if (raise >= _state.minRaise)
+		{
+			_state.minRaise = raise;
+			std::fill(_acted.begin(), _acted.end(), false);
+		}
+		_state.currentBet = amount;
+		break;
+	}
+	default:
+		throw msgerror("unknown action", error_invalid_argument);
+	}
+
+	record(seat, action, _committed[seat] - committed);
+	_acted[seat] = true;
+	_state.toAct = seat;
+	advance();
+}
+
+void Table::nextStreet()
+{
+	_state.street = _state.street + 1;
+	int count = _state.street == street_flop ? 3 : 1;
+	for (int i = 0; i < count; ++i)
+		_state.board.push_back(_deck.cards[_deckPos++]);
+}
+
+void Table::advance()
+{
+	int live = 0;
+	int able = 0;
+	int last = -1;
+	for (int s = 0; s < static_cast<int>(_state.seats.size()); ++s)
+	{
+		if (!isLive(s))
+			continue;
+		++live;
+		last = s;
+		if (!_state.seats[s].allIn)
+			++able;
+	}
+	if (live == 1)
+	{
+		awardAll(last);
+		return;
+	}
+
+	int next = nextSeat(_state.toAct, &Table::needsToAct);
+	if (next >= 0)
+	{
+		_state.toAct = next;
+		armTimer(_config.actionTimeoutMs, &Table::onActionTimeout);
+		broadcast();
+		return;
+	}
+
+	// betting round closed
+	collectBets();
+	if (_state.street == street_river || able < 2)
+	{
+		// nobody left to bet against, run the board out
+		while (_state.street < street_river)
+			nextStreet();
+		showdown();
+		return;
+	}
+
+	nextStreet();
+	_state.toAct = nextSeat(_state.button, &Table::needsToAct);
+	armTimer(_config.actionTimeoutMs, &Table::onActionTimeout);
+	broadcast();
+}
+
+void Table::collectBets()
+{
+	for (size_t s = 0; s < _state.seats.size(); ++s)
+	{
+		_state.pot += _state.seats[s].bet;
+		_state.seats[s].bet = 0;
+		_acted[s] = false;
+	}
+	_state.currentBet = 0;
+	_state.minRaise = _config.bigBlind;
+}
+
+void Table::showdown()
+{
+	int seats = static_cast<int>(_state.seats.size());
+	HandMask board = 0;
+	for (int card : _state.board)
+		board |= cardMask(static_cast<Card>(card));
+
+	std::vector<HandRank> ranks(seats, 0);
+	std::vector<int64_t> levels;
+	for (int s = 0; s < seats; ++s)
+	{
+		if (!isLive(s))
+			continue;
+		ranks[s] = HandEvaluator::evaluate(_holes[s] | board);
+		_state.seats[s].shown = maskCards(_holes[s]);
+		levels.push_back(_committed[s]);
+	}
+	std::sort(levels.begin(), levels.end());
+	levels.erase(std::unique(levels.begin(), levels.end()), levels.end());
+
+	// one pot per all in level, each to the best live hand that paid into it.
+	// odd chips go to the winners first after the button.
+	int64_t paid = 0;
+	int64_t previous = 0;
+	std::vector<int> winners;
+	for (int64_t level : levels)
+	{
+		int64_t slice = 0;
+		for (int s = 0; s < seats; ++s)
+			slice += std::min(_committed[s], level) - std::min(_committed[s], previous);
+		previous = level;
+
+		HandRank best = 0;
+		winners.clear();
+		for (int i = 1; i <= seats; ++i)
+		{
+			int s = (_state.button + i) % seats;
+			if (!isLive(s) || _committed[s] < level)
+				continue;
+			if (ranks[s] > best)
+			{
+				best = ranks[s];
+				winners.clear();
+			}
+			if (ranks[s] == best)
+				winners.push_back(s);
+		}
+
+		int64_t share = slice / static_cast<int64_t>(winners.size());
+		int64_t odd = slice % static_cast<int64_t>(winners.size());
+		for (size_t i = 0; i < winners.size(); ++i)
+		{
+			int64_t won = share + (static_cast<int64_t>(i) < odd ? 1 : 0);
+			_state.seats[winners[i]].stack += won;
+			_record.results[winners[i]] += won;
+		}
+		paid += slice;
+	}
+
+	// chips of folded players above every live level
+	if (paid < _state.pot && !winners.empty())
+	{
+		_state.seats[winners.front()].stack += _state.pot - paid;
+		_record.results[winners.front()] += _state.pot - paid;
+	}
+	_state.pot = 0;
+	endHand();
+}
+
+void Table::awardAll(int seat)
+{
+	collectBets();
+	_state.seats[seat].stack += _state.pot;
+	_record.results[seat] += _state.pot;
+	_state.pot = 0;
+	endHand();
+}
+
+void Table::endHand()
+{
+	_state.street = street_showdown;
+	_state.toAct = -1;
+	for (int s = 0; s < static_cast<int>(_state.seats.size()); ++s)
+	{
+		_record.results[s] -= _committed[s];
+		if (_record.results[s])
+			recordResult(s);
+		if (!_leaving[s])
+			continue;
+		try
+		{
+			freeSeat(s);
+		}
+		catch (msgerror&)
+		{
+			// the wallet takes no chips now, the player sits out until a later leave gets them there
+		}
+	}
+	if (_history)
+	{
+		_record.board = _state.board;
+		_history->append(std::move(_record));
+	}
+	if (_onHandEnd)
+		_onHandEnd(*this);
+	broadcast();
+	armTimer(_config.nextHandDelayMs, &Table::startHand);
+	runIdle();
+}
+
+void Table::freeSeat(int seat, bool cashOut)
+{
+	// with wallets the seat empties once the chips are back in the wallet
+	if (cashOut && _wallets && _state.seats[seat].stack > 0)
+		moveWallet(seat, ledger_cash_out, _state.seats[seat].player, _state.seats[seat].stack);
+	else
+		clearSeat(seat);
+}
+
+void Table::clearSeat(int seat)
+{
+	_state.seats[seat] = SeatState();
+	_connections[seat].reset();
+	_acked[seat] = 0;
+	_leaving[seat] = false;
+	if (_bindings)
+		_bindings->unbind(_tokens[seat], _state.tableId);
+	_tokens[seat].clear();
+	updateLobby();
+}
+
+void Table::moveWallet(int seat, LedgerKind kind, const std::string& player, int64_t amount)
+{
+	auto self = shared_from_this();
+	_wallets->move(ledgerEntry(kind, player, amount), [self, seat](msgpack::rpc::ServerSideError error)
+	{
+		self->_strand.post([self, seat, error]() { self->onSettled(seat, error); });
+	});
+	_settling[seat] = kind == ledger_buy_in ? buying_in : cashing_out;
+}
+
+void Table::onSettled(int seat, msgpack::rpc::ServerSideError error)
+{
+	Settling settling = _settling[seat];
+	bool durable = error == msgpack::rpc::success;
+	_settling[seat] = settled;
+	if (settling == buying_in && durable)
+	{
+		if (_state.street == street_waiting)
+			startHand();
+	}
+	else if (settling == buying_in || durable)
+	{
+		// a buy in that failed never took the chips, a cash out that made it did
+		clearSeat(seat);
+		broadcast();
+	}
+	else
+	{
+		// the chips stay on the table, the player sits out until a later leave gets them home
+		_leaving[seat] = true;
+		broadcast();
+	}
+	auto handlers = std::move(_settledHandlers[seat]);
+	_settledHandlers[seat].clear();
+	for (auto& handler : handlers)
+		handler(*this, error);
+	runIdle();
+}
+
+void Table::runIdle()
+{
+	if (!_onIdle || !isBetweenHands() || !isSettled())
+		return;
+	auto onIdle = std::move(_onIdle);
+	_onIdle = nullptr;
+	onIdle(*this);
+}
+
+LedgerEntry Table::ledgerEntry(LedgerKind kind, const std::string& account, int64_t amount) const
+{
+	LedgerEntry entry;
+	entry.kind = kind;
+	entry.account = account;
+	entry.amount = amount;
+	entry.tableId = _state.tableId;
+	entry.handId = _state.handId;
+	return entry;
+}
+
+void Table::recordResult(int seat)
+{
+	if (_wallets)
+		_wallets->record(ledgerEntry(ledger_pot_award, _state.seats[seat].player, _record.results[seat]));
+}
+
+void Table::armTimer(uint32_t delayMs, void (Table::*onExpired)())
+{
+	uint64_t seq = ++_timerSeq;
+	_timer.expires_from_now(std::chrono::milliseconds(delayMs));
+	auto self = shared_from_this();
+	_timer.async_wait(_strand.wrap([self, seq, onExpired](const boost::system::error_code& error)
+	{
+		// a wait already queued when the timer was re-armed is stale
+		if (error || seq != self->_timerSeq)
+			return;
+		((*self).*onExpired)();
+	}));
+}
+
+void Table::onActionTimeout()
+{
+	int seat = _state.toAct;
+	if (seat < 0)
+		return;
+	bool facingBet = _state.seats[seat].bet < _state.currentBet;
+	applyAction(seat, facingBet ? action_fold : action_check, 0);
+}
+
+void Table::broadcast()
+{
+	// clients hold the captured version, the node the table moves to carries on from there
+	if (_moving)
+		return;
+	++_state.version;
+	_sync.publish(_state);
+
+	// clients on the same version share one packed message
+	for (size_t seat = 0; seat < _connections.size(); ++seat)
+	{
+		auto connection = _connections[seat].lock();
+		auto update = connection ? _sync.update(_acked[seat]) : nullptr;
+		if (update)
+			connection->postWrite(update, WriteHandler(), priority_high);
+	}
+
+	auto it = _spectators.begin();
+	while (it != _spectators.end())
+	{
+		auto connection = it->connection.lock();
+		if (!connection)
+		{
+			it = _spectators.erase(it);
+			continue;
+		}
+		auto update = _sync.update(it->acked);
+		if (update)
+			connection->postWrite(update, WriteHandler(), priority_high);
+		++it;
+	}
+}
+
+void Table::updateLobby()
+{
+	if (!_lobby || _config.assignedSeats)
+		return;
+
+	LobbyEntry entry;
+	entry.tableId = _state.tableId;
+	entry.game = _config.game;
+	entry.smallBlind = _config.smallBlind;
+	entry.bigBlind = _config.bigBlind;
+	entry.seats = static_cast<uint32_t>(_state.seats.size());
+	for (auto& seat : _state.seats)
+		entry.players += seat.player.empty() ? 0 : 1;
+	_lobby->update(entry);
+}
+
+void Table::sendHoleCards(int seat)
+{
+	auto connection = _connections[seat].lock();
+	if (!connection)
+		return;
+
+	msgpack::rpc::MsgNotify<std::string, std::tuple<uint32_t, uint64_t, std::vector<int>>> notify(
+		"hole_cards", std::make_tuple(_state.tableId, _state.handId, maskCards(_holes[seat])));
+	auto sbuf = msgpack::rpc::packExact(notify);
+	connection->postWrite(sbuf, WriteHandler(), priority_high);
+}
+
+}
@@ -0,0 +1,254 @@
+#pragma once
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+#include <boost/asio/io_service.hpp>
+#include <boost/asio/strand.hpp>
+#include <boost/asio/steady_timer.hpp>
+#include "TcpConnection.h"
+#include "HandEvaluator.h"
+#include "TableState.h"
+#include "TableSync.h"
+#include "HandHistory.h"
+#include "Lobby.h"
+#include "Deck.h"
+#include "SessionResume.h"
+#include "Wallets.h"
+
+namespace poker {
+
+struct TableConfig
+{
+	std::string game = "holdem";	// lobby grouping, the rules are hold'em for now
+	uint32_t seats = 9;
+	int64_t smallBlind = 1;
+	int64_t bigBlind = 2;
+	uint32_t actionTimeoutMs = 30 * 1000;	// then check or fold for the player
+	uint32_t nextHandDelayMs = 3 * 1000;
+	bool assignedSeats = false;		// seated by the owner through seatMoved only, not listed in the lobby
+};
+
+/// Shared by the tables of one manager, each may be left out.
+struct TableServices
+{
+	std::shared_ptr<HandHistory> history;
+	std::shared_ptr<Lobby> lobby;
+	std::shared_ptr<DeckService> decks;
+	std::shared_ptr<SeatBindings> bindings;
+	std::shared_ptr<Wallets> wallets;
+};
+
+/// One hold'em table, cash or tournament. All state lives on the table's strand, so the
+/// game logic takes no locks; post() is the only way in from outside.
+/// Players are known by the connection they joined from. Players and
+/// spectators are kept in sync through TableSync, finished hands go to
+/// the HandHistory and seat changes to the Lobby, if there are ones.
+/// Decks come ready shuffled from the DeckService, each hand logs the
+/// seed of its deck so it can be dealt again for audit. Seats are bound to
+/// the resume token of the joining session, so a client that reconnects,
+/// even to a restarted server, gets its seat back. At cash tables buy ins and
+/// cash outs go to the player's wallet, wherever in the cluster it is, and hand
+/// results to the Ledger. A seat that buys in or cashes out is held until that
+/// is durable: a player is dealt in, and a seat freed, only then. Who can not
+/// cash out sits out with the chips, which stay in the snapshot, until a later
+/// leave gets them to the wallet.
+class Table : public std::enable_shared_from_this<Table>
+{
+public:
+	typedef std::shared_ptr<msgpack::rpc::TcpConnection> ConnectionPtr;
+	typedef std::function<void(Table&, msgpack::rpc::ServerSideError error)> SettledHandler;
+
+	Table(boost::asio::io_service& ios, uint32_t id, const TableConfig& config,
+		const TableServices& services = TableServices());
+
+	uint32_t getId() const;
+
+	/// run fn(table) on the strand
+	template<typename F>
+	void post(F fn);
+
+	// strand only, the calls below throw msgerror on bad input
+
+	/// take seat with buyIn chips from the player's wallet, returns the seat.
+	/// with wallets the player plays once the buy in is durable, a failed one frees the seat.
+	int join(ConnectionPtr connection, int seat, const std::string& player, int64_t buyIn);
+
+	/// join at the first free seat, -1 if the table is full
+	int joinAny(ConnectionPtr connection, const std::string& player, int64_t buyIn);
+
+	/// fold if in a hand, the seat is freed when the hand ends. returns the seat.
+	int leave(const ConnectionPtr& connection);
+
+	/// run fn once the buy in or cash out of seat is durable or failed, now if none is pending
+	void whenSettled(int seat, SettledHandler fn);
+
+	void act(const ConnectionPtr& connection, TableAction action, int64_t amount);
+
+	/// follow the table without a seat, the caller is given the current state
+	void watch(ConnectionPtr connection);
+	void unwatch(const ConnectionPtr& connection);
+
+	/// the client holds version, later updates are deltas against it
+	void ack(const ConnectionPtr& connection, uint64_t version);
+
+	/// from the next hand on
+	void setBlinds(int64_t smallBlind, int64_t bigBlind);
+
+	/// deal the next hand from deck instead of a fresh one, to replay a logged hand
+	void setNextDeck(const Deck& deck);
+
+	/// a paused table finishes the running hand and starts no new one
+	void setPaused(bool paused);
+
+	/// called on the strand when a hand is over, before the next is scheduled
+	void setHandEndHandler(std::function<void(Table&)> handler);
+
+	/// no hand running, seats may change hands
+	bool isBetweenHands() const;
+
+	/// run fn on the strand once no hand runs and no buy in or cash out is pending,
+	/// now if none does. one at a time.
+	void whenIdle(std::function<void(Table&)> fn);
+
+	/// while the table moves to another node seats do not change, joins,
+	/// leaves and watches are refused
+	void setMoving(bool moving);
+
+	/// the connections that follow the table, seated ones by seat and spectators as seat -1
+	std::vector<std::pair<int, ConnectionPtr>> followers() const;
+
+	/// the table runs elsewhere now, drop its seat bindings, lobby entry and
+	/// connections without moving any chips
+	void retire();
+
+	/// take the player off the table between hands, connection may come back empty
+	SeatSnapshot unseat(int seat, ConnectionPtr& connection);
+
+	/// seat a player moved from another table at the first free seat, -1 if full.
+	/// connection may be empty for a player who is away.
+	int seatMoved(const SeatSnapshot& player, ConnectionPtr connection);
+
+	/// queue one packed message to every player and spectator
+	void sendToAll(std::shared_ptr<msgpack::sbuffer> msg);
+
+	/// seat the session of connection in place of the one that held seat,
+	/// false if player no longer sits there
+	bool resume(int seat, const std::string& player, ConnectionPtr connection);
+
+	/// the seats and stacks, chips in a running hand go back to their owners.
+	/// seats whose buy in or cash out is not durable yet are left out.
+	TableSnapshot capture() const;
+
+	/// seat the players of a snapshot before the table runs, they play once resumed
+	void restore(const TableSnapshot& snapshot);
+
+	const TableState& getState() const;
+	const TableConfig& getConfig() const;
+
+private:
+	int seatOf(const ConnectionPtr& connection) const;
+	int nextSeat(int from, bool (Table::*pred)(int) const) const;
+	bool isEligible(int seat) const;
+	bool isLive(int seat) const;
+	bool needsToAct(int seat) const;
+	bool isSettled() const;
+
+	void startHand();
+	int64_t postChips(int seat, int64_t amount);
+	void record(int seat, TableAction action, int64_t amount);
+	void applyAction(int seat, TableAction action, int64_t amount);
+	void nextStreet();
+	void advance();
+	void collectBets();
+	void showdown();
+	void awardAll(int seat);
+	void endHand();
+	/// throws msgerror if the wallet refuses the cash out, the seat is left as it was
+	void freeSeat(int seat, bool cashOut = true);
+	void clearSeat(int seat);
+	/// queue a wallet move for the player at seat, throws msgerror if refused.
+	/// the seat settles on the strand once the move is durable.
+	void moveWallet(int seat, LedgerKind kind, const std::string& player, int64_t amount);
+	void onSettled(int seat, msgpack::rpc::ServerSideError error);
+	void runIdle();
+	LedgerEntry ledgerEntry(LedgerKind kind, const std::string& account, int64_t amount) const;
+	/// the net result of the hand at seat, never throws
+	void recordResult(int seat);
+
+	void armTimer(uint32_t delayMs, void (Table::*onExpired)());
+	void onActionTimeout();
+
+	void broadcast();
+	void sendHoleCards(int seat);
+	void updateLobby();
+
+	boost::asio::io_service::strand _strand;
+	boost::asio::steady_timer _timer;
+	uint64_t _timerSeq;			// a newer arm makes older expiries stale
+
+	TableConfig _config;
+	TableState _state;
+
+	struct Spectator
+	{
+		std::weak_ptr<msgpack::rpc::TcpConnection> connection;
+		uint64_t acked;
+	};
+
+	TableSync _sync;
+	std::vector<std::weak_ptr<msgpack::rpc::TcpConnection>> _connections;	// by seat
+	std::vector<uint64_t> _acked;		// by seat, version the client holds
+	std::vector<Spectator> _spectators;
+	std::vector<bool> _leaving;
+	enum Settling { settled, buying_in, cashing_out };
+	std::vector<Settling> _settling;	// by seat, a wallet move not durable yet
+	std::vector<std::vector<SettledHandler>> _settledHandlers;	// by seat
+	std::vector<bool> _acted;			// acted since the last full raise
+	std::vector<int64_t> _committed;	// chips put in this hand, for side pots
+	std::vector<HandMask> _holes;
+
+	std::shared_ptr<HandHistory> _history;
+	std::shared_ptr<Lobby> _lobby;
+	std::shared_ptr<SeatBindings> _bindings;
+	std::shared_ptr<Wallets> _wallets;		// null at tournament tables, their chips are not money
+	std::vector<std::string> _tokens;	// by seat, resume token of the seated session
+	HandRecord _record;					// the hand in progress
+	bool _paused;
+	bool _moving;
+	std::function<void(Table&)> _onHandEnd;
+	std::function<void(Table&)> _onIdle;
+
+	std::shared_ptr<DeckService> _deckService;
+	std::shared_ptr<DeckStream> _decks;
+	Deck _deck;
+	size_t _deckPos;
+	bool _presetDeck;			// _deck was set by setNextDeck
+};
+
+inline uint32_t Table::getId() const
+{
+	return _state.tableId;
+}
+
+inline const TableState& Table::getState() const
+{
+	return _state;
+}
+
+inline const TableConfig& Table::getConfig() const
+{
+	return _config;
+}
+
+template<typename F>
+inline void Table::post(F fn)
+{
+	auto self = shared_from_this();
+	_strand.post([self, fn]() mutable
+	{
+		fn(*self);
+	});
+}
+
+}
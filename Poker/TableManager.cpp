@@ -0,0 +1,356 @@
+#include "TableManager.h"
+#include "Cluster.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <future>
+#include <boost/asio/steady_timer.hpp>
+
+namespace poker {
+
+using msgpack::rpc::msgerror;
+using msgpack::rpc::error_invalid_argument;
+using msgpack::rpc::error_node_unavailable;
+using msgpack::rpc::AsyncCallCtx;
+
+TableManager::TableManager(size_t threads, std::shared_ptr<HandHistory> history, std::shared_ptr<Ledger> ledger):
+	_work(new boost::asio::io_service::work(_ioService)),
+	_nextId(1)
+{
+	_services.history = history;
+	_services.lobby = std::make_shared<Lobby>();
+	_services.decks = std::make_shared<DeckService>();
+	_services.bindings = std::make_shared<SeatBindings>();
+	_services.wallets = ledger ? std::make_shared<Wallets>(ledger) : nullptr;
+
+	if (!threads)
+		threads = 1;
+	for (size_t i = 0; i < threads; ++i)
+		_threads.emplace_back([this]() { _ioService.run(); });
+}
+
+TableManager::~TableManager()
+{
+	_work.reset();
+	_ioService.stop();
+	for (auto& thread : _threads)
+		thread.join();
+
+	std::lock_guard<std::mutex> lock(_mtx);
+	_tables.clear();
+}
+
+std::shared_ptr<Table> TableManager::create(const TableConfig& config, uint32_t tableId)
+{
+	if (config.seats < 2 || config.seats > 10)
+		throw msgerror("2 to 10 seats expected", error_invalid_argument);
+	if (config.smallBlind <= 0 || config.bigBlind < config.smallBlind)
+		throw msgerror("invalid blinds", error_invalid_argument);
+	if (config.game.empty())
+		throw msgerror("game required", error_invalid_argument);
+
+	std::shared_ptr<Table> table;
+	{
+		std::lock_guard<std::mutex> lock(_mtx);
+		uint32_t id = tableId ? tableId : _nextId++;
+		if (_tables.count(id))
+			throw msgerror("table id taken", error_invalid_argument);
+		table = std::make_shared<Table>(_ioService, id, config, _services);
+		_tables.insert(std::make_pair(id, table));
+	}
+	if (_cluster)
+		_cluster->claim(clusterKey(table->getId()));
+	return table;
+}
+
+std::shared_ptr<Table> TableManager::find(uint32_t tableId)
+{
+	std::lock_guard<std::mutex> lock(_mtx);
+	auto found = _tables.find(tableId);
+	return found == _tables.end() ? nullptr : found->second;
+}
+
+uint32_t TableManager::reserveId()
+{
+	std::lock_guard<std::mutex> lock(_mtx);
+	return _nextId++;
+}
+
+void TableManager::remove(uint32_t tableId)
+{
+	{
+		std::lock_guard<std::mutex> lock(_mtx);
+		if (!_tables.erase(tableId))
+			return;
+	}
+	if (_cluster)
+		_cluster->release(clusterKey(tableId));
+}
+
+std::shared_ptr<Table> TableManager::forget(uint32_t tableId)
+{
+	std::lock_guard<std::mutex> lock(_mtx);
+	auto found = _tables.find(tableId);
+	if (found == _tables.end())
+		return nullptr;
+	auto table = found->second;
+	_tables.erase(found);
+	return table;
+}
+
+size_t TableManager::size()
+{
+	std::lock_guard<std::mutex> lock(_mtx);
+	return _tables.size();
+}
+
+ServerSnapshot TableManager::snapshot()
+{
+	std::vector<std::shared_ptr<Table>> tables;
+	{
+		std::lock_guard<std::mutex> lock(_mtx);
+		for (auto& entry : _tables)
+			tables.push_back(entry.second);
+	}
+
+	// all tables capture at once, each on its own strand
+	std::vector<std::future<TableSnapshot>> captures;
+	for (auto& table : tables)
+	{
+		auto capture = std::make_shared<std::promise<TableSnapshot>>();
+		captures.push_back(capture->get_future());
+		table->post([capture](Table& table) { capture->set_value(table.capture()); });
+	}
+
+	ServerSnapshot snapshot;
+	snapshot.savedMs = std::chrono::duration_cast<std::chrono::milliseconds>(
+		std::chrono::system_clock::now().time_since_epoch()).count();
+	for (auto& capture : captures)
+		snapshot.tables.push_back(capture.get());
+	return snapshot;
+}
+
+bool TableManager::saveSnapshot(const std::string& path)
+{
+	return snapshot::save(path, snapshot());
+}
+
+size_t TableManager::restore(const std::string& path)
+{
+	ServerSnapshot snapshot;
+	if (!snapshot::load(path, snapshot))
+		return 0;
+
+	std::unique_lock<std::mutex> lock(_mtx);
+	std::vector<uint32_t> restored;
+	for (auto& saved : snapshot.tables)
+	{
+		if (!saved.tableId || _tables.count(saved.tableId) || saved.seats < 2 || saved.seats > 10)
+			continue;
+
+		TableConfig config;
+		config.game = saved.game;
+		config.seats = saved.seats;
+		config.smallBlind = saved.smallBlind;
+		config.bigBlind = saved.bigBlind;
+		config.actionTimeoutMs = saved.actionTimeoutMs;
+		config.nextHandDelayMs = saved.nextHandDelayMs;
+
+		auto table = std::make_shared<Table>(_ioService, saved.tableId, config, _services);
+		table->restore(saved);
+		_tables.insert(std::make_pair(saved.tableId, table));
+		_nextId = std::max(_nextId, saved.tableId + 1);
+		restored.push_back(saved.tableId);
+	}
+	lock.unlock();
+
+	if (_cluster)
+	{
+		for (auto tableId : restored)
+			_cluster->claim(clusterKey(tableId));
+	}
+	return restored.size();
+}
+
+void TableManager::setCluster(std::shared_ptr<msgpack::rpc::Cluster> cluster)
+{
+	std::lock_guard<std::mutex> lock(_mtx);
+	_cluster = cluster;
+	_nextId = std::max(_nextId, (cluster->getNodeId() << 24) + 1);
+	if (_services.wallets)
+		_services.wallets->setCluster(cluster);
+}
+
+std::string TableManager::clusterKey(uint32_t tableId)
+{
+	return "table:" + std::to_string(tableId);
+}
+
+void TableManager::migrate(uint32_t tableId, uint32_t node, uint32_t maxPauseMs,
+	std::function<void(const std::string& error)> done)
+{
+	auto cluster = _cluster;
+	if (!cluster)
+		throw msgerror("not in a cluster", error_invalid_argument);
+	auto table = find(tableId);
+	if (!table)
+		throw msgerror("no such table", error_invalid_argument);
+	if (!node)
+		node = cluster->placement(clusterKey(tableId));
+	if (node == cluster->getNodeId())
+		throw msgerror("table is on that node already", error_invalid_argument);
+	{
+		std::lock_guard<std::mutex> lock(_mtx);
+		if (!_migrating.insert(tableId).second)
+			throw msgerror("table is moving already", error_invalid_argument);
+	}
+
+	// the table stops for no longer than one trip to node and back, bounded by maxPauseMs
+	auto finish = [this, cluster, tableId, node, done](std::shared_ptr<Table> table, const std::string& error)
+	{
+		std::string key = clusterKey(tableId);
+		if (error.empty())
+		{
+			cluster->moved(key, node);
+			forget(tableId);
+			table->post([](Table& table) { table.retire(); });
+		}
+		else
+		{
+			// node may have taken it after all, it lets go and this node claims it again
+			cluster->call(node, [cluster, key](AsyncCallCtx*) { cluster->claim(key); }, "table_evict", tableId);
+			cluster->claim(key);
+			table->post([](Table& table)
+			{
+				table.setMoving(false);
+				table.setPaused(false);
+			});
+		}
+		{
+			std::lock_guard<std::mutex> lock(_mtx);
+			_migrating.erase(tableId);
+		}
+		done(error);
+	};
+
+	auto& ios = _ioService;
+	table->post([cluster, node, maxPauseMs, finish, &ios](Table& table)
+	{
+		if (table.getConfig().assignedSeats)
+		{
+			finish(table.shared_from_this(), "tournament tables stay with their tournament");
+			return;
+		}
+
+		// the running hand plays out, no new one starts
+		table.setPaused(true);
+		table.whenIdle([cluster, node, maxPauseMs, finish, &ios](Table& table)
+		{
+			table.setMoving(true);
+			TableHandoff handoff;
+			handoff.table = table.capture();
+			for (auto& follower : table.followers())
+			{
+				HandoffSession session;
+				session.seat = follower.first;
+				session.token = follower.second->getResumeToken();
+				session.node = cluster->homeOf(follower.second);
+				if (session.node && !session.token.empty())
+					handoff.sessions.push_back(session);
+			}
+
+			auto self = table.shared_from_this();
+			auto settled = std::make_shared<std::atomic<bool>>(false);
+			auto timer = std::make_shared<boost::asio::steady_timer>(ios);
+			timer->expires_from_now(std::chrono::milliseconds(maxPauseMs));
+			timer->async_wait([self, settled, finish](const boost::system::error_code& error)
+			{
+				if (!error && !settled->exchange(true))
+					finish(self, "node did not take the table in time");
+			});
+
+			bool sent = cluster->call(node, [self, settled, timer, finish](AsyncCallCtx* ctx)
+			{
+				if (settled->exchange(true))
+					return;
+				boost::system::error_code ec;
+				timer->cancel(ec);
+				finish(self, ctx->isError() ? ctx->getErrorMessage() : std::string());
+			}, "table_adopt", handoff);
+			if (!sent && !settled->exchange(true))
+			{
+				boost::system::error_code ec;
+				timer->cancel(ec);
+				finish(self, "no such node");
+			}
+		});
+	});
+}
+
+void TableManager::adopt(const TableHandoff& handoff)
+{
+	auto cluster = _cluster;
+	const TableSnapshot& saved = handoff.table;
+	if (!cluster)
+		throw msgerror("not in a cluster", error_invalid_argument);
+	if (!saved.tableId || saved.seats < 2 || saved.seats > 10)
+		throw msgerror("invalid table", error_invalid_argument);
+
+	TableConfig config;
+	config.game = saved.game;
+	config.seats = saved.seats;
+	config.smallBlind = saved.smallBlind;
+	config.bigBlind = saved.bigBlind;
+	config.actionTimeoutMs = saved.actionTimeoutMs;
+	config.nextHandDelayMs = saved.nextHandDelayMs;
+
+	std::shared_ptr<Table> table;
+	{
+		std::lock_guard<std::mutex> lock(_mtx);
+		if (_tables.count(saved.tableId))
+			throw msgerror("table is here already", error_invalid_argument);
+		table = std::make_shared<Table>(_ioService, saved.tableId, config, _services);
+		table->restore(saved);
+		_tables.insert(std::make_pair(saved.tableId, table));
+	}
+	cluster->claim(clusterKey(saved.tableId));
+
+	std::vector<std::string> players(saved.seats);
+	for (auto& player : saved.players)
+	{
+		if (player.seat >= 0 && player.seat < static_cast<int>(players.size()))
+			players[player.seat] = player.player;
+	}
+
+	// the sessions take their seats back as if they had resumed, spectators
+	// first so the first update of the seated reaches them as well
+	auto sessions = handoff.sessions;
+	table->post([cluster, sessions, players](Table& table)
+	{
+		for (auto& session : sessions)
+		{
+			auto connection = session.seat < 0 ? cluster->sessionOf(session.node, session.token) : nullptr;
+			if (connection)
+				table.watch(connection);
+		}
+		for (auto& session : sessions)
+		{
+			if (session.seat < 0 || session.seat >= static_cast<int>(players.size()))
+				continue;
+			if (auto connection = cluster->sessionOf(session.node, session.token))
+				table.resume(session.seat, players[session.seat], connection);
+		}
+	});
+}
+
+void TableManager::evict(uint32_t tableId)
+{
+	auto table = forget(tableId);
+	if (!table)
+		return;
+	table->post([](Table& table) { table.retire(); });
+	if (_cluster)
+		_cluster->release(clusterKey(tableId));
+}
+
+}
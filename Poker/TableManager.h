@@ -0,0 +1,156 @@
+#pragma once
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <set>
+#include <thread>
+#include <vector>
+#include <boost/asio/io_service.hpp>
+#include "Table.h"
+
+namespace msgpack {
+namespace rpc {
+class Cluster;
+} }
+
+namespace poker {
+
+/// a session that follows a moving table, from the node its socket is on. seat -1 for a spectator.
+struct HandoffSession
+{
+	int seat = -1;
+	std::string token;
+	uint32_t node = 0;
+	MSGPACK_DEFINE(seat, token, node);
+};
+
+/// what a table takes along to another node
+struct TableHandoff
+{
+	TableSnapshot table;
+	std::vector<HandoffSession> sessions;
+	MSGPACK_DEFINE(table, sessions);
+};
+
+/// as the params of a table_adopt call are logged
+inline std::ostream& operator<<(std::ostream& os, const TableHandoff& handoff)
+{
+	return os << "table " << handoff.table.tableId << ", " << handoff.sessions.size() << " sessions";
+}
+
+/// Owns the tables and the threads that run them. Each table is pinned to
+/// its own strand, so many tables spread over all threads while any one of
+/// them is only ever run by one thread at a time.
+class TableManager
+{
+public:
+	/// finished hands go to history and chip movements to ledger if given,
+	/// which holds the wallets of this node
+	explicit TableManager(size_t threads = std::thread::hardware_concurrency(),
+		std::shared_ptr<HandHistory> history = nullptr, std::shared_ptr<Ledger> ledger = nullptr);
+	~TableManager();
+
+	/// throws msgerror if config is out of range or tableId is taken, 0 takes the next id
+	std::shared_ptr<Table> create(const TableConfig& config, uint32_t tableId = 0);
+
+	/// an id no table here or elsewhere in the cluster has, for create
+	uint32_t reserveId();
+
+	/// nullptr if there is no such table
+	std::shared_ptr<Table> find(uint32_t tableId);
+
+	/// drop a table from the registry, it lives on while anyone holds it
+	void remove(uint32_t tableId);
+
+	/// every table created here is listed
+	Lobby& getLobby();
+
+	/// seats by resume token, over all tables
+	SeatBindings& getBindings();
+
+	/// nullptr if chips are not accounted
+	std::shared_ptr<Ledger> getLedger() const;
+	std::shared_ptr<Wallets> getWallets() const;
+
+	/// capture every table on its strand, blocks so not for table threads
+	ServerSnapshot snapshot();
+	bool saveSnapshot(const std::string& path);
+
+	/// recreate the tables of a snapshot file under their old ids, before
+	/// any are created. returns the tables restored, 0 if there is no file.
+	size_t restore(const std::string& path);
+
+	size_t size();
+
+	/// one of several nodes, call before any table is created or restored.
+	/// table ids start at nodeId << 24 and each table is claimed in the
+	/// cluster under clusterKey(id) while it is here. The wallets are spread
+	/// over the nodes from then on, see Wallets.
+	void setCluster(std::shared_ptr<msgpack::rpc::Cluster> cluster);
+
+	static std::string clusterKey(uint32_t tableId);
+
+	/// nullptr if not one of several nodes
+	std::shared_ptr<msgpack::rpc::Cluster> getCluster() const;
+
+	/// Move a table to node, 0 for the node the placement ring puts it on.
+	/// Once no hand runs the table is captured and stops, the capture and the
+	/// sessions that follow it go to node, which runs it from there on and
+	/// takes over the sessions. done("") is called when it has; if node does
+	/// not take it within maxPauseMs the table runs on here and done gets why.
+	/// Buy ins and cash outs still pending are settled before the capture.
+	void migrate(uint32_t tableId, uint32_t node, uint32_t maxPauseMs,
+		std::function<void(const std::string& error)> done);
+
+	/// the receiving end of migrate, throws msgerror if the table is here already
+	void adopt(const TableHandoff& handoff);
+
+	/// drop a table adopted too late, its old node runs it again
+	void evict(uint32_t tableId);
+
+private:
+	TableManager(const TableManager&) = delete;
+	TableManager& operator=(const TableManager&) = delete;
+
+	std::shared_ptr<Table> forget(uint32_t tableId);
+
+	boost::asio::io_service _ioService;
+	std::unique_ptr<boost::asio::io_service::work> _work;
+	std::vector<std::thread> _threads;
+	TableServices _services;
+
+	std::mutex _mtx;		// guards the registry only, never held while a table runs
+	std::map<uint32_t, std::shared_ptr<Table>> _tables;
+	uint32_t _nextId;
+	std::set<uint32_t> _migrating;
+	std::shared_ptr<msgpack::rpc::Cluster> _cluster;
+};
+
+inline Lobby& TableManager::getLobby()
+{
+	return *_services.lobby;
+}
+
+inline std::shared_ptr<Ledger> TableManager::getLedger() const
+{
+	return _services.wallets ? _services.wallets->getLedger() : nullptr;
+}
+
+inline std::shared_ptr<Wallets> TableManager::getWallets() const
+{
+	return _services.wallets;
+}
+
+inline std::shared_ptr<msgpack::rpc::Cluster> TableManager::getCluster() const
+{
+	return _cluster;
+}
+
+inline SeatBindings& TableManager::getBindings()
+{
+	return *_services.bindings;
+}
+
+}
@@ -0,0 +1,68 @@
+#pragma once
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <msgpack.hpp>
+
+namespace poker {
+
+enum TableAction
+{
+	action_fold,
+	action_check,
+	action_call,
+	action_bet,			// amount is the total bet on this street, a raise to
+	action_post,		// blinds, only seen in hand records
+};
+
+enum Street
+{
+	street_waiting,		// not enough players, or paused
+	street_preflop,
+	street_flop,
+	street_turn,
+	street_river,
+	street_showdown,	// hand over, the next starts shortly
+};
+
+/// public view of one seat
+struct SeatState
+{
+	std::string player;			// empty when the seat is free
+	int64_t stack = 0;
+	int64_t bet = 0;			// put in on this street
+	bool inHand = false;
+	bool folded = false;
+	bool allIn = false;
+	std::vector<int> shown;		// hole cards, only after a showdown
+	MSGPACK_DEFINE(player, stack, bet, inHand, folded, allIn, shown);
+
+	bool operator==(const SeatState& other) const
+	{
+		return player == other.player && stack == other.stack && bet == other.bet && inHand == other.inHand
+			&& folded == other.folded && allIn == other.allIn && shown == other.shown;
+	}
+	bool operator!=(const SeatState& other) const { return !(*this == other); }
+};
+
+/// what every seated player sees, synced to clients by TableSync
+struct TableState
+{
+	uint32_t tableId = 0;
+	uint64_t version = 0;
+	uint64_t handId = 0;
+	int street = street_waiting;
+	int button = -1;
+	int toAct = -1;
+	int64_t smallBlind = 0;
+	int64_t bigBlind = 0;
+	int64_t pot = 0;			// collected from earlier streets
+	int64_t currentBet = 0;
+	int64_t minRaise = 0;
+	std::vector<int> board;
+	std::vector<SeatState> seats;
+	MSGPACK_DEFINE(tableId, version, handId, street, button, toAct, smallBlind, bigBlind,
+		pot, currentBet, minRaise, board, seats);
+};
+
+}
@@ -0,0 +1,158 @@
+#include "TableSync.h"
+#include "Protocol.h"
+#include "PackBuffer.h"
+
+namespace poker {
+
+namespace {
+
+typedef msgpack::packer<msgpack::sbuffer> Packer;
+
+void packChanges(Packer& pk, const TableState& from, const TableState& to)
+{
+	std::vector<size_t> seats;
+	for (size_t seat = 0; seat < to.seats.size(); ++seat)
+	{
+		if (seat >= from.seats.size() || from.seats[seat] != to.seats[seat])
+			seats.push_back(seat);
+	}
+
+	uint32_t count = (from.handId != to.handId) + (from.street != to.street) + (from.button != to.button)
+		+ (from.toAct != to.toAct) + (from.smallBlind != to.smallBlind) + (from.bigBlind != to.bigBlind)
+		+ (from.pot != to.pot) + (from.currentBet != to.currentBet) + (from.minRaise != to.minRaise)
+		+ (from.board != to.board) + !seats.empty();
+	pk.pack_map(count);
+
+	if (from.handId != to.handId)
+		pk.pack(static_cast<int>(field_hand_id)).pack(to.handId);
+	if (from.street != to.street)
+		pk.pack(static_cast<int>(field_street)).pack(to.street);
+	if (from.button != to.button)
+		pk.pack(static_cast<int>(field_button)).pack(to.button);
+	if (from.toAct != to.toAct)
+		pk.pack(static_cast<int>(field_to_act)).pack(to.toAct);
+	if (from.smallBlind != to.smallBlind)
+		pk.pack(static_cast<int>(field_small_blind)).pack(to.smallBlind);
+	if (from.bigBlind != to.bigBlind)
+		pk.pack(static_cast<int>(field_big_blind)).pack(to.bigBlind);
+	if (from.pot != to.pot)
+		pk.pack(static_cast<int>(field_pot)).pack(to.pot);
+	if (from.currentBet != to.currentBet)
+		pk.pack(static_cast<int>(field_current_bet)).pack(to.currentBet);
+	if (from.minRaise != to.minRaise)
+		pk.pack(static_cast<int>(field_min_raise)).pack(to.minRaise);
+	if (from.board != to.board)
+		pk.pack(static_cast<int>(field_board)).pack(to.board);
+	if (!seats.empty())
+	{
+		pk.pack(static_cast<int>(field_seats));
+		pk.pack_map(static_cast<uint32_t>(seats.size()));
+		for (size_t seat : seats)
+			pk.pack(static_cast<int>(seat)).pack(to.seats[seat]);
+	}
+}
+
+std::shared_ptr<msgpack::sbuffer> packSnapshot(const TableState& state)
+{
+	msgpack::rpc::MsgNotify<std::string, std::tuple<const TableState&>> notify(
+		"table_state", std::tuple<const TableState&>(state));
+	return msgpack::rpc::packExact(notify);
+}
+
+std::shared_ptr<msgpack::sbuffer> packDelta(const TableState& from, const TableState& to)
+{
+	// same layout as MsgNotify, the params end in the change map
+	auto sbuf = std::make_shared<msgpack::sbuffer>();
+	Packer pk(*sbuf);
+	pk.pack_array(3);
+	pk.pack(msgpack::rpc::MSG_TYPE_NOTIFY);
+	pk.pack(std::string("table_delta"));
+	pk.pack_array(4);
+	pk.pack(to.tableId);
+	pk.pack(from.version);
+	pk.pack(to.version);
+	packChanges(pk, from, to);
+	return sbuf;
+}
+
+}
+
+void TableSync::publish(const TableState& state)
+{
+	_history.push_back(state);
+	if (_history.size() > HISTORY)
+		_history.pop_front();
+	_packed.clear();
+}
+
+std::shared_ptr<msgpack::sbuffer> TableSync::update(uint64_t acked)
+{
+	if (_history.empty() || acked == getVersion())
+		return nullptr;
+
+	const TableState* base = acked ? find(acked) : nullptr;
+	uint64_t key = base ? acked : 0;
+	auto found = _packed.find(key);
+	if (found != _packed.end())
+		return found->second;
+
+	auto sbuf = base ? packDelta(*base, _history.back()) : packSnapshot(_history.back());
+	_packed.insert(std::make_pair(key, sbuf));
+	return sbuf;
+}
+
+const TableState* TableSync::find(uint64_t version) const
+{
+	// versions are consecutive apart from tables that skipped some
+	for (auto it = _history.rbegin(); it != _history.rend(); ++it)
+	{
+		if (it->version == version)
+			return &*it;
+		if (it->version < version)
+			break;
+	}
+	return nullptr;
+}
+
+void TableSync::apply(TableState& state, uint64_t version, const msgpack::object& changes)
+{
+	if (changes.type != msgpack::type::MAP)
+		throw msgpack::type_error();
+
+	state.version = version;
+	for (uint32_t i = 0; i < changes.via.map.size; ++i)
+	{
+		const msgpack::object& value = changes.via.map.ptr[i].val;
+		switch (changes.via.map.ptr[i].key.as<int>())
+		{
+		case field_hand_id: value.convert(&state.handId); break;
+		case field_street: value.convert(&state.street); break;
+		case field_button: value.convert(&state.button); break;
+		case field_to_act: value.convert(&state.toAct); break;
+		case field_small_blind: value.convert(&state.smallBlind); break;
+		case field_big_blind: value.convert(&state.bigBlind); break;
+		case field_pot: value.convert(&state.pot); break;
+		case field_current_bet: value.convert(&state.currentBet); break;
+		case field_min_raise: value.convert(&state.minRaise); break;
+		case field_board: value.convert(&state.board); break;
+		case field_seats:
+		{
+			if (value.type != msgpack::type::MAP)
+				throw msgpack::type_error();
+			for (uint32_t s = 0; s < value.via.map.size; ++s)
+			{
+				size_t seat = value.via.map.ptr[s].key.as<size_t>();
+				if (seat >= state.seats.size())
+					state.seats.resize(seat + 1);
+				value.via.map.ptr[s].val.convert(&state.seats[seat]);
+			}
+			break;
+		}
+		default:
+			// newer servers may add fields
+			break;
+		}
+	}
+}
+
+}
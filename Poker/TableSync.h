@@ -0,0 +1,64 @@
+#pragma once
+#include <deque>
+#include <map>
+#include <memory>
+#include <msgpack.hpp>
+#include "TableState.h"
+
+namespace poker {
+
+/// Field keys of a table_delta change map. seats maps seat index to SeatState.
+enum TableField
+{
+	field_hand_id,
+	field_street,
+	field_button,
+	field_to_act,
+	field_small_blind,
+	field_big_blind,
+	field_pot,
+	field_current_bet,
+	field_min_raise,
+	field_board,
+	field_seats,
+};
+
+/// Versioned table state and the messages that bring clients up to date.
+///
+/// A client at version v gets table_delta(tableId, v, version, changes),
+/// the fields that differ between v and the current version, so it applies
+/// the delta to its copy of v. Clients ack versions with table_ack; until
+/// then deltas stay against the last acked one, so a client keeps the
+/// versions it has not seen acked. Without a usable base it gets the full
+/// table_state. Each message is packed once per version and shared.
+///
+/// Not thread safe, owned by one table and used on its strand.
+class TableSync
+{
+public:
+	static const size_t HISTORY = 64;		// versions a delta can start from
+
+	/// state.version must be newer than the last one published
+	void publish(const TableState& state);
+
+	/// message for a client at acked, 0 meaning it has nothing, nullptr if it is current
+	std::shared_ptr<msgpack::sbuffer> update(uint64_t acked);
+
+	uint64_t getVersion() const;
+
+	/// client side, apply the changes of a table_delta to the state it is based on
+	static void apply(TableState& state, uint64_t version, const msgpack::object& changes);
+
+private:
+	const TableState* find(uint64_t version) const;
+
+	std::deque<TableState> _history;		// oldest first, back is current
+	std::map<uint64_t, std::shared_ptr<msgpack::sbuffer>> _packed;	// by base version, 0 is the snapshot
+};
+
+inline uint64_t TableSync::getVersion() const
+{
+	return _history.empty() ? 0 : _history.back().version;
+}
+
+}
@@ -0,0 +1,481 @@
+#include "Tournament.h"
+#include <algorithm>
+#include <random>
+
+namespace poker {
+
+using msgpack::rpc::msgerror;
+using msgpack::rpc::error_invalid_argument;
+using msgpack::rpc::error_illegal_action;
+
+namespace {
+
+template<typename T>
+std::shared_ptr<msgpack::sbuffer> packNotify(const std::string& method, const T& params)
+{
+	msgpack::rpc::MsgNotify<std::string, T> notify(method, params);
+	return msgpack::rpc::packExact(notify);
+}
+
+uint32_t countPlayers(const Table& table)
+{
+	uint32_t players = 0;
+	for (auto& seat : table.getState().seats)
+		players += seat.player.empty() ? 0 : 1;
+	return players;
+}
+
+}
+
+TournamentScheduler::TournamentScheduler(std::shared_ptr<TableManager> tables):
+	_tables(tables),
+	_work(new boost::asio::io_service::work(_ioService)),
+	_wheel(std::make_shared<msgpack::rpc::TimerWheel>(_ioService, TICK_MS)),
+	_nextId(1)
+{
+	auto wheel = _wheel;
+	_ioService.post([wheel]() { wheel->start(); });
+	_thread = std::thread([this]() { _ioService.run(); });
+}
+
+TournamentScheduler::~TournamentScheduler()
+{
+	_work.reset();
+	_ioService.stop();
+	_thread.join();
+}
+
+uint32_t TournamentScheduler::create(const TournamentConfig& config)
+{
+	if (config.seatsPerTable < 2 || config.seatsPerTable > 10)
+		throw msgerror("2 to 10 seats per table expected", error_invalid_argument);
+	if (config.startingStack <= 0 || config.levels.empty())
+		throw msgerror("starting stack and blind levels required", error_invalid_argument);
+	for (auto& level : config.levels)
+	{
+		if (!level.durationMs || (!level.isBreak && (level.smallBlind <= 0 || level.bigBlind < level.smallBlind)))
+			throw msgerror("invalid blind level", error_invalid_argument);
+	}
+	if (config.levels.front().isBreak)
+		throw msgerror("the first level can not be a break", error_invalid_argument);
+
+	Tournament tournament;
+	tournament.id = _nextId++;
+	tournament.config = config;
+	_tournaments.insert(std::make_pair(tournament.id, tournament));
+	return tournament.id;
+}
+
+uint32_t TournamentScheduler::enroll(uint32_t tournamentId, const std::string& player, Table::ConnectionPtr connection)
+{
+	Tournament& tournament = find(tournamentId);
+	if (tournament.status != tournament_registering)
+		throw msgerror("registration is closed", error_illegal_action);
+	if (player.empty())
+		throw msgerror("player name required", error_invalid_argument);
+	for (auto& entrant : tournament.entrants)
+	{
+		if (entrant.player == player)
+			throw msgerror("already registered", error_illegal_action);
+	}
+
+	Entrant entrant;
+	entrant.player = player;
+	entrant.connection = connection;
+	entrant.token = connection ? connection->getResumeToken() : std::string();
+	tournament.entrants.push_back(entrant);
+	return static_cast<uint32_t>(tournament.entrants.size());
+}
+
+void TournamentScheduler::start(uint32_t tournamentId)
+{
+	Tournament& tournament = find(tournamentId);
+	if (tournament.status != tournament_registering)
+		throw msgerror("already started", error_illegal_action);
+	if (tournament.entrants.size() < 2)
+		throw msgerror("2 players at least", error_illegal_action);
+
+	const TournamentConfig& config = tournament.config;
+	std::mt19937 rng(std::random_device{}());
+	std::shuffle(tournament.entrants.begin(), tournament.entrants.end(), rng);
+
+	TableConfig tableConfig;
+	tableConfig.game = "tournament";
+	tableConfig.seats = config.seatsPerTable;
+	tableConfig.smallBlind = config.levels.front().smallBlind;
+	tableConfig.bigBlind = config.levels.front().bigBlind;
+	tableConfig.actionTimeoutMs = config.actionTimeoutMs;
+	tableConfig.nextHandDelayMs = config.nextHandDelayMs;
+	tableConfig.assignedSeats = true;
+
+	size_t count = (tournament.entrants.size() + config.seatsPerTable - 1) / config.seatsPerTable;
+	std::vector<Seating*> seatings;
+	std::weak_ptr<TournamentScheduler> weak = shared_from_this();
+	for (size_t i = 0; i < count; ++i)
+	{
+		auto table = _tables->create(tableConfig);
+		Seating& seating = tournament.tables[table->getId()];
+		seating.table = table;
+		seating.moves = std::make_shared<MoveQueue>();
+		seatings.push_back(&seating);
+
+		// paused until the first level, so no hand starts half seated
+		auto moves = seating.moves;
+		table->post([weak, tournamentId, moves](Table& table)
+		{
+			table.setPaused(true);
+			table.setHandEndHandler([weak, tournamentId, moves](Table& table)
+			{
+				settle(weak, tournamentId, moves, table);
+			});
+		});
+	}
+
+	// dealt round the tables so they start within one player of each other
+	for (size_t i = 0; i < tournament.entrants.size(); ++i)
+	{
+		const Entrant& entrant = tournament.entrants[i];
+		Seating& seating = *seatings[i % count];
+		SeatSnapshot player;
+		player.player = entrant.player;
+		player.stack = config.startingStack;
+		player.token = entrant.token;
+		auto connection = entrant.connection.lock();
+		seating.table->post([player, connection](Table& table) { table.seatMoved(player, connection); });
+		++seating.players;
+	}
+
+	tournament.status = tournament_running;
+	startLevel(tournament, 0);
+}
+
+TournamentInfo TournamentScheduler::getInfo(uint32_t tournamentId)
+{
+	Tournament& tournament = find(tournamentId);
+	TournamentInfo info;
+	info.tournamentId = tournament.id;
+	info.name = tournament.config.name;
+	info.status = tournament.status;
+	info.level = static_cast<uint32_t>(tournament.level);
+	info.entrants = static_cast<uint32_t>(tournament.entrants.size());
+	info.playersLeft = static_cast<uint32_t>(tournament.entrants.size() - tournament.busted.size());
+	for (auto& entry : tournament.tables)
+		info.tables.push_back(entry.first);
+	if (tournament.status == tournament_finished)
+	{
+		for (auto& entrant : tournament.entrants)
+		{
+			if (std::find(tournament.busted.begin(), tournament.busted.end(), entrant.player) == tournament.busted.end())
+				info.standings.push_back(entrant.player);
+		}
+	}
+	info.standings.insert(info.standings.end(), tournament.busted.rbegin(), tournament.busted.rend());
+	return info;
+}
+
+std::vector<TableMove> TournamentScheduler::planMoves(std::vector<TableCount> tables, uint32_t seatsPerTable)
+{
+	std::vector<TableMove> moves;
+	uint32_t total = 0;
+	for (auto& table : tables)
+		total += table.players;
+	if (!total || !seatsPerTable)
+		return moves;
+
+	// the fullest tables stay, the extra players go to the fullest of those
+	std::sort(tables.begin(), tables.end(), [](const TableCount& a, const TableCount& b)
+	{
+		return a.players != b.players ? a.players > b.players : a.tableId < b.tableId;
+	});
+	size_t keep = std::min<size_t>(tables.size(), (total + seatsPerTable - 1) / seatsPerTable);
+	uint32_t base = static_cast<uint32_t>(total / keep);
+	size_t extra = total % keep;
+
+	std::vector<TableCount> surplus;
+	std::vector<TableCount> deficit;
+	for (size_t i = 0; i < tables.size(); ++i)
+	{
+		uint32_t target = i < keep ? base + (i < extra ? 1 : 0) : 0;
+		if (tables[i].players > target)
+			surplus.push_back(TableCount{ tables[i].tableId, tables[i].players - target });
+		else if (tables[i].players < target)
+			deficit.push_back(TableCount{ tables[i].tableId, target - tables[i].players });
+	}
+
+	// surplus and deficit sum up the same, any pairing moves the minimum
+	size_t d = 0;
+	for (auto& from : surplus)
+	{
+		while (from.players && d < deficit.size())
+		{
+			uint32_t players = std::min(from.players, deficit[d].players);
+			moves.push_back(TableMove{ from.tableId, deficit[d].tableId, players });
+			from.players -= players;
+			deficit[d].players -= players;
+			if (!deficit[d].players)
+				++d;
+		}
+	}
+	return moves;
+}
+
+TournamentScheduler::Tournament& TournamentScheduler::find(uint32_t tournamentId)
+{
+	auto found = _tournaments.find(tournamentId);
+	if (found == _tournaments.end())
+		throw msgerror("no such tournament", error_invalid_argument);
+	return found->second;
+}
+
+void TournamentScheduler::startLevel(Tournament& tournament, size_t level)
+{
+	tournament.level = level;
+	uint64_t seq = ++tournament.levelSeq;
+	const BlindLevel& blinds = tournament.config.levels[level];
+
+	// packed once, every session of every table gets the same buffer
+	auto msg = packNotify("tournament_level", std::make_tuple(tournament.id, static_cast<uint32_t>(level),
+		blinds.smallBlind, blinds.bigBlind, blinds.isBreak, blinds.durationMs));
+	for (auto& entry : tournament.tables)
+	{
+		entry.second.table->post([blinds, msg](Table& table)
+		{
+			if (!blinds.isBreak)
+				table.setBlinds(blinds.smallBlind, blinds.bigBlind);
+			table.sendToAll(msg);
+			table.setPaused(blinds.isBreak);
+		});
+	}
+
+	if (level + 1 >= tournament.config.levels.size())
+		return;
+	std::weak_ptr<TournamentScheduler> weak = shared_from_this();
+	uint32_t tournamentId = tournament.id;
+	_wheel->schedule(blinds.durationMs, [weak, tournamentId, seq]()
+	{
+		auto self = weak.lock();
+		if (!self)
+			return;
+		auto found = self->_tournaments.find(tournamentId);
+		if (found == self->_tournaments.end() || found->second.levelSeq != seq
+			|| found->second.status != tournament_running)
+			return;
+		self->startLevel(found->second, found->second.level + 1);
+	});
+}
+
+void TournamentScheduler::settle(std::weak_ptr<TournamentScheduler> weak, uint32_t tournamentId,
+	std::shared_ptr<MoveQueue> moves, Table& table)
+{
+	TableReport report;
+	report.tableId = table.getId();
+
+	Table::ConnectionPtr connection;
+	for (size_t seat = 0; seat < table.getState().seats.size(); ++seat)
+	{
+		const SeatState& state = table.getState().seats[seat];
+		if (!state.player.empty() && state.stack <= 0)
+			report.busted.push_back(table.unseat(static_cast<int>(seat), connection).player);
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(moves->mtx);
+		while (!moves->to.empty())
+		{
+			auto to = moves->to.front();
+			moves->to.pop_front();
+
+			// the last seat goes, nobody is picked on by name
+			int seat = static_cast<int>(table.getState().seats.size()) - 1;
+			while (seat >= 0 && table.getState().seats[seat].player.empty())
+				--seat;
+			if (seat < 0)
+			{
+				report.cancelled.push_back(to->getId());
+				continue;
+			}
+
+			SeatSnapshot player = table.unseat(seat, connection);
+			++report.moved;
+			uint32_t toId = to->getId();
+			to->post([weak, tournamentId, toId, player, connection](Table& table)
+			{
+				bool seated = table.seatMoved(player, connection) >= 0;
+				if (auto self = weak.lock())
+				{
+					self->post([tournamentId, toId, player, connection, seated](TournamentScheduler& scheduler)
+					{
+						scheduler.onArrived(tournamentId, toId, player, connection, seated);
+					});
+				}
+			});
+		}
+	}
+
+	report.players = countPlayers(table);
+	if (auto self = weak.lock())
+	{
+		self->post([tournamentId, report](TournamentScheduler& scheduler)
+		{
+			scheduler.onReport(tournamentId, report);
+		});
+	}
+}
+
+void TournamentScheduler::onReport(uint32_t tournamentId, const TableReport& report)
+{
+	auto found = _tournaments.find(tournamentId);
+	if (found == _tournaments.end() || found->second.status != tournament_running)
+		return;
+	Tournament& tournament = found->second;
+	auto seating = tournament.tables.find(report.tableId);
+	if (seating == tournament.tables.end())
+		return;
+
+	seating->second.players = report.players;
+	seating->second.queued -= std::min<uint32_t>(seating->second.queued,
+		report.moved + static_cast<uint32_t>(report.cancelled.size()));
+	for (uint32_t to : report.cancelled)
+	{
+		auto target = tournament.tables.find(to);
+		if (target != tournament.tables.end() && target->second.incoming)
+			--target->second.incoming;
+	}
+	tournament.busted.insert(tournament.busted.end(), report.busted.begin(), report.busted.end());
+
+	if (tournament.entrants.size() - tournament.busted.size() <= 1)
+		finish(tournament);
+	else
+		rebalance(tournament);
+}
+
+void TournamentScheduler::onArrived(uint32_t tournamentId, uint32_t tableId, const SeatSnapshot& player,
+	Table::ConnectionPtr connection, bool seated)
+{
+	auto found = _tournaments.find(tournamentId);
+	if (found == _tournaments.end())
+		return;
+	Tournament& tournament = found->second;
+	auto seating = tournament.tables.find(tableId);
+	if (seating != tournament.tables.end())
+	{
+		--seating->second.incoming;
+		if (seated)
+			++seating->second.players;
+	}
+
+	if (!seated)
+	{
+		// the table filled up meanwhile, try the emptiest one
+		Seating* best = nullptr;
+		for (auto& entry : tournament.tables)
+		{
+			Seating& candidate = entry.second;
+			if (!best || candidate.players + candidate.incoming - candidate.queued
+				< best->players + best->incoming - best->queued)
+				best = &candidate;
+		}
+		if (best)
+			moveTo(tournament, *best, player, connection);
+		return;
+	}
+	if (tournament.status == tournament_running)
+		rebalance(tournament);
+}
+
+void TournamentScheduler::moveTo(Tournament& tournament, Seating& to, const SeatSnapshot& player,
+	Table::ConnectionPtr connection)
+{
+	++to.incoming;
+	std::weak_ptr<TournamentScheduler> weak = shared_from_this();
+	uint32_t tournamentId = tournament.id;
+	uint32_t toId = to.table->getId();
+	to.table->post([weak, tournamentId, toId, player, connection](Table& table)
+	{
+		bool seated = table.seatMoved(player, connection) >= 0;
+		if (auto self = weak.lock())
+		{
+			self->post([tournamentId, toId, player, connection, seated](TournamentScheduler& scheduler)
+			{
+				scheduler.onArrived(tournamentId, toId, player, connection, seated);
+			});
+		}
+	});
+}
+
+void TournamentScheduler::rebalance(Tournament& tournament)
+{
+	// one round of moves at a time, counts are only exact once it settled
+	std::vector<TableCount> counts;
+	for (auto& entry : tournament.tables)
+	{
+		if (entry.second.queued || entry.second.incoming)
+			return;
+		counts.push_back(TableCount{ entry.first, entry.second.players });
+	}
+
+	std::weak_ptr<TournamentScheduler> weak = shared_from_this();
+	uint32_t tournamentId = tournament.id;
+	for (auto& move : planMoves(counts, tournament.config.seatsPerTable))
+	{
+		Seating& from = tournament.tables[move.from];
+		Seating& to = tournament.tables[move.to];
+		from.queued += move.players;
+		to.incoming += move.players;
+		{
+			std::lock_guard<std::mutex> lock(from.moves->mtx);
+			for (uint32_t i = 0; i < move.players; ++i)
+				from.moves->to.push_back(to.table);
+		}
+
+		// a table between hands moves now, one in a hand when it is over
+		auto moves = from.moves;
+		from.table->post([weak, tournamentId, moves](Table& table)
+		{
+			if (table.isBetweenHands())
+				settle(weak, tournamentId, moves, table);
+		});
+	}
+
+	// broken tables are dropped once the last player left
+	auto it = tournament.tables.begin();
+	while (it != tournament.tables.end())
+	{
+		if (!it->second.players && !it->second.queued && !it->second.incoming)
+		{
+			it->second.table->post([](Table& table) { table.setHandEndHandler(nullptr); });
+			_tables->remove(it->first);
+			it = tournament.tables.erase(it);
+		}
+		else
+			++it;
+	}
+}
+
+void TournamentScheduler::finish(Tournament& tournament)
+{
+	tournament.status = tournament_finished;
+	++tournament.levelSeq;
+
+	std::string winner;
+	for (auto& entrant : tournament.entrants)
+	{
+		if (std::find(tournament.busted.begin(), tournament.busted.end(), entrant.player) == tournament.busted.end())
+			winner = entrant.player;
+	}
+
+	auto msg = packNotify("tournament_finished", std::make_tuple(tournament.id, winner));
+	for (auto& entry : tournament.tables)
+	{
+		entry.second.table->post([msg](Table& table)
+		{
+			table.setHandEndHandler(nullptr);
+			table.setPaused(true);
+			table.sendToAll(msg);
+		});
+		_tables->remove(entry.first);
+	}
+	tournament.tables.clear();
+}
+
+}
@@ -0,0 +1,180 @@
+#pragma once
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <boost/asio/io_service.hpp>
+#include "TimerWheel.h"
+#include "TableManager.h"
+
+namespace poker {
+
+struct BlindLevel
+{
+	int64_t smallBlind = 0;
+	int64_t bigBlind = 0;
+	uint32_t durationMs = 0;
+	bool isBreak = false;		// no hands are dealt, the blinds are ignored
+	MSGPACK_DEFINE(smallBlind, bigBlind, durationMs, isBreak);
+};
+
+struct TournamentConfig
+{
+	std::string name;
+	uint32_t seatsPerTable = 9;
+	int64_t startingStack = 10000;
+	uint32_t actionTimeoutMs = 30 * 1000;
+	uint32_t nextHandDelayMs = 3 * 1000;
+	std::vector<BlindLevel> levels;		// the last one holds until the end
+};
+
+enum TournamentStatus
+{
+	tournament_registering,
+	tournament_running,
+	tournament_finished,
+};
+
+struct TournamentInfo
+{
+	uint32_t tournamentId = 0;
+	std::string name;
+	int status = tournament_registering;
+	uint32_t level = 0;
+	uint32_t entrants = 0;
+	uint32_t playersLeft = 0;
+	std::vector<uint32_t> tables;
+	std::vector<std::string> standings;		// winner first, then in reverse order of going out
+	MSGPACK_DEFINE(tournamentId, name, status, level, entrants, playersLeft, tables, standings);
+};
+
+struct TableCount
+{
+	uint32_t tableId;
+	uint32_t players;
+};
+
+struct TableMove
+{
+	uint32_t from;
+	uint32_t to;
+	uint32_t players;
+};
+
+/// Runs multi-table tournaments over the tables of a TableManager. One
+/// timer wheel on the scheduler's own thread drives the blind levels of
+/// every tournament, tables keep only their action timers. Level changes
+/// are packed once and the same buffer is queued to every session.
+/// Tournament state lives on the scheduler thread, post() is the way in.
+class TournamentScheduler : public std::enable_shared_from_this<TournamentScheduler>
+{
+public:
+	static const uint32_t TICK_MS = 1000;
+
+	explicit TournamentScheduler(std::shared_ptr<TableManager> tables);
+	~TournamentScheduler();
+
+	/// run fn(scheduler) on the scheduler thread
+	template<typename F>
+	void post(F fn);
+
+	// scheduler thread only, the calls below throw msgerror on bad input
+
+	uint32_t create(const TournamentConfig& config);
+	uint32_t enroll(uint32_t tournamentId, const std::string& player, Table::ConnectionPtr connection);
+
+	/// draw the seats and start the first level
+	void start(uint32_t tournamentId);
+
+	TournamentInfo getInfo(uint32_t tournamentId);
+
+	/// Moves that even out the tables, keeping the fullest ones and breaking
+	/// the rest once fewer tables will do. Every kept table ends within one
+	/// player of the others, with no player moved who did not have to be.
+	static std::vector<TableMove> planMoves(std::vector<TableCount> tables, uint32_t seatsPerTable);
+
+private:
+	/// players to move out, shared with the hand end hook of the table
+	struct MoveQueue
+	{
+		std::mutex mtx;
+		std::deque<std::shared_ptr<Table>> to;
+	};
+
+	struct Seating
+	{
+		std::shared_ptr<Table> table;
+		std::shared_ptr<MoveQueue> moves;
+		uint32_t players = 0;		// as last reported by the table
+		uint32_t queued = 0;		// moves out not done yet
+		uint32_t incoming = 0;		// moves in not arrived yet
+	};
+
+	struct Entrant
+	{
+		std::string player;
+		std::weak_ptr<msgpack::rpc::TcpConnection> connection;
+		std::string token;
+	};
+
+	struct Tournament
+	{
+		uint32_t id = 0;
+		TournamentConfig config;
+		TournamentStatus status = tournament_registering;
+		size_t level = 0;
+		uint64_t levelSeq = 0;			// a newer level makes older wheel entries stale
+		std::vector<Entrant> entrants;
+		std::map<uint32_t, Seating> tables;
+		std::vector<std::string> busted;	// in the order they went out
+	};
+
+	struct TableReport
+	{
+		uint32_t tableId = 0;
+		uint32_t players = 0;
+		uint32_t moved = 0;
+		std::vector<uint32_t> cancelled;	// moves to these tables found nobody left to move
+		std::vector<std::string> busted;
+	};
+
+	TournamentScheduler(const TournamentScheduler&) = delete;
+	TournamentScheduler& operator=(const TournamentScheduler&) = delete;
+
+	Tournament& find(uint32_t tournamentId);
+
+	void startLevel(Tournament& tournament, size_t level);
+	void onReport(uint32_t tournamentId, const TableReport& report);
+	void onArrived(uint32_t tournamentId, uint32_t tableId, const SeatSnapshot& player,
+		Table::ConnectionPtr connection, bool seated);
+	void rebalance(Tournament& tournament);
+	void moveTo(Tournament& tournament, Seating& to, const SeatSnapshot& player, Table::ConnectionPtr connection);
+	void finish(Tournament& tournament);
+
+	/// on the table strand between hands: bust the broke, move the queued
+	static void settle(std::weak_ptr<TournamentScheduler> weak, uint32_t tournamentId,
+		std::shared_ptr<MoveQueue> moves, Table& table);
+
+	std::shared_ptr<TableManager> _tables;
+	boost::asio::io_service _ioService;
+	std::unique_ptr<boost::asio::io_service::work> _work;
+	std::shared_ptr<msgpack::rpc::TimerWheel> _wheel;
+	std::map<uint32_t, Tournament> _tournaments;
+	uint32_t _nextId;
+	std::thread _thread;
+};
+
+template<typename F>
+inline void TournamentScheduler::post(F fn)
+{
+	auto self = shared_from_this();
+	_ioService.post([self, fn]() mutable
+	{
+		fn(*self);
+	});
+}
+
+}
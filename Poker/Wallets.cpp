@@ -0,0 +1,102 @@
+#include "Wallets.h"
+#include "Cluster.h"
+
+namespace poker {
+
+using msgpack::rpc::msgerror;
+using msgpack::rpc::ServerSideError;
+using msgpack::rpc::AsyncCallCtx;
+
+Wallets::Wallets(std::shared_ptr<Ledger> ledger):
+	_ledger(ledger)
+{
+}
+
+void Wallets::setCluster(std::shared_ptr<msgpack::rpc::Cluster> cluster)
+{
+	_cluster = cluster;
+}
+
+std::string Wallets::walletKey(const std::string& account)
+{
+	return "wallet:" + account;
+}
+
+uint32_t Wallets::nodeOf(const std::string& account) const
+{
+	if (!_cluster)
+		return 0;
+	uint32_t node = _cluster->placement(walletKey(account));
+	return node == _cluster->getNodeId() ? 0 : node;
+}
+
+void Wallets::move(const LedgerEntry& entry, MoveHandler onMoved)
+{
+	uint32_t node = nodeOf(entry.account);
+	if (!node)
+	{
+		_ledger->append(entry, [onMoved](bool durable)
+		{
+			onMoved(durable ? msgpack::rpc::success : msgpack::rpc::error_handler_failed);
+		});
+		return;
+	}
+
+	bool sent = _cluster->call(node, [onMoved](AsyncCallCtx* ctx)
+	{
+		onMoved(ctx->isError() ? ctx->getErrorCode() : msgpack::rpc::success);
+	}, "ledger_append", entry);
+	if (!sent)
+		throw msgerror(describe(msgpack::rpc::error_node_unavailable), msgpack::rpc::error_node_unavailable);
+}
+
+void Wallets::balance(const std::string& account, BalanceHandler onBalance)
+{
+	uint32_t node = nodeOf(account);
+	if (!node)
+	{
+		onBalance(msgpack::rpc::success, _ledger->getBalance(account));
+		return;
+	}
+
+	bool sent = _cluster->call(node, [onBalance](AsyncCallCtx* ctx)
+	{
+		int64_t balance = 0;
+		if (ctx->isError())
+			onBalance(ctx->getErrorCode(), 0);
+		else
+			onBalance(msgpack::rpc::success, ctx->convert(&balance));
+	}, "ledger_balance", account);
+	if (!sent)
+		throw msgerror(describe(msgpack::rpc::error_node_unavailable), msgpack::rpc::error_node_unavailable);
+}
+
+void Wallets::record(const LedgerEntry& entry)
+{
+	try
+	{
+		_ledger->append(entry);
+	}
+	catch (msgerror&)
+	{
+		// read only, a result moves no wallet and the hand ends all the same
+	}
+}
+
+const char* Wallets::describe(ServerSideError error)
+{
+	switch (error)
+	{
+	case msgpack::rpc::error_illegal_action:
+		return "insufficient funds";
+	case msgpack::rpc::error_handler_failed:
+		return "ledger write failed";
+	case msgpack::rpc::error_node_unavailable:
+	case msgpack::rpc::error_connection_lost:
+		return "the node of the wallet is unavailable";
+	default:
+		return "wallet move failed";
+	}
+}
+
+}
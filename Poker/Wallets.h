@@ -0,0 +1,69 @@
+#pragma once
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+#include "Asio.h"
+#include "Ledger.h"
+
+namespace msgpack {
+namespace rpc {
+class Cluster;
+} }
+
+namespace poker {
+
+/// The wallets behind the ledgers of the nodes. A node on its own keeps every
+/// wallet in its ledger. In a cluster the wallet of an account is in the
+/// ledger of the node the placement ring puts walletKey(account) on, the same
+/// on every node, so a table may run on any node and still buys its players
+/// in from their one wallet. Moves of a wallet of another node go there as a
+/// ledger_append call, and are durable once that node has them on disk.
+///
+/// A move whose link drops before the reply counts as failed here, though the
+/// node of the wallet may have made it; its ledger is the record to settle from.
+class Wallets
+{
+public:
+	/// success once the move is durable where the wallet is, else why it is not
+	typedef std::function<void(msgpack::rpc::ServerSideError error)> MoveHandler;
+	typedef std::function<void(msgpack::rpc::ServerSideError error, int64_t balance)> BalanceHandler;
+
+	explicit Wallets(std::shared_ptr<Ledger> ledger);
+
+	/// one of several nodes, before any move
+	void setCluster(std::shared_ptr<msgpack::rpc::Cluster> cluster);
+
+	/// Queue a wallet move, onMoved runs on the ledger's committer thread or the
+	/// cluster's io thread once it is durable or failed. Throws msgerror if it is
+	/// refused at once: funds short in a wallet of this node, the ledger read only,
+	/// or the node of the wallet not reachable.
+	void move(const LedgerEntry& entry, MoveHandler onMoved);
+
+	/// the balance where the wallet is, moves not yet durable included. throws like move.
+	void balance(const std::string& account, BalanceHandler onBalance);
+
+	/// a hand result, kept in this node's ledger; dropped if it is read only
+	void record(const LedgerEntry& entry);
+
+	/// node whose ledger holds the wallet of account, 0 for this one
+	uint32_t nodeOf(const std::string& account) const;
+
+	std::shared_ptr<Ledger> getLedger() const;
+
+	static std::string walletKey(const std::string& account);
+
+	/// for the reply to a move or balance that failed with error
+	static const char* describe(msgpack::rpc::ServerSideError error);
+
+private:
+	std::shared_ptr<Ledger> _ledger;
+	std::shared_ptr<msgpack::rpc::Cluster> _cluster;
+};
+
+inline std::shared_ptr<Ledger> Wallets::getLedger() const
+{
+	return _ledger;
+}
+
+}
@@ -0,0 +1,115 @@
+#include "WorkStealingPool.h"
+#include <algorithm>
+
+namespace poker {
+
+namespace {
+
+thread_local const WorkStealingPool* t_pool = nullptr;
+thread_local size_t t_worker = 0;
+
+}
+
+WorkStealingPool::WorkStealingPool(size_t threads):
+	_next(0),
+	_queued(0),
+	_stopping(false)
+{
+	threads = std::max<size_t>(threads, 1);
+	for (size_t i = 0; i < threads; ++i)
+		_workers.emplace_back(new Worker());
+	for (size_t i = 0; i < threads; ++i)
+		_threads.emplace_back([this, i]() { run(i); });
+}
+
+WorkStealingPool::~WorkStealingPool()
+{
+	{
+		std::lock_guard<std::mutex> lock(_idleMtx);
+		_stopping = true;
+	}
+	_idleCond.notify_all();
+	for (auto& thread : _threads)
+		thread.join();
+}
+
+size_t WorkStealingPool::currentWorker() const
+{
+	return t_pool == this ? t_worker : _workers.size();
+}
+
+void WorkStealingPool::submit(Task task)
+{
+	// count before pushing so a thief never takes _queued below zero
+	{
+		std::lock_guard<std::mutex> lock(_idleMtx);
+		_queued.fetch_add(1, std::memory_order_relaxed);
+	}
+
+	size_t index = currentWorker();
+	if (index < _workers.size())
+	{
+		// own work first, it is hot in this core's cache
+		std::lock_guard<std::mutex> lock(_workers[index]->mtx);
+		_workers[index]->tasks.push_front(std::move(task));
+	}
+	else
+	{
+		index = _next.fetch_add(1, std::memory_order_relaxed) % _workers.size();
+		std::lock_guard<std::mutex> lock(_workers[index]->mtx);
+		_workers[index]->tasks.push_back(std::move(task));
+	}
+	_idleCond.notify_one();
+}
+
+bool WorkStealingPool::popLocal(size_t index, Task& task)
+{
+	Worker& worker = *_workers[index];
+	std::lock_guard<std::mutex> lock(worker.mtx);
+	if (worker.tasks.empty())
+		return false;
+	task = std::move(worker.tasks.front());
+	worker.tasks.pop_front();
+	return true;
+}
+
+bool WorkStealingPool::steal(size_t index, Task& task)
+{
+	for (size_t i = 1; i < _workers.size(); ++i)
+	{
+		Worker& victim = *_workers[(index + i) % _workers.size()];
+		std::unique_lock<std::mutex> lock(victim.mtx, std::try_to_lock);
+		if (!lock.owns_lock() || victim.tasks.empty())
+			continue;
+		task = std::move(victim.tasks.back());
+		victim.tasks.pop_back();
+		return true;
+	}
+	return false;
+}
+
+void WorkStealingPool::run(size_t index)
+{
+	t_pool = this;
+	t_worker = index;
+
+	Task task;
+	for (;;)
+	{
+		if (popLocal(index, task) || steal(index, task))
+		{
+			_queued.fetch_sub(1, std::memory_order_relaxed);
+			task();
+			task = nullptr;
+			continue;
+		}
+
+		std::unique_lock<std::mutex> lock(_idleMtx);
+		// a failed try_lock in steal() may have skipped work, so only sleep on an empty pool
+		_idleCond.wait(lock, [this]() { return _stopping || _queued.load(std::memory_order_relaxed) > 0; });
+		if (_stopping && _queued.load(std::memory_order_relaxed) == 0)
+			return;
+	}
+}
+
+}
@@ -0,0 +1,57 @@
+#pragma once
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace poker {
+
+/// Fixed set of workers, each with its own deque. A worker runs its own
+/// tasks newest first and steals the oldest ones of the others when idle.
+class WorkStealingPool
+{
+public:
+	typedef std::function<void()> Task;
+
+	explicit WorkStealingPool(size_t threads = std::thread::hardware_concurrency());
+	~WorkStealingPool();
+
+	/// queue task, from a worker of this pool it goes to that worker's own deque
+	void submit(Task task);
+
+	size_t size() const;
+
+	/// index of the calling worker, size() if the caller is not one of ours
+	size_t currentWorker() const;
+
+private:
+	struct Worker
+	{
+		std::mutex mtx;
+		std::deque<Task> tasks;
+	};
+
+	void run(size_t index);
+	bool popLocal(size_t index, Task& task);
+	bool steal(size_t index, Task& task);
+
+	std::vector<std::unique_ptr<Worker>> _workers;
+	std::vector<std::thread> _threads;
+	std::atomic<size_t> _next;
+	std::atomic<size_t> _queued;
+
+	std::mutex _idleMtx;
+	std::condition_variable _idleCond;
+	bool _stopping;
+};
+
+inline size_t WorkStealingPool::size() const
+{
+	return _workers.size();
+}
+
+}
@@ -1,10 +1,17 @@
 // PokerServer.cpp : ̨Ӧóڵ㡣 //
 
+#include <fstream>
 #include "TcpConnection.h"
 #include "TcpSession.h"
 #include "TcpServer.h"
 #include "SessionManager.h"
 #include "TcpClient.h"
+#include "Cluster.h"
+#include "IoLoop.h"
+#include "Poker/PokerHandlers.h"
+#include "Poker/EquityCalculator.h"
+#include "Poker/TableManager.h"
+#include "Poker/Tournament.h"
 
  void on_result(msgpack::rpc::AsyncCallCtx* result)
 {
@@ -13,10 +20,10 @@
 	std::cout << "on_result =" << ret << std::endl;
 }
 
-int serveradd(int a, int b)
+int serveradd(msgpack::rpc::SessionManager& sessions, int a, int b)
 {
 	std::cout <<"handle add, " << a << " + " << b << std::endl;
-	auto sessionPool = msgpack::rpc::SessionManager::instance()->getSessionPool();
+	auto sessionPool = sessions.getSessionPool();
  	for (auto session : sessionPool)
 	{
 		if (session->isConnected())
@@ -25,41 +32,95 @@ int serveradd(int a, int b)
 	return a + b;
 }
 
-int main()
+struct Args
 {
-	const static int PORT = 8070;
-
-	// server
-	boost::asio::io_service server_io;
-	msgpack::rpc::TcpServer server(server_io, PORT);
+	int port = 8070;
+	int adminPort = 0;			// operator calls, on loopback only, 0 for none
+	uint32_t busyPollUs = 0;
+	std::string loginSecret;	// shared with the account service, empty disables logins
+	msgpack::rpc::ClusterOptions cluster;
+};
+
+// the first line of path, secrets are kept out of the command line where ps shows them
+bool readSecret(const std::string& path, std::string& secret)
+{
+	std::ifstream in(path);
+	return std::getline(in, secret) && !secret.empty();
+}
 
-	std::shared_ptr<msgpack::rpc::Dispatcher> dispatcher = std::make_shared<msgpack::rpc::Dispatcher>();
-	dispatcher->add_handler("add", &serveradd);
-	dispatcher->add_handler("mul", [](float a, float b)->float { return a*b; });
+// address:port
+bool parseEndpoint(const std::string& value, boost::asio::ip::tcp::endpoint& endpoint)
+{
+	auto colon = value.rfind(':');
+	if (colon == std::string::npos)
+		return false;
+	auto address = boost::asio::ip::address::from_string(value.substr(0, colon));
+	endpoint = boost::asio::ip::tcp::endpoint(address, static_cast<unsigned short>(std::stoi(value.substr(colon + 1))));
+	return true;
+}
 
-	server.setDispatcher(dispatcher);
-	server.start();	
-	std::thread server_thread([&server_io]() { server_io.run(); });
+// --node 1 --port 8071 --cluster-port 9071 --cluster-secret-file cluster.key
+// --peer 2=10.0.0.2:9072 --peer 3=10.0.0.3:9073 runs one node of a cluster,
+// peers given by the address of their cluster port
+bool parseArgs(int argc, char* argv[], Args& args)
+{
+	msgpack::rpc::ClusterOptions& cluster = args.cluster;
+	for (int i = 1; i + 1 < argc; i += 2)
+	{
+		std::string name = argv[i], value = argv[i + 1];
+		if (name == "--port")
+			args.port = std::stoi(value);
+		else if (name == "--admin-port")
+			args.adminPort = std::stoi(value);
+		else if (name == "--busy-poll")
+			args.busyPollUs = static_cast<uint32_t>(std::stoul(value));
+		else if (name == "--login-secret-file")
+		{
+			if (!readSecret(value, args.loginSecret))
+				return false;
+		}
+		else if (name == "--node")
+			cluster.nodeId = static_cast<uint32_t>(std::stoul(value));
+		else if (name == "--cluster-port")
+			cluster.listen = boost::asio::ip::tcp::endpoint(boost::asio::ip::tcp::v4(), static_cast<unsigned short>(std::stoi(value)));
+		else if (name == "--cluster-secret-file")
+		{
+			if (!readSecret(value, cluster.secret))
+				return false;
+		}
+		else if (name == "--peer")
+		{
+			auto eq = value.find('=');
+			if (eq == std::string::npos)
+				return false;
+			uint32_t node = static_cast<uint32_t>(std::stoul(value.substr(0, eq)));
+			if (!parseEndpoint(value.substr(eq + 1), cluster.peers[node]))
+				return false;
+		}
+		else
+			return false;
+	}
+	// a node takes peers only on a port of its own, and only those that know the secret
+	return !cluster.nodeId || (cluster.listen.port() && cluster.listen.port() != args.port && !cluster.secret.empty());
+}
 
-	// client
+void runDemoClient(int port)
+{
 	boost::asio::io_service client_io;
 
 	// avoid stop client_io when client closed
 	boost::asio::io_service::work work(client_io);
 
 	msgpack::rpc::TcpClient client(client_io);
-	client.asyncConnect(boost::asio::ip::tcp::endpoint(boost::asio::ip::address::from_string("127.0.0.1"), PORT));
+	// add has no side effects, so it survives a dropped connection, the client reconnects by itself
+	client.setIdempotent("add");
+	client.asyncConnect(boost::asio::ip::tcp::endpoint(boost::asio::ip::address::from_string("127.0.0.1"), port));
 	boost::thread clinet_thread([&client_io]() { client_io.run(); });
 
 	// sync request
 	int result1;
 	std::cout << "add, 1, 2 = " << client.syncCall(&result1, "add", 1, 2) << std::endl;
 
-	// close
-	client.close();
-
-	// reconnect
-	client.asyncConnect(boost::asio::ip::tcp::endpoint(boost::asio::ip::address::from_string("127.0.0.1"), PORT));
 
 	// request callback
 	auto on_result = [](msgpack::rpc::AsyncCallCtx* result)
@@ -73,10 +134,122 @@ int main()
 	result2->sync();
 
 	// stop asio
+	client.close();
 	client_io.stop();
 	clinet_thread.join();
+}
+
+int main(int argc, char* argv[])
+{
+	Args args;
+	if (!parseArgs(argc, argv, args))
+	{
+		std::cout << "usage: PokerServer [--port port] [--admin-port port] [--login-secret-file path] [--busy-poll us]"
+			" [--node id --cluster-port port --cluster-secret-file path --peer id=address:port ...]" << std::endl;
+		return 1;
+	}
+
+	// nodes may share a directory, each keeps its own files
+	std::string suffix = args.cluster.nodeId ? ".node" + std::to_string(args.cluster.nodeId) : "";
+	poker::LedgerOptions ledgerOptions;
+	ledgerOptions.path = "ledger" + suffix + ".wal";
+	const std::string SNAPSHOT = "tables" + suffix + ".snapshot";
+
+	// cpu bound handlers, declared first so it outlives the io services
+	poker::WorkStealingPool pool;
+	auto history = std::make_shared<poker::HandHistory>(poker::HandHistoryOptions());
+	auto ledger = std::make_shared<poker::Ledger>(ledgerOptions);
+	auto tables = std::make_shared<poker::TableManager>(std::thread::hardware_concurrency(), history, ledger);
+	auto tournaments = std::make_shared<poker::TournamentScheduler>(tables);
+
+	// server
+	boost::asio::io_service server_io;
+	msgpack::rpc::ServerOptions options;
+	options.backlog = 1024;
+	options.keepAlive = true;
+	options.busyPollUs = args.busyPollUs;
+	msgpack::rpc::TcpServer server(server_io, boost::asio::ip::tcp::endpoint(boost::asio::ip::tcp::v4(), args.port), options);
 
-	server_io.stop();
+	std::shared_ptr<msgpack::rpc::Dispatcher> dispatcher = std::make_shared<msgpack::rpc::Dispatcher>();
+	auto sessions = server.getSessions();
+	dispatcher->add_handler("add", [sessions](int a, int b)->int { return serveradd(*sessions, a, b); });
+	dispatcher->add_handler("mul", [](float a, float b)->float { return a*b; });
+	poker::addEvaluatorHandlers(*dispatcher);
+	poker::addEquityHandlers(*dispatcher, std::make_shared<poker::EquityCalculator>(pool));
+	poker::addTableHandlers(*dispatcher, tables);
+	poker::addLobbyHandlers(*dispatcher, tables);
+	poker::addResumeHandlers(*dispatcher, tables);
+	poker::addTournamentHandlers(*dispatcher, tournaments);
+	poker::addLoginHandlers(*dispatcher, args.loginSecret);
+	poker::addWalletHandlers(*dispatcher, tables->getWallets());
+	dispatcher->set_session_rate_limit(200, 100);
+	dispatcher->set_rate_limit("add", 50, 20);
+
+	server.setDispatcher(dispatcher);
+
+	// money moves in and out of wallets, tournaments are set up and tables move between nodes only
+	// from the operator's side, never on the port clients reach
+	auto adminDispatcher = std::make_shared<msgpack::rpc::Dispatcher>();
+	poker::addWalletAdminHandlers(*adminDispatcher, tables->getWallets());
+	poker::addTournamentAdminHandlers(*adminDispatcher, tournaments);
+	std::unique_ptr<msgpack::rpc::TcpServer> admin;
+	if (args.adminPort)
+	{
+		admin.reset(new msgpack::rpc::TcpServer(server_io, boost::asio::ip::tcp::endpoint(
+			boost::asio::ip::address_v4::loopback(), static_cast<unsigned short>(args.adminPort))));
+		admin->setDispatcher(adminDispatcher);
+	}
+
+	std::shared_ptr<msgpack::rpc::Cluster> cluster;
+	if (args.cluster.nodeId)
+	{
+		cluster = std::make_shared<msgpack::rpc::Cluster>(server_io, dispatcher, args.cluster);
+		poker::addClusterRoutes(*cluster);
+		poker::addClusterHandlers(*cluster->getPeerDispatcher(), tables);
+		poker::addClusterAdminHandlers(*adminDispatcher, tables);
+		tables->setCluster(cluster);
+		cluster->start();
+	}
+
+	// warm restart, players keep their seats and reclaim them with their resume token
+	tables->restore(SNAPSHOT);
+	std::remove(SNAPSHOT.c_str());
+
+	msgpack::rpc::AdmissionLimits limits;
+	limits.maxInflightRequests = 64;
+	limits.maxPendingWriteBytes = 4 * 1024 * 1024;
+	limits.maxServerWork = 10000;
+	server.setAdmissionLimits(limits);
+	server.setHeartbeat(30 * 1000, 90 * 1000);
+	server.start();	
+	if (admin)
+		admin->start();
+	std::cout << "serving on port " << args.port << " over " << msgpack::rpc::ioBackendName() << std::endl;
+	// --busy-poll gives the server io thread a core of its own to cut wakeup latency
+	msgpack::rpc::IoLoopOptions loopOptions;
+	loopOptions.busyPoll = args.busyPollUs > 0;
+	std::thread server_thread([&server_io, loopOptions]() { msgpack::rpc::runIoLoop(server_io, loopOptions); });
+
+	if (cluster)
+	{
+		// a node serves until it is told to stop
+		boost::asio::signal_set signals(server_io, SIGINT, SIGTERM);
+		std::promise<void> stopped;
+		signals.async_wait([&stopped](const boost::system::error_code&, int) { stopped.set_value(); });
+		stopped.get_future().wait();
+		cluster->stop();
+	}
+	else
+		runDemoClient(args.port);
+
+	// finish in-flight requests before stopping
+	if (admin)
+		admin->stop();
+	server.drain(std::chrono::seconds(5), [&server_io, tables, SNAPSHOT]()
+	{
+		tables->saveSnapshot(SNAPSHOT);
+		server_io.stop();
+	});
 	server_thread.join();
 	return 0;
 }
\ No newline at end of file
@@ -0,0 +1,308 @@
+#include <boost/test/unit_test.hpp>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <future>
+#include <iostream>
+#include <numeric>
+#include <random>
+#include <thread>
+#include "../Poker/HandEvaluator.h"
+#include "../Poker/EquityCalculator.h"
+#include "../Poker/Ledger.h"
+#include "PackBuffer.h"
+#include "TcpConnection.h"
+#include "IoLoop.h"
+
+using namespace poker;
+
+namespace {
+
+std::vector<HandMask> randomHands(size_t count, int cardsPerHand)
+{
+	std::mt19937_64 rng(42);
+	std::vector<HandMask> hands(count);
+	for (auto& hand : hands)
+	{
+		hand = 0;
+		for (int n = 0; n < cardsPerHand;)
+		{
+			HandMask bit = cardMask(static_cast<Card>(rng() % 52));
+			if (!(hand & bit))
+			{
+				hand |= bit;
+				++n;
+			}
+		}
+	}
+	return hands;
+}
+
+template<typename F>
+double millionsPerSecond(size_t count, int rounds, F f)
+{
+	auto begin = std::chrono::steady_clock::now();
+	for (int i = 0; i < rounds; ++i)
+		f();
+	double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+	return count * rounds / seconds / 1e6;
+}
+
+}
+
+BOOST_AUTO_TEST_CASE(bench_hand_evaluator)
+{
+	const size_t COUNT = 1 << 20;
+	const int ROUNDS = 20;
+	auto hands = randomHands(COUNT, 7);
+	std::vector<HandRank> single(COUNT), batch(COUNT);
+
+	double scalar = millionsPerSecond(COUNT, ROUNDS, [&]()
+	{
+		for (size_t i = 0; i < COUNT; ++i)
+			single[i] = HandEvaluator::evaluate(hands[i]);
+	});
+	double batched = millionsPerSecond(COUNT, ROUNDS, [&]()
+	{
+		HandEvaluator::evaluateBatch(hands.data(), batch.data(), COUNT);
+	});
+
+	BOOST_CHECK(single == batch);
+	std::cout << "7 card eval, one core: " << scalar << " M hands/s, batch " << batched << " M hands/s" << std::endl;
+}
+
+BOOST_AUTO_TEST_CASE(bench_equity_scaling)
+{
+	// AA vs KK preflop, every board, above the default limit of a server
+	std::vector<HandMask> hands = {
+		cardMask(makeCard(12, 0)) | cardMask(makeCard(12, 1)),
+		cardMask(makeCard(11, 2)) | cardMask(makeCard(11, 3)),
+	};
+
+	size_t threads = std::max(1u, std::thread::hardware_concurrency());
+	for (size_t n = 1; n <= threads; n *= 2)
+	{
+		WorkStealingPool pool(n);
+		EquityCalculator calc(pool, 2000000);
+		auto begin = std::chrono::steady_clock::now();
+		EquityResult result = calc.calculate(hands, 0, 0, 0);
+		double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - begin).count();
+
+		BOOST_CHECK(result.exhaustive);
+		BOOST_CHECK_EQUAL(result.samples, 1712304u);
+		BOOST_CHECK(result.equity[0] > 0.81 && result.equity[0] < 0.82);
+		std::cout << "equity AA vs KK, " << n << " threads: " << ms << " ms" << std::endl;
+	}
+}
+
+BOOST_AUTO_TEST_CASE(bench_pack_exact)
+{
+	// an eval_batch sized result and a typical small response
+	std::vector<uint32_t> large(1 << 18);
+	std::iota(large.begin(), large.end(), 0x10000u);
+	std::tuple<uint32_t, std::string, int64_t> small(7, "table_act", 1200);
+
+	for (int run = 0; run < 2; ++run)
+	{
+		const int ROUNDS = run ? 200000 : 200;
+		size_t bytes = 0;
+		double grown = millionsPerSecond(1, ROUNDS, [&]()
+		{
+			auto sbuf = std::make_shared<msgpack::sbuffer>();
+			if (run)
+				msgpack::pack(*sbuf, small);
+			else
+				msgpack::pack(*sbuf, large);
+			bytes = sbuf->size();
+		});
+		double exact = millionsPerSecond(1, ROUNDS, [&]()
+		{
+			auto sbuf = run ? msgpack::rpc::packExact(small) : msgpack::rpc::packExact(large);
+			BOOST_CHECK_EQUAL(sbuf->size(), bytes);
+		});
+		std::cout << "pack " << bytes << " bytes: " << grown * 1e6 << " msg/s regrown, "
+			<< exact * 1e6 << " msg/s exact and pooled" << std::endl;
+	}
+}
+
+BOOST_AUTO_TEST_CASE(bench_ledger_group_commit)
+{
+	// each writer waits for its entry to be durable before the next, like a handler does
+	const size_t WRITERS = 32;
+	const auto RUN = std::chrono::seconds(1);
+	const uint32_t windows[] = { 0, 100, 500, 2000, 10000 };
+
+	for (uint32_t windowUs : windows)
+	{
+		LedgerOptions options;
+		options.path = "bench-ledger.wal";
+		options.commitWindowUs = windowUs;
+		std::remove(options.path.c_str());
+
+		std::atomic<uint64_t> durable(0);
+		std::atomic<uint64_t> latencyUs(0);
+		{
+			Ledger ledger(options);
+			auto end = std::chrono::steady_clock::now() + RUN;
+			std::vector<std::thread> writers;
+			for (size_t w = 0; w < WRITERS; ++w)
+			{
+				writers.emplace_back([&, w]()
+				{
+					LedgerEntry entry;
+					entry.kind = ledger_deposit;
+					entry.account = "player" + std::to_string(w);
+					entry.amount = 100;
+					while (std::chrono::steady_clock::now() < end)
+					{
+						std::promise<void> done;
+						auto begin = std::chrono::steady_clock::now();
+						ledger.append(entry, [&done](bool) { done.set_value(); });
+						done.get_future().wait();
+						latencyUs += std::chrono::duration_cast<std::chrono::microseconds>(
+							std::chrono::steady_clock::now() - begin).count();
+						++durable;
+					}
+				});
+			}
+			for (auto& writer : writers)
+				writer.join();
+
+			LedgerStats stats = ledger.getStats();
+			BOOST_CHECK_EQUAL(stats.failures, 0u);
+			std::cout << "ledger, window " << windowUs << " us: " << durable / std::chrono::duration<double>(RUN).count()
+				<< " entries/s, " << double(stats.entries) / std::max<uint64_t>(stats.commits, 1) << " per fsync, "
+				<< latencyUs / std::max<uint64_t>(durable, 1) << " us to durable" << std::endl;
+		}
+		std::remove(options.path.c_str());
+	}
+}
+
+BOOST_AUTO_TEST_CASE(bench_sync_wait_strategies)
+{
+	// the io thread sets the reply as a read of it would, the caller waits in sync()
+	const int CALLS = 20000;
+	const std::pair<const char*, msgpack::rpc::WaitStrategy> strategies[] = {
+		{ "park", msgpack::rpc::WaitStrategy::park() },
+		{ "spin 20 us", msgpack::rpc::WaitStrategy::spinThenPark(20) },
+		{ "spin 50 us", msgpack::rpc::WaitStrategy::spinThenPark(50) },
+		{ "spin 20 us, yield 200 us", msgpack::rpc::WaitStrategy::spinThenPark(20, 200) },
+	};
+
+	boost::asio::io_service ios;
+	boost::asio::io_service::work work(ios);
+	std::thread io([&ios]() { ios.run(); });
+
+	for (auto& strategy : strategies)
+	{
+		std::vector<double> us;
+		us.reserve(CALLS);
+		for (int i = 0; i < CALLS; ++i)
+		{
+			auto call = std::make_shared<msgpack::rpc::AsyncCallCtx>("bench", nullptr);
+			auto begin = std::chrono::steady_clock::now();
+			ios.post([call]() { call->setResult(msgpack::object(1)); });
+			call->sync(strategy.second);
+			us.push_back(std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - begin).count());
+			BOOST_CHECK(!call->isError());
+		}
+		std::sort(us.begin(), us.end());
+		std::cout << "sync, " << strategy.first << ": " << us[CALLS / 2] << " us median, "
+			<< us[CALLS * 99 / 100] << " us p99" << std::endl;
+	}
+
+	ios.stop();
+	io.join();
+}
+
+BOOST_AUTO_TEST_CASE(bench_transport_syscalls)
+{
+	// notifies in bursts from one connection to another over loopback, run it on
+	// a build with and one without BOOST_ASIO_HAS_IO_URING to compare backends
+	const int MESSAGES = 200000;
+	const int BURST = 64;
+	using boost::asio::ip::tcp;
+
+	boost::asio::io_service ios;
+	tcp::acceptor acceptor(ios, tcp::endpoint(boost::asio::ip::address_v4::loopback(), 0));
+	tcp::socket accepted(ios);
+	auto sender = std::make_shared<msgpack::rpc::TcpConnection>(ios);
+	sender->asyncConnect(acceptor.local_endpoint());
+	acceptor.accept(accepted);
+
+	std::atomic<int> received(0);
+	std::promise<void> done;
+	auto receiver = std::make_shared<msgpack::rpc::TcpConnection>(ios, std::move(accepted));
+	receiver->setMsgHandler([&](const msgpack::object&, std::shared_ptr<msgpack::rpc::TcpConnection>)
+	{
+		if (++received == MESSAGES)
+			done.set_value();
+	});
+	receiver->startRead();
+
+	std::string payload(100, 'x');
+	auto begin = std::chrono::steady_clock::now();
+	std::thread io([&ios]() { ios.run(); });
+	for (int sent = 0; sent < MESSAGES; sent += BURST)
+	{
+		ios.post([&, sent]()
+		{
+			for (int i = sent; i < std::min(sent + BURST, MESSAGES); ++i)
+			{
+				msgpack::rpc::MsgNotify<std::string, std::tuple<int, std::string>> notify("bench", std::make_tuple(i, payload));
+				sender->asyncWrite(msgpack::rpc::packExact(notify));
+			}
+		});
+	}
+	done.get_future().wait();
+	double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+
+	auto in = receiver->getIoStats();
+	auto out = sender->getIoStats();
+	std::cout << "transport over " << msgpack::rpc::ioBackendName() << ": " << MESSAGES / seconds / 1e3 << "k msg/s, "
+		<< 1000.0 * in.reads / MESSAGES << " reads and " << 1000.0 * out.writes / MESSAGES << " writes per 1000 messages, "
+		<< double(in.bytesRead) / std::max<uint64_t>(in.reads, 1) << " bytes per read" << std::endl;
+
+	ios.stop();
+	io.join();
+}
+
+BOOST_AUTO_TEST_CASE(bench_io_loop_wakeup)
+{
+	// time from a post on another thread to its handler running, with the io
+	// thread idle in between as it is between the moves of a table
+	const int POSTS = 5000;
+	const auto GAP = std::chrono::microseconds(100);
+	const std::pair<const char*, bool> modes[] = { { "run()", false }, { "busy poll", true } };
+
+	for (auto& mode : modes)
+	{
+		boost::asio::io_service ios;
+		std::unique_ptr<boost::asio::io_service::work> work(new boost::asio::io_service::work(ios));
+		msgpack::rpc::IoLoopOptions options;
+		options.busyPoll = mode.second;
+		msgpack::rpc::IoLoopStats stats;
+		std::thread io([&]() { stats = msgpack::rpc::runIoLoop(ios, options); });
+
+		std::vector<double> us(POSTS);
+		for (int i = 0; i < POSTS; ++i)
+		{
+			std::promise<void> ran;
+			auto posted = std::chrono::steady_clock::now();
+			ios.post([&, i, posted]()
+			{
+				us[i] = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - posted).count();
+				ran.set_value();
+			});
+			ran.get_future().wait();
+			std::this_thread::sleep_for(GAP);
+		}
+		work.reset();
+		io.join();
+
+		std::sort(us.begin(), us.end());
+		std::cout << "wakeup, " << mode.first << ": " << us[POSTS / 2] << " us median, "
+			<< us[POSTS * 99 / 100] << " us p99, " << stats.parks << " parks" << std::endl;
+	}
+}
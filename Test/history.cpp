@@ -0,0 +1,189 @@
+#include <boost/test/unit_test.hpp>
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <thread>
+#include "../Poker/HandHistory.h"
+
+using namespace poker;
+
+namespace {
+
+HandAction actionOf(int seat, int action, int64_t amount)
+{
+	HandAction entry;
+	entry.seat = seat;
+	entry.street = 1;
+	entry.action = action;
+	entry.amount = amount;
+	return entry;
+}
+
+/// a hand of table at two seats, what tells hands apart is in handId and tableId
+HandRecord handOf(uint64_t handId, uint32_t tableId)
+{
+	HandRecord hand;
+	hand.handId = handId;
+	hand.tableId = tableId;
+	hand.button = 0;
+	hand.smallBlind = 1;
+	hand.bigBlind = 2;
+	hand.players = { "alice", "bob" };
+	hand.stacks = { 100, 100 };
+	hand.holes = { { 0, 1 }, { 2, 3 } };
+	hand.actions = { actionOf(0, 4, 1), actionOf(1, 4, 2), actionOf(0, 0, 0) };
+	hand.results = { -1, 1 };
+	hand.deckSeed = std::string(64, '0');
+	return hand;
+}
+
+/// until history wrote count hands or about five seconds passed
+bool waitWritten(HandHistory& history, uint64_t count)
+{
+	for (int i = 0; i < 500 && history.getWritten() < count; ++i)
+		std::this_thread::sleep_for(std::chrono::milliseconds(10));
+	return history.getWritten() == count;
+}
+
+void removeSegments(const std::string& directory)
+{
+	for (uint32_t index = 1; segment::exists(directory, index); ++index)
+		std::remove(segment::path(directory, index).c_str());
+}
+
+/// every hand 1..last is found and reads back as written for table id * 10
+void checkHands(HandHistory& history, uint64_t last)
+{
+	for (uint64_t id = 1; id <= last; ++id)
+	{
+		HandHistory::Location location;
+		HandRecord hand;
+		BOOST_CHECK(history.find(id, location));
+		BOOST_REQUIRE(history.read(id, hand));
+		BOOST_CHECK_EQUAL(hand.handId, id);
+		BOOST_CHECK_EQUAL(hand.tableId, id * 10);
+		BOOST_CHECK(hand.players == std::vector<std::string>({ "alice", "bob" }));
+		BOOST_CHECK_EQUAL(hand.actions.size(), 3u);
+	}
+}
+
+}
+
+BOOST_AUTO_TEST_CASE(history_torn_tail_replay)
+{
+	HandHistoryOptions options;
+	options.segmentSize = 64 * 1024;
+	removeSegments(options.directory);
+
+	HandHistory::Location last;
+	{
+		HandHistory history(options);
+		BOOST_CHECK_EQUAL(history.nextHandId(), 1u);
+		for (uint64_t id = 2; id <= 5; ++id)
+			BOOST_CHECK_EQUAL(history.nextHandId(), id);
+		for (uint32_t id = 1; id <= 5; ++id)
+			history.append(handOf(id, id * 10));
+		BOOST_REQUIRE(waitWritten(history, 5));
+		checkHands(history, 5);
+		BOOST_REQUIRE(history.find(5, last));
+	}
+
+	// hand ids go on after the highest one on disk
+	{
+		HandHistory history(options);
+		checkHands(history, 5);
+		BOOST_CHECK_EQUAL(history.nextHandId(), 6u);
+	}
+
+	// a crash mid write: the last record is there but its bytes are not all right
+	{
+		std::fstream file(segment::path(options.directory, last.segment), std::ios::binary | std::ios::in | std::ios::out);
+		file.seekp(static_cast<std::streamoff>(last.offset + segment::FRAME_SIZE + 1));
+		file.put('\x7f');
+	}
+	{
+		HandHistory history(options);
+		checkHands(history, 4);
+		HandHistory::Location location;
+		HandRecord hand;
+		BOOST_CHECK(!history.find(5, location));
+		BOOST_CHECK(!history.read(5, hand));
+		BOOST_CHECK_EQUAL(history.nextHandId(), 5u);
+
+		// the next hand goes where the torn one was, not behind it
+		history.append(handOf(5, 50));
+		BOOST_REQUIRE(waitWritten(history, 1));
+		BOOST_REQUIRE(history.find(5, location));
+		BOOST_CHECK_EQUAL(location.segment, last.segment);
+		BOOST_CHECK_EQUAL(location.offset, last.offset);
+	}
+	{
+		HandHistory history(options);
+		checkHands(history, 5);
+		BOOST_CHECK_EQUAL(history.nextHandId(), 6u);
+	}
+	removeSegments(options.directory);
+}
+
+BOOST_AUTO_TEST_CASE(history_rotates_segments)
+{
+	HandHistoryOptions options;
+	options.segmentSize = 1024;
+	removeSegments(options.directory);
+	HandHistoryOptions tiny = options;
+	tiny.segmentSize = segment::HEADER_SIZE + segment::FRAME_SIZE;
+	BOOST_CHECK_THROW(HandHistory history(tiny), std::invalid_argument);
+
+	{
+		HandHistory history(options);
+		for (uint32_t id = 1; id <= 40; ++id)
+			history.append(handOf(id, id * 10));
+		BOOST_REQUIRE(waitWritten(history, 40));
+		checkHands(history, 40);
+
+		// each segment holds the hands after the previous one's
+		HandHistory::Location previous{ 1, 0 };
+		for (uint64_t id = 1; id <= 40; ++id)
+		{
+			HandHistory::Location location;
+			BOOST_REQUIRE(history.find(id, location));
+			BOOST_CHECK(location.segment == previous.segment ? location.offset > previous.offset : location.segment == previous.segment + 1);
+			BOOST_CHECK(location.offset + segment::FRAME_SIZE < options.segmentSize);
+			previous = location;
+		}
+		BOOST_CHECK(previous.segment >= 3);
+		BOOST_CHECK(segment::exists(options.directory, previous.segment));
+		BOOST_CHECK(!segment::exists(options.directory, previous.segment + 1));
+
+		// a hand that fits no segment is lost, the ones after it are not
+		HandRecord huge = handOf(41, 410);
+		huge.deckSeed = std::string(options.segmentSize, 'f');
+		history.append(huge);
+		history.append(handOf(42, 420));
+		BOOST_REQUIRE(waitWritten(history, 41));
+		HandHistory::Location location;
+		BOOST_CHECK(!history.find(41, location));
+		BOOST_CHECK(history.find(42, location));
+	}
+
+	// a restart finds every segment and writes on in the last one
+	{
+		HandHistory history(options);
+		checkHands(history, 40);
+		BOOST_CHECK_EQUAL(history.nextHandId(), 43u);
+		history.append(handOf(43, 430));
+		BOOST_REQUIRE(waitWritten(history, 1));
+		HandHistory::Location location;
+		BOOST_REQUIRE(history.find(43, location));
+		BOOST_CHECK(segment::exists(options.directory, location.segment));
+		BOOST_CHECK(!segment::exists(options.directory, location.segment + 1));
+	}
+	{
+		HandHistory history(options);
+		HandRecord hand;
+		BOOST_REQUIRE(history.read(43, hand));
+		BOOST_CHECK_EQUAL(hand.tableId, 430u);
+		BOOST_CHECK_EQUAL(history.nextHandId(), 44u);
+	}
+	removeSegments(options.directory);
+}
@@ -0,0 +1,356 @@
+#include <boost/test/unit_test.hpp>
+#include <cstdio>
+#include <fstream>
+#include <future>
+#include <thread>
+#include "../Poker/Ledger.h"
+#include "../Poker/TableManager.h"
+#include "../Poker/PokerHandlers.h"
+#include "../Poker/Login.h"
+#include "Asio.h"
+#include "Cluster.h"
+#include "TcpServer.h"
+#include "TcpClient.h"
+
+using namespace poker;
+using msgpack::rpc::ServerSideError;
+
+namespace {
+
+/// append and wait until it is on disk
+bool appendDurably(Ledger& ledger, LedgerKind kind, const std::string& account, int64_t amount)
+{
+	LedgerEntry entry;
+	entry.kind = kind;
+	entry.account = account;
+	entry.amount = amount;
+	std::promise<bool> durable;
+	ledger.append(entry, [&durable](bool ok) { durable.set_value(ok); });
+	return durable.get_future().get();
+}
+
+size_t fileSize(const std::string& path)
+{
+	std::ifstream in(path, std::ios::binary | std::ios::ate);
+	return static_cast<size_t>(in.tellg());
+}
+
+/// what a wallet move ended with
+ServerSideError moveWallet(Wallets& wallets, LedgerKind kind, const std::string& account, int64_t amount)
+{
+	LedgerEntry entry;
+	entry.kind = kind;
+	entry.account = account;
+	entry.amount = amount;
+	std::promise<ServerSideError> done;
+	wallets.move(entry, [&done](ServerSideError error) { done.set_value(error); });
+	return done.get_future().get();
+}
+
+/// run fn on the strand of table, it returns a seat, and wait until its buy in or cash out settled
+template<typename F>
+ServerSideError settle(Table& table, F fn)
+{
+	std::promise<ServerSideError> done;
+	table.post([&done, fn](Table& table)
+	{
+		try
+		{
+			table.whenSettled(fn(table), [&done](Table&, ServerSideError error) { done.set_value(error); });
+		}
+		catch (msgpack::rpc::msgerror&)
+		{
+			done.set_value(msgpack::rpc::error_illegal_action);
+		}
+	});
+	return done.get_future().get();
+}
+
+/// the state of table, read on its strand
+TableState stateOf(Table& table)
+{
+	std::promise<TableState> state;
+	table.post([&state](Table& table) { state.set_value(table.getState()); });
+	return state.get_future().get();
+}
+
+/// until done() or about five seconds passed
+template<typename Done>
+bool waitFor(Done done)
+{
+	for (int i = 0; i < 500 && !done(); ++i)
+		std::this_thread::sleep_for(std::chrono::milliseconds(10));
+	return done();
+}
+
+const char* const LOGIN_SECRET = "login secret";
+
+/// two nodes of a cluster on one io thread, each with a ledger of its own
+/// and the handlers a node serves clients and peers with
+struct TwoNodes
+{
+	static const size_t NODES = 2;
+
+	boost::asio::io_service ios;
+	std::unique_ptr<boost::asio::io_service::work> work;
+	std::string paths[NODES];
+	std::vector<std::shared_ptr<TableManager>> tables;
+	std::vector<std::shared_ptr<msgpack::rpc::Dispatcher>> dispatchers;
+	std::vector<std::shared_ptr<msgpack::rpc::Cluster>> nodes;
+	std::thread io;
+
+	TwoNodes();
+	~TwoNodes();
+
+	/// stop the nodes and the io thread, for servers and clients of the test to go after
+	void stop();
+
+	/// an account whose wallet the placement ring puts on node
+	std::string accountOn(uint32_t node) const;
+};
+
+TwoNodes::TwoNodes():
+	work(new boost::asio::io_service::work(ios))
+{
+	msgpack::rpc::ClusterOptions options[NODES];
+	for (size_t i = 0; i < NODES; ++i)
+	{
+		boost::asio::ip::tcp::acceptor free(ios, boost::asio::ip::tcp::endpoint(boost::asio::ip::address_v4::loopback(), 0));
+		options[i].nodeId = static_cast<uint32_t>(i + 1);
+		options[i].listen = free.local_endpoint();
+		options[i].secret = "secret";
+		options[i].reconnect.initialDelayMs = 10;
+		options[i].reconnect.maxDelayMs = 50;
+	}
+	for (size_t i = 0; i < NODES; ++i)
+	{
+		options[i].peers[options[1 - i].nodeId] = options[1 - i].listen;
+		LedgerOptions ledgerOptions;
+		ledgerOptions.path = paths[i] = "test-wallets-" + std::to_string(i + 1) + ".wal";
+		std::remove(ledgerOptions.path.c_str());
+		tables.push_back(std::make_shared<TableManager>(1, nullptr, std::make_shared<Ledger>(ledgerOptions)));
+
+		dispatchers.push_back(std::make_shared<msgpack::rpc::Dispatcher>());
+		addTableHandlers(*dispatchers.back(), tables.back());
+		addLoginHandlers(*dispatchers.back(), LOGIN_SECRET);
+		addWalletHandlers(*dispatchers.back(), tables.back()->getWallets());
+
+		nodes.push_back(std::make_shared<msgpack::rpc::Cluster>(ios, dispatchers.back(), options[i]));
+		addClusterRoutes(*nodes.back());
+		addClusterHandlers(*nodes.back()->getPeerDispatcher(), tables.back());
+		tables.back()->setCluster(nodes.back());
+		nodes.back()->start();
+	}
+	io = std::thread([this]() { ios.run(); });
+}
+
+TwoNodes::~TwoNodes()
+{
+	stop();
+	nodes.clear();
+	dispatchers.clear();
+	tables.clear();
+	for (size_t i = 0; i < NODES; ++i)
+		std::remove(paths[i].c_str());
+}
+
+void TwoNodes::stop()
+{
+	if (!io.joinable())
+		return;
+	for (auto& node : nodes)
+		node->stop();
+	work.reset();
+	ios.stop();
+	io.join();
+}
+
+std::string TwoNodes::accountOn(uint32_t node) const
+{
+	for (int i = 0;; ++i)
+	{
+		std::string account = "p" + std::to_string(i);
+		if (nodes[0]->placement(Wallets::walletKey(account)) == node)
+			return account;
+	}
+}
+
+}
+
+BOOST_AUTO_TEST_CASE(ledger_torn_tail_replay)
+{
+	LedgerOptions options;
+	options.path = "test-ledger.wal";
+	std::remove(options.path.c_str());
+
+	size_t durableSize;
+	{
+		Ledger ledger(options);
+		BOOST_CHECK(appendDurably(ledger, ledger_deposit, "alice", 100));
+		BOOST_CHECK(appendDurably(ledger, ledger_withdraw, "alice", -30));
+		BOOST_CHECK_THROW(appendDurably(ledger, ledger_withdraw, "alice", -500), msgpack::rpc::msgerror);
+		BOOST_CHECK_EQUAL(ledger.getBalance("alice"), 70);
+		durableSize = fileSize(options.path);
+	}
+
+	// a crash mid write: a frame header promising more than made it to disk
+	{
+		std::ofstream out(options.path, std::ios::binary | std::ios::app);
+		const char torn[] = { 40, 0, 0, 0, 1, 2, 3, 4, (char)0x96, 0 };
+		out.write(torn, sizeof(torn));
+	}
+	{
+		Ledger ledger(options);
+		BOOST_CHECK_EQUAL(ledger.getBalance("alice"), 70);
+		BOOST_CHECK_EQUAL(fileSize(options.path), durableSize);
+
+		// appends go where the torn frame was, not behind it
+		BOOST_CHECK(appendDurably(ledger, ledger_deposit, "alice", 5));
+		BOOST_CHECK(appendDurably(ledger, ledger_deposit, "bob", 20));
+		durableSize = fileSize(options.path);
+	}
+	{
+		Ledger ledger(options);
+		BOOST_CHECK_EQUAL(ledger.getBalance("alice"), 75);
+		BOOST_CHECK_EQUAL(ledger.getBalance("bob"), 20);
+		BOOST_CHECK(!ledger.getStats().readOnly);
+	}
+
+	// a complete frame whose body was not all written fails its crc and goes too
+	{
+		std::fstream file(options.path, std::ios::binary | std::ios::in | std::ios::out);
+		file.seekp(static_cast<std::streamoff>(durableSize - 1));
+		file.put('\x7f');
+	}
+	{
+		Ledger ledger(options);
+		BOOST_CHECK_EQUAL(ledger.getBalance("alice"), 75);
+		BOOST_CHECK_EQUAL(ledger.getBalance("bob"), 0);
+		BOOST_CHECK(fileSize(options.path) < durableSize);
+		BOOST_CHECK(appendDurably(ledger, ledger_deposit, "bob", 1));
+	}
+	{
+		Ledger ledger(options);
+		BOOST_CHECK_EQUAL(ledger.getBalance("bob"), 1);
+	}
+	std::remove(options.path.c_str());
+}
+
+BOOST_AUTO_TEST_CASE(ledger_wallets_across_nodes)
+{
+	TwoNodes cluster;
+	auto& tables = cluster.tables;
+	auto& nodes = cluster.nodes;
+	BOOST_REQUIRE(waitFor([&nodes]() { return nodes[0]->getStats().linksUp == 1 && nodes[1]->getStats().linksUp == 1; }));
+
+	// a player whose wallet is on node 2, the same on both nodes
+	std::string player = cluster.accountOn(2);
+	auto wallets = tables[0]->getWallets();
+	BOOST_CHECK_EQUAL(wallets->nodeOf(player), 2u);
+	BOOST_CHECK_EQUAL(tables[1]->getWallets()->nodeOf(player), 0u);
+	auto home = tables[1]->getLedger();
+
+	// a deposit made on node 1 lands in the ledger of node 2
+	BOOST_CHECK_EQUAL(moveWallet(*wallets, ledger_deposit, player, 1000), msgpack::rpc::success);
+	BOOST_CHECK_EQUAL(home->getBalance(player), 1000);
+	BOOST_CHECK_EQUAL(tables[0]->getLedger()->getBalance(player), 0);
+
+	// more than the wallet holds is refused there, a table of node 1 buys the player in from there
+	TableConfig config;
+	config.seats = 6;
+	auto table = tables[0]->create(config);
+	auto ios = &cluster.ios;
+	auto connection = std::make_shared<msgpack::rpc::TcpConnection>(*ios);
+	auto broke = std::make_shared<msgpack::rpc::TcpConnection>(*ios);
+	BOOST_CHECK_EQUAL(settle(*table, [broke, player](Table& table) { return table.join(broke, 1, player, 5000); }),
+		msgpack::rpc::error_illegal_action);
+	BOOST_CHECK_EQUAL(settle(*table, [connection, player](Table& table) { return table.join(connection, 0, player, 100); }),
+		msgpack::rpc::success);
+	BOOST_CHECK_EQUAL(home->getBalance(player), 900);
+	TableState state = stateOf(*table);
+	BOOST_CHECK_EQUAL(state.seats[0].stack, 100);
+	BOOST_CHECK(state.seats[1].player.empty());
+
+	// the table moves to node 2 with the seat, the wallet stays where it is
+	std::promise<std::string> migrated;
+	tables[0]->migrate(table->getId(), 2, 2000, [&migrated](const std::string& error) { migrated.set_value(error); });
+	BOOST_CHECK_EQUAL(migrated.get_future().get(), "");
+	auto moved = tables[1]->find(table->getId());
+	BOOST_REQUIRE(moved);
+	BOOST_CHECK(!tables[0]->find(table->getId()));
+
+	// the player comes back to the seat there and cashes out
+	auto back = std::make_shared<msgpack::rpc::TcpConnection>(*ios);
+	std::promise<bool> resumed;
+	moved->post([&resumed, back, player](Table& table) { resumed.set_value(table.resume(0, player, back)); });
+	BOOST_CHECK(resumed.get_future().get());
+	BOOST_CHECK_EQUAL(settle(*moved, [back](Table& table) { return table.leave(back); }), msgpack::rpc::success);
+	BOOST_CHECK_EQUAL(home->getBalance(player), 1000);
+	BOOST_CHECK(stateOf(*moved).seats[0].player.empty());
+	BOOST_CHECK_EQUAL(tables[0]->getLedger()->getBalance(player), 0);
+}
+
+BOOST_AUTO_TEST_CASE(ledger_join_from_another_node)
+{
+	TwoNodes cluster;
+	auto& tables = cluster.tables;
+	auto& nodes = cluster.nodes;
+	BOOST_REQUIRE(waitFor([&nodes]() { return nodes[0]->getStats().linksUp == 1 && nodes[1]->getStats().linksUp == 1; }));
+
+	// the table runs on node 2, the player's wallet is on node 1
+	std::string player = cluster.accountOn(1);
+	BOOST_CHECK(appendDurably(*tables[0]->getLedger(), ledger_deposit, player, 1000));
+	TableConfig config;
+	config.seats = 6;
+	uint32_t tableId = tables[1]->create(config)->getId();
+	std::string key = TableManager::clusterKey(tableId);
+	BOOST_REQUIRE(waitFor([&nodes, &key]() { return nodes[0]->ownerOf(key) == 2; }));
+
+	// a client of node 1 logs in there and joins, node 2 runs the join and buys in from node 1
+	boost::asio::ip::tcp::acceptor free(cluster.ios, boost::asio::ip::tcp::endpoint(boost::asio::ip::address_v4::loopback(), 0));
+	boost::asio::ip::tcp::endpoint endpoint = free.local_endpoint();
+	free.close();
+	msgpack::rpc::TcpServer server(cluster.ios, endpoint);
+	server.setDispatcher(cluster.dispatchers[0]);
+	server.start();
+	msgpack::rpc::TcpClient client(cluster.ios);
+	client.asyncConnect(endpoint);
+
+	uint64_t nowMs = std::chrono::duration_cast<std::chrono::milliseconds>(
+		std::chrono::system_clock::now().time_since_epoch()).count();
+	auto login = client.asyncCall("session_login", makeLoginToken(LOGIN_SECRET, player, nowMs + 60 * 1000));
+	login->sync();
+	BOOST_REQUIRE(!login->isError());
+
+	auto join = client.asyncCall("table_join", tableId, 0, static_cast<int64_t>(100));
+	join->sync();
+	BOOST_REQUIRE(!join->isError());
+	TableState state;
+	join->convert(&state);
+	BOOST_CHECK_EQUAL(state.seats[0].player, player);
+	BOOST_CHECK_EQUAL(state.seats[0].stack, 100);
+	BOOST_CHECK_EQUAL(tables[0]->getLedger()->getBalance(player), 900);
+	BOOST_CHECK_EQUAL(tables[1]->getLedger()->getBalance(player), 0);
+	BOOST_CHECK(nodes[0]->getStats().forwardedCalls >= 1);
+
+	// more than is left in the wallet is refused with why
+	msgpack::rpc::TcpClient other(cluster.ios);
+	other.asyncConnect(endpoint);
+	login = other.asyncCall("session_login", makeLoginToken(LOGIN_SECRET, player, nowMs + 60 * 1000));
+	login->sync();
+	auto broke = other.asyncCall("table_join", tableId, 1, static_cast<int64_t>(5000));
+	broke->sync();
+	BOOST_CHECK(broke->isError());
+	BOOST_CHECK_EQUAL(broke->getErrorCode(), msgpack::rpc::error_illegal_action);
+
+	// leaving puts the chips back in the wallet on node 1
+	auto leave = client.asyncCall("table_leave", tableId);
+	leave->sync();
+	BOOST_CHECK(!leave->isError());
+	BOOST_CHECK_EQUAL(tables[0]->getLedger()->getBalance(player), 1000);
+
+	client.close();
+	other.close();
+	server.stop();
+	cluster.stop();
+}
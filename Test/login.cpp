@@ -0,0 +1,43 @@
+#include <boost/test/unit_test.hpp>
+#include "Hmac.h"
+#include "Asio.h"
+#include "../Poker/Login.h"
+
+using namespace poker;
+using msgpack::rpc::msgerror;
+
+BOOST_AUTO_TEST_CASE(hmac_sha256_vectors)
+{
+	// RFC 4231, test cases 1, 2 and 6
+	BOOST_CHECK_EQUAL(msgpack::rpc::hmacSha256(std::string(20, '\x0b'), "Hi There"),
+		"b0344c61d8db38535ca8afceaf0bf12b881dc200c9833da726e9376c2e32cff7");
+	BOOST_CHECK_EQUAL(msgpack::rpc::hmacSha256("Jefe", "what do ya want for nothing?"),
+		"5bdcc146bf60754e6a042426089575c75a003f089d2739839dec58b964ec3843");
+	BOOST_CHECK_EQUAL(msgpack::rpc::hmacSha256(std::string(131, '\xaa'), "Test Using Larger Than Block-Size Key - Hash Key First"),
+		"60e431591ee0b67f0d8a26aacbf5b77f8e0bc6213728c5140546040f0ee37f54");
+
+	BOOST_CHECK(msgpack::rpc::macEquals("abc", "abc"));
+	BOOST_CHECK(!msgpack::rpc::macEquals("abc", "abd"));
+	BOOST_CHECK(!msgpack::rpc::macEquals("abc", "ab"));
+}
+
+BOOST_AUTO_TEST_CASE(login_token_checks)
+{
+	const std::string SECRET = "shared with the account service";
+	std::string token = makeLoginToken(SECRET, "alice", 2000);
+	BOOST_CHECK_EQUAL(checkLoginToken(SECRET, token, 1999), "alice");
+	BOOST_CHECK_EQUAL(checkLoginToken(SECRET, makeLoginToken(SECRET, "team:alice", 2000), 0), "team:alice");
+
+	// expired, another secret, a changed account or expiry, garbage
+	BOOST_CHECK_THROW(checkLoginToken(SECRET, token, 2000), msgerror);
+	BOOST_CHECK_THROW(checkLoginToken("another secret", token, 0), msgerror);
+	BOOST_CHECK_THROW(checkLoginToken("", token, 0), msgerror);
+	std::string forged = token;
+	forged.replace(0, 5, "mallo");
+	BOOST_CHECK_THROW(checkLoginToken(SECRET, forged, 0), msgerror);
+	forged = token;
+	forged.replace(6, 4, "9999");
+	BOOST_CHECK_THROW(checkLoginToken(SECRET, forged, 0), msgerror);
+	for (const char* garbage : { "", ":", "::", "alice", "alice:2000", ":2000:00", "alice::00" })
+		BOOST_CHECK_THROW(checkLoginToken(SECRET, garbage, 0), msgerror);
+}
@@ -0,0 +1,766 @@
+#include <boost/test/unit_test.hpp>
+#include <future>
+#include <map>
+#include <thread>
+#include "TcpSession.h"
+#include "TcpClient.h"
+#include "HashRing.h"
+#include "Property.h"
+#include "ParamView.h"
+#include "RateLimit.h"
+#include "Cluster.h"
+#include "TcpServer.h"
+#include "SessionManager.h"
+
+using namespace msgpack::rpc;
+using boost::asio::ip::tcp;
+
+namespace {
+
+/// the next request the client sent on socket, its objects live in unpacked
+MsgRequest<std::string, msgpack::object> readRequest(tcp::socket& socket, msgpack::unpacker& unpacker,
+	msgpack::unpacked& unpacked)
+{
+	while (!unpacker.next(&unpacked))
+	{
+		unpacker.reserve_buffer(4096);
+		size_t read = socket.read_some(boost::asio::buffer(unpacker.buffer(), unpacker.buffer_capacity()));
+		unpacker.buffer_consumed(read);
+	}
+	MsgRequest<std::string, msgpack::object> request;
+	unpacked.get().convert(&request);
+	return request;
+}
+
+/// the next response on socket, its objects live in unpacked. notifies a server
+/// sends in between, such as session_token, are skipped.
+MsgResponse<msgpack::object, msgpack::object> readResponse(tcp::socket& socket, msgpack::unpacker& unpacker,
+	msgpack::unpacked& unpacked)
+{
+	MsgRpc rpc;
+	do
+	{
+		while (!unpacker.next(&unpacked))
+		{
+			unpacker.reserve_buffer(4096);
+			size_t read = socket.read_some(boost::asio::buffer(unpacker.buffer(), unpacker.buffer_capacity()));
+			unpacker.buffer_consumed(read);
+		}
+		unpacked.get().convert(&rpc);
+	} while (rpc.is_notify());
+	MsgResponse<msgpack::object, msgpack::object> response;
+	unpacked.get().convert(&response);
+	return response;
+}
+
+/// success, or the code of the error response carries
+int errorCodeOf(const MsgResponse<msgpack::object, msgpack::object>& response)
+{
+	if (response.error.type == msgpack::type::NIL || (response.error.type == msgpack::type::BOOLEAN && !response.error.via.boolean))
+		return success;
+	std::tuple<int, std::string> error;
+	response.result.convert(&error);
+	return std::get<0>(error);
+}
+
+/// send a request on socket as a client would
+template<typename... TArgs>
+void writeRequest(tcp::socket& socket, uint32_t msgid, const std::string& method, TArgs... args)
+{
+	MsgRequest<std::string, std::tuple<TArgs...>> request(method, std::tuple<TArgs...>(args...), msgid);
+	auto sbuf = packExact(request);
+	boost::asio::write(socket, boost::asio::buffer(sbuf->data(), sbuf->size()));
+}
+
+/// hand disp a request as if it had come in on connection
+template<typename... TArgs>
+void dispatchRequest(Dispatcher& disp, std::shared_ptr<TcpConnection> connection, const std::string& method, TArgs... args)
+{
+	MsgRequest<std::string, std::tuple<TArgs...>> request(method, std::tuple<TArgs...>(args...), 1);
+	auto sbuf = packExact(request);
+	msgpack::unpacked unpacked;
+	msgpack::unpack(unpacked, sbuf->data(), sbuf->size());
+	disp.dispatch(unpacked.get(), connection);
+}
+
+/// the values of the next properties_changed notify on socket
+std::map<std::string, int64_t> readChanges(tcp::socket& socket, msgpack::unpacker& unpacker)
+{
+	msgpack::unpacked unpacked;
+	while (!unpacker.next(&unpacked))
+	{
+		unpacker.reserve_buffer(4096);
+		size_t read = socket.read_some(boost::asio::buffer(unpacker.buffer(), unpacker.buffer_capacity()));
+		unpacker.buffer_consumed(read);
+	}
+	MsgNotify<std::string, std::tuple<std::map<std::string, int64_t>>> notify;
+	unpacked.get().convert(&notify);
+	BOOST_CHECK_EQUAL(notify.method, "properties_changed");
+	return std::get<0>(notify.param);
+}
+
+/// a notify of method whose packed size is about bytes
+std::shared_ptr<msgpack::sbuffer> notifyOf(const std::string& method, size_t bytes)
+{
+	MsgNotify<std::string, std::tuple<std::string>> notify(method, std::tuple<std::string>(std::string(bytes, 'x')));
+	return packExact(notify);
+}
+
+/// the method of the next notify on socket
+std::string readNotify(tcp::socket& socket, msgpack::unpacker& unpacker)
+{
+	msgpack::unpacked unpacked;
+	while (!unpacker.next(&unpacked))
+	{
+		unpacker.reserve_buffer(64 * 1024);
+		size_t read = socket.read_some(boost::asio::buffer(unpacker.buffer(), unpacker.buffer_capacity()));
+		unpacker.buffer_consumed(read);
+	}
+	MsgNotify<std::string, msgpack::object> notify;
+	unpacked.get().convert(&notify);
+	return notify.method;
+}
+
+tcp::endpoint loopback()
+{
+	return tcp::endpoint(boost::asio::ip::address_v4::loopback(), 0);
+}
+
+/// a loopback endpoint nothing listens on, for servers that take a fixed one
+tcp::endpoint freeEndpoint(boost::asio::io_service& ios)
+{
+	tcp::acceptor acceptor(ios, loopback());
+	return acceptor.local_endpoint();
+}
+
+/// until done() or about five seconds passed
+template<typename Done>
+bool waitFor(Done done)
+{
+	for (int i = 0; i < 500 && !done(); ++i)
+		std::this_thread::sleep_for(std::chrono::milliseconds(10));
+	return done();
+}
+
+}
+
+BOOST_AUTO_TEST_CASE(hash_ring_placement)
+{
+	HashRing ring, reversed;
+	BOOST_CHECK_EQUAL(ring.nodeFor("table:1"), 0u);
+	for (uint32_t node = 1; node <= 3; ++node)
+	{
+		ring.add(node);
+		reversed.add(4 - node);
+	}
+
+	// every process with the same nodes agrees, and each node gets a fair share
+	std::map<uint32_t, size_t> shares;
+	const size_t KEYS = 10000;
+	for (size_t id = 0; id < KEYS; ++id)
+	{
+		std::string key = "table:" + std::to_string(id);
+		BOOST_CHECK_EQUAL(ring.nodeFor(key), reversed.nodeFor(key));
+		++shares[ring.nodeFor(key)];
+	}
+	BOOST_CHECK_EQUAL(shares.size(), 3u);
+	for (auto& share : shares)
+		BOOST_CHECK(share.second > KEYS / 5 && share.second < KEYS / 2);
+
+	// a new node only takes keys, about a quarter of them
+	HashRing grown = ring;
+	grown.add(4);
+	size_t moved = 0;
+	for (size_t id = 0; id < KEYS; ++id)
+	{
+		std::string key = "table:" + std::to_string(id);
+		if (grown.nodeFor(key) != ring.nodeFor(key))
+		{
+			BOOST_CHECK_EQUAL(grown.nodeFor(key), 4u);
+			++moved;
+		}
+	}
+	BOOST_CHECK(moved > KEYS / 8 && moved < KEYS * 3 / 8);
+
+	// and gives back exactly those when it leaves
+	grown.remove(4);
+	for (size_t id = 0; id < KEYS; ++id)
+	{
+		std::string key = "table:" + std::to_string(id);
+		BOOST_CHECK_EQUAL(grown.nodeFor(key), ring.nodeFor(key));
+	}
+}
+
+BOOST_AUTO_TEST_CASE(array_view_bounds)
+{
+	msgpack::zone zone;
+	msgpack::object array(std::make_tuple(7, std::string("seat")), zone);
+	ArrayView view;
+	convertParam(array, view);
+	BOOST_CHECK_EQUAL(view.size(), 2u);
+	BOOST_CHECK_EQUAL(view.as<int>(0), 7);
+	BOOST_CHECK(view.as<StrView>(1) == "seat");
+
+	// a request with too few elements is a type error, not a read past the end
+	BOOST_CHECK_THROW(view[2], msgpack::type_error);
+	BOOST_CHECK_THROW(view.as<int>(2), msgpack::type_error);
+	BOOST_CHECK_THROW(ArrayView().as<int>(0), msgpack::type_error);
+}
+
+BOOST_AUTO_TEST_CASE(array_view_errors_reply)
+{
+	boost::asio::io_service ios;
+	std::unique_ptr<boost::asio::io_service::work> work(new boost::asio::io_service::work(ios));
+	tcp::acceptor acceptor(ios, loopback());
+	auto connection = std::make_shared<TcpConnection>(ios);
+	connection->asyncConnect(acceptor.local_endpoint());
+	tcp::socket peer(ios);
+	acceptor.accept(peer);
+	std::thread io([&ios]() { ios.run(); });
+	while (connection->getConnectionStatus() != connection_connected)
+		std::this_thread::yield();
+
+	Dispatcher disp;
+	disp.add_handler("sum", [](ArrayView cards)
+	{
+		int sum = 0;
+		for (size_t i = 0; i < 3; ++i)
+			sum += cards.as<int>(i);
+		return sum;
+	});
+	disp.add_async_handler("first", std::function<void(AsyncReply<int>, ArrayView)>([](AsyncReply<int> reply, ArrayView cards)
+	{
+		reply.result(cards.as<int>(0));
+	}));
+
+	msgpack::unpacker unpacker;
+	msgpack::unpacked unpacked;
+	auto checkConvertError = [&]()
+	{
+		auto response = readResponse(peer, unpacker, unpacked);
+		BOOST_REQUIRE(response.error.type != msgpack::type::NIL);
+		std::tuple<int, std::string> error;
+		response.result.convert(&error);
+		BOOST_CHECK_EQUAL(std::get<0>(error), error_params_convert);
+	};
+
+	// elements the handler reads past the end or of the wrong type are an error reply
+	dispatchRequest(disp, connection, "sum", std::vector<int>{ 1, 2 });
+	checkConvertError();
+	dispatchRequest(disp, connection, "sum", std::make_tuple(1, std::string("two"), 3));
+	checkConvertError();
+	dispatchRequest(disp, connection, "first", std::vector<int>());
+	checkConvertError();
+
+	// and the connection stays up for the next call
+	dispatchRequest(disp, connection, "sum", std::vector<int>{ 1, 2, 3 });
+	auto response = readResponse(peer, unpacker, unpacked);
+	BOOST_CHECK(response.error.type == msgpack::type::NIL);
+	int sum = 0;
+	response.result.convert(&sum);
+	BOOST_CHECK_EQUAL(sum, 6);
+	BOOST_CHECK(connection->getConnectionStatus() == connection_connected);
+
+	work.reset();
+	ios.stop();
+	io.join();
+}
+
+BOOST_AUTO_TEST_CASE(property_changes_coalesce)
+{
+	boost::asio::io_service ios;
+	std::unique_ptr<boost::asio::io_service::work> work(new boost::asio::io_service::work(ios));
+	tcp::acceptor acceptor(ios, loopback());
+	auto connection = std::make_shared<TcpConnection>(ios);
+	connection->asyncConnect(acceptor.local_endpoint());
+	tcp::socket peer(ios);
+	acceptor.accept(peer);
+	std::thread io([&ios]() { ios.run(); });
+	while (connection->getConnectionStatus() != connection_connected)
+		std::this_thread::yield();
+
+	std::atomic<int64_t> pot(0);
+	auto hub = std::make_shared<PropertyHub>();
+	hub->add("pot", [&pot](msgpack::zone& zone) { return msgpack::object(pot.load(), zone); });
+	BOOST_CHECK_EQUAL(hub->subscribe(connection, { "pot" }, 50).values.size(), 1u);
+	BOOST_CHECK_THROW(hub->read({ "rake" }), msgerror);
+
+	// changes within one interval make one notify with the value as of sending
+	for (int i = 1; i <= 10; ++i)
+	{
+		pot = i;
+		hub->changed("pot");
+	}
+	msgpack::unpacker unpacker;
+	auto changes = readChanges(peer, unpacker);
+	BOOST_CHECK_EQUAL(changes.size(), 1u);
+	BOOST_CHECK_EQUAL(changes["pot"], 10);
+	std::this_thread::sleep_for(std::chrono::milliseconds(100));
+	BOOST_CHECK_EQUAL(peer.available(), 0u);
+
+	// a later change is sent again, one not followed is not
+	hub->changed("rake");
+	pot = 11;
+	hub->changed("pot");
+	BOOST_CHECK_EQUAL(readChanges(peer, unpacker)["pot"], 11);
+
+	// nothing after unsubscribing
+	hub->unsubscribe(connection, {});
+	hub->changed("pot");
+	std::this_thread::sleep_for(std::chrono::milliseconds(100));
+	BOOST_CHECK_EQUAL(peer.available(), 0u);
+
+	// no interval still coalesces, over the minimum
+	hub->subscribe(connection, { "pot" }, 0);
+	for (int i = 12; i <= 20; ++i)
+	{
+		pot = i;
+		hub->changed("pot");
+	}
+	BOOST_CHECK_EQUAL(readChanges(peer, unpacker)["pot"], 20);
+	std::this_thread::sleep_for(std::chrono::milliseconds(PropertyHub::MIN_INTERVAL_MS * 3));
+	BOOST_CHECK_EQUAL(peer.available(), 0u);
+
+	// nor once the connection closed, even with a flush scheduled
+	hub->changed("pot");
+	hub->disconnected(connection);
+	std::this_thread::sleep_for(std::chrono::milliseconds(100));
+	BOOST_CHECK_EQUAL(peer.available(), 0u);
+
+	work.reset();
+	ios.stop();
+	io.join();
+}
+
+BOOST_AUTO_TEST_CASE(property_owner_gone)
+{
+	boost::asio::io_service ios;
+	std::unique_ptr<boost::asio::io_service::work> work(new boost::asio::io_service::work(ios));
+	tcp::acceptor acceptor(ios, loopback());
+	auto connection = std::make_shared<TcpConnection>(ios);
+	connection->asyncConnect(acceptor.local_endpoint());
+	tcp::socket peer(ios);
+	acceptor.accept(peer);
+	std::thread io([&ios]() { ios.run(); });
+	while (connection->getConnectionStatus() != connection_connected)
+		std::this_thread::yield();
+
+	struct Pot
+	{
+		int64_t chips = 0;
+		int64_t get() const { return chips; }
+		void set(int64_t value) { chips = value; }
+	};
+	Pot pot;
+	std::atomic<Pot*> owner(&pot);
+	Dispatcher disp;
+	disp.add_property("pot", std::function<Pot*()>([&owner]() { return owner.load(); }), &Pot::get, &Pot::set);
+
+	dispatchRequest(disp, connection, "subscribe_properties", std::vector<std::string>{ "pot" }, uint32_t(20));
+	msgpack::unpacker unpacker;
+	msgpack::unpacked unpacked;
+	BOOST_CHECK(readResponse(peer, unpacker, unpacked).error.type == msgpack::type::NIL);
+
+	// the getter throws msgerror from the flush timer, which must not leave the io loop
+	owner = nullptr;
+	disp.property_changed("pot");
+	std::this_thread::sleep_for(std::chrono::milliseconds(100));
+	BOOST_CHECK_EQUAL(peer.available(), 0u);
+
+	// the loop still runs, a later change is sent
+	pot.chips = 5;
+	owner = &pot;
+	disp.property_changed("pot");
+	BOOST_CHECK_EQUAL(readChanges(peer, unpacker)["pot"], 5);
+
+	work.reset();
+	ios.stop();
+	io.join();
+}
+
+BOOST_AUTO_TEST_CASE(client_replays_idempotent_calls)
+{
+	boost::asio::io_service server_io;
+	tcp::acceptor acceptor(server_io, loopback());
+	boost::asio::io_service client_io;
+	boost::asio::io_service::work work(client_io);
+
+	TcpClient client(client_io);
+	ReconnectPolicy policy;
+	policy.initialDelayMs = 10;
+	policy.maxDelayMs = 10;
+	client.setReconnectPolicy(policy);
+	client.setIdempotent("add");
+	client.asyncConnect(acceptor.local_endpoint());
+	std::thread io([&client_io]() { client_io.run(); });
+
+	// both calls reach the server, which drops the connection without answering
+	tcp::socket first(server_io);
+	acceptor.accept(first);
+	auto add = client.asyncCall("add", 1, 2);
+	auto bet = client.asyncCall("bet", 10);
+	{
+		msgpack::unpacker unpacker;
+		msgpack::unpacked unpacked;
+		BOOST_CHECK_EQUAL(readRequest(first, unpacker, unpacked).method, "add");
+		BOOST_CHECK_EQUAL(readRequest(first, unpacker, unpacked).method, "bet");
+		first.close();
+	}
+
+	// the call that is not safe to send twice fails, add is sent again once reconnected
+	bet->sync();
+	BOOST_CHECK(bet->isError());
+	BOOST_CHECK_EQUAL(bet->getErrorCode(), error_connection_lost);
+
+	tcp::socket second(server_io);
+	acceptor.accept(second);
+	{
+		msgpack::unpacker unpacker;
+		msgpack::unpacked unpacked;
+		auto request = readRequest(second, unpacker, unpacked);
+		BOOST_CHECK_EQUAL(request.method, "add");
+		MsgResponse<int, msgpack::type::nil> response(3, msgpack::type::nil(), request.msgid);
+		auto sbuf = packExact(response);
+		boost::asio::write(second, boost::asio::buffer(sbuf->data(), sbuf->size()));
+	}
+
+	int result = 0;
+	add->sync().convert(&result);
+	BOOST_CHECK_EQUAL(result, 3);
+	ReconnectStats stats = client.getReconnectStats();
+	BOOST_CHECK_EQUAL(stats.replayedCalls, 1u);
+	BOOST_CHECK_EQUAL(stats.failedCalls, 1u);
+	BOOST_CHECK_EQUAL(stats.reconnects, 1u);
+
+	client.close();
+	client_io.stop();
+	io.join();
+}
+
+BOOST_AUTO_TEST_CASE(cluster_peers_authenticate)
+{
+	boost::asio::io_service ios;
+	std::unique_ptr<boost::asio::io_service::work> work(new boost::asio::io_service::work(ios));
+
+	// three nodes that list each other, the third does not know the secret
+	const size_t NODES = 3;
+	ClusterOptions options[NODES];
+	for (size_t i = 0; i < NODES; ++i)
+	{
+		options[i].nodeId = static_cast<uint32_t>(i + 1);
+		options[i].listen = freeEndpoint(ios);
+		options[i].secret = "known to nodes only";
+		options[i].reconnect.initialDelayMs = 10;
+		options[i].reconnect.maxDelayMs = 50;
+	}
+	options[2].secret = "a guess";
+	std::vector<std::shared_ptr<Cluster>> nodes;
+	for (size_t i = 0; i < NODES; ++i)
+	{
+		for (size_t j = 0; j < NODES; ++j)
+		{
+			if (j != i)
+				options[i].peers[options[j].nodeId] = options[j].listen;
+		}
+		nodes.push_back(std::make_shared<Cluster>(ios, std::make_shared<Dispatcher>(), options[i]));
+		nodes.back()->start();
+	}
+	std::thread io([&ios]() { ios.run(); });
+
+	// the first two let each other in and turn the third away
+	BOOST_CHECK(waitFor([&nodes]()
+	{
+		return nodes[0]->getStats().linksUp == 1 && nodes[1]->getStats().linksUp == 1
+			&& nodes[0]->getStats().refusedPeers && nodes[1]->getStats().refusedPeers;
+	}));
+	BOOST_CHECK_EQUAL(nodes[2]->getStats().linksUp, 0u);
+
+	// so only they hear of a claim
+	nodes[0]->claim("table:1");
+	BOOST_CHECK(waitFor([&nodes]() { return nodes[1]->ownerOf("table:1") == 1; }));
+	BOOST_CHECK_EQUAL(nodes[2]->ownerOf("table:1"), 0u);
+
+	for (auto& node : nodes)
+		node->stop();
+	work.reset();
+	ios.stop();
+	io.join();
+}
+
+BOOST_AUTO_TEST_CASE(server_drains_own_sessions)
+{
+	boost::asio::io_service ios;
+	std::unique_ptr<boost::asio::io_service::work> work(new boost::asio::io_service::work(ios));
+	auto disp = std::make_shared<Dispatcher>();
+	disp->add_handler("add", [](int a, int b)->int { return a + b; });
+
+	// a client server and an admin server on one io thread
+	tcp::endpoint clientPort = freeEndpoint(ios), adminPort = freeEndpoint(ios);
+	TcpServer clients(ios, clientPort);
+	TcpServer admin(ios, adminPort);
+	clients.setDispatcher(disp);
+	admin.setDispatcher(disp);
+	clients.start();
+	admin.start();
+	std::thread io([&ios]() { ios.run(); });
+
+	ReconnectPolicy once;
+	once.enabled = false;
+	TcpClient player(ios), operatorClient(ios);
+	player.setReconnectPolicy(once);
+	operatorClient.setReconnectPolicy(once);
+	player.asyncConnect(clientPort);
+	operatorClient.asyncConnect(adminPort);
+	BOOST_REQUIRE(waitFor([&clients, &admin]()
+	{
+		return clients.getSessions()->getSessionPool().size() == 1 && admin.getSessions()->getSessionPool().size() == 1;
+	}));
+
+	// draining the client server leaves the admin session open
+	std::promise<void> drained;
+	clients.drain(std::chrono::milliseconds(200), [&drained]() { drained.set_value(); });
+	BOOST_CHECK(drained.get_future().wait_for(std::chrono::seconds(5)) == std::future_status::ready);
+	BOOST_CHECK(clients.getSessions()->getSessionPool().empty());
+	BOOST_CHECK_EQUAL(admin.getSessions()->getSessionPool().size(), 1u);
+	int sum = 0;
+	operatorClient.asyncCall("add", 1, 2)->sync().convert(&sum);
+	BOOST_CHECK_EQUAL(sum, 3);
+
+	player.close();
+	operatorClient.close();
+	admin.stop();
+	work.reset();
+	ios.stop();
+	io.join();
+}
+
+BOOST_AUTO_TEST_CASE(admission_sheds_and_pauses_reading)
+{
+	boost::asio::io_service ios;
+	std::unique_ptr<boost::asio::io_service::work> work(new boost::asio::io_service::work(ios));
+
+	// one request in flight per session, hold keeps its reply until the test lets go
+	std::mutex mtx;
+	std::vector<AsyncReply<int>> held;
+	auto disp = std::make_shared<Dispatcher>();
+	disp->add_handler("add", [](int a, int b)->int { return a + b; });
+	disp->add_async_handler("hold", std::function<void(AsyncReply<int>)>([&mtx, &held](AsyncReply<int> reply)
+	{
+		std::lock_guard<std::mutex> lock(mtx);
+		held.push_back(reply);
+	}));
+	tcp::endpoint endpoint = freeEndpoint(ios);
+	TcpServer server(ios, endpoint);
+	server.setDispatcher(disp);
+	AdmissionLimits limits;
+	limits.maxInflightRequests = 1;
+	server.setAdmissionLimits(limits);
+	server.start();
+	std::thread io([&ios]() { ios.run(); });
+
+	tcp::socket peer(ios);
+	peer.connect(endpoint);
+	writeRequest(peer, 1, "hold");
+	BOOST_REQUIRE(waitFor([&mtx, &held]() { std::lock_guard<std::mutex> lock(mtx); return held.size() == 1; }));
+
+	// the next request is answered at once with the overload error, not queued
+	msgpack::unpacker unpacker;
+	msgpack::unpacked unpacked;
+	writeRequest(peer, 2, "add", 1, 2);
+	auto response = readResponse(peer, unpacker, unpacked);
+	BOOST_CHECK_EQUAL(response.msgid, 2u);
+	BOOST_CHECK_EQUAL(errorCodeOf(response), error_server_overloaded);
+	BOOST_CHECK_EQUAL(server.getAdmission()->getRejected(), 1u);
+
+	// and the session reads no more until the request in flight is answered
+	writeRequest(peer, 3, "add", 2, 3);
+	std::this_thread::sleep_for(std::chrono::milliseconds(100));
+	BOOST_CHECK_EQUAL(peer.available(), 0u);
+
+	ios.post([&mtx, &held]() { std::lock_guard<std::mutex> lock(mtx); held[0].result(7); });
+	response = readResponse(peer, unpacker, unpacked);
+	BOOST_CHECK_EQUAL(response.msgid, 1u);
+	BOOST_CHECK_EQUAL(errorCodeOf(response), success);
+	BOOST_CHECK_EQUAL(response.result.as<int>(), 7);
+	response = readResponse(peer, unpacker, unpacked);
+	BOOST_CHECK_EQUAL(response.msgid, 3u);
+	BOOST_CHECK_EQUAL(response.result.as<int>(), 5);
+	BOOST_CHECK_EQUAL(server.getAdmission()->getRejected(), 1u);
+
+	peer.close();
+	server.stop();
+	{
+		std::lock_guard<std::mutex> lock(mtx);
+		held.clear();
+	}
+	work.reset();
+	ios.stop();
+	io.join();
+}
+
+BOOST_AUTO_TEST_CASE(rate_limits_throttle_and_refund)
+{
+	// a bucket gives its burst at once, then one token per 1000 / perSecond ms
+	RateLimit limit(2, 1);
+	TokenBucket bucket;
+	BOOST_CHECK(bucket.tryTake(limit, 0));
+	BOOST_CHECK(bucket.tryTake(limit, 0));
+	BOOST_CHECK(!bucket.tryTake(limit, 0));
+	BOOST_CHECK(!bucket.tryTake(limit, CoarseClock::toTicks(500)));
+	BOOST_CHECK(bucket.tryTake(limit, CoarseClock::toTicks(1000)));
+	BOOST_CHECK(!bucket.tryTake(limit, CoarseClock::toTicks(1000)));
+
+	// idle for long it holds no more than the burst
+	BOOST_CHECK(bucket.tryTake(limit, CoarseClock::toTicks(60 * 1000)));
+	BOOST_CHECK(bucket.tryTake(limit, CoarseClock::toTicks(60 * 1000)));
+	BOOST_CHECK(!bucket.tryTake(limit, CoarseClock::toTicks(60 * 1000)));
+
+	// three calls a session, one bet; the clock does not advance here, nothing refills
+	Dispatcher disp;
+	disp.set_session_rate_limit(3, 1);
+	disp.set_rate_limit("bet", 1, 1);
+	msgpack::zone zone;
+	msgpack::object bet(std::string("bet"), zone);
+	msgpack::object add(std::string("add"), zone);
+	RateState state;
+	BOOST_CHECK(disp.check_rate(bet, state));
+
+	// the bet bucket turns the second bet away and the session gets its token back
+	BOOST_CHECK(!disp.check_rate(bet, state));
+	BOOST_CHECK(disp.check_rate(add, state));
+	BOOST_CHECK(disp.check_rate(add, state));
+	BOOST_CHECK(!disp.check_rate(add, state));
+
+	auto throttled = disp.get_throttled();
+	BOOST_CHECK_EQUAL(throttled["bet"], 1u);
+	BOOST_CHECK_EQUAL(throttled["*"], 1u);
+
+	// a session of its own has full buckets
+	RateState other;
+	BOOST_CHECK(disp.check_rate(bet, other));
+}
+
+BOOST_AUTO_TEST_CASE(idle_session_pinged_then_reaped)
+{
+	// idle times are read from the coarse clock, it runs on the io loop of this test
+	CoarseClock::stop();
+	boost::asio::io_service ios;
+	std::unique_ptr<boost::asio::io_service::work> work(new boost::asio::io_service::work(ios));
+	tcp::endpoint endpoint = freeEndpoint(ios);
+	TcpServer server(ios, endpoint);
+	server.setHeartbeat(300, 900);
+	server.start();
+	std::thread io([&ios]() { ios.run(); });
+
+	tcp::socket peer(ios);
+	auto connected = std::chrono::steady_clock::now();
+	peer.connect(endpoint);
+	BOOST_REQUIRE(waitFor([&server]() { return server.getSessions()->getSessionPool().size() == 1; }));
+
+	// a peer that sends nothing is pinged from the timer wheel once pingIntervalMs passed
+	msgpack::unpacker unpacker;
+	MsgNotify<std::string, msgpack::object> notify;
+	do
+	{
+		msgpack::unpacked unpacked;
+		while (!unpacker.next(&unpacked))
+		{
+			unpacker.reserve_buffer(4096);
+			size_t read = peer.read_some(boost::asio::buffer(unpacker.buffer(), unpacker.buffer_capacity()));
+			unpacker.buffer_consumed(read);
+		}
+		unpacked.get().convert(&notify);
+	} while (notify.method == "session_token");
+	BOOST_CHECK_EQUAL(notify.method, "ping");
+	BOOST_CHECK(std::chrono::steady_clock::now() - connected >= std::chrono::milliseconds(250));
+
+	// and closed once idleTimeoutMs passed with no answer
+	boost::system::error_code error;
+	char byte;
+	while (!error)
+		peer.read_some(boost::asio::buffer(&byte, 1), error);
+	BOOST_CHECK(std::chrono::steady_clock::now() - connected >= std::chrono::milliseconds(850));
+	BOOST_CHECK(waitFor([&server]() { return server.getSessions()->getSessionPool().empty(); }));
+
+	server.stop();
+	work.reset();
+	ios.stop();
+	io.join();
+	CoarseClock::stop();
+}
+
+BOOST_AUTO_TEST_CASE(priority_write_overtakes_bulk)
+{
+	boost::asio::io_service ios;
+	tcp::acceptor acceptor(ios, loopback());
+	tcp::socket socket(ios);
+	socket.connect(acceptor.local_endpoint());
+	tcp::socket peer(ios);
+	acceptor.accept(peer);
+	auto connection = std::make_shared<TcpConnection>(ios, std::move(socket));
+
+	// the io thread is not running yet, the first write stays in flight while the rest queue
+	connection->asyncWrite(notifyOf("first", 100));
+	for (int i = 0; i < 4; ++i)
+		connection->asyncWrite(notifyOf("bulk", 40 * 1024), WriteHandler(), priority_bulk);
+	connection->asyncWrite(notifyOf("normal", 100));
+	connection->asyncWrite(notifyOf("high", 100), WriteHandler(), priority_high);
+	BOOST_CHECK_EQUAL(connection->getIoStats().writes, 0u);
+
+	std::thread io([&ios]() { ios.run(); });
+	msgpack::unpacker unpacker;
+	BOOST_CHECK_EQUAL(readNotify(peer, unpacker), "first");
+	BOOST_CHECK_EQUAL(readNotify(peer, unpacker), "high");
+	BOOST_CHECK_EQUAL(readNotify(peer, unpacker), "normal");
+	for (int i = 0; i < 4; ++i)
+		BOOST_CHECK_EQUAL(readNotify(peer, unpacker), "bulk");
+	io.join();
+
+	// one write for the first message, then one per bulk batch, the first batch
+	// carrying the high and normal messages as well
+	BOOST_CHECK_EQUAL(connection->getIoStats().writes, 5u);
+	BOOST_CHECK_EQUAL(connection->getPendingBytes(), 0u);
+}
+
+BOOST_AUTO_TEST_CASE(protocol_error_drops_input)
+{
+	boost::asio::io_service ios;
+	std::unique_ptr<boost::asio::io_service::work> work(new boost::asio::io_service::work(ios));
+	tcp::acceptor acceptor(ios, loopback());
+	std::atomic<int> messages(0);
+	auto connection = std::make_shared<TcpConnection>(ios);
+	connection->setMsgHandler([&messages](const msgpack::object&, std::shared_ptr<TcpConnection>) { ++messages; });
+	connection->asyncConnect(acceptor.local_endpoint());
+	tcp::socket peer(ios);
+	acceptor.accept(peer);
+	std::thread io([&ios]() { ios.run(); });
+	BOOST_REQUIRE(waitFor([&]() { return connection->getConnectionStatus() == connection_connected; }));
+
+	auto hello = notifyOf("hello", 10);
+	boost::asio::write(peer, boost::asio::buffer(hello->data(), hello->size()));
+	BOOST_REQUIRE(waitFor([&]() { return messages == 1; }));
+
+	// 0xc1 is never used by msgpack, the message after it is not parsed
+	std::string broken = "\xc1" + std::string(hello->data(), hello->size());
+	boost::asio::write(peer, boost::asio::buffer(broken));
+	msgpack::unpacker unpacker;
+	BOOST_CHECK_EQUAL(readNotify(peer, unpacker), "error_notify");
+	char byte;
+	boost::system::error_code ec;
+	peer.read_some(boost::asio::buffer(&byte, 1), ec);
+	BOOST_CHECK(ec == boost::asio::error::eof);
+
+	// what the peer sends until it closes is read and dropped, with no second error
+	uint64_t read = connection->getIoStats().bytesRead;
+	boost::asio::write(peer, boost::asio::buffer(broken + broken));
+	BOOST_CHECK(waitFor([&]() { return connection->getIoStats().bytesRead >= read + 2 * broken.size(); }));
+	BOOST_CHECK_EQUAL(messages.load(), 1);
+	BOOST_CHECK(connection->getConnectionStatus() == connection_connected);
+	peer.close();
+	BOOST_CHECK(waitFor([&]() { return connection->getConnectionStatus() == connection_none; }));
+	BOOST_CHECK_EQUAL(messages.load(), 1);
+
+	work.reset();
+	ios.stop();
+	io.join();
+}
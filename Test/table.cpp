@@ -0,0 +1,711 @@
+#include <boost/test/unit_test.hpp>
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <fstream>
+#include <future>
+#include <set>
+#include <thread>
+#include "../Poker/Table.h"
+#include "../Poker/TableManager.h"
+#include "../Poker/PokerHandlers.h"
+#include "Dispatcher.h"
+
+using namespace poker;
+
+namespace {
+
+typedef std::shared_ptr<msgpack::rpc::TcpConnection> ConnectionPtr;
+
+/// deals holes in seat order, two cards each, then the board
+Deck stackedDeck(const std::vector<std::vector<Card>>& holes, const std::vector<Card>& board)
+{
+	Deck deck;
+	deck.seed.fill(0);
+	HandMask used = 0;
+	size_t pos = 0;
+	for (auto& hole : holes)
+	{
+		for (Card card : hole)
+		{
+			deck.cards[pos++] = card;
+			used |= cardMask(card);
+		}
+	}
+	for (Card card : board)
+	{
+		deck.cards[pos++] = card;
+		used |= cardMask(card);
+	}
+	for (int card = 0; card < 52; ++card)
+	{
+		if (!(used & cardMask(static_cast<Card>(card))))
+			deck.cards[pos++] = static_cast<Card>(card);
+	}
+	return deck;
+}
+
+/// until what was appended so far is on disk, false if that failed
+bool waitDurable(Ledger& ledger)
+{
+	std::promise<bool> durable;
+	ledger.whenDurable([&durable](bool ok) { durable.set_value(ok); });
+	return durable.get_future().get();
+}
+
+bool deposit(Ledger& ledger, const std::string& account, int64_t amount)
+{
+	LedgerEntry entry;
+	entry.kind = ledger_deposit;
+	entry.account = account;
+	entry.amount = amount;
+	ledger.append(entry);
+	return waitDurable(ledger);
+}
+
+/// players p0.. at seats 0.. with stacks, the first hand is dealt from deck.
+/// ios is never run, the test thread stands in for the strand; with wallets
+/// it is polled once for the buy ins to settle.
+std::shared_ptr<Table> startTable(boost::asio::io_service& ios, std::vector<ConnectionPtr>& players,
+	const std::vector<int64_t>& stacks, const Deck& deck, const TableServices& services = TableServices())
+{
+	TableConfig config;
+	config.seats = 6;
+	auto table = std::make_shared<Table>(ios, 1, config, services);
+	table->setPaused(true);
+	for (size_t seat = 0; seat < stacks.size(); ++seat)
+	{
+		players.push_back(std::make_shared<msgpack::rpc::TcpConnection>(ios));
+		table->join(players.back(), static_cast<int>(seat), "p" + std::to_string(seat), stacks[seat]);
+	}
+	if (services.wallets)
+	{
+		// the players are dealt in once their buy ins are durable
+		BOOST_REQUIRE(waitDurable(*services.wallets->getLedger()));
+		ios.poll();
+	}
+	table->setNextDeck(deck);
+	table->setPaused(false);
+	return table;
+}
+
+/// act for the player whose turn it is
+void actNext(Table& table, const std::vector<ConnectionPtr>& players, TableAction action, int64_t amount = 0)
+{
+	int seat = table.getState().toAct;
+	BOOST_REQUIRE(seat >= 0);
+	table.act(players[seat], action, amount);
+}
+
+int64_t stackOf(const Table& table, int seat)
+{
+	return table.getState().seats[seat].stack;
+}
+
+LobbyEntry lobbyEntry(uint32_t tableId, const std::string& game, int64_t bigBlind, uint32_t seats, uint32_t players)
+{
+	LobbyEntry entry;
+	entry.tableId = tableId;
+	entry.game = game;
+	entry.smallBlind = bigBlind / 2;
+	entry.bigBlind = bigBlind;
+	entry.seats = seats;
+	entry.players = players;
+	return entry;
+}
+
+/// the table ids of a page
+std::vector<uint32_t> idsOf(const LobbyPage& page)
+{
+	std::vector<uint32_t> ids;
+	for (auto& entry : page.tables)
+		ids.push_back(entry.tableId);
+	return ids;
+}
+
+/// a server side connection whose client end is socket, ios runs on another thread
+ConnectionPtr connectPeer(boost::asio::io_service& ios, boost::asio::ip::tcp::acceptor& acceptor,
+	boost::asio::ip::tcp::socket& socket)
+{
+	auto connection = std::make_shared<msgpack::rpc::TcpConnection>(ios);
+	connection->asyncConnect(acceptor.local_endpoint());
+	acceptor.accept(socket);
+	while (connection->getConnectionStatus() != msgpack::rpc::connection_connected)
+		std::this_thread::yield();
+	return connection;
+}
+
+/// call method of disp for connection and wait for the reply its peer reads on socket
+template<typename R, typename... TArgs>
+R callFrom(msgpack::rpc::Dispatcher& disp, ConnectionPtr connection, boost::asio::ip::tcp::socket& socket,
+	const std::string& method, TArgs... args)
+{
+	msgpack::rpc::MsgRequest<std::string, std::tuple<TArgs...>> request(method, std::tuple<TArgs...>(args...), 1);
+	auto sbuf = msgpack::rpc::packExact(request);
+	msgpack::unpacked unpacked;
+	msgpack::unpack(unpacked, sbuf->data(), sbuf->size());
+	disp.dispatch(unpacked.get(), connection);
+
+	// table notifies may come first
+	msgpack::unpacker unpacker;
+	msgpack::rpc::MsgRpc rpc;
+	do
+	{
+		while (!unpacker.next(&unpacked))
+		{
+			unpacker.reserve_buffer(4096);
+			size_t read = socket.read_some(boost::asio::buffer(unpacker.buffer(), unpacker.buffer_capacity()));
+			unpacker.buffer_consumed(read);
+		}
+		unpacked.get().convert(&rpc);
+	} while (!rpc.is_response());
+	msgpack::rpc::MsgResponse<msgpack::object, msgpack::object> response;
+	unpacked.get().convert(&response);
+	R result;
+	response.result.convert(&result);
+	return result;
+}
+
+}
+
+BOOST_AUTO_TEST_CASE(table_heads_up_blind_order)
+{
+	boost::asio::io_service ios;
+	std::vector<ConnectionPtr> players;
+	auto table = startTable(ios, players, { 100, 100 }, makeDeck(Seed()));
+
+	// the button posts the small blind and acts first before the flop
+	const TableState& state = table->getState();
+	BOOST_CHECK_EQUAL(state.street, street_preflop);
+	BOOST_CHECK_EQUAL(state.button, 0);
+	BOOST_CHECK_EQUAL(state.seats[0].bet, 1);
+	BOOST_CHECK_EQUAL(state.seats[1].bet, 2);
+	BOOST_CHECK_EQUAL(state.toAct, 0);
+
+	// the big blind keeps its option, then acts first after the flop
+	BOOST_CHECK_THROW(table->act(players[0], action_check, 0), msgpack::rpc::msgerror);
+	table->act(players[0], action_call, 0);
+	BOOST_CHECK_EQUAL(state.toAct, 1);
+	table->act(players[1], action_check, 0);
+	BOOST_CHECK_EQUAL(state.street, street_flop);
+	BOOST_CHECK_EQUAL(state.board.size(), 3u);
+	BOOST_CHECK_EQUAL(state.toAct, 1);
+	BOOST_CHECK_EQUAL(state.pot, 4);
+}
+
+BOOST_AUTO_TEST_CASE(deck_replays_from_seed)
+{
+	// the keystream of the all zero key and nonce, as published for ChaCha20
+	ChaCha20 rng(Seed(), 0);
+	BOOST_CHECK_EQUAL(rng.next(), 0xade0b876u);
+	BOOST_CHECK_EQUAL(rng.next(), 0x903df1a0u);
+	BOOST_CHECK_EQUAL(rng.next(), 0xe56a5d40u);
+	BOOST_CHECK_EQUAL(rng.next(), 0x28bd8653u);
+
+	// a fixed seed gives a fixed deck, every card once
+	Deck deck = makeDeck(Seed());
+	std::vector<int> top(deck.cards.begin(), deck.cards.begin() + 8);
+	BOOST_CHECK(top == std::vector<int>({ 45, 22, 42, 40, 14, 13, 5, 41 }));
+	BOOST_CHECK(makeDeck(Seed()).cards == deck.cards);
+	BOOST_CHECK_EQUAL(std::set<int>(deck.cards.begin(), deck.cards.end()).size(), 52u);
+
+	Seed seed;
+	for (size_t i = 0; i < seed.size(); ++i)
+		seed[i] = static_cast<uint8_t>(i);
+	BOOST_CHECK(makeDeck(seed).cards != deck.cards);
+	Seed parsed;
+	BOOST_REQUIRE(seedFromHex(seedToHex(seed), parsed));
+	BOOST_CHECK(parsed == seed);
+	BOOST_CHECK(!seedFromHex("0g" + seedToHex(seed).substr(2), parsed));
+	BOOST_CHECK(!seedFromHex("00", parsed));
+}
+
+BOOST_AUTO_TEST_CASE(table_hand_replays_from_seed)
+{
+	HandHistoryOptions options;
+	for (uint32_t index = 1; segment::exists(options.directory, index); ++index)
+		std::remove(segment::path(options.directory, index).c_str());
+	{
+		// every seat of this deck gets its higher card first
+		TableServices services;
+		services.history = std::make_shared<HandHistory>(options);
+		boost::asio::io_service ios;
+		std::vector<ConnectionPtr> players;
+		auto table = startTable(ios, players, { 100, 100, 100 }, makeDeck(Seed()), services);
+		uint64_t handId = table->getState().handId;
+		actNext(*table, players, action_fold);
+		actNext(*table, players, action_fold);
+		for (int i = 0; i < 500 && services.history->getWritten() < 1; ++i)
+			std::this_thread::sleep_for(std::chrono::milliseconds(10));
+
+		HandRecord hand;
+		BOOST_REQUIRE(services.history->read(handId, hand));
+		BOOST_CHECK_EQUAL(hand.deckSeed, seedToHex(Seed()));
+		BOOST_CHECK(hand.holes[0] == std::vector<int>({ 45, 22 }));
+		BOOST_CHECK(hand.holes[2] == std::vector<int>({ 14, 13 }));
+		BOOST_CHECK_EQUAL(verifyDeal(hand), "");
+
+		// holes logged sorted, as before they were kept in deal order, verify too
+		HandRecord sorted = hand;
+		for (auto& hole : sorted.holes)
+			std::sort(hole.begin(), hole.end());
+		BOOST_CHECK_EQUAL(verifyDeal(sorted), "");
+
+		// a card that was not dealt there, a board not from the deck, another seed
+		HandRecord swapped = hand;
+		std::swap(swapped.holes[0][1], swapped.holes[1][0]);
+		BOOST_CHECK_EQUAL(verifyDeal(swapped), "seat 0 was not dealt its hole cards from the deck");
+		HandRecord board = hand;
+		board.board = { 5, 41, 32, 0 };
+		BOOST_CHECK_EQUAL(verifyDeal(board), "board was not dealt from the deck");
+		HandRecord reseeded = hand;
+		reseeded.deckSeed = seedToHex(makeDeck(randomSeed()).seed);
+		BOOST_CHECK(!verifyDeal(reseeded).empty());
+		reseeded.deckSeed = "nope";
+		BOOST_CHECK_EQUAL(verifyDeal(reseeded), "bad deck seed");
+	}
+	for (uint32_t index = 1; segment::exists(options.directory, index); ++index)
+		std::remove(segment::path(options.directory, index).c_str());
+}
+
+BOOST_AUTO_TEST_CASE(table_side_pots)
+{
+	// aces all in short, kings cover the queens, nothing on the board helps
+	std::vector<Card> board = { makeCard(0, 2), makeCard(5, 3), makeCard(7, 2), makeCard(9, 3), makeCard(1, 2) };
+	Deck deck = stackedDeck({
+		{ makeCard(12, 0), makeCard(12, 1) },
+		{ makeCard(11, 0), makeCard(11, 1) },
+		{ makeCard(10, 0), makeCard(10, 1) } }, board);
+
+	boost::asio::io_service ios;
+	std::vector<ConnectionPtr> players;
+	auto table = startTable(ios, players, { 50, 100, 100 }, deck);
+
+	actNext(*table, players, action_bet, 50);
+	actNext(*table, players, action_bet, 100);
+	actNext(*table, players, action_call);
+
+	// main pot of 150 to the aces, the side pot of 100 only the other two paid into to the kings
+	BOOST_CHECK_EQUAL(table->getState().street, street_showdown);
+	BOOST_CHECK(table->getState().board == std::vector<int>(board.begin(), board.end()));
+	BOOST_CHECK_EQUAL(stackOf(*table, 0), 150);
+	BOOST_CHECK_EQUAL(stackOf(*table, 1), 100);
+	BOOST_CHECK_EQUAL(stackOf(*table, 2), 0);
+	BOOST_CHECK_EQUAL(table->getState().pot, 0);
+}
+
+BOOST_AUTO_TEST_CASE(table_odd_chip)
+{
+	// a royal flush on the board, every hand ties
+	std::vector<Card> board = { makeCard(8, 0), makeCard(9, 0), makeCard(10, 0), makeCard(11, 0), makeCard(12, 0) };
+	Deck deck = stackedDeck({
+		{ makeCard(0, 1), makeCard(1, 2) },
+		{ makeCard(2, 1), makeCard(3, 2) },
+		{ makeCard(4, 1), makeCard(5, 2) } }, board);
+
+	boost::asio::io_service ios;
+	std::vector<ConnectionPtr> players;
+	auto table = startTable(ios, players, { 100, 100, 100 }, deck);
+
+	// the button calls, the small blind folds, the rest is checked down
+	actNext(*table, players, action_call);
+	actNext(*table, players, action_fold);
+	actNext(*table, players, action_check);
+	for (int street = street_flop; street <= street_river; ++street)
+	{
+		BOOST_CHECK_EQUAL(table->getState().street, street);
+		actNext(*table, players, action_check);
+		actNext(*table, players, action_check);
+	}
+
+	// a pot of 5 split two ways, the odd chip to the first winner after the button
+	BOOST_CHECK_EQUAL(table->getState().street, street_showdown);
+	BOOST_CHECK_EQUAL(stackOf(*table, 0), 100);
+	BOOST_CHECK_EQUAL(stackOf(*table, 1), 99);
+	BOOST_CHECK_EQUAL(stackOf(*table, 2), 101);
+}
+
+BOOST_AUTO_TEST_CASE(table_leave_mid_hand)
+{
+	boost::asio::io_service ios;
+	std::vector<ConnectionPtr> players;
+	auto table = startTable(ios, players, { 100, 100, 100 }, makeDeck(Seed()));
+	const TableState& state = table->getState();
+	BOOST_CHECK_EQUAL(state.toAct, 0);
+
+	// out of turn, the small blind folds and keeps the seat until the hand is over
+	table->leave(players[1]);
+	BOOST_CHECK(state.seats[1].folded);
+	BOOST_CHECK_EQUAL(state.seats[1].player, "p1");
+	BOOST_CHECK_EQUAL(state.toAct, 0);
+	BOOST_CHECK_THROW(table->act(players[1], action_call, 0), msgpack::rpc::msgerror);
+
+	// the big blind is the last one in and takes the blinds
+	table->act(players[0], action_fold, 0);
+	BOOST_CHECK_EQUAL(state.street, street_showdown);
+	BOOST_CHECK(state.seats[1].player.empty());
+	BOOST_CHECK_EQUAL(stackOf(*table, 0), 100);
+	BOOST_CHECK_EQUAL(stackOf(*table, 2), 101);
+}
+
+BOOST_AUTO_TEST_CASE(table_leave_on_turn)
+{
+	boost::asio::io_service ios;
+	std::vector<ConnectionPtr> players;
+	auto table = startTable(ios, players, { 100, 100 }, makeDeck(Seed()));
+
+	// leaving on one's turn is a fold, heads up that ends the hand
+	table->leave(players[0]);
+	const TableState& state = table->getState();
+	BOOST_CHECK_EQUAL(state.street, street_showdown);
+	BOOST_CHECK(state.seats[0].player.empty());
+	BOOST_CHECK_EQUAL(stackOf(*table, 1), 101);
+}
+
+BOOST_AUTO_TEST_CASE(table_ledger_fails_mid_hand)
+{
+	LedgerOptions options;
+	options.path = "test-table-ledger.wal";
+	std::remove(options.path.c_str());
+	std::atomic<bool> failing(false);
+	options.failWrite = [&failing]() { return failing.load(); };
+	{
+		auto ledger = std::make_shared<Ledger>(options);
+		for (int i = 0; i < 3; ++i)
+			BOOST_REQUIRE(deposit(*ledger, "p" + std::to_string(i), 1000));
+		TableServices services;
+		services.wallets = std::make_shared<Wallets>(ledger);
+		boost::asio::io_service ios;
+		std::vector<ConnectionPtr> players;
+		auto table = startTable(ios, players, { 100, 100, 100 }, makeDeck(Seed()), services);
+		const TableState& state = table->getState();
+		BOOST_CHECK_EQUAL(state.toAct, 0);
+
+		// the disk fails while the hand runs, the ledger turns read only
+		failing = true;
+		BOOST_CHECK(!deposit(*ledger, "house", 1));
+		BOOST_CHECK(ledger->getStats().readOnly);
+
+		// the hand still ends, with no pot award logged and no cash out for who left
+		table->leave(players[1]);
+		BOOST_CHECK_NO_THROW(table->act(players[0], action_fold, 0));
+		BOOST_CHECK_EQUAL(state.street, street_showdown);
+		BOOST_CHECK_EQUAL(stackOf(*table, 2), 101);
+
+		// the chips stay on the table, the player sits out and is in the snapshot
+		BOOST_CHECK_EQUAL(state.seats[1].player, "p1");
+		BOOST_CHECK_EQUAL(stackOf(*table, 1), 99);
+		BOOST_CHECK_EQUAL(table->capture().players.size(), 3u);
+		BOOST_CHECK_EQUAL(ledger->getBalance("p1"), 900);
+
+		// and seats change no more, nobody is left halfway
+		BOOST_CHECK_THROW(table->leave(players[0]), msgpack::rpc::msgerror);
+		BOOST_CHECK_EQUAL(state.seats[0].player, "p0");
+		players.push_back(std::make_shared<msgpack::rpc::TcpConnection>(ios));
+		BOOST_CHECK_THROW(table->join(players.back(), 3, "p3", 100), msgpack::rpc::msgerror);
+		BOOST_CHECK(state.seats[3].player.empty());
+	}
+	std::remove(options.path.c_str());
+}
+
+BOOST_AUTO_TEST_CASE(table_buy_in_settles)
+{
+	LedgerOptions options;
+	options.path = "test-table-buy-in.wal";
+	std::remove(options.path.c_str());
+	std::atomic<bool> failing(false);
+	options.failWrite = [&failing]() { return failing.load(); };
+	{
+		auto ledger = std::make_shared<Ledger>(options);
+		BOOST_REQUIRE(deposit(*ledger, "p0", 1000));
+		BOOST_REQUIRE(deposit(*ledger, "p1", 1000));
+		TableServices services;
+		services.wallets = std::make_shared<Wallets>(ledger);
+		TableConfig config;
+		config.seats = 6;
+		boost::asio::io_service ios;
+		auto table = std::make_shared<Table>(ios, 1, config, services);
+		const TableState& state = table->getState();
+		std::vector<ConnectionPtr> players;
+		for (int i = 0; i < 2; ++i)
+			players.push_back(std::make_shared<msgpack::rpc::TcpConnection>(ios));
+
+		// the seat is held, not played nor captured, until the buy in is durable
+		table->join(players[0], 0, "p0", 100);
+		BOOST_CHECK_EQUAL(state.seats[0].player, "p0");
+		BOOST_CHECK(table->capture().players.empty());
+		BOOST_CHECK_THROW(table->leave(players[0]), msgpack::rpc::msgerror);
+		BOOST_REQUIRE(waitDurable(*ledger));
+		ios.poll();
+		BOOST_CHECK_EQUAL(table->capture().players.size(), 1u);
+
+		// a buy in whose commit fails frees the seat, no hand is dealt with chips never paid
+		failing = true;
+		table->join(players[1], 1, "p1", 100);
+		BOOST_CHECK_EQUAL(state.street, street_waiting);
+		bool idle = false;
+		table->whenIdle([&idle](Table&) { idle = true; });
+		BOOST_CHECK(!idle);
+		BOOST_CHECK(!waitDurable(*ledger));
+		ios.reset();
+		ios.poll();
+		BOOST_CHECK(idle);
+		BOOST_CHECK(state.seats[1].player.empty());
+		BOOST_CHECK_EQUAL(state.street, street_waiting);
+		BOOST_CHECK_EQUAL(table->capture().players.size(), 1u);
+		BOOST_CHECK_EQUAL(ledger->getBalance("p1"), 1000);
+	}
+	std::remove(options.path.c_str());
+}
+
+BOOST_AUTO_TEST_CASE(table_sync_delta)
+{
+	TableState first;
+	first.tableId = 3;
+	first.version = 1;
+	first.street = street_preflop;
+	first.button = 0;
+	first.toAct = 1;
+	first.smallBlind = 1;
+	first.bigBlind = 2;
+	first.seats.resize(3);
+	first.seats[0].player = "p0";
+	first.seats[0].stack = 99;
+	first.seats[1].player = "p1";
+	first.seats[1].stack = 98;
+
+	// the flop after a call, one seat changes and one joins past the end
+	TableState second = first;
+	second.version = 2;
+	second.street = street_flop;
+	second.toAct = 0;
+	second.pot = 4;
+	second.board = { 1, 2, 3 };
+	second.seats[0].stack = 98;
+	second.seats.resize(4);
+	second.seats[3].player = "p3";
+	second.seats[3].stack = 200;
+
+	TableSync sync;
+	sync.publish(first);
+	sync.publish(second);
+	BOOST_CHECK_EQUAL(sync.getVersion(), 2u);
+	BOOST_CHECK(!sync.update(2));
+
+	auto delta = sync.update(1);
+	BOOST_REQUIRE(delta);
+	BOOST_CHECK(sync.update(1) == delta);
+	msgpack::unpacked unpacked;
+	msgpack::unpack(unpacked, delta->data(), delta->size());
+	msgpack::rpc::MsgNotify<std::string, msgpack::object> notify;
+	unpacked.get().convert(&notify);
+	BOOST_CHECK_EQUAL(notify.method, "table_delta");
+	BOOST_REQUIRE_EQUAL(notify.param.type, msgpack::type::ARRAY);
+	BOOST_REQUIRE_EQUAL(notify.param.via.array.size, 4u);
+	BOOST_CHECK_EQUAL(notify.param.via.array.ptr[0].as<uint32_t>(), 3u);
+	BOOST_CHECK_EQUAL(notify.param.via.array.ptr[1].as<uint64_t>(), 1u);
+
+	// the client's copy of version 1 ends up equal to version 2
+	TableState client = first;
+	TableSync::apply(client, notify.param.via.array.ptr[2].as<uint64_t>(), notify.param.via.array.ptr[3]);
+	BOOST_CHECK_EQUAL(client.version, 2u);
+	BOOST_CHECK_EQUAL(client.street, street_flop);
+	BOOST_CHECK_EQUAL(client.toAct, 0);
+	BOOST_CHECK_EQUAL(client.pot, 4);
+	BOOST_CHECK(client.board == second.board);
+	BOOST_REQUIRE_EQUAL(client.seats.size(), 4u);
+	for (size_t seat = 0; seat < client.seats.size(); ++seat)
+		BOOST_CHECK(client.seats[seat] == second.seats[seat]);
+
+	// a client with nothing, or with a version not kept here, gets the whole state
+	auto snapshot = sync.update(0);
+	BOOST_REQUIRE(snapshot);
+	msgpack::unpack(unpacked, snapshot->data(), snapshot->size());
+	unpacked.get().convert(&notify);
+	BOOST_CHECK_EQUAL(notify.method, "table_state");
+	BOOST_CHECK(sync.update(7) != nullptr);
+}
+
+BOOST_AUTO_TEST_CASE(lobby_pages_and_seats)
+{
+	// stakes then table id order, other games left out
+	Lobby lobby;
+	lobby.update(lobbyEntry(5, "holdem", 4, 6, 2));
+	lobby.update(lobbyEntry(2, "holdem", 2, 6, 6));
+	lobby.update(lobbyEntry(9, "holdem", 2, 6, 1));
+	lobby.update(lobbyEntry(7, "holdem", 2, 6, 4));
+	lobby.update(lobbyEntry(3, "omaha", 2, 6, 0));
+	LobbyPage page = lobby.list("holdem", LobbyCursor(), 2);
+	BOOST_CHECK(idsOf(page) == std::vector<uint32_t>({ 2, 7 }));
+	BOOST_CHECK(page.more);
+	page = lobby.list("holdem", page.next, 2);
+	BOOST_CHECK(idsOf(page) == std::vector<uint32_t>({ 9, 5 }));
+	BOOST_CHECK(!page.more);
+	BOOST_CHECK(lobby.list("holdem", page.next, 2).tables.empty());
+
+	// the fullest table with a free seat, a full one is passed over
+	LobbyEntry best;
+	BOOST_REQUIRE(lobby.findBest("holdem", 1, 2, best));
+	BOOST_CHECK_EQUAL(best.tableId, 7u);
+	lobby.update(lobbyEntry(7, "holdem", 2, 6, 6));
+	BOOST_REQUIRE(lobby.findBest("holdem", 1, 2, best));
+	BOOST_CHECK_EQUAL(best.tableId, 9u);
+	lobby.remove(9);
+	BOOST_CHECK(!lobby.findBest("holdem", 1, 2, best));
+	BOOST_CHECK_EQUAL(lobby.size(), 4u);
+
+	// lobby_seat fills the open table of the stakes, then opens another
+	boost::asio::io_service ios;
+	std::unique_ptr<boost::asio::io_service::work> work(new boost::asio::io_service::work(ios));
+	boost::asio::ip::tcp::acceptor acceptor(ios, boost::asio::ip::tcp::endpoint(boost::asio::ip::address_v4::loopback(), 0));
+	std::thread io([&ios]() { ios.run(); });
+	auto tables = std::make_shared<TableManager>(1);
+	msgpack::rpc::Dispatcher disp;
+	addLobbyHandlers(disp, tables);
+	TableConfig config;
+	config.seats = 2;
+	uint32_t open = tables->create(config)->getId();
+
+	std::vector<ConnectionPtr> players;
+	std::vector<std::unique_ptr<boost::asio::ip::tcp::socket>> sockets;
+	std::vector<uint32_t> seatedAt;
+	for (int i = 0; i < 3; ++i)
+	{
+		sockets.emplace_back(new boost::asio::ip::tcp::socket(ios));
+		players.push_back(connectPeer(ios, acceptor, *sockets.back()));
+		players.back()->setIdentity("p" + std::to_string(i));
+
+		TableState state = callFrom<TableState>(disp, players.back(), *sockets.back(),
+			"lobby_seat", std::string("holdem"), int64_t(1), int64_t(2), int64_t(100));
+		seatedAt.push_back(state.tableId);
+	}
+	BOOST_CHECK_EQUAL(seatedAt[0], open);
+	BOOST_CHECK_EQUAL(seatedAt[1], open);
+	BOOST_CHECK_NE(seatedAt[2], open);
+	LobbyEntry entry;
+	BOOST_REQUIRE(tables->getLobby().findBest("holdem", 1, 2, entry));
+	BOOST_CHECK_EQUAL(entry.tableId, seatedAt[2]);
+	BOOST_CHECK_EQUAL(entry.players, 1u);
+
+	tables.reset();
+	work.reset();
+	ios.stop();
+	io.join();
+}
+
+BOOST_AUTO_TEST_CASE(lobby_page_within_bulk_bound)
+{
+	// long game names make for fewer tables a page, the reply still fits one bulk message
+	Lobby lobby;
+	std::string game(300, 'g');
+	for (uint32_t id = 1; id <= 250; ++id)
+		lobby.update(lobbyEntry(id, game, 1000000000000LL, 10, 3));
+
+	std::set<uint32_t> listed;
+	LobbyPage page;
+	size_t pages = 0;
+	do
+	{
+		page = lobby.list(game, page.next, Lobby::MAX_PAGE);
+		msgpack::rpc::MsgResponse<LobbyPage, bool> reply(page, false, 0xffffffff);
+		BOOST_CHECK_LE(msgpack::rpc::packExact(reply)->size(), size_t(Lobby::MAX_PAGE_BYTES));
+		BOOST_CHECK_LT(page.tables.size(), size_t(Lobby::MAX_PAGE));
+		BOOST_REQUIRE(!page.tables.empty());
+		for (auto& entry : page.tables)
+			listed.insert(entry.tableId);
+		++pages;
+	} while (page.more);
+	BOOST_CHECK_EQUAL(listed.size(), 250u);
+	BOOST_CHECK_GT(pages, 3u);
+
+	// a short name still pages by count
+	for (uint32_t id = 1001; id <= 1150; ++id)
+		lobby.update(lobbyEntry(id, "holdem", 2, 6, 1));
+	BOOST_CHECK_EQUAL(lobby.list("holdem", LobbyCursor(), 0).tables.size(), size_t(Lobby::MAX_PAGE));
+
+	// a name longer than a page gets a table a page
+	std::string huge(Lobby::MAX_PAGE_BYTES, 'h');
+	lobby.update(lobbyEntry(301, huge, 2, 6, 1));
+	lobby.update(lobbyEntry(302, huge, 2, 6, 1));
+	page = lobby.list(huge, LobbyCursor(), 0);
+	BOOST_CHECK(idsOf(page) == std::vector<uint32_t>({ 301 }));
+	BOOST_CHECK(page.more);
+}
+
+BOOST_AUTO_TEST_CASE(resume_restores_snapshot)
+{
+	boost::asio::io_service ios;
+	std::unique_ptr<boost::asio::io_service::work> work(new boost::asio::io_service::work(ios));
+	boost::asio::ip::tcp::acceptor acceptor(ios, boost::asio::ip::tcp::endpoint(boost::asio::ip::address_v4::loopback(), 0));
+	std::thread io([&ios]() { ios.run(); });
+	const std::string path = "test-resume.snap";
+	std::remove(path.c_str());
+
+	// two players sit down, each session with its resume token, and a hand starts
+	uint32_t tableId = 0;
+	{
+		TableManager before(1);
+		TableConfig config;
+		config.seats = 6;
+		auto table = before.create(config);
+		tableId = table->getId();
+		std::vector<ConnectionPtr> players;
+		for (int seat = 0; seat < 2; ++seat)
+		{
+			players.push_back(std::make_shared<msgpack::rpc::TcpConnection>(ios));
+			players.back()->setResumeToken("token-" + std::to_string(seat));
+		}
+		std::promise<void> seated;
+		table->post([&players, &seated](Table& table)
+		{
+			table.join(players[0], 0, "p0", 100);
+			table.join(players[1], 1, "p1", 200);
+			seated.set_value();
+		});
+		seated.get_future().get();
+
+		// the chips in the hand go back to their owners in the snapshot
+		BOOST_REQUIRE(before.saveSnapshot(path));
+	}
+
+	ServerSnapshot saved;
+	BOOST_REQUIRE(snapshot::load(path, saved));
+	BOOST_REQUIRE_EQUAL(saved.tables.size(), 1u);
+	BOOST_REQUIRE_EQUAL(saved.tables[0].players.size(), 2u);
+	BOOST_CHECK_EQUAL(saved.tables[0].players[0].stack, 100);
+	BOOST_CHECK_EQUAL(saved.tables[0].players[1].token, "token-1");
+
+	// a restarted server has the table back and the seats wait for their tokens
+	auto after = std::make_shared<TableManager>(1);
+	BOOST_CHECK_EQUAL(after->restore(path), 1u);
+	BOOST_REQUIRE(after->find(tableId));
+	msgpack::rpc::Dispatcher disp;
+	addResumeHandlers(disp, after);
+	boost::asio::ip::tcp::socket socket(ios);
+	auto back = connectPeer(ios, acceptor, socket);
+	BOOST_CHECK_EQUAL(callFrom<uint32_t>(disp, back, socket, "session_resume", std::string("token-0")), 1u);
+
+	// a token resumes once, one never issued resumes nothing
+	BOOST_CHECK_EQUAL(callFrom<uint32_t>(disp, back, socket, "session_resume", std::string("token-0")), 0u);
+	BOOST_CHECK_EQUAL(callFrom<uint32_t>(disp, back, socket, "session_resume", std::string("token-9")), 0u);
+	std::promise<TableState> state;
+	after->find(tableId)->post([&state](Table& table) { state.set_value(table.getState()); });
+	TableState restored = state.get_future().get();
+	BOOST_CHECK_EQUAL(restored.seats[0].player, "p0");
+	BOOST_CHECK_EQUAL(restored.seats[1].player, "p1");
+	BOOST_CHECK_EQUAL(after->snapshot().tables[0].players[1].stack, 200);
+
+	// a file that fails its crc restores nothing
+	{
+		std::fstream file(path, std::ios::in | std::ios::out | std::ios::binary);
+		file.seekp(snapshot::HEADER_SIZE);
+		file.put('\xff');
+	}
+	BOOST_CHECK_EQUAL(TableManager(1).restore(path), 0u);
+
+	after.reset();
+	std::remove(path.c_str());
+	work.reset();
+	ios.stop();
+	io.join();
+}
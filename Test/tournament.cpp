@@ -0,0 +1,431 @@
+#include <boost/test/unit_test.hpp>
+#include <algorithm>
+#include <chrono>
+#include <future>
+#include <map>
+#include <random>
+#include <set>
+#include <thread>
+#include "../Poker/Tournament.h"
+#include "../Poker/PokerHandlers.h"
+#include "Dispatcher.h"
+
+using namespace poker;
+using boost::asio::ip::tcp;
+
+namespace {
+
+typedef std::map<uint32_t, uint32_t> Counts;
+
+/// players at each table once moves are done
+Counts applyMoves(const std::vector<TableCount>& tables, const std::vector<TableMove>& moves)
+{
+	Counts counts;
+	for (auto& table : tables)
+		counts[table.tableId] = table.players;
+	for (auto& move : moves)
+	{
+		BOOST_REQUIRE(counts[move.from] >= move.players);
+		counts[move.from] -= move.players;
+		counts[move.to] += move.players;
+	}
+	return counts;
+}
+
+bool sameMove(const TableMove& move, uint32_t from, uint32_t to, uint32_t players)
+{
+	return move.from == from && move.to == to && move.players == players;
+}
+
+/// a server side connection whose client end is socket, ios runs on another thread
+Table::ConnectionPtr connectPeer(boost::asio::io_service& ios, tcp::acceptor& acceptor, tcp::socket& socket)
+{
+	auto connection = std::make_shared<msgpack::rpc::TcpConnection>(ios);
+	connection->asyncConnect(acceptor.local_endpoint());
+	acceptor.accept(socket);
+	while (connection->getConnectionStatus() != msgpack::rpc::connection_connected)
+		std::this_thread::yield();
+	return connection;
+}
+
+/// call method of disp as connection, the error code of the reply its peer reads
+/// on socket and, if there is none, the result in result
+template<typename R, typename... TArgs>
+int callFrom(msgpack::rpc::Dispatcher& disp, Table::ConnectionPtr connection, tcp::socket& socket,
+	R& result, const std::string& method, TArgs... args)
+{
+	msgpack::rpc::MsgRequest<std::string, std::tuple<TArgs...>> request(method, std::tuple<TArgs...>(args...), 1);
+	auto sbuf = msgpack::rpc::packExact(request);
+	msgpack::unpacked unpacked;
+	msgpack::unpack(unpacked, sbuf->data(), sbuf->size());
+	disp.dispatch(unpacked.get(), connection);
+
+	msgpack::unpacker unpacker;
+	msgpack::rpc::MsgRpc rpc;
+	do
+	{
+		while (!unpacker.next(&unpacked))
+		{
+			unpacker.reserve_buffer(4096);
+			size_t read = socket.read_some(boost::asio::buffer(unpacker.buffer(), unpacker.buffer_capacity()));
+			unpacker.buffer_consumed(read);
+		}
+		unpacked.get().convert(&rpc);
+	} while (!rpc.is_response());
+	msgpack::rpc::MsgResponse<msgpack::object, msgpack::object> response;
+	unpacked.get().convert(&response);
+	if (response.error.type == msgpack::type::NIL || (response.error.type == msgpack::type::BOOLEAN && !response.error.via.boolean))
+	{
+		response.result.convert(&result);
+		return msgpack::rpc::success;
+	}
+	std::tuple<int, std::string> error;
+	response.result.convert(&error);
+	return std::get<0>(error);
+}
+
+/// a player's client end, what its tables send is read as it comes
+struct Peer
+{
+	explicit Peer(boost::asio::io_service& ios): socket(ios) { }
+
+	tcp::socket socket;
+	Table::ConnectionPtr connection;
+	msgpack::unpacker unpacker;
+	std::vector<uint32_t> levels;		// of the tournament_level notifies, in the order they came
+	bool finished = false;
+};
+
+/// take in what peer was sent so far, without waiting for more
+void drain(Peer& peer)
+{
+	while (peer.socket.available())
+	{
+		peer.unpacker.reserve_buffer(64 * 1024);
+		size_t read = peer.socket.read_some(boost::asio::buffer(peer.unpacker.buffer(), peer.unpacker.buffer_capacity()));
+		peer.unpacker.buffer_consumed(read);
+	}
+	msgpack::unpacked unpacked;
+	while (peer.unpacker.next(&unpacked))
+	{
+		msgpack::rpc::MsgRpc rpc;
+		unpacked.get().convert(&rpc);
+		if (!rpc.is_notify())
+			continue;
+		msgpack::rpc::MsgNotify<std::string, msgpack::object> notify;
+		unpacked.get().convert(&notify);
+		if (notify.method == "tournament_level")
+		{
+			std::tuple<uint32_t, uint32_t, int64_t, int64_t, bool, uint32_t> level;
+			notify.param.convert(&level);
+			peer.levels.push_back(std::get<1>(level));
+		}
+		else if (notify.method == "tournament_finished")
+			peer.finished = true;
+	}
+}
+
+/// run fn on the scheduler thread and wait for it, what it throws is thrown here
+template<typename F>
+void onScheduler(TournamentScheduler& scheduler, F fn)
+{
+	auto done = std::make_shared<std::promise<void>>();
+	scheduler.post([done, fn](TournamentScheduler& self) mutable
+	{
+		try
+		{
+			fn(self);
+			done->set_value();
+		}
+		catch (...)
+		{
+			done->set_exception(std::current_exception());
+		}
+	});
+	done->get_future().get();
+}
+
+/// the tables each player was seen at, filled in on the table strands
+struct Sightings
+{
+	std::mutex mtx;
+	std::map<std::string, std::set<uint32_t>> tables;
+};
+
+/// whoever is to act at table calls a bet or goes all in, so every hand is a showdown
+void playAllIn(Table& table, const std::map<std::string, Table::ConnectionPtr>& players, Sightings& seen)
+{
+	const TableState& state = table.getState();
+	{
+		std::lock_guard<std::mutex> lock(seen.mtx);
+		for (auto& seat : state.seats)
+		{
+			if (!seat.player.empty())
+				seen.tables[seat.player].insert(table.getId());
+		}
+	}
+	if (state.street < street_preflop || state.street > street_river || state.toAct < 0)
+		return;
+	const SeatState& seat = state.seats[state.toAct];
+	auto player = players.find(seat.player);
+	if (player == players.end())
+		return;
+	try
+	{
+		if (state.currentBet > seat.bet)
+			table.act(player->second, action_call, 0);
+		else
+			table.act(player->second, action_bet, seat.bet + seat.stack);
+	}
+	catch (msgpack::rpc::msgerror&)
+	{
+	}
+}
+
+}
+
+BOOST_AUTO_TEST_CASE(plan_moves_evens_out)
+{
+	// the two full tables give to the short one until all are within one
+	auto moves = TournamentScheduler::planMoves({ { 1, 9 }, { 2, 9 }, { 3, 4 } }, 9);
+	BOOST_REQUIRE_EQUAL(moves.size(), 2u);
+	BOOST_CHECK(sameMove(moves[0], 1, 3, 1));
+	BOOST_CHECK(sameMove(moves[1], 2, 3, 2));
+
+	// already within one, nobody moves
+	BOOST_CHECK(TournamentScheduler::planMoves({ { 1, 6 }, { 2, 5 } }, 9).empty());
+	BOOST_CHECK(TournamentScheduler::planMoves({}, 9).empty());
+	BOOST_CHECK(TournamentScheduler::planMoves({ { 1, 0 }, { 2, 0 } }, 9).empty());
+}
+
+BOOST_AUTO_TEST_CASE(plan_moves_breaks_tables)
+{
+	// twelve players fit two tables of six, the shortest table breaks
+	auto moves = TournamentScheduler::planMoves({ { 1, 5 }, { 2, 4 }, { 3, 3 } }, 6);
+	BOOST_REQUIRE_EQUAL(moves.size(), 2u);
+	BOOST_CHECK(sameMove(moves[0], 3, 1, 1));
+	BOOST_CHECK(sameMove(moves[1], 3, 2, 2));
+
+	// the final table
+	std::vector<TableCount> tables = { { 4, 2 }, { 7, 3 }, { 9, 1 } };
+	auto counts = applyMoves(tables, TournamentScheduler::planMoves(tables, 9));
+	BOOST_CHECK_EQUAL(counts[7], 6u);
+	BOOST_CHECK_EQUAL(counts[4], 0u);
+	BOOST_CHECK_EQUAL(counts[9], 0u);
+}
+
+BOOST_AUTO_TEST_CASE(plan_moves_invariants)
+{
+	std::mt19937 rng(7);
+	for (int round = 0; round < 200; ++round)
+	{
+		uint32_t seats = 2 + rng() % 9;
+		std::vector<TableCount> tables;
+		uint32_t total = 0;
+		for (uint32_t id = 1, n = 1 + rng() % 12; id <= n; ++id)
+		{
+			tables.push_back(TableCount{ id, static_cast<uint32_t>(rng() % (seats + 1)) });
+			total += tables.back().players;
+		}
+		auto moves = TournamentScheduler::planMoves(tables, seats);
+		auto counts = applyMoves(tables, moves);
+
+		// as few tables as fit everyone, none over full, all within one of each other
+		uint32_t kept = 0, fewest = seats, most = 0, after = 0;
+		for (auto& count : counts)
+		{
+			after += count.second;
+			if (!count.second)
+				continue;
+			++kept;
+			fewest = std::min(fewest, count.second);
+			most = std::max(most, count.second);
+		}
+		BOOST_CHECK_EQUAL(after, total);
+		if (!total)
+			continue;
+		BOOST_CHECK_EQUAL(kept, std::min<uint32_t>(static_cast<uint32_t>(tables.size()), (total + seats - 1) / seats));
+		BOOST_CHECK(most <= seats);
+		BOOST_CHECK(most - fewest <= 1);
+
+		// nobody is moved onto a table that is broken or off one that gains players
+		for (auto& move : moves)
+		{
+			BOOST_CHECK(counts[move.to] > 0);
+			for (auto& other : moves)
+				BOOST_CHECK(other.to != move.from);
+		}
+	}
+}
+
+BOOST_AUTO_TEST_CASE(tournament_register_as_account)
+{
+	boost::asio::io_service ios;
+	std::unique_ptr<boost::asio::io_service::work> work(new boost::asio::io_service::work(ios));
+	tcp::acceptor acceptor(ios, tcp::endpoint(boost::asio::ip::address_v4::loopback(), 0));
+	std::thread io([&ios]() { ios.run(); });
+	auto tables = std::make_shared<TableManager>(1);
+	auto scheduler = std::make_shared<TournamentScheduler>(tables);
+	msgpack::rpc::Dispatcher disp;
+	msgpack::rpc::Dispatcher admin;
+	addTournamentHandlers(disp, scheduler);
+	addTournamentAdminHandlers(admin, scheduler);
+	tcp::socket socket(ios);
+	auto connection = connectPeer(ios, acceptor, socket);
+
+	// tournaments are set up from the operator's side only
+	BlindLevel level;
+	level.smallBlind = 10;
+	level.bigBlind = 20;
+	level.durationMs = 60 * 1000;
+	std::vector<BlindLevel> levels = { level };
+	uint32_t id = 0;
+	BOOST_CHECK_EQUAL(callFrom(disp, connection, socket, id, "tournament_create", std::string("sunday"), 9u, int64_t(1000), levels),
+		msgpack::rpc::error_dispatcher_no_handler);
+	BOOST_REQUIRE_EQUAL(callFrom(admin, connection, socket, id, "tournament_create", std::string("sunday"), 9u, int64_t(1000), levels),
+		msgpack::rpc::success);
+	bool started = false;
+	BOOST_CHECK_EQUAL(callFrom(disp, connection, socket, started, "tournament_start", id), msgpack::rpc::error_dispatcher_no_handler);
+
+	// players register as the account they logged in as, and only once
+	uint32_t entrants = 0;
+	BOOST_CHECK_EQUAL(callFrom(disp, connection, socket, entrants, "tournament_register", id), msgpack::rpc::error_not_authorized);
+	BOOST_CHECK_EQUAL(callFrom(disp, connection, socket, entrants, "tournament_register", id, std::string("bob")),
+		msgpack::rpc::error_params_too_many);
+	connection->setIdentity("alice");
+	BOOST_CHECK_EQUAL(callFrom(disp, connection, socket, entrants, "tournament_register", id), msgpack::rpc::success);
+	BOOST_CHECK_EQUAL(entrants, 1u);
+	BOOST_CHECK_EQUAL(callFrom(disp, connection, socket, entrants, "tournament_register", id), msgpack::rpc::error_illegal_action);
+
+	TournamentInfo info;
+	BOOST_CHECK_EQUAL(callFrom(disp, connection, socket, info, "tournament_info", id), msgpack::rpc::success);
+	BOOST_CHECK_EQUAL(info.entrants, 1u);
+	BOOST_CHECK_EQUAL(info.status, tournament_registering);
+
+	scheduler.reset();
+	tables.reset();
+	work.reset();
+	ios.stop();
+	io.join();
+}
+
+BOOST_AUTO_TEST_CASE(tournament_plays_down_to_one)
+{
+	boost::asio::io_service ios;
+	std::unique_ptr<boost::asio::io_service::work> work(new boost::asio::io_service::work(ios));
+	tcp::acceptor acceptor(ios, tcp::endpoint(boost::asio::ip::address_v4::loopback(), 0));
+	std::thread io([&ios]() { ios.run(); });
+	auto tables = std::make_shared<TableManager>(1);
+	auto scheduler = std::make_shared<TournamentScheduler>(tables);
+
+	// five players on two tables of three, one level, a break, then blinds that last
+	TournamentConfig config;
+	config.name = "turbo";
+	config.seatsPerTable = 3;
+	config.startingStack = 1000;
+	config.actionTimeoutMs = 10 * 1000;
+	config.nextHandDelayMs = 100;
+	BlindLevel level;
+	level.smallBlind = 10;
+	level.bigBlind = 20;
+	level.durationMs = 1000;
+	BlindLevel pause;
+	pause.isBreak = true;
+	pause.durationMs = 1000;
+	BlindLevel last;
+	last.smallBlind = 25;
+	last.bigBlind = 50;
+	last.durationMs = 10 * 60 * 1000;
+	config.levels = { level, pause, last };
+
+	std::vector<std::unique_ptr<Peer>> peers;
+	std::map<std::string, Table::ConnectionPtr> players;
+	uint32_t id = 0;
+	onScheduler(*scheduler, [&id, config](TournamentScheduler& self) { id = self.create(config); });
+	for (int i = 0; i < 5; ++i)
+	{
+		peers.emplace_back(new Peer(ios));
+		Peer& peer = *peers.back();
+		peer.connection = connectPeer(ios, acceptor, peer.socket);
+		std::string player = "player" + std::to_string(i);
+		players[player] = peer.connection;
+		auto connection = peer.connection;
+		onScheduler(*scheduler, [id, player, connection](TournamentScheduler& self) { self.enroll(id, player, connection); });
+	}
+	onScheduler(*scheduler, [id](TournamentScheduler& self) { self.start(id); });
+	TournamentInfo info;
+	onScheduler(*scheduler, [&info, id](TournamentScheduler& self) { info = self.getInfo(id); });
+	BOOST_CHECK_EQUAL(info.status, tournament_running);
+	BOOST_REQUIRE_EQUAL(info.tables.size(), 2u);
+	std::vector<uint32_t> started = info.tables;
+
+	// the wheel moves the levels on while nobody acts
+	auto allSeen = [&peers](size_t levels)
+	{
+		for (auto& peer : peers)
+		{
+			drain(*peer);
+			if (peer->levels.size() < levels)
+				return false;
+		}
+		return true;
+	};
+	for (int i = 0; i < 1000 && !allSeen(3); ++i)
+		std::this_thread::sleep_for(std::chrono::milliseconds(10));
+	for (auto& peer : peers)
+		BOOST_CHECK(peer->levels == std::vector<uint32_t>({ 0, 1, 2 }));
+	onScheduler(*scheduler, [&info, id](TournamentScheduler& self) { info = self.getInfo(id); });
+	BOOST_CHECK_EQUAL(info.level, 2u);
+	BOOST_CHECK_EQUAL(info.playersLeft, 5u);
+
+	// all in every hand until one is left, the tables break on the way
+	auto seen = std::make_shared<Sightings>();
+	for (int i = 0; i < 3000 && info.status == tournament_running; ++i)
+	{
+		for (uint32_t tableId : info.tables)
+		{
+			if (auto table = tables->find(tableId))
+				table->post([players, seen](Table& table) { playAllIn(table, players, *seen); });
+		}
+		std::this_thread::sleep_for(std::chrono::milliseconds(10));
+		for (auto& peer : peers)
+			drain(*peer);
+		onScheduler(*scheduler, [&info, id](TournamentScheduler& self) { info = self.getInfo(id); });
+	}
+	BOOST_REQUIRE_EQUAL(info.status, tournament_finished);
+	BOOST_CHECK_EQUAL(info.playersLeft, 1u);
+	BOOST_REQUIRE_EQUAL(info.standings.size(), 5u);
+	std::set<std::string> standings(info.standings.begin(), info.standings.end());
+	BOOST_CHECK_EQUAL(standings.size(), 5u);
+	BOOST_CHECK(info.tables.empty());
+	for (uint32_t tableId : started)
+		BOOST_CHECK(!tables->find(tableId));
+
+	// the last two sat at one table, so somebody was moved there between hands
+	size_t moved = 0;
+	{
+		std::lock_guard<std::mutex> lock(seen->mtx);
+		for (auto& player : seen->tables)
+			moved += player.second.size() > 1 ? 1 : 0;
+	}
+	BOOST_CHECK(moved > 0);
+
+	// the winner is told, and every level came once to everyone
+	auto won = players[info.standings.front()];
+	Peer& winner = **std::find_if(peers.begin(), peers.end(),
+		[&won](const std::unique_ptr<Peer>& peer) { return peer->connection == won; });
+	for (int i = 0; i < 500 && !winner.finished; ++i)
+	{
+		std::this_thread::sleep_for(std::chrono::milliseconds(10));
+		drain(winner);
+	}
+	BOOST_CHECK(winner.finished);
+	for (auto& peer : peers)
+		BOOST_CHECK(peer->levels == std::vector<uint32_t>({ 0, 1, 2 }));
+
+	scheduler.reset();
+	tables.reset();
+	work.reset();
+	ios.stop();
+	io.join();
+}
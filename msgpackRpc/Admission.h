@@ -0,0 +1,95 @@
+#pragma once
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <vector>
+
+namespace msgpack {
+namespace rpc {
+
+/// Limits used to shed load instead of queuing it. 0 means unlimited.
+struct AdmissionLimits
+{
+	size_t maxInflightRequests = 0;		// per session, requests not answered yet
+	size_t maxPendingWriteBytes = 0;	// per connection, bytes queued but not written
+	size_t maxServerWork = 0;			// per server, requests in progress over all sessions
+};
+
+/// Shared by all sessions of one server, counts the work in progress.
+class AdmissionControl
+{
+public:
+	AdmissionControl(const AdmissionLimits& limits) :
+		_limits(limits),
+		_work(0),
+		_rejected(0),
+		_hasWaiters(false)
+	{
+	}
+
+	const AdmissionLimits& limits() const { return _limits; }
+
+	/// Take one unit of server work, false if the server is saturated.
+	bool tryAcquire()
+	{
+		size_t work = _work.fetch_add(1, std::memory_order_relaxed);
+		if (_limits.maxServerWork && work >= _limits.maxServerWork)
+		{
+			_work.fetch_sub(1, std::memory_order_relaxed);
+			return false;
+		}
+		return true;
+	}
+
+	void release()
+	{
+		_work.fetch_sub(1, std::memory_order_relaxed);
+		if (_hasWaiters.load(std::memory_order_acquire))
+			wakeIfBelow();
+	}
+
+	/// call wake once the server work is under maxServerWork again, at once if
+	/// it is already. wake runs on the thread that released, post from it.
+	void whenBelowLimit(std::function<void()> wake)
+	{
+		{
+			std::lock_guard<std::mutex> lock(_mtx);
+			_waiters.push_back(wake);
+			_hasWaiters.store(true, std::memory_order_release);
+		}
+		// a release before the push saw no waiter
+		wakeIfBelow();
+	}
+
+	void onRejected() { _rejected.fetch_add(1, std::memory_order_relaxed); }
+
+	size_t getWork() const { return _work.load(std::memory_order_relaxed); }
+	uint64_t getRejected() const { return _rejected.load(std::memory_order_relaxed); }
+
+private:
+	AdmissionLimits _limits;
+	std::atomic<size_t> _work;
+	std::atomic<uint64_t> _rejected;
+
+	void wakeIfBelow()
+	{
+		std::vector<std::function<void()>> waiters;
+		{
+			std::lock_guard<std::mutex> lock(_mtx);
+			if (_limits.maxServerWork && _work.load(std::memory_order_relaxed) >= _limits.maxServerWork)
+				return;
+			waiters.swap(_waiters);
+			_hasWaiters.store(false, std::memory_order_release);
+		}
+		for (auto& wake : waiters)
+			wake();
+	}
+
+	std::mutex _mtx;
+	std::vector<std::function<void()>> _waiters;	// sessions paused by a saturated server
+	std::atomic<bool> _hasWaiters;
+};
+
+} }
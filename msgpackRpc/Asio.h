@@ -1,4 +1,14 @@
 #pragma once
+#include <boost/version.hpp>
+// On linux the sockets run on epoll, one syscall per read or write that does
+// not complete at once. Building everything with BOOST_ASIO_HAS_IO_URING and
+// BOOST_ASIO_DISABLE_EPOLL, and linking liburing, puts them on io_uring instead,
+// where submissions of a turn of the io loop go to the kernel together. It has
+// to be defined for the whole build, a translation unit without it would use
+// another reactor for the same io_service.
+#if defined(BOOST_ASIO_HAS_IO_URING) && (!defined(__linux__) || BOOST_VERSION < 107800)
+#error "the io_uring backend needs linux and boost 1.78 or later"
+#endif
 #ifdef _MSC_VER
 #pragma warning(push)
 #pragma warning(disable:4819)
@@ -10,8 +20,12 @@
 #endif
 #include <memory>
 #include <functional>
+#if defined(_M_IX86) || defined(_M_X64) || defined(__i386__) || defined(__x86_64__)
+#include <immintrin.h>
+#endif
 #include "Protocol.h"
 #include "TupleUtil.h"
+#include "PackBuffer.h"
 
 namespace msgpack {
 namespace rpc {
@@ -26,10 +40,44 @@ enum ServerSideError
     error_params_convert,
     error_not_implemented,
     error_self_pointer_is_null,
+    error_server_overloaded,
+    error_rate_limited,
+    error_server_draining,
+    error_invalid_argument,
+    error_no_reply,
+    error_handler_failed,
+    error_illegal_action,
+    error_connection_lost,
+    error_node_unavailable,
+    error_not_authorized,
 };
 
 typedef std::function<void(boost::system::error_code error)> error_handler_t;
 
+/// one turn of a spin wait, lets the other hyperthread of the core run
+inline void cpuRelax()
+{
+#if defined(_M_IX86) || defined(_M_X64) || defined(__i386__) || defined(__x86_64__)
+	_mm_pause();
+#endif
+}
+
+/// what the sockets of this build run on, for the startup log
+inline const char* ioBackendName()
+{
+#if defined(BOOST_ASIO_HAS_IOCP)
+	return "iocp";
+#elif defined(BOOST_ASIO_HAS_IO_URING) && defined(BOOST_ASIO_DISABLE_EPOLL)
+	return "io_uring";
+#elif defined(BOOST_ASIO_HAS_EPOLL)
+	return "epoll";
+#elif defined(BOOST_ASIO_HAS_KQUEUE)
+	return "kqueue";
+#else
+	return "select";
+#endif
+}
+
 
 
 class msgerror: std::runtime_error
@@ -49,9 +97,7 @@ public:
                 true,
                 msgid);
         // result
-        auto sbuf=std::make_shared<msgpack::sbuffer>();
-        msgpack::pack(*sbuf, msgres);
-        return sbuf;
+        return packExact(msgres);
     }
 
 };
@@ -0,0 +1,572 @@
+#include "Cluster.h"
+#include "ParamView.h"
+#include "PackBuffer.h"
+#include "Hmac.h"
+
+namespace msgpack {
+namespace rpc {
+
+namespace {
+
+// the messages of one flush as [[token, bin, priority], ...], the bins are packed as they are
+template<typename Outbox>
+struct DeliveryBatch
+{
+	const Outbox* messages;
+
+	template<typename Packer>
+	void msgpack_pack(Packer& pk) const
+	{
+		pk.pack_array(static_cast<uint32_t>(messages->size()));
+		for (auto& message : *messages)
+		{
+			pk.pack_array(3);
+			pk.pack(message.token);
+			pk.pack_bin(static_cast<uint32_t>(message.msg->size()));
+			pk.pack_bin_body(message.msg->data(), static_cast<uint32_t>(message.msg->size()));
+			pk.pack(static_cast<int>(message.priority));
+		}
+	}
+};
+
+// what node from sends node to, for the challenge to this connection
+std::string helloMac(const std::string& secret, uint32_t from, uint32_t to, const std::string& challenge)
+{
+	return hmacSha256(secret, "cluster_hello:" + std::to_string(from) + ":" + std::to_string(to) + ":" + challenge);
+}
+
+// identity of a connection that proved to be node
+std::string nodeIdentity(uint32_t node)
+{
+	return "node:" + std::to_string(node);
+}
+
+}
+
+Cluster::Cluster(boost::asio::io_service& ios, std::shared_ptr<Dispatcher> dispatcher, const ClusterOptions& options):
+	_ioService(ios),
+	_dispatcher(dispatcher),
+	_peerDispatcher(std::make_shared<Dispatcher>()),
+	_options(options),
+	_ring(options.virtualNodes),
+	_forwardedCalls(0),
+	_servedCalls(0),
+	_unavailable(0),
+	_deliveries(0),
+	_batches(0),
+	_refusedPeers(0)
+{
+	if (!_options.nodeId)
+		throw msgerror("node id required", error_invalid_argument);
+	if (_options.secret.empty())
+		throw msgerror("cluster secret required", error_invalid_argument);
+
+	_ring.add(_options.nodeId);
+	for (auto& peer : _options.peers)
+		_ring.add(peer.first);
+}
+
+Cluster::~Cluster()
+{
+}
+
+void Cluster::start()
+{
+	std::weak_ptr<Cluster> weak = shared_from_this();
+
+	_dispatcher->set_router([weak](const MsgRequest<msgpack::object, msgpack::object>& req, std::shared_ptr<TcpConnection> connection)
+	{
+		auto self = weak.lock();
+		return self && self->forward(req, connection);
+	});
+
+	addPeerHandlers();
+	_listener.reset(new TcpServer(_ioService, _options.listen));
+	_listener->setDispatcher(_peerDispatcher);
+	_listener->start();
+
+	for (auto& peer : _options.peers)
+	{
+		if (peer.first == _options.nodeId)
+			continue;
+
+		uint32_t node = peer.first;
+		std::unique_ptr<Link> link(new Link());
+		link->client.reset(new TcpClient(_ioService));
+		link->client->setReconnectPolicy(_options.reconnect);
+		link->client->setConnectedHandler([weak, node]()
+		{
+			if (auto self = weak.lock())
+				self->hello(node);
+		});
+		_links[node] = std::move(link);
+	}
+	for (auto& link : _links)
+		link.second->client->asyncConnect(_options.peers[link.first]);
+}
+
+void Cluster::stop()
+{
+	if (_listener)
+		_listener->stop();
+
+	auto self = shared_from_this();
+	_ioService.post([self]()
+	{
+		for (auto& link : self->_links)
+			link.second->client->close();
+
+		std::lock_guard<std::mutex> lock(self->_mtx);
+		for (auto& proxy : self->_proxies)
+			proxy.second->close();
+		self->_proxies.clear();
+	});
+}
+
+void Cluster::addPeerHandlers()
+{
+	std::weak_ptr<Cluster> weak = shared_from_this();
+
+	// a connection is let in by its hello, then may only speak for the node it proved to be
+	_peerDispatcher->set_authorizer([](const std::string& method, const std::shared_ptr<TcpConnection>& connection)
+	{
+		return method == "cluster_challenge" || method == "cluster_hello" || !connection->getIdentity().empty();
+	});
+
+	std::function<void(AsyncReply<std::string>)> challenge = [](AsyncReply<std::string> reply)
+	{
+		// 128 random bits for every connection, a hello seen on one is no good on another
+		reply.result(reply.connection()->getResumeToken());
+	};
+	_peerDispatcher->add_async_handler("cluster_challenge", challenge);
+
+	std::function<void(AsyncReply<bool>, uint32_t, std::string)> hello = [weak](AsyncReply<bool> reply, uint32_t node, std::string mac)
+	{
+		auto self = weak.lock();
+		if (!self)
+			throw msgerror("node stopped", error_node_unavailable);
+		self->onHello(reply, node, mac);
+	};
+	_peerDispatcher->add_async_handler("cluster_hello", hello);
+
+	auto on = [this, weak](const std::string& method, std::function<void(Cluster&, const msgpack::object&)> handler)
+	{
+		_peerDispatcher->add_notify_handler(method, [weak, handler](msgpack::object params, std::shared_ptr<TcpConnection> connection)
+		{
+			auto self = weak.lock();
+			if (!self)
+				return;
+			try
+			{
+				// every notify starts with the node it is from
+				if (params.type != msgpack::type::ARRAY || params.via.array.size == 0
+					|| connection->getIdentity() != nodeIdentity(params.via.array.ptr[0].as<uint32_t>()))
+					return;
+				handler(*self, params);
+			}
+			catch (std::exception&)
+			{
+				// a malformed notify from a peer, there is no one to answer
+			}
+		});
+	};
+	on("cluster_sync", &Cluster::onSync);
+	on("cluster_call", &Cluster::onCall);
+	on("cluster_deliver", &Cluster::onDeliver);
+	on("cluster_gone", &Cluster::onGone);
+	on("cluster_claim", [](Cluster& self, const msgpack::object& params) { self.onClaim(params, true); });
+	on("cluster_release", [](Cluster& self, const msgpack::object& params) { self.onClaim(params, false); });
+}
+
+void Cluster::onHello(AsyncReply<bool> reply, uint32_t node, const std::string& mac)
+{
+	const std::shared_ptr<TcpConnection>& connection = reply.connection();
+	const std::string& challenge = connection->getResumeToken();
+	if (node == _options.nodeId || !_options.peers.count(node) || challenge.empty()
+		|| !macEquals(mac, helloMac(_options.secret, node, _options.nodeId, challenge)))
+	{
+		++_refusedPeers;
+		throw msgerror("not a node of this cluster", error_not_authorized);
+	}
+	connection->setIdentity(nodeIdentity(node));
+	reply.result(true);
+}
+
+void Cluster::hello(uint32_t node)
+{
+	// a new connection, the peer knows nothing of it yet
+	Link& link = *_links[node];
+	link.ready = false;
+
+	std::weak_ptr<Cluster> weak = shared_from_this();
+	link.client->asyncCall([weak, node](AsyncCallCtx* ctx)
+	{
+		auto self = weak.lock();
+		if (!self || ctx->isError())
+			return;
+		std::string challenge;
+		try
+		{
+			ctx->convert(&challenge);
+		}
+		catch (std::exception&)
+		{
+			return;
+		}
+
+		// refused when the secrets differ or the peer does not list us, the link stays down until it reconnects
+		std::string mac = helloMac(self->_options.secret, self->_options.nodeId, node, challenge);
+		self->_links[node]->client->asyncCall([weak, node](AsyncCallCtx* ctx)
+		{
+			auto self = weak.lock();
+			if (!self || ctx->isError())
+				return;
+			self->_links[node]->ready = true;
+			self->sendSync(node);
+		}, "cluster_hello", self->_options.nodeId, mac);
+	}, "cluster_challenge");
+}
+
+bool Cluster::isUp(const Link& link) const
+{
+	return link.ready && link.client->getReconnectStats().connected;
+}
+
+void Cluster::route(const std::string& method, KeyOf keyOf)
+{
+	_routes[method] = keyOf;
+}
+
+void Cluster::claim(const std::string& key)
+{
+	{
+		std::lock_guard<std::mutex> lock(_mtx);
+		_claims.insert(key);
+		_directory[key] = _options.nodeId;
+	}
+	broadcast("cluster_claim", _options.nodeId, key);
+}
+
+void Cluster::release(const std::string& key)
+{
+	{
+		std::lock_guard<std::mutex> lock(_mtx);
+		if (!_claims.erase(key))
+			return;
+		auto found = _directory.find(key);
+		if (found != _directory.end() && found->second == _options.nodeId)
+			_directory.erase(found);
+	}
+	broadcast("cluster_release", _options.nodeId, key);
+}
+
+uint32_t Cluster::ownerOf(const std::string& key)
+{
+	std::lock_guard<std::mutex> lock(_mtx);
+	auto found = _directory.find(key);
+	return found == _directory.end() ? 0 : found->second;
+}
+
+uint32_t Cluster::placement(const std::string& key) const
+{
+	return _ring.nodeFor(key);
+}
+
+void Cluster::moved(const std::string& key, uint32_t node)
+{
+	std::lock_guard<std::mutex> lock(_mtx);
+	_claims.erase(key);
+	_directory[key] = node;
+}
+
+uint32_t Cluster::homeOf(const std::shared_ptr<TcpConnection>& connection)
+{
+	if (!connection->isRelay())
+	{
+		keepSession(connection->getResumeToken(), connection);
+		return _options.nodeId;
+	}
+
+	std::lock_guard<std::mutex> lock(_mtx);
+	for (auto& proxy : _proxies)
+	{
+		if (proxy.second == connection)
+			return proxy.first.first;
+	}
+	return 0;
+}
+
+std::shared_ptr<TcpConnection> Cluster::sessionOf(uint32_t node, const std::string& token)
+{
+	if (node != _options.nodeId)
+		return proxyFor(node, token);
+
+	std::lock_guard<std::mutex> lock(_mtx);
+	auto found = _sessions.find(token);
+	return found == _sessions.end() ? nullptr : found->second.lock();
+}
+
+void Cluster::keepSession(const std::string& token, const std::shared_ptr<TcpConnection>& connection)
+{
+	bool newSession = false;
+	{
+		std::lock_guard<std::mutex> lock(_mtx);
+		auto& session = _sessions[token];
+		if (session.lock() != connection)
+		{
+			newSession = session.expired();
+			session = connection;
+		}
+	}
+	if (newSession)
+		claim("session:" + token);
+}
+
+ClusterStats Cluster::getStats()
+{
+	ClusterStats stats;
+	stats.forwardedCalls = _forwardedCalls;
+	stats.servedCalls = _servedCalls;
+	stats.unavailable = _unavailable;
+	stats.deliveries = _deliveries;
+	stats.batches = _batches;
+	stats.refusedPeers = _refusedPeers;
+	for (auto& link : _links)
+	{
+		if (isUp(*link.second))
+			++stats.linksUp;
+	}
+
+	std::lock_guard<std::mutex> lock(_mtx);
+	stats.keys = _directory.size();
+	stats.proxies = _proxies.size();
+	return stats;
+}
+
+bool Cluster::forward(const MsgRequest<msgpack::object, msgpack::object>& req, std::shared_ptr<TcpConnection> connection)
+{
+	// forwarded once already, the directory moved on since; run it here rather than bounce it around
+	if (connection->isRelay() || req.method.type != msgpack::type::STR)
+		return false;
+
+	auto route = _routes.find(std::string(req.method.via.str.ptr, req.method.via.str.size));
+	if (route == _routes.end())
+		return false;
+
+	std::string key = route->second(req.param);
+	const std::string& token = connection->getResumeToken();
+	if (key.empty() || token.empty())
+		return false;
+
+	uint32_t owner = ownerOf(key);
+	if (!owner || owner == _options.nodeId)
+		return false;
+	keepSession(token, connection);
+
+	auto link = _links.find(owner);
+	if (link == _links.end() || !isUp(*link->second)
+		|| !link->second->client->notify("cluster_call", _options.nodeId, token, connection->getIdentity(), req))
+	{
+		++_unavailable;
+		connection->asyncWrite(msgerror("node unavailable", error_node_unavailable).to_msg(req.msgid));
+		return true;
+	}
+	++_forwardedCalls;
+	return true;
+}
+
+void Cluster::sendSync(uint32_t node)
+{
+	std::vector<std::string> claims;
+	{
+		std::lock_guard<std::mutex> lock(_mtx);
+		claims.assign(_claims.begin(), _claims.end());
+	}
+	_links[node]->client->notify("cluster_sync", _options.nodeId, claims);
+}
+
+void Cluster::onSync(const msgpack::object& params)
+{
+	std::tuple<uint32_t, std::vector<std::string>> sync;
+	params.convert(&sync);
+	uint32_t from = std::get<0>(sync);
+
+	// the peer may have restarted, what it owned before is gone
+	std::lock_guard<std::mutex> lock(_mtx);
+	for (auto it = _directory.begin(); it != _directory.end();)
+	{
+		if (it->second == from)
+			it = _directory.erase(it);
+		else
+			++it;
+	}
+	for (auto& key : std::get<1>(sync))
+		_directory[key] = from;
+}
+
+void Cluster::onClaim(const msgpack::object& params, bool claimed)
+{
+	std::tuple<uint32_t, std::string> change;
+	try
+	{
+		params.convert(&change);
+	}
+	catch (std::exception&)
+	{
+		return;
+	}
+
+	std::lock_guard<std::mutex> lock(_mtx);
+	auto& key = std::get<1>(change);
+	if (claimed)
+		_directory[key] = std::get<0>(change);
+	else if (_directory.count(key) && _directory[key] == std::get<0>(change))
+		_directory.erase(key);
+}
+
+void Cluster::onCall(const msgpack::object& params)
+{
+	std::tuple<uint32_t, std::string, std::string, MsgRequest<msgpack::object, msgpack::object>> call;
+	params.convert(&call);
+
+	// params point into the received message, dispatch is done with them before it returns.
+	// the session logged in on its own node, the proxy plays as the same account
+	auto proxy = proxyFor(std::get<0>(call), std::get<1>(call));
+	proxy->setIdentity(std::get<2>(call));
+	++_servedCalls;
+	_dispatcher->dispatch(std::get<3>(call), proxy);
+}
+
+void Cluster::onDeliver(const msgpack::object& params)
+{
+	if (params.type != msgpack::type::ARRAY || params.via.array.size != 2)
+		throw msgpack::type_error();
+
+	ArrayView args(params.via.array);
+	uint32_t from = args.as<uint32_t>(0);
+	ArrayView messages = args.as<ArrayView>(1);
+
+	std::vector<std::string> gone;
+	for (auto& message : messages)
+	{
+		ArrayView entry;
+		convertParam(message, entry);
+		std::string token = entry.as<StrView>(0).to_string();
+		BinView bytes = entry.as<BinView>(1);
+		int priority = entry.size() > 2 ? entry.as<int>(2) : priority_normal;
+		if (priority < priority_high || priority >= priority_count)
+			priority = priority_normal;
+
+		std::shared_ptr<TcpConnection> connection;
+		{
+			std::lock_guard<std::mutex> lock(_mtx);
+			auto found = _sessions.find(token);
+			if (found != _sessions.end())
+			{
+				connection = found->second.lock();
+				if (!connection)
+					_sessions.erase(found);
+			}
+		}
+		if (!connection || connection->getConnectionStatus() != connection_connected)
+		{
+			gone.push_back(token);
+			continue;
+		}
+
+		auto sbuf = BufferPool::instance().acquire(bytes.size);
+		sbuf->write(bytes.data, bytes.size);
+		connection->asyncWrite(sbuf, WriteHandler(), static_cast<WritePriority>(priority));
+	}
+
+	// the owner stops writing for a session that left, a client that resumes calls in again
+	for (auto& token : gone)
+	{
+		release("session:" + token);
+		auto link = _links.find(from);
+		if (link != _links.end())
+			link->second->client->notify("cluster_gone", _options.nodeId, token);
+	}
+}
+
+void Cluster::onGone(const msgpack::object& params)
+{
+	std::tuple<uint32_t, std::string> gone;
+	params.convert(&gone);
+
+	std::shared_ptr<TcpConnection> proxy;
+	{
+		std::lock_guard<std::mutex> lock(_mtx);
+		auto found = _proxies.find(std::make_pair(std::get<0>(gone), std::get<1>(gone)));
+		if (found == _proxies.end())
+			return;
+		proxy = found->second;
+		_proxies.erase(found);
+	}
+	proxy->close();
+}
+
+std::shared_ptr<TcpConnection> Cluster::proxyFor(uint32_t node, const std::string& token)
+{
+	std::lock_guard<std::mutex> lock(_mtx);
+	auto& proxy = _proxies[std::make_pair(node, token)];
+	if (!proxy)
+	{
+		std::weak_ptr<Cluster> weak = shared_from_this();
+		proxy = std::make_shared<TcpConnection>(_ioService);
+		proxy->setResumeToken(token);
+		proxy->startRelay([weak, node, token](std::shared_ptr<msgpack::sbuffer> msg, WritePriority priority)
+		{
+			if (auto self = weak.lock())
+				self->deliver(node, token, msg, priority);
+		});
+	}
+	return proxy;
+}
+
+void Cluster::deliver(uint32_t node, const std::string& token, std::shared_ptr<msgpack::sbuffer> msg, WritePriority priority)
+{
+	auto found = _links.find(node);
+	if (found == _links.end())
+		return;
+
+	// whatever is written before the flush runs goes in one notify
+	Link& link = *found->second;
+	bool post = false;
+	{
+		std::lock_guard<std::mutex> lock(_mtx);
+		link.outbox.push_back(Delivery{ token, msg, priority });
+		if (!link.flushPosted)
+			post = link.flushPosted = true;
+	}
+	++_deliveries;
+	if (post)
+	{
+		std::weak_ptr<Cluster> weak = shared_from_this();
+		_ioService.post([weak, node]()
+		{
+			if (auto self = weak.lock())
+				self->flush(node);
+		});
+	}
+}
+
+void Cluster::flush(uint32_t node)
+{
+	Link& link = *_links[node];
+	std::vector<Delivery> messages;
+	{
+		std::lock_guard<std::mutex> lock(_mtx);
+		messages.swap(link.outbox);
+		link.flushPosted = false;
+	}
+	if (messages.empty())
+		return;
+
+	// dropped while the link is down, the session resumes on its node and is sent the state again
+	DeliveryBatch<std::vector<Delivery>> batch = { &messages };
+	if (isUp(link) && link.client->notify("cluster_deliver", _options.nodeId, batch))
+		++_batches;
+}
+
+} }
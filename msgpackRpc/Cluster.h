@@ -0,0 +1,197 @@
+#pragma once
+#include <atomic>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <utility>
+#include <vector>
+#include <boost/asio.hpp>
+#include "TcpSession.h"
+#include "TcpClient.h"
+#include "TcpServer.h"
+#include "Dispatcher.h"
+#include "HashRing.h"
+
+namespace msgpack {
+namespace rpc {
+
+struct ClusterOptions
+{
+	uint32_t nodeId = 0;		// 1 and up, unique in the cluster
+	boost::asio::ip::tcp::endpoint listen;	// where peers connect, apart from the port clients reach
+	std::map<uint32_t, boost::asio::ip::tcp::endpoint> peers;	// the other nodes and their listen endpoints, no other node is let in
+	std::string secret;			// shared by every node, proves a peer is one of them
+	ReconnectPolicy reconnect;
+	uint32_t virtualNodes = 64;		// points per node on the placement ring
+};
+
+struct ClusterStats
+{
+	uint64_t forwardedCalls = 0;	// requests sent on to the node that owns their key
+	uint64_t servedCalls = 0;		// requests run here for sessions of other nodes
+	uint64_t unavailable = 0;		// requests failed because the owner was unreachable
+	uint64_t deliveries = 0;		// messages sent back to the node of their session
+	uint64_t batches = 0;			// cluster_deliver notifies that carried them
+	uint64_t refusedPeers = 0;		// cluster_hello calls that did not prove a node of the list
+	size_t keys = 0;				// directory entries
+	size_t proxies = 0;				// sessions of other nodes served here
+	size_t linksUp = 0;
+};
+
+/// Several servers that act as one. Each node owns some keys, say "table:7",
+/// and every node knows the owners from a directory the nodes keep in sync
+/// with notifies over one TcpClient link per peer. A request for a routed
+/// method whose key another node owns is forwarded there, with the resume
+/// token of the session it came from; the owner runs it on a relay connection
+/// that stands in for that session, and what the owner writes to it comes back
+/// batched per link and is written to the real session. Clients see one server.
+///
+/// Nodes talk on a port of their own, served by a dispatcher of their own, so
+/// no client can send cluster_* or anything else meant for nodes. A link first
+/// calls cluster_challenge() and then cluster_hello(nodeId, mac), mac being the
+/// HMAC-SHA256 under the shared secret of both ids and the challenge, which is
+/// new for every connection. Until that succeeds the listener takes nothing else.
+class Cluster : public std::enable_shared_from_this<Cluster>
+{
+public:
+	/// the directory key of a request, empty to run it where it came in
+	typedef std::function<std::string(const msgpack::object& params)> KeyOf;
+
+	Cluster(boost::asio::io_service& ios, std::shared_ptr<Dispatcher> dispatcher, const ClusterOptions& options);
+	~Cluster();
+
+	/// route methods and add handlers for peers first, start before the server accepts
+	void start();
+
+	/// from any thread, the links and proxies are closed on the io thread
+	void stop();
+
+	uint32_t getNodeId() const;
+
+	/// handlers only other nodes may call, once they proved who they are
+	std::shared_ptr<Dispatcher> getPeerDispatcher() const;
+
+	/// requests of method go to the owner of keyOf(params)
+	void route(const std::string& method, KeyOf keyOf);
+
+	/// this node owns key from now on, told to every peer
+	void claim(const std::string& key);
+	void release(const std::string& key);
+
+	/// node that owns key, 0 if none does
+	uint32_t ownerOf(const std::string& key);
+
+	/// node a new key belongs on by the placement ring, the same on every node
+	uint32_t placement(const std::string& key) const;
+
+	/// key now belongs to node, which claims it itself, this node keeps no claim
+	void moved(const std::string& key, uint32_t node);
+
+	/// node the socket of connection is on. A local session is kept so what
+	/// other nodes write to it finds it.
+	uint32_t homeOf(const std::shared_ptr<TcpConnection>& connection);
+
+	/// connection that stands for the session token of node here, null if a local one is gone
+	std::shared_ptr<TcpConnection> sessionOf(uint32_t node, const std::string& token);
+
+	/// call method of the peer dispatcher of node over its link, callback gets
+	/// the reply or error_connection_lost. false if there is no such node or
+	/// the link is not up.
+	template<typename... TArgs>
+	bool call(uint32_t node, OnAsyncCall callback, const std::string& method, TArgs... args);
+
+	ClusterStats getStats();
+
+private:
+	struct Delivery
+	{
+		std::string token;
+		std::shared_ptr<msgpack::sbuffer> msg;
+		WritePriority priority;
+	};
+
+	struct Link
+	{
+		std::unique_ptr<TcpClient> client;
+		std::vector<Delivery> outbox;
+		bool flushPosted = false;
+		std::atomic<bool> ready{ false };	// the peer took our cluster_hello on this connection
+	};
+
+	bool forward(const MsgRequest<msgpack::object, msgpack::object>& req, std::shared_ptr<TcpConnection> connection);
+	void addPeerHandlers();
+	void hello(uint32_t node);
+	void onHello(AsyncReply<bool> reply, uint32_t node, const std::string& mac);
+	bool isUp(const Link& link) const;
+	void sendSync(uint32_t node);
+	void onSync(const msgpack::object& params);
+	void onClaim(const msgpack::object& params, bool claimed);
+	void onCall(const msgpack::object& params);
+	void onDeliver(const msgpack::object& params);
+	void onGone(const msgpack::object& params);
+
+	std::shared_ptr<TcpConnection> proxyFor(uint32_t node, const std::string& token);
+	void deliver(uint32_t node, const std::string& token, std::shared_ptr<msgpack::sbuffer> msg, WritePriority priority);
+	void flush(uint32_t node);
+	void keepSession(const std::string& token, const std::shared_ptr<TcpConnection>& connection);
+
+	template<typename... TArgs>
+	void broadcast(const std::string& method, TArgs... args);
+
+	boost::asio::io_service& _ioService;
+	std::shared_ptr<Dispatcher> _dispatcher;
+	std::shared_ptr<Dispatcher> _peerDispatcher;
+	std::unique_ptr<TcpServer> _listener;
+	ClusterOptions _options;
+	std::map<std::string, KeyOf> _routes;			// fixed once started
+	std::map<uint32_t, std::unique_ptr<Link>> _links;	// by node, fixed once started
+	HashRing _ring;									// every node, fixed
+
+	std::mutex _mtx;
+	std::map<std::string, uint32_t> _directory;		// key to owner
+	std::set<std::string> _claims;					// keys of this node
+	std::map<std::string, std::weak_ptr<TcpConnection>> _sessions;	// local sessions with calls forwarded, by token
+	std::map<std::pair<uint32_t, std::string>, std::shared_ptr<TcpConnection>> _proxies;	// by node and token
+
+	std::atomic<uint64_t> _forwardedCalls;
+	std::atomic<uint64_t> _servedCalls;
+	std::atomic<uint64_t> _unavailable;
+	std::atomic<uint64_t> _deliveries;
+	std::atomic<uint64_t> _batches;
+	std::atomic<uint64_t> _refusedPeers;
+};
+
+inline uint32_t Cluster::getNodeId() const
+{
+	return _options.nodeId;
+}
+
+inline std::shared_ptr<Dispatcher> Cluster::getPeerDispatcher() const
+{
+	return _peerDispatcher;
+}
+
+template<typename... TArgs>
+inline bool Cluster::call(uint32_t node, OnAsyncCall callback, const std::string& method, TArgs... args)
+{
+	auto found = _links.find(node);
+	if (found == _links.end() || !isUp(*found->second))
+		return false;
+	found->second->client->asyncCall(callback, method, args...);
+	return true;
+}
+
+template<typename... TArgs>
+inline void Cluster::broadcast(const std::string& method, TArgs... args)
+{
+	// a peer that is down now gets the whole directory once it takes our hello
+	for (auto& link : _links)
+	{
+		if (isUp(*link.second))
+			link.second->client->notify(method, args...);
+	}
+}
+
+} }
@@ -0,0 +1,55 @@
+#include "CoarseClock.h"
+#include <mutex>
+
+namespace msgpack {
+namespace rpc {
+
+std::atomic<uint64_t> CoarseClock::_ticks(0);
+std::shared_ptr<boost::asio::steady_timer> CoarseClock::_timer;
+std::chrono::steady_clock::time_point CoarseClock::_begin;
+
+static std::mutex s_clockMtx;
+
+void CoarseClock::start(boost::asio::io_service& ios)
+{
+	std::lock_guard<std::mutex> lock(s_clockMtx);
+	if (_timer)
+		return;
+
+	_begin = std::chrono::steady_clock::now() - std::chrono::milliseconds(_ticks.load(std::memory_order_relaxed) * TICK_MS);
+	_timer = std::make_shared<boost::asio::steady_timer>(ios);
+	asyncTick();
+}
+
+void CoarseClock::stop()
+{
+	std::lock_guard<std::mutex> lock(s_clockMtx);
+	if (!_timer)
+		return;
+
+	boost::system::error_code ec;
+	_timer->cancel(ec);
+	_timer.reset();
+}
+
+void CoarseClock::asyncTick()
+{
+	auto timer = _timer;
+	timer->expires_from_now(std::chrono::milliseconds(TICK_MS));
+	timer->async_wait([timer](const boost::system::error_code& error)
+	{
+		if (error)
+			return;
+
+		// derive ticks from the real clock once per tick so timer lateness does not drift
+		auto elapsed = std::chrono::steady_clock::now() - _begin;
+		_ticks.store(std::chrono::duration_cast<std::chrono::milliseconds>(elapsed).count() / TICK_MS,
+			std::memory_order_relaxed);
+
+		std::lock_guard<std::mutex> lock(s_clockMtx);
+		if (_timer == timer)
+			asyncTick();
+	});
+}
+
+} }
@@ -0,0 +1,41 @@
+#pragma once
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <boost/asio.hpp>
+#include <boost/asio/steady_timer.hpp>
+
+namespace msgpack {
+namespace rpc {
+
+/// Process wide tick counter advanced by a timer, so hot paths read time
+/// with one relaxed load instead of a clock syscall per message.
+class CoarseClock
+{
+public:
+	static const uint32_t TICK_MS = 10;
+
+	/// ticks since start(), stays 0 until the clock is started
+	static uint64_t now();
+
+	/// drive the clock from ios, only the first call has effect until stop().
+	/// started again it goes on from where it stopped, it never runs back.
+	static void start(boost::asio::io_service& ios);
+	static void stop();
+
+	static uint64_t toTicks(uint32_t ms) { return (ms + TICK_MS - 1) / TICK_MS; }
+
+private:
+	static void asyncTick();
+
+	static std::atomic<uint64_t> _ticks;
+	static std::shared_ptr<boost::asio::steady_timer> _timer;
+	static std::chrono::steady_clock::time_point _begin;
+};
+
+inline uint64_t CoarseClock::now()
+{
+	return _ticks.load(std::memory_order_relaxed);
+}
+
+} }
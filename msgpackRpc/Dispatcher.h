@@ -12,17 +12,28 @@
 #endif
 
 #include <thread>
+#include <atomic>
+#include <utility>
+#include <deque>
 #include "Protocol.h"
 #include "TcpConnection.h"
+#include "RateLimit.h"
+#include "ParamView.h"
+#include "Property.h"
 
 namespace msgpack {
 namespace rpc {
 
-    template<typename F, typename R, typename C, typename Params>
-        std::shared_ptr<msgpack::sbuffer> helpInvoke(
-                F handler,
-                uint32_t msgid, 
-                ::msgpack::object msg_params)
+    // element by element, so view params can point into the message
+    template<typename Params, size_t... I>
+        void convertEach(const ::msgpack::object_array &args, Params &params, std::index_sequence<I...>)
+    {
+        int expand[]={ 0, (convertParam(args.ptr[I], std::get<I>(params)), 0)... };
+        (void)expand;
+    }
+
+    template<typename Params>
+        void convertParams(const ::msgpack::object &msg_params, Params &params)
     {
         // args check
         if(msg_params.type != type::ARRAY) { 
@@ -35,86 +46,249 @@ namespace rpc {
             throw msgerror("error_params_not_enough", error_params_not_enough); 
         }
 
-        // extract args
-        Params params;
         try {
-            msg_params.convert(&params);
+            convertEach(msg_params.via.array, params, std::make_index_sequence<std::tuple_size<Params>::value>());
         }
         catch(msgpack::type_error){
             throw msgerror("fail to convert params", error_params_convert);
         }
+    }
 
-        // call
-        R result=std::call_with_tuple(handler, params);
+    // sends a packed response, async handlers may call it from any thread
+    typedef std::function<void(std::shared_ptr<msgpack::sbuffer>)> ReplySender;
 
-        MsgResponse<R&, bool> msgres(
-                result, 
-				false, 
-                msgid);
-        // result
-        auto sbuf=std::make_shared<msgpack::sbuffer>();
-        msgpack::pack(*sbuf, msgres);
-        return sbuf;
+    // response handle given to async handlers, copyable, the first reply wins.
+    // a request whose handles are all gone unanswered gets error_no_reply.
+    // connection() is the caller, for handlers that push notifies to it later.
+    template<typename R>
+    class AsyncReply
+    {
+        struct State
+        {
+            State(uint32_t msgid, ReplySender send, std::shared_ptr<TcpConnection> connection)
+                : msgid(msgid), send(send), connection(connection), replied(false) {}
+            ~State()
+            {
+                if(!replied.exchange(true)){
+                    send(msgerror("handler dropped the reply", error_no_reply).to_msg(msgid));
+                }
+            }
+
+            uint32_t msgid;
+            ReplySender send;
+            std::shared_ptr<TcpConnection> connection;
+            std::atomic<bool> replied;
+        };
+        std::shared_ptr<State> m_state;
+
+    public:
+        AsyncReply(uint32_t msgid, ReplySender send, std::shared_ptr<TcpConnection> connection = nullptr)
+            : m_state(std::make_shared<State>(msgid, send, connection)) {}
+
+        std::shared_ptr<TcpConnection> connection() const
+        {
+            return m_state->connection;
+        }
+
+        void result(const R &value) const
+        {
+            if(m_state->replied.exchange(true)){
+                return;
+            }
+            MsgResponse<const R&, bool> msgres(value, false, m_state->msgid);
+            m_state->send(packExact(msgres));
+        }
+
+        void error(const msgerror &ex) const
+        {
+            if(m_state->replied.exchange(true)){
+                return;
+            }
+            m_state->send(ex.to_msg(m_state->msgid));
+        }
+
+        void error(ServerSideError code, const std::string &msg) const
+        {
+            error(msgerror(msg, code));
+        }
+    };
+
+    template<typename F, typename R, typename Params, size_t... I>
+        void callWithReply(const F &handler, const AsyncReply<R> &reply, Params &params, std::index_sequence<I...>)
+    {
+        handler(reply, std::move(std::get<I>(params))...);
     }
 
-    // void
-    template<typename F, typename C, typename Params>
+    template<typename F, typename R, typename C, typename Params>
         std::shared_ptr<msgpack::sbuffer> helpInvoke(
                 F handler,
                 uint32_t msgid, 
                 ::msgpack::object msg_params)
     {
-        // args check
-        if(msg_params.type != type::ARRAY) { 
-            throw msgerror("error_params_not_array", error_params_not_array); 
-        }
-        if(msg_params.via.array.size>std::tuple_size<Params>::value){
-            throw msgerror("error_params_too_many", error_params_too_many); 
+        // extract args
+        Params params;
+        convertParams(msg_params, params);
+
+        try{
+            // call
+            R result=std::call_with_tuple(handler, params);
+
+            MsgResponse<R&, bool> msgres(
+                    result, 
+                    false, 
+                    msgid);
+            // result, sized up front so a large one is not regrown while packing
+            return packExact(msgres);
         }
-        else if(msg_params.via.array.size<std::tuple_size<Params>::value){
-            throw msgerror("error_params_not_enough", error_params_not_enough); 
+        catch(msgpack::type_error){
+            // a view param converts its elements as the handler reads them
+            throw msgerror("fail to convert params", error_params_convert);
         }
+    }
 
+    // void
+    template<typename F, typename C, typename Params>
+        std::shared_ptr<msgpack::sbuffer> helpInvoke(
+                F handler,
+                uint32_t msgid, 
+                ::msgpack::object msg_params)
+    {
         // extract args
         Params params;
-        try {
-            msg_params.convert(&params);
+        convertParams(msg_params, params);
+
+        // call
+        try{
+            std::call_with_tuple_void(handler, params);
         }
         catch(msgpack::type_error){
+            // a view param converts its elements as the handler reads them
             throw msgerror("fail to convert params", error_params_convert);
         }
 
-        // call
-        std::call_with_tuple_void(handler, params);
-
         MsgResponse<msgpack::type::nil, bool> msgres(
                 msgpack::type::nil(), 
                 false, 
                 msgid);
 
-        // result
-        auto sbuf=std::make_shared<msgpack::sbuffer>();
-        msgpack::pack(*sbuf, msgres);
-        return sbuf;
+        // result, sized up front so a large one is not regrown while packing
+        return packExact(msgres);
     }
 
 
 class Dispatcher
 {
+public:
+    // takes a request away from this node, true if it did. it answers the caller itself.
+    typedef std::function<bool(const MsgRequest<msgpack::object, msgpack::object>&, std::shared_ptr<TcpConnection>)> Router;
+    typedef std::function<void(msgpack::object, std::shared_ptr<TcpConnection>)> NotifyHandler;
+    // whether connection may call method, say only once it proved who it is
+    typedef std::function<bool(const std::string&, const std::shared_ptr<TcpConnection>&)> Authorizer;
+
+private:
     typedef std::function<std::shared_ptr<msgpack::sbuffer>(uint32_t, msgpack::object)> Procedure;
+    typedef std::function<void(uint32_t, msgpack::object, std::shared_ptr<TcpConnection>, ReplySender)> AsyncProcedure;
     std::map<std::string, Procedure> m_handlerMap;
+    std::map<std::string, AsyncProcedure> m_asyncHandlerMap;
+    std::map<std::string, NotifyHandler> m_notifyHandlerMap;
+    std::map<std::string, WritePriority> m_replyPriority;
+    Router m_router;
+    Authorizer m_authorizer;
     std::shared_ptr<std::thread> m_thread;
 
+    struct MethodLimit
+    {
+        MethodLimit(const std::string &method, const RateLimit &limit)
+            : method(method), limit(limit), throttled(0) {}
+
+        std::string method;
+        RateLimit limit;
+        std::atomic<uint64_t> throttled;
+    };
+    std::map<std::string, size_t> m_limitIndex;
+    std::deque<MethodLimit> m_methodLimits;     // deque keeps the atomics in place
+    RateLimit m_sessionLimit;
+    std::atomic<uint64_t> m_sessionThrottled;
+    std::shared_ptr<PropertyHub> m_properties;
+
 public:
-	Dispatcher() {}
+	Dispatcher() : m_sessionThrottled(0), m_properties(std::make_shared<PropertyHub>()) {}
 
 	~Dispatcher() {}
 
+    // rate limits, set together with the handlers before serving.
+    // buckets refill from CoarseClock, which TcpServer::start runs.
+    void set_session_rate_limit(uint32_t burst, uint32_t perSecond)
+    {
+        m_sessionLimit = RateLimit(burst, perSecond);
+    }
+
+    void set_rate_limit(const std::string &method, uint32_t burst, uint32_t perSecond)
+    {
+        auto found=m_limitIndex.find(method);
+        if(found!=m_limitIndex.end()){
+            m_methodLimits[found->second].limit = RateLimit(burst, perSecond);
+            return;
+        }
+        m_limitIndex.insert(std::make_pair(method, m_methodLimits.size()));
+        m_methodLimits.emplace_back(method, RateLimit(burst, perSecond));
+    }
+
+    // take a token from the session bucket and the method bucket, false if throttled.
+    // a call throttled by either one takes no token from the other.
+    bool check_rate(const msgpack::object &method, RateState &state)
+    {
+        uint64_t now=CoarseClock::now();
+        bool sessionTaken=m_sessionLimit.isLimited();
+        if(sessionTaken && !state.session.tryTake(m_sessionLimit, now)){
+            m_sessionThrottled.fetch_add(1, std::memory_order_relaxed);
+            return false;
+        }
+        if(m_limitIndex.empty() || method.type != type::STR){
+            return true;
+        }
+
+        auto found=m_limitIndex.find(std::string(method.via.str.ptr, method.via.str.size));
+        if(found==m_limitIndex.end()){
+            return true;
+        }
+        MethodLimit &entry=m_methodLimits[found->second];
+        if(!entry.limit.isLimited()){
+            return true;
+        }
+        if(state.methods.size()<m_methodLimits.size()){
+            state.methods.resize(m_methodLimits.size());
+        }
+        if(!state.methods[found->second].tryTake(entry.limit, now)){
+            entry.throttled.fetch_add(1, std::memory_order_relaxed);
+            if(sessionTaken){
+                state.session.refund();
+            }
+            return false;
+        }
+        return true;
+    }
+
+    // throttled calls by method, the session wide limit is reported as "*"
+    std::map<std::string, uint64_t> get_throttled() const
+    {
+        std::map<std::string, uint64_t> stats;
+        stats["*"]=m_sessionThrottled.load(std::memory_order_relaxed);
+        for(auto &entry : m_methodLimits){
+            stats[entry.method]=entry.throttled.load(std::memory_order_relaxed);
+        }
+        return stats;
+    }
+
     std::shared_ptr<msgpack::sbuffer> processInvocation(uint32_t msgid, msgpack::object method, msgpack::object params)
     {
         std::string method_name;
         method.convert(&method_name);
+        return processInvocation(msgid, method_name, params);
+    }
 
+    std::shared_ptr<msgpack::sbuffer> processInvocation(uint32_t msgid, const std::string &method_name, msgpack::object params)
+    {
         auto found=m_handlerMap.find(method_name);
         if(found==m_handlerMap.end()){
             throw msgerror("no handler", error_dispatcher_no_handler);
@@ -130,15 +304,84 @@ public:
         // extract msgpack request
         MsgRequest<msgpack::object, msgpack::object> req;
         msg.convert(&req);
+        dispatch(req, connection);
+    }
+
+    // lane the replies of method are written in, priority_normal if not set. set before serving.
+    void set_reply_priority(const std::string &method, WritePriority priority)
+    {
+        m_replyPriority[method] = priority;
+    }
+
+    // set before serving, asked before any handler
+    void set_router(Router router)
+    {
+        m_router = router;
+    }
+
+    // set before serving, asked before the router and any handler. a request it
+    // refuses is answered with error_not_authorized, a notify is dropped.
+    void set_authorizer(Authorizer authorizer)
+    {
+        m_authorizer = authorizer;
+    }
+
+    // notifies have no reply, params as sent
+    void add_notify_handler(const std::string &method, NotifyHandler handler)
+    {
+        m_notifyHandlerMap.insert(std::make_pair(method, handler));
+    }
+
+    // false if there is no handler for method, or connection may not call it
+    bool dispatch_notify(const std::string &method, msgpack::object params, std::shared_ptr<TcpConnection> connection)
+    {
+        auto found=m_notifyHandlerMap.find(method);
+        if(found==m_notifyHandlerMap.end() || (m_authorizer && !m_authorizer(method, connection))){
+            return false;
+        }
+        found->second(params, connection);
+        return true;
+    }
+
+    // onReplied is called when the response is written
+    void dispatch(const MsgRequest<msgpack::object, msgpack::object> &req, std::shared_ptr<TcpConnection> connection,
+            WriteHandler onReplied = WriteHandler())
+    {
         try{
+            std::string method_name;
+            req.method.convert(&method_name);
+            if(m_authorizer && !m_authorizer(method_name, connection)){
+                throw msgerror("not authorized", error_not_authorized);
+            }
+
+            if(m_router && m_router(req, connection)){
+                // answered elsewhere, nothing is left in flight here
+                if(onReplied){
+                    onReplied(boost::system::error_code());
+                }
+                return;
+            }
+
+            auto lane=m_replyPriority.find(method_name);
+            WritePriority priority=lane==m_replyPriority.end() ? priority_normal : lane->second;
+
+            auto async=m_asyncHandlerMap.find(method_name);
+            if(async!=m_asyncHandlerMap.end()){
+                // the handler replies later, maybe from another thread, write from the io thread
+                async->second(req.msgid, req.param, connection, [connection, onReplied, priority](std::shared_ptr<msgpack::sbuffer> sbuf){
+                        connection->postWrite(sbuf, onReplied, priority);
+                        });
+                return;
+            }
+
             // execute callback
-            std::shared_ptr<msgpack::sbuffer> result = processInvocation(req.msgid, req.method, req.param);
+            std::shared_ptr<msgpack::sbuffer> result = processInvocation(req.msgid, method_name, req.param);
             // send 
-			connection->asyncWrite(result);
+			connection->asyncWrite(result, onReplied, priority);
         }
         catch(msgerror ex)
         {
-			connection->asyncWrite(ex.to_msg(req.msgid));
+			connection->asyncWrite(ex.to_msg(req.msgid), onReplied);
         }
     }
 
@@ -147,10 +390,10 @@ public:
     template<typename F, typename R, typename C>
         void add_handler(const std::string &method, F handler, R(C::*p)()const)
         {
-			procedure proc = [handler](uint32_t msgid, msgpack::object msg_params)->std::shared_ptr<msgpack::sbuffer>
-							{
-								return helpInvoke<F, R, C, std::tuple<>>(handler, msgid, msg_params);
-							}
+            Procedure proc = [handler](uint32_t msgid, msgpack::object msg_params)->std::shared_ptr<msgpack::sbuffer>
+                        {
+                        return helpInvoke<F, R, C, std::tuple<>>(handler, msgid, msg_params);
+                        };
             m_handlerMap.insert(std::make_pair(method, std::move(proc)));
         }
 
@@ -308,6 +551,38 @@ public:
                         }));
         }
 
+    // async, the handler answers through AsyncReply<R> when it is done,
+    // so long work can leave the io thread. params are copied out of the
+    // request before the handler is called, view params only last the call.
+    template<typename R, typename... Args>
+        void add_async_handler(const std::string &method, std::function<void(AsyncReply<R>, Args...)> handler)
+        {
+            m_asyncHandlerMap.insert(std::make_pair(method, [handler](
+                            uint32_t msgid,
+                            ::msgpack::object msg_params,
+                            std::shared_ptr<TcpConnection> connection,
+                            ReplySender send)
+                        {
+                        typedef std::tuple<typename std::decay<Args>::type...> Params;
+                        Params params;
+                        convertParams(msg_params, params);
+
+                        AsyncReply<R> reply(msgid, send, connection);
+                        try{
+                            callWithReply(handler, reply, params, std::index_sequence_for<Args...>());
+                        }
+                        catch(msgerror ex){
+                            reply.error(ex);
+                        }
+                        catch(msgpack::type_error){
+                            reply.error(error_params_convert, "fail to convert params");
+                        }
+                        catch(std::exception &ex){
+                            reply.error(error_handler_failed, ex.what());
+                        }
+                        }));
+        }
+
     // for lambda/std::function
     template<typename F>
         void add_handler(const std::string &method, F handler)
@@ -431,6 +706,19 @@ public:
             add_handler(method, std::function<R(A1, A2)>(std::bind(handler, self, b1, b2)));
         }
 
+    // tell the subscribers of property that it changed, from any thread.
+    // set_ and the list handlers tell them by themselves.
+    void property_changed(const std::string &property)
+    {
+        m_properties->changed(property);
+    }
+
+    // a connection of a session using this dispatcher closed, drops what it subscribed to
+    void connection_closed(const std::shared_ptr<TcpConnection> &connection)
+    {
+        m_properties->disconnected(connection);
+    }
+
     // utility
     template<typename T, typename V>
         void add_property(const std::string &property,
@@ -439,6 +727,7 @@ public:
                 void(T::*setMethod)(V)
                 )
         {
+            add_property_getter(property, thisGetter, getMethod);
             add_handler(std::string("get_")+property, [thisGetter, getMethod](
                         )->V{
                     auto self=thisGetter();
@@ -447,13 +736,15 @@ public:
                     }
                     return (self->*getMethod)();
                     });
-            add_handler(std::string("set_")+property, [thisGetter, setMethod](
+            auto properties=m_properties;
+            add_handler(std::string("set_")+property, [thisGetter, setMethod, properties, property](
                         const V& value){
                     auto self=thisGetter();
                     if(!self){
                     throw msgerror("fail to convert params", error_self_pointer_is_null);
                     }
                     (self->*setMethod)(value);
+                    properties->changed(property);
                     });
         }
     // utility(const &)
@@ -464,6 +755,7 @@ public:
                 void(T::*setMethod)(const V&)
                 )
         {
+            add_property_getter(property, thisGetter, getMethod);
             add_handler(std::string("get_")+property, [thisGetter, getMethod](
                         )->V{
                     auto self=thisGetter();
@@ -472,13 +764,15 @@ public:
                     }
                     return (self->*getMethod)();
                     });
-            add_handler(std::string("set_")+property, [thisGetter, setMethod](
+            auto properties=m_properties;
+            add_handler(std::string("set_")+property, [thisGetter, setMethod, properties, property](
                         const V& value){
                     auto self=thisGetter();
                     if(!self){
                     throw msgerror("fail to convert params", error_self_pointer_is_null);
                     }
                     (self->*setMethod)(value);
+                    properties->changed(property);
                     });
         }
 
@@ -497,24 +791,30 @@ public:
                 std::list<V>(T::*listMethod)()const              
                 )
         {
+            auto properties=m_properties;
+            if(listMethod){
+                add_property_getter(property, thisGetter, listMethod);
+            }
             if(clearMethod){
-            add_handler(std::string("clear_")+property, [thisGetter, clearMethod](
+            add_handler(std::string("clear_")+property, [thisGetter, clearMethod, properties, property](
                         ){
                     auto self=thisGetter();
                     if(!self){
                     throw msgerror("fail to convert params", error_self_pointer_is_null);
                     }
                     (self->*clearMethod)();
+                    properties->changed(property);
                     });
             }
             if(addMethod){
-            add_handler(std::string("additem_")+property, [thisGetter, addMethod](
+            add_handler(std::string("additem_")+property, [thisGetter, addMethod, properties, property](
                         const V &item){
                     auto self=thisGetter();
                     if(!self){
                     throw msgerror("fail to convert params", error_self_pointer_is_null);
                     }
                     (self->*addMethod)(item);
+                    properties->changed(property);
                     });
             }
             /*
@@ -530,33 +830,36 @@ public:
             }
             */
             if(updateAtMethod){
-            add_handler(std::string("updateitemat_")+property, [thisGetter, updateAtMethod](
+            add_handler(std::string("updateitemat_")+property, [thisGetter, updateAtMethod, properties, property](
                         size_t index, const V &item){
                     auto self=thisGetter();
                     if(!self){
                     throw msgerror("fail to convert params", error_self_pointer_is_null);
                     }
                     (self->*updateAtMethod)(index, item);
+                    properties->changed(property);
                     });
             }
             if(removeAtMethod){
-            add_handler(std::string("removeat_")+property, [thisGetter, removeAtMethod](
+            add_handler(std::string("removeat_")+property, [thisGetter, removeAtMethod, properties, property](
                         size_t index){
                     auto self=thisGetter();
                     if(!self){
                     throw msgerror("fail to convert params", error_self_pointer_is_null);
                     }
                     (self->*removeAtMethod)(index);
+                    properties->changed(property);
                     });
             }
             if(movefromtoMethod){
-            add_handler(std::string("movefromto_")+property, [thisGetter, movefromtoMethod](
+            add_handler(std::string("movefromto_")+property, [thisGetter, movefromtoMethod, properties, property](
                         size_t from, size_t to){
                     auto self=thisGetter();
                     if(!self){
                     throw msgerror("fail to convert params", error_self_pointer_is_null);
                     }
                     (self->*movefromtoMethod)(from, to);
+                    properties->changed(property);
                     });
             }
             if(listMethod){
@@ -571,6 +874,46 @@ public:
             }
         }
 
+private:
+    // the value of a property for get_many and subscribers
+    template<typename T, typename V>
+        void add_property_getter(const std::string &property, std::function<T*()> thisGetter, V(T::*getMethod)()const)
+        {
+            if(m_properties->empty()){
+                add_property_handlers();
+            }
+            m_properties->add(property, [thisGetter, getMethod](msgpack::zone &zone)->msgpack::object{
+                    auto self=thisGetter();
+                    if(!self){
+                    throw msgerror("fail to convert params", error_self_pointer_is_null);
+                    }
+                    return msgpack::object((self->*getMethod)(), zone);
+                    });
+        }
+
+    // get_many(names) reads several properties in one call.
+    // subscribe_properties(names, intervalMs) answers the current values, then
+    // properties_changed notifies bring the ones that changed, at most once per intervalMs.
+    void add_property_handlers()
+    {
+        auto properties=m_properties;
+        add_handler("get_many", [properties](std::vector<std::string> names)->PropertyValues{
+                return properties->read(names);
+                });
+
+        std::function<void(AsyncReply<PropertyValues>, std::vector<std::string>, uint32_t)> subscribe=
+            [properties](AsyncReply<PropertyValues> reply, std::vector<std::string> names, uint32_t intervalMs){
+                reply.result(properties->subscribe(reply.connection(), names, intervalMs));
+            };
+        add_async_handler("subscribe_properties", subscribe);
+
+        std::function<void(AsyncReply<bool>, std::vector<std::string>)> unsubscribe=
+            [properties](AsyncReply<bool> reply, std::vector<std::string> names){
+                properties->unsubscribe(reply.connection(), names);
+                reply.result(true);
+            };
+        add_async_handler("unsubscribe_properties", unsubscribe);
+    }
 };
 
 } }
\ No newline at end of file
@@ -0,0 +1,69 @@
+#pragma once
+#include <cstdint>
+#include <map>
+#include <string>
+
+namespace msgpack {
+namespace rpc {
+
+/// Consistent hashing of keys to nodes. Each node sits on the ring at
+/// virtualNodes points, a key belongs to the first point at or after its
+/// hash. Adding or removing a node moves only the keys next to its points,
+/// about 1/n of them, and every process with the same nodes agrees on the
+/// placement, the hash does not depend on the build or the platform.
+class HashRing
+{
+public:
+	explicit HashRing(uint32_t virtualNodes = 64) : _virtualNodes(virtualNodes ? virtualNodes : 1) {}
+
+	void add(uint32_t node)
+	{
+		for (uint32_t i = 0; i < _virtualNodes; ++i)
+			_points[hash(std::to_string(node) + "#" + std::to_string(i))] = node;
+	}
+
+	void remove(uint32_t node)
+	{
+		for (auto it = _points.begin(); it != _points.end();)
+		{
+			if (it->second == node)
+				it = _points.erase(it);
+			else
+				++it;
+		}
+	}
+
+	/// 0 if the ring is empty
+	uint32_t nodeFor(const std::string& key) const
+	{
+		if (_points.empty())
+			return 0;
+		auto found = _points.lower_bound(hash(key));
+		return found == _points.end() ? _points.begin()->second : found->second;
+	}
+
+	bool empty() const { return _points.empty(); }
+
+	/// fnv-1a, then mixed so keys that differ only at the end spread over the whole ring
+	static uint64_t hash(const std::string& key)
+	{
+		uint64_t h = 14695981039346656037ull;
+		for (unsigned char c : key)
+		{
+			h ^= c;
+			h *= 1099511628211ull;
+		}
+		h ^= h >> 33;
+		h *= 0xff51afd7ed558ccdull;
+		h ^= h >> 33;
+		h *= 0xc4ceb9fe1a85ec53ull;
+		h ^= h >> 33;
+		return h;
+	}
+
+private:
+	uint32_t _virtualNodes;
+	std::map<uint64_t, uint32_t> _points;	// hash to node
+};
+
+} }
@@ -0,0 +1,161 @@
+#pragma once
+#include <cstdint>
+#include <cstring>
+#include <string>
+
+namespace msgpack {
+namespace rpc {
+
+/// SHA-256 (FIPS 180-4), for HMAC below; nothing here is speed critical.
+class Sha256
+{
+public:
+	enum { DIGEST_SIZE = 32, BLOCK_SIZE = 64 };
+
+	Sha256()
+	{
+		static const uint32_t INIT[8] = {
+			0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19 };
+		std::memcpy(_state, INIT, sizeof(_state));
+	}
+
+	void update(const void* data, size_t size)
+	{
+		const uint8_t* bytes = static_cast<const uint8_t*>(data);
+		_length += size;
+		while (size)
+		{
+			size_t take = BLOCK_SIZE - _used < size ? BLOCK_SIZE - _used : size;
+			std::memcpy(_block + _used, bytes, take);
+			_used += take;
+			bytes += take;
+			size -= take;
+			if (_used == BLOCK_SIZE)
+			{
+				transform();
+				_used = 0;
+			}
+		}
+	}
+
+	/// the digest as raw bytes, the object is spent
+	std::string finish()
+	{
+		uint64_t bits = _length * 8;
+		uint8_t pad = 0x80;
+		update(&pad, 1);
+		pad = 0;
+		while (_used != BLOCK_SIZE - 8)
+			update(&pad, 1);
+		uint8_t length[8];
+		for (int i = 0; i < 8; ++i)
+			length[i] = static_cast<uint8_t>(bits >> (56 - 8 * i));
+		update(length, 8);
+
+		std::string digest(DIGEST_SIZE, '\0');
+		for (int i = 0; i < DIGEST_SIZE; ++i)
+			digest[i] = static_cast<char>(_state[i / 4] >> (24 - 8 * (i % 4)));
+		return digest;
+	}
+
+private:
+	static uint32_t rotr(uint32_t x, int n) { return (x >> n) | (x << (32 - n)); }
+
+	void transform()
+	{
+		static const uint32_t K[64] = {
+			0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+			0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+			0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+			0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+			0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+			0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+			0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+			0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2 };
+
+		uint32_t w[64];
+		for (int i = 0; i < 16; ++i)
+		{
+			w[i] = static_cast<uint32_t>(_block[i * 4]) << 24 | static_cast<uint32_t>(_block[i * 4 + 1]) << 16
+				| static_cast<uint32_t>(_block[i * 4 + 2]) << 8 | _block[i * 4 + 3];
+		}
+		for (int i = 16; i < 64; ++i)
+		{
+			uint32_t s0 = rotr(w[i - 15], 7) ^ rotr(w[i - 15], 18) ^ (w[i - 15] >> 3);
+			uint32_t s1 = rotr(w[i - 2], 17) ^ rotr(w[i - 2], 19) ^ (w[i - 2] >> 10);
+			w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+		}
+
+		uint32_t v[8];
+		std::memcpy(v, _state, sizeof(v));
+		for (int i = 0; i < 64; ++i)
+		{
+			uint32_t s1 = rotr(v[4], 6) ^ rotr(v[4], 11) ^ rotr(v[4], 25);
+			uint32_t ch = (v[4] & v[5]) ^ (~v[4] & v[6]);
+			uint32_t t1 = v[7] + s1 + ch + K[i] + w[i];
+			uint32_t s0 = rotr(v[0], 2) ^ rotr(v[0], 13) ^ rotr(v[0], 22);
+			uint32_t maj = (v[0] & v[1]) ^ (v[0] & v[2]) ^ (v[1] & v[2]);
+			uint32_t t2 = s0 + maj;
+			std::memmove(v + 1, v, sizeof(uint32_t) * 7);
+			v[4] += t1;
+			v[0] = t1 + t2;
+		}
+		for (int i = 0; i < 8; ++i)
+			_state[i] += v[i];
+	}
+
+	uint32_t _state[8];
+	uint8_t _block[BLOCK_SIZE];
+	size_t _used = 0;
+	uint64_t _length = 0;
+};
+
+/// HMAC-SHA256 (RFC 2104) of message under key, as lowercase hex
+inline std::string hmacSha256(const std::string& key, const std::string& message)
+{
+	std::string block = key;
+	if (block.size() > Sha256::BLOCK_SIZE)
+	{
+		Sha256 hash;
+		hash.update(block.data(), block.size());
+		block = hash.finish();
+	}
+	block.resize(Sha256::BLOCK_SIZE, '\0');
+
+	std::string pad(Sha256::BLOCK_SIZE, '\0');
+	Sha256 inner;
+	for (size_t i = 0; i < pad.size(); ++i)
+		pad[i] = static_cast<char>(block[i] ^ 0x36);
+	inner.update(pad.data(), pad.size());
+	inner.update(message.data(), message.size());
+	std::string innerDigest = inner.finish();
+
+	Sha256 outer;
+	for (size_t i = 0; i < pad.size(); ++i)
+		pad[i] = static_cast<char>(block[i] ^ 0x5c);
+	outer.update(pad.data(), pad.size());
+	outer.update(innerDigest.data(), innerDigest.size());
+	std::string digest = outer.finish();
+
+	static const char digits[] = "0123456789abcdef";
+	std::string hex;
+	for (unsigned char c : digest)
+	{
+		hex += digits[c >> 4];
+		hex += digits[c & 15];
+	}
+	return hex;
+}
+
+/// compare a mac without telling how much of it matched by the time taken
+inline bool macEquals(const std::string& a, const std::string& b)
+{
+	if (a.size() != b.size())
+		return false;
+	unsigned char diff = 0;
+	for (size_t i = 0; i < a.size(); ++i)
+		diff |= static_cast<unsigned char>(a[i] ^ b[i]);
+	return diff == 0;
+}
+
+} }
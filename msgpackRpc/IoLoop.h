@@ -0,0 +1,80 @@
+#pragma once
+#include <chrono>
+#include <thread>
+#include "Asio.h"
+
+namespace msgpack {
+namespace rpc {
+
+/// How a thread runs its io_service. run() sleeps in the reactor until there is
+/// something to do, and waking it takes a few microseconds or more. Busy polling
+/// calls poll() in a loop so an event is handled as soon as it is there, at the
+/// cost of the whole core. Once idle for spinUs it yields, and after yieldUs
+/// more it sleeps in run_one() until the next event, then spins again.
+struct IoLoopOptions
+{
+	bool busyPoll = false;
+	uint32_t spinUs = 200;
+	uint32_t yieldUs = 1000;
+};
+
+struct IoLoopStats
+{
+	uint64_t handlers = 0;		// handlers run
+	uint64_t parks = 0;			// times the loop went idle long enough to sleep
+};
+
+/// run ios on this thread until it is stopped or out of work, like run()
+inline IoLoopStats runIoLoop(boost::asio::io_service& ios, const IoLoopOptions& options = IoLoopOptions())
+{
+	IoLoopStats stats;
+	if (!options.busyPoll)
+	{
+		stats.handlers = ios.run();
+		return stats;
+	}
+
+	auto spin = std::chrono::microseconds(options.spinUs);
+	auto yield = spin + std::chrono::microseconds(options.yieldUs);
+	auto idleSince = std::chrono::steady_clock::now();
+	// poll() stops ios once it is out of work, as run() would return
+	while (!ios.stopped())
+	{
+		size_t ran = ios.poll();
+		if (ran)
+		{
+			stats.handlers += ran;
+			idleSince = std::chrono::steady_clock::now();
+			continue;
+		}
+
+		auto idle = std::chrono::steady_clock::now() - idleSince;
+		if (idle < spin)
+			cpuRelax();
+		else if (idle < yield)
+			std::this_thread::yield();
+		else
+		{
+			++stats.parks;
+			stats.handlers += ios.run_one();
+			idleSince = std::chrono::steady_clock::now();
+		}
+	}
+	return stats;
+}
+
+/// SO_BUSY_POLL, a read that finds the socket empty polls the device queue for
+/// up to us before it gives up. Linux only, needs CAP_NET_ADMIN to raise it
+/// above net.core.busy_read; a no-op elsewhere.
+inline void setBusyPoll(boost::asio::ip::tcp::socket& socket, uint32_t us, boost::system::error_code& ec)
+{
+#if defined(__linux__) && defined(SO_BUSY_POLL)
+	socket.set_option(boost::asio::detail::socket_option::integer<SOL_SOCKET, SO_BUSY_POLL>(static_cast<int>(us)), ec);
+#else
+	(void)socket;
+	(void)us;
+	(void)ec;
+#endif
+}
+
+} }
@@ -0,0 +1,114 @@
+#pragma once
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include <msgpack.hpp>
+
+namespace msgpack {
+namespace rpc {
+
+/// A stream for msgpack::pack that only counts the bytes it is given.
+class PackCounter
+{
+public:
+	void write(const char*, size_t size) { _size += size; }
+	size_t size() const { return _size; }
+
+private:
+	size_t _size = 0;
+};
+
+/// bytes value packs to, str and bin bodies are counted, not copied
+template<typename T>
+inline size_t packedSize(const T& value)
+{
+	PackCounter counter;
+	msgpack::pack(counter, value);
+	return counter.size();
+}
+
+/// Outgoing message buffers kept for reuse. Buffers come in power of 2 sizes,
+/// one is back in the pool when the last shared_ptr to it goes, so a buffer
+/// queued on several connections returns once all of them have written it.
+class BufferPool
+{
+public:
+	static const size_t MIN_SIZE = 256;
+	static const size_t MAX_POOLED_SIZE = 1 << 20;	// larger ones are sized exactly and freed
+	static const size_t MAX_PER_CLASS = 64;
+
+	static BufferPool& instance()
+	{
+		// never destroyed, buffers may come back while statics go away
+		static BufferPool* pool = new BufferPool();
+		return *pool;
+	}
+
+	/// an empty buffer that holds size bytes without growing
+	std::shared_ptr<msgpack::sbuffer> acquire(size_t size)
+	{
+		if (size > MAX_POOLED_SIZE)
+			return std::make_shared<msgpack::sbuffer>(size);
+
+		size_t cls = sizeClass(size);
+		msgpack::sbuffer* buffer = nullptr;
+		{
+			std::lock_guard<std::mutex> lock(_mtx);
+			auto& free = _free[cls];
+			if (!free.empty())
+			{
+				buffer = free.back();
+				free.pop_back();
+			}
+		}
+		if (!buffer)
+			buffer = new msgpack::sbuffer(MIN_SIZE << cls);
+
+		return std::shared_ptr<msgpack::sbuffer>(buffer, [this, cls](msgpack::sbuffer* buffer) { release(buffer, cls); });
+	}
+
+private:
+	static const size_t CLASSES = 13;	// MIN_SIZE << 12 is MAX_POOLED_SIZE
+
+	BufferPool() : _free(CLASSES) {}
+
+	static size_t sizeClass(size_t size)
+	{
+		size_t cls = 0;
+		while ((MIN_SIZE << cls) < size)
+			++cls;
+		return cls;
+	}
+
+	void release(msgpack::sbuffer* buffer, size_t cls)
+	{
+		// a buffer that outgrew its class has been reallocated, it is not the size it claims
+		if (buffer->size() <= (MIN_SIZE << cls))
+		{
+			buffer->clear();
+			std::lock_guard<std::mutex> lock(_mtx);
+			if (_free[cls].size() < MAX_PER_CLASS)
+			{
+				_free[cls].push_back(buffer);
+				return;
+			}
+		}
+		delete buffer;
+	}
+
+	std::mutex _mtx;
+	std::vector<std::vector<msgpack::sbuffer*>> _free;	// by size class
+};
+
+/// pack value into a pooled buffer that fits it, one counting pass and one
+/// writing pass, so the buffer is never regrown and its bytes never moved
+template<typename T>
+inline std::shared_ptr<msgpack::sbuffer> packExact(const T& value)
+{
+	auto sbuf = BufferPool::instance().acquire(packedSize(value));
+	msgpack::pack(*sbuf, value);
+	return sbuf;
+}
+
+} }
@@ -0,0 +1,152 @@
+#pragma once
+#include <cstddef>
+#include <string>
+#include <boost/utility/string_ref.hpp>
+#include "Protocol.h"
+
+namespace msgpack {
+namespace rpc {
+
+// Handler params that point into the received message instead of owning a copy.
+// They are valid until the handler returns, the unpacked buffer is reused for
+// the next message, so copy out what is kept longer (an async reply included).
+// A msgpack::type_error a handler lets out of them is answered as error_params_convert.
+
+/// a str param
+typedef boost::string_ref StrView;
+
+/// a bin param, str is taken as well
+struct BinView
+{
+	const char* data = nullptr;
+	size_t size = 0;
+
+	bool empty() const { return size == 0; }
+	const char* begin() const { return data; }
+	const char* end() const { return data + size; }
+};
+
+/// an array param, elements are converted when asked for
+class ArrayView
+{
+public:
+	ArrayView() : _array() {}
+	explicit ArrayView(const msgpack::object_array& array) : _array(array) {}
+
+	size_t size() const { return _array.size; }
+	bool empty() const { return _array.size == 0; }
+	/// element i, throws msgpack::type_error past the end, a client sent too few
+	const msgpack::object& operator[](size_t i) const
+	{
+		if (i >= _array.size)
+			throw msgpack::type_error();
+		return _array.ptr[i];
+	}
+	const msgpack::object* begin() const { return _array.ptr; }
+	const msgpack::object* end() const { return _array.ptr + _array.size; }
+
+	/// element i as T, which may be a view again, throws msgpack::type_error
+	template<typename T>
+	T as(size_t i) const;
+
+private:
+	msgpack::object_array _array;
+};
+
+/// a map param, looked up by walking it, the maps of a request are small
+class MapView
+{
+public:
+	MapView() : _map() {}
+	explicit MapView(const msgpack::object_map& map) : _map(map) {}
+
+	size_t size() const { return _map.size; }
+	bool empty() const { return _map.size == 0; }
+	const msgpack::object_kv* begin() const { return _map.ptr; }
+	const msgpack::object_kv* end() const { return _map.ptr + _map.size; }
+
+	/// the value of a str key, null if there is none
+	const msgpack::object* find(StrView key) const;
+
+	/// convert the value of key into value, false if there is none
+	template<typename T>
+	bool get(StrView key, T& value) const;
+
+private:
+	msgpack::object_map _map;
+};
+
+// one param, owning types go through msgpack, views are pointed at the message
+
+template<typename T>
+inline void convertParam(const msgpack::object& o, T& value)
+{
+	o.convert(&value);
+}
+
+inline void convertParam(const msgpack::object& o, StrView& value)
+{
+	if (o.type != msgpack::type::STR)
+		throw msgpack::type_error();
+	value = StrView(o.via.str.ptr, o.via.str.size);
+}
+
+inline void convertParam(const msgpack::object& o, BinView& value)
+{
+	if (o.type == msgpack::type::BIN)
+	{
+		value.data = o.via.bin.ptr;
+		value.size = o.via.bin.size;
+	}
+	else if (o.type == msgpack::type::STR)
+	{
+		value.data = o.via.str.ptr;
+		value.size = o.via.str.size;
+	}
+	else
+		throw msgpack::type_error();
+}
+
+inline void convertParam(const msgpack::object& o, ArrayView& value)
+{
+	if (o.type != msgpack::type::ARRAY)
+		throw msgpack::type_error();
+	value = ArrayView(o.via.array);
+}
+
+inline void convertParam(const msgpack::object& o, MapView& value)
+{
+	if (o.type != msgpack::type::MAP)
+		throw msgpack::type_error();
+	value = MapView(o.via.map);
+}
+
+template<typename T>
+inline T ArrayView::as(size_t i) const
+{
+	T value;
+	convertParam((*this)[i], value);
+	return value;
+}
+
+inline const msgpack::object* MapView::find(StrView key) const
+{
+	for (auto& kv : *this)
+	{
+		if (kv.key.type == msgpack::type::STR && StrView(kv.key.via.str.ptr, kv.key.via.str.size) == key)
+			return &kv.val;
+	}
+	return nullptr;
+}
+
+template<typename T>
+inline bool MapView::get(StrView key, T& value) const
+{
+	const msgpack::object* found = find(key);
+	if (!found)
+		return false;
+	convertParam(*found, value);
+	return true;
+}
+
+} }
@@ -0,0 +1,228 @@
+#pragma once
+#include <chrono>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <utility>
+#include <vector>
+#include <boost/asio/steady_timer.hpp>
+#include "TcpConnection.h"
+
+namespace msgpack {
+namespace rpc {
+
+/// Property values by name, packed as a map. The objects live in zone.
+struct PropertyValues
+{
+	std::shared_ptr<msgpack::zone> zone = std::make_shared<msgpack::zone>();
+	std::vector<std::pair<std::string, msgpack::object>> values;
+
+	template<typename Packer>
+	void msgpack_pack(Packer& pk) const
+	{
+		pk.pack_map(static_cast<uint32_t>(values.size()));
+		for (auto& value : values)
+		{
+			pk.pack(value.first);
+			pk.pack(value.second);
+		}
+	}
+};
+
+/// The properties of a dispatcher and who follows them. A subscriber gets the
+/// properties that changed in one properties_changed notify, at most once per
+/// its interval, whatever changed in between is sent once with its latest value.
+/// Changes are what set_/list handlers do and what changed() is told about.
+/// A subscriber is dropped when its connection closes.
+class PropertyHub : public std::enable_shared_from_this<PropertyHub>
+{
+public:
+	typedef std::function<msgpack::object(msgpack::zone&)> Getter;
+
+	/// shorter intervals asked for are raised to this, 0 would send every change
+	static const uint32_t MIN_INTERVAL_MS = 20;
+
+	/// register before serving
+	void add(const std::string& property, Getter getter)
+	{
+		_getters[property] = getter;
+	}
+
+	bool empty() const { return _getters.empty(); }
+
+	/// current values, throws msgerror for an unknown property
+	PropertyValues read(const std::vector<std::string>& properties) const
+	{
+		PropertyValues result;
+		result.values.reserve(properties.size());
+		for (auto& property : properties)
+		{
+			auto found = _getters.find(property);
+			if (found == _getters.end())
+				throw msgerror("no property " + property, error_invalid_argument);
+			result.values.emplace_back(property, found->second(*result.zone));
+		}
+		return result;
+	}
+
+	/// follow properties from connection, returns their current values
+	PropertyValues subscribe(const std::shared_ptr<TcpConnection>& connection,
+		const std::vector<std::string>& properties, uint32_t intervalMs)
+	{
+		PropertyValues current = read(properties);
+
+		std::lock_guard<std::mutex> lock(_mtx);
+		auto& subscriber = _subscribers[connection];
+		if (!subscriber)
+		{
+			subscriber = std::make_shared<Subscriber>(connection->getIoService());
+			subscriber->connection = connection;
+		}
+		if (intervalMs < MIN_INTERVAL_MS)
+			subscriber->intervalMs = MIN_INTERVAL_MS;
+		else
+			subscriber->intervalMs = intervalMs;
+		subscriber->lastSent = std::chrono::steady_clock::now();
+		subscriber->properties.insert(properties.begin(), properties.end());
+		return current;
+	}
+
+	/// stop following properties, all of them if empty
+	void unsubscribe(const std::shared_ptr<TcpConnection>& connection, const std::vector<std::string>& properties)
+	{
+		std::lock_guard<std::mutex> lock(_mtx);
+		auto found = _subscribers.find(connection);
+		if (found == _subscribers.end())
+			return;
+
+		auto& subscriber = found->second;
+		if (properties.empty())
+			subscriber->properties.clear();
+		for (auto& property : properties)
+		{
+			subscriber->properties.erase(property);
+			subscriber->pending.erase(property);
+		}
+		if (subscriber->properties.empty())
+			drop(found);
+	}
+
+	/// connection closed, called by its session
+	void disconnected(const std::shared_ptr<TcpConnection>& connection)
+	{
+		std::lock_guard<std::mutex> lock(_mtx);
+		auto found = _subscribers.find(connection);
+		if (found != _subscribers.end())
+			drop(found);
+	}
+
+	/// property has a new value, from any thread
+	void changed(const std::string& property)
+	{
+		std::vector<std::pair<std::shared_ptr<Subscriber>, std::chrono::steady_clock::duration>> due;
+		{
+			std::lock_guard<std::mutex> lock(_mtx);
+			auto now = std::chrono::steady_clock::now();
+			for (auto it = _subscribers.begin(); it != _subscribers.end();)
+			{
+				auto& subscriber = it->second;
+				if (subscriber->connection.expired())
+				{
+					// freed without disconnected(), a connection with no session
+					drop(it++);
+					continue;
+				}
+				else if (subscriber->properties.count(property))
+				{
+					subscriber->pending.insert(property);
+					if (!subscriber->scheduled)
+					{
+						subscriber->scheduled = true;
+						auto next = subscriber->lastSent + std::chrono::milliseconds(subscriber->intervalMs);
+						due.emplace_back(subscriber, next > now ? next - now : std::chrono::steady_clock::duration::zero());
+					}
+				}
+				++it;
+			}
+		}
+
+		// only the thread that set scheduled touches the timer until the flush
+		auto self = shared_from_this();
+		for (auto& entry : due)
+		{
+			auto subscriber = entry.first;
+			subscriber->timer.expires_from_now(entry.second);
+			subscriber->timer.async_wait([self, subscriber](const boost::system::error_code& error)
+			{
+				if (!error)
+					self->flush(subscriber);
+			});
+		}
+	}
+
+private:
+	struct Subscriber
+	{
+		Subscriber(boost::asio::io_service& ios) : timer(ios) {}
+
+		std::weak_ptr<TcpConnection> connection;
+		uint32_t intervalMs = 0;
+		std::chrono::steady_clock::time_point lastSent;
+		std::set<std::string> properties;
+		std::set<std::string> pending;		// changed since lastSent
+		bool scheduled = false;				// a flush is waiting on timer
+		boost::asio::steady_timer timer;	// on the io thread of the connection
+	};
+
+	typedef std::map<std::weak_ptr<TcpConnection>, std::shared_ptr<Subscriber>,
+		std::owner_less<std::weak_ptr<TcpConnection>>> SubscriberMap;
+
+	/// under _mtx. A flush already scheduled keeps the subscriber alive and finds
+	/// nothing pending, a later subscribe starts a new one.
+	void drop(SubscriberMap::iterator it)
+	{
+		it->second->pending.clear();
+		_subscribers.erase(it);
+	}
+
+	void flush(const std::shared_ptr<Subscriber>& subscriber)
+	{
+		std::vector<std::string> properties;
+		std::shared_ptr<TcpConnection> connection;
+		{
+			std::lock_guard<std::mutex> lock(_mtx);
+			properties.assign(subscriber->pending.begin(), subscriber->pending.end());
+			subscriber->pending.clear();
+			subscriber->scheduled = false;
+			subscriber->lastSent = std::chrono::steady_clock::now();
+			connection = subscriber->connection.lock();
+		}
+		if (!connection || properties.empty() || connection->getConnectionStatus() != connection_connected)
+			return;
+
+		try
+		{
+			// values as of now, not as of the change
+			PropertyValues values = read(properties);
+			MsgNotify<std::string, std::tuple<const PropertyValues&>> notify("properties_changed",
+				std::tuple<const PropertyValues&>(values));
+			connection->asyncWrite(packExact(notify));
+		}
+		catch (msgerror&)
+		{
+			// the object behind a property is gone, nothing to tell
+		}
+		catch (std::exception&)
+		{
+			// a value that does not pack, the next change tries again
+		}
+	}
+
+	std::map<std::string, Getter> _getters;
+	std::mutex _mtx;
+	SubscriberMap _subscribers;		// by owner, not address, a new connection can reuse a freed one's
+};
+
+} }
@@ -0,0 +1,73 @@
+#pragma once
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+#include "CoarseClock.h"
+
+namespace msgpack {
+namespace rpc {
+
+/// burst tokens, refilled at perSecond, 0 means unlimited
+struct RateLimit
+{
+	RateLimit() { }
+	RateLimit(uint32_t burst, uint32_t perSecond) :
+		burst(burst),
+		perSecond(perSecond) { }
+
+	bool isLimited() const { return perSecond != 0; }
+
+	uint32_t burst{ 0 };
+	uint32_t perSecond{ 0 };
+};
+
+/// Token bucket in fixed point milli tokens, refilled from CoarseClock ticks.
+class TokenBucket
+{
+public:
+	static const uint64_t SCALE = 1000;
+
+	bool tryTake(const RateLimit& limit, uint64_t now)
+	{
+		uint64_t capacity = uint64_t(std::max<uint32_t>(limit.burst, 1)) * SCALE;
+		if (!_started)
+		{
+			_started = true;
+			_tokens = capacity;
+			_last = now;
+		}
+		else if (now > _last)
+		{
+			// perSecond tokens per 1000ms is perSecond * TICK_MS milli tokens per tick
+			uint64_t refill = uint64_t(limit.perSecond) * CoarseClock::TICK_MS;
+			uint64_t ticks = std::min<uint64_t>(now - _last, capacity / refill + 1);
+			_tokens = std::min(capacity, _tokens + ticks * refill);
+			_last = now;
+		}
+
+		if (_tokens < SCALE)
+			return false;
+		_tokens -= SCALE;
+		return true;
+	}
+
+	/// give back the token of the last tryTake
+	void refund()
+	{
+		_tokens += SCALE;
+	}
+
+private:
+	bool _started{ false };
+	uint64_t _tokens{ 0 };
+	uint64_t _last{ 0 };
+};
+
+/// Buckets of one session: the session wide one and one per limited method.
+struct RateState
+{
+	TokenBucket session;
+	std::vector<TokenBucket> methods;
+};
+
+} }
@@ -11,15 +11,6 @@ SessionManager::~SessionManager()
 {
 }
 
-SessionManager* SessionManager::instance()
-{
-	static std::once_flag instance_flag;
-	static SessionManager* m_pInstance;
-
-	std::call_once(instance_flag, []() { m_pInstance = new SessionManager(); });
-	return m_pInstance;
-}
-
 void SessionManager::start(SessionPtr session)
 {
 	std::unique_lock<std::mutex> lck(_mtx);
@@ -38,8 +29,68 @@ void SessionManager::stopAll()
 {
 	std::unique_lock<std::mutex> lck(_mtx);
 	for (auto session : _sessionPool)
-		session->stop();
+		session->closeGracefully();
 	_sessionPool.clear();
 }
 
+void SessionManager::drainAll(boost::asio::io_service& ios, std::chrono::milliseconds deadline, std::function<void()> onDrained)
+{
+	std::set<SessionPtr> sessions;
+	{
+		std::unique_lock<std::mutex> lck(_mtx);
+		sessions = _sessionPool;
+	}
+	for (auto session : sessions)
+		session->drain(static_cast<uint32_t>(deadline.count()));
+
+	auto timer = std::make_shared<boost::asio::steady_timer>(ios);
+	checkDrained(timer, std::chrono::steady_clock::now() + deadline, onDrained);
+}
+
+void SessionManager::checkDrained(std::shared_ptr<boost::asio::steady_timer> timer,
+	std::chrono::steady_clock::time_point deadline, std::function<void()> onDrained)
+{
+	bool expired = std::chrono::steady_clock::now() >= deadline;
+	std::vector<SessionPtr> done;
+	bool empty;
+	{
+		std::unique_lock<std::mutex> lck(_mtx);
+		for (auto it = _sessionPool.begin(); it != _sessionPool.end();)
+		{
+			if (expired || (*it)->isIdle())
+			{
+				done.push_back(*it);
+				it = _sessionPool.erase(it);
+			}
+			else
+				++it;
+		}
+		empty = _sessionPool.empty();
+	}
+
+	for (auto session : done)
+	{
+		if (expired)
+			session->close();
+		else
+			session->closeGracefully();
+	}
+
+	if (empty)
+	{
+		if (onDrained)
+			onDrained();
+		return;
+	}
+
+	timer->expires_from_now(std::chrono::milliseconds(50));
+	// the server may be gone before the deadline, its sessions are not
+	auto self = shared_from_this();
+	timer->async_wait([self, timer, deadline, onDrained](const boost::system::error_code& error)
+	{
+		if (!error)
+			self->checkDrained(timer, deadline, onDrained);
+	});
+}
+
 } }
\ No newline at end of file
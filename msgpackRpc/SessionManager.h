@@ -1,14 +1,18 @@
 #pragma once
 #include <mutex>
+#include <chrono>
+#include <boost/asio/steady_timer.hpp>
 #include "TcpSession.h"
 namespace msgpack {
 namespace rpc {
-		
-class SessionManager
+
+/// The sessions one TcpServer accepted, so stopping or draining a server
+/// touches none of another's.
+class SessionManager : public std::enable_shared_from_this<SessionManager>
 {
 public:
-	/// Create instance
-	static SessionManager* instance();
+	SessionManager();
+	~SessionManager();
 
 	/// Add the specified session to the manager and start it.
 	void start(SessionPtr session);
@@ -16,24 +20,30 @@ public:
 	/// Stop the specified connection.
 	void stop(SessionPtr session);
 
-	/// Stop all session.
+	/// Stop all session, queued writes are flushed first.
 	void stopAll();
 
-	/// Get session pool
-	std::set<SessionPtr>& getSessionPool();
+	/// Send going_away to all sessions, close each one once idle and
+	/// force the rest closed at the deadline, then call onDrained.
+	void drainAll(boost::asio::io_service& ios, std::chrono::milliseconds deadline, std::function<void()> onDrained);
+
+	/// Copy of the session pool, safe to walk while sessions come and go
+	std::set<SessionPtr> getSessionPool();
 
 private:
-	SessionManager();
-	~SessionManager();
 	SessionManager(const SessionManager&) = delete;
 	SessionManager& operator=(const SessionManager&) = delete;
 
+	void checkDrained(std::shared_ptr<boost::asio::steady_timer> timer,
+		std::chrono::steady_clock::time_point deadline, std::function<void()> onDrained);
+
 	std::mutex _mtx;
 	std::set<SessionPtr> _sessionPool;
 };
 
-inline std::set<SessionPtr>& SessionManager::getSessionPool()
+inline std::set<SessionPtr> SessionManager::getSessionPool()
 {
+	std::unique_lock<std::mutex> lck(_mtx);
 	return _sessionPool;
 }
 
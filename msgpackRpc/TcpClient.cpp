@@ -1,6 +1,7 @@
 #pragma once
 #include "TcpClient.h"
 #include "TcpSession.h"
+#include "CoarseClock.h"
 
 namespace msgpack {
 namespace rpc {
@@ -9,27 +10,172 @@ using boost::asio::io_service;
 using boost::asio::ip::tcp;
 
 TcpClient::TcpClient(io_service &ios): 
-	_ioService(ios)
+	_ioService(ios),
+	_dispatcher(std::make_shared<Dispatcher>()),
+	_retryTimer(ios),
+	_jitter(std::random_device()()),
+	_closed(false),
+	_connected(false),
+	_attempt(0),
+	_disconnects(0),
+	_attempts(0),
+	_reconnects(0),
+	_lastDelayMs(0)
 {
+	_session = std::make_shared<TcpSession>(_ioService, _dispatcher);
+	_session->setConnectionHandler([this](ConnectionStatus status) { onConnectionStatus(status); });
+	_session->setDisconnectHandler([this]() { onDisconnected(); });
 } 
 
 TcpClient::~TcpClient()
 {
+	_closed = true;
+	boost::system::error_code ec;
+	_retryTimer.cancel(ec);
+	_session->setConnectionHandler(ConnectionHandler());
+	_session->setDisconnectHandler(std::function<void()>());
 }
 
 void TcpClient::setDispatcher(std::shared_ptr<Dispatcher> disp)
 {
-	_dispatcher = disp;
+	if (disp)
+	{
+		_dispatcher = disp;
+		_session->setDispatcher(disp);
+	}
+}
+
+void TcpClient::setAdmissionLimits(const AdmissionLimits& limits)
+{
+	_admission = std::make_shared<AdmissionControl>(limits);
+	_session->setAdmission(_admission);
+}
+
+void TcpClient::setReconnectPolicy(const ReconnectPolicy& policy)
+{
+	_policy = policy;
+}
+
+void TcpClient::setConnectedHandler(std::function<void()> handler)
+{
+	_onConnected = handler;
+}
+
+void TcpClient::setWaitStrategy(const WaitStrategy& strategy)
+{
+	_session->setWaitStrategy(strategy);
+}
+
+void TcpClient::setBusyPoll(uint32_t us)
+{
+	_session->setBusyPoll(us);
+}
+
+void TcpClient::setIdempotent(const std::string& method)
+{
+	_session->setIdempotent(method);
+}
+
+ReconnectStats TcpClient::getReconnectStats() const
+{
+	ReconnectStats stats;
+	stats.disconnects = _disconnects;
+	stats.attempts = _attempts;
+	stats.reconnects = _reconnects;
+	stats.replayedCalls = _session->getReplayedCalls();
+	stats.failedCalls = _session->getFailedCalls();
+	stats.lastDelayMs = _lastDelayMs;
+	stats.connected = _connected;
+	return stats;
 }
 
 void TcpClient::asyncConnect(const boost::asio::ip::tcp::endpoint &endpoint)
 {
-	_session = std::make_shared<TcpSession>(_ioService, _dispatcher ? _dispatcher : std::make_shared<Dispatcher>());
-	_session->asyncConnect(endpoint);
+	_endpoint = endpoint;
+	_closed = false;
+	_attempt = 0;
+	_session->setHoldCalls(_policy.enabled);
+	CoarseClock::start(_ioService);
+	connect();
+}
+
+void TcpClient::connect()
+{
+	// kept until the new session has a token of its own, a failed connect does not lose it
+	_resumeToken = getResumeToken();
+
+	_session->asyncConnect(_endpoint);
+
+	// queued behind the connect, so it is the first request the server sees
+	if (!_resumeToken.empty())
+		_session->asyncCall("session_resume", _resumeToken);
+
+	// then what the lost connection left unanswered
+	_session->replay();
+}
+
+void TcpClient::onConnectionStatus(ConnectionStatus status)
+{
+	if (status != connection_connected)
+		return;
+	_connected = true;
+	if (_attempt)
+		++_reconnects;
+	_attempt = 0;
+	if (_onConnected)
+		_onConnected();
+}
+
+void TcpClient::onDisconnected()
+{
+	if (_connected.exchange(false))
+		++_disconnects;
+
+	if (_closed || !_policy.enabled)
+		return;
+	if (_policy.maxAttempts && _attempt >= _policy.maxAttempts)
+	{
+		// give up, nothing is coming for the held calls
+		_session->setHoldCalls(false);
+		return;
+	}
+
+	uint32_t delayMs = backoffMs(_attempt++);
+	_lastDelayMs = delayMs;
+	_retryTimer.expires_from_now(std::chrono::milliseconds(delayMs));
+	_retryTimer.async_wait([this](const boost::system::error_code& error)
+	{
+		if (error || _closed)
+			return;
+		++_attempts;
+		connect();
+	});
+}
+
+uint32_t TcpClient::backoffMs(uint32_t attempt)
+{
+	uint64_t step = std::min<uint64_t>(_policy.maxDelayMs,
+		static_cast<uint64_t>(_policy.initialDelayMs) << std::min<uint32_t>(attempt, 20));
+	std::uniform_int_distribution<uint64_t> jitter(0, step / 2);
+	return static_cast<uint32_t>(step - step / 2 + jitter(_jitter));
+}
+
+std::string TcpClient::getResumeToken()
+{
+	std::string token = _session->getResumeToken();
+	return token.empty() ? _resumeToken : token;
+}
+
+void TcpClient::setResumeToken(const std::string& token)
+{
+	_resumeToken = token;
 }
 
 void TcpClient::close()
 {
+	// the retry timer sees _closed, it is not touched off the io thread
+	_closed = true;
+	_session->setHoldCalls(false);
 	_session->close();
 }
 
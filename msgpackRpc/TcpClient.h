@@ -1,11 +1,37 @@
 #pragma once
+#include <atomic>
 #include <memory>
+#include <random>
 #include <boost/asio.hpp>
+#include <boost/asio/steady_timer.hpp>
 #include "TcpConnection.h"
+#include "Admission.h"
 
 namespace msgpack {
 namespace rpc {
 
+/// How a client gets back a lost connection. Delays grow from initialDelayMs by
+/// doubling up to maxDelayMs, each drawn at random from the upper half of its step,
+/// so clients that lost the same server do not come back all at once.
+struct ReconnectPolicy
+{
+	bool enabled = true;
+	uint32_t initialDelayMs = 100;
+	uint32_t maxDelayMs = 30 * 1000;
+	uint32_t maxAttempts = 0;		// in a row before giving up, 0 tries forever
+};
+
+struct ReconnectStats
+{
+	uint64_t disconnects = 0;		// connections lost, not counting close()
+	uint64_t attempts = 0;			// reconnects tried
+	uint64_t reconnects = 0;		// of them that connected
+	uint64_t replayedCalls = 0;		// idempotent calls sent again
+	uint64_t failedCalls = 0;		// calls failed with error_connection_lost
+	uint32_t lastDelayMs = 0;		// backoff before the last attempt
+	bool connected = false;
+};
+
 class TcpSession;
 class Dispatcher;
 class TcpClient
@@ -16,8 +42,41 @@ public:
 
 	void close();
 	void setDispatcher(std::shared_ptr<Dispatcher> disp);
+
+	/// reconnecting with a resume token first calls session_resume(token), so
+	/// the server can give back what the old session held. a lost connection is
+	/// connected again by the reconnect policy until close().
 	void asyncConnect(const boost::asio::ip::tcp::endpoint& endpoint);
 
+	/// call before asyncConnect
+	void setReconnectPolicy(const ReconnectPolicy& policy);
+
+	/// calls of method are safe to send twice, they wait out a reconnect and are
+	/// sent again. other calls on a lost connection fail with error_connection_lost.
+	void setIdempotent(const std::string& method);
+
+	ReconnectStats getReconnectStats() const;
+
+	/// how syncCall waits for its reply, say WaitStrategy::spinThenPark(50)
+	/// for a client that talks to a server next to it
+	void setWaitStrategy(const WaitStrategy& strategy);
+
+	/// SO_BUSY_POLL on the socket, for a client whose io thread busy polls too,
+	/// see runIoLoop. Set before asyncConnect, reconnects keep it.
+	void setBusyPoll(uint32_t us);
+
+	/// called on the io thread each time a connect or reconnect succeeds
+	void setConnectedHandler(std::function<void()> handler);
+
+	/// the token of the current session, or the one set below until the server sends a new one
+	std::string getResumeToken();
+
+	/// resume from a token kept elsewhere, say by a client that restarted too, call before the first asyncConnect
+	void setResumeToken(const std::string& token);
+
+	/// calls over maxInflightRequests fail fast with error_server_overloaded
+	void setAdmissionLimits(const AdmissionLimits& limits);
+
 	/// register a function without return
 	template<typename... TArgs>
 	void registerFunc(const std::string& method, void(*handler)(TArgs... args));
@@ -34,6 +93,10 @@ public:
 	template<typename... TArgs>
 	std::shared_ptr<AsyncCallCtx> asyncCall(OnAsyncCall callback, const std::string& method, TArgs... args);
 
+	/// notify without reply, dropped while not connected
+	template<typename... TArgs>
+	bool notify(const std::string& method, TArgs... args);
+
 	/// syncCall without return
 	template<typename... TArgs>
 	void syncCall(const std::string& method, TArgs... args);
@@ -43,11 +106,31 @@ public:
 	R& syncCall(R* value, const std::string& method, TArgs... args);
 
 private:
+	void connect();
+	void onDisconnected();
+	void onConnectionStatus(ConnectionStatus status);
+	uint32_t backoffMs(uint32_t attempt);
+
 	boost::asio::io_service& _ioService;
 
-	std::shared_ptr<TcpSession> _session;
+	std::shared_ptr<TcpSession> _session;		// one for the client, a connection per connect
+	boost::asio::ip::tcp::endpoint _endpoint;
+
+	ReconnectPolicy _policy;
+	boost::asio::steady_timer _retryTimer;
+	std::mt19937 _jitter;
+	std::atomic<bool> _closed;
+	std::atomic<bool> _connected;
+	uint32_t _attempt;				// failed attempts in a row, io thread
+	std::atomic<uint64_t> _disconnects;
+	std::atomic<uint64_t> _attempts;
+	std::atomic<uint64_t> _reconnects;
+	std::atomic<uint32_t> _lastDelayMs;
+	std::function<void()> _onConnected;
 
 	std::shared_ptr<Dispatcher> _dispatcher;
+	std::shared_ptr<AdmissionControl> _admission;
+	std::string _resumeToken;		// the last token known
 };
 
 template<typename... TArgs>
@@ -74,6 +157,12 @@ inline std::shared_ptr<AsyncCallCtx> TcpClient::asyncCall(OnAsyncCall callback,
 	return _session->asyncCall(callback, method, args...);
 }
 
+template<typename... TArgs>
+inline bool TcpClient::notify(const std::string& method, TArgs... args)
+{
+	return _session->notify(method, args...);
+}
+
 template<typename... TArgs>
 inline void TcpClient::syncCall(const std::string& method, TArgs... args)
 {
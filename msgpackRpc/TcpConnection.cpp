@@ -1,4 +1,8 @@
 #include "TcpConnection.h"
+#include "CoarseClock.h"
+#include "IoLoop.h"
+#include <algorithm>
+#include <iterator>
 
 namespace msgpack {
 namespace rpc {
@@ -34,7 +38,7 @@ std::string AsyncCallCtx::string() const
 	}
 	boost::mutex::scoped_lock lock(m_mutex);
 	m_result = result;
-	m_status = STATUS_RECEIVED;
+	m_status.store(STATUS_RECEIVED, std::memory_order_release);
 	notify();
 }
 
@@ -47,9 +51,21 @@ void AsyncCallCtx::setError(const ::msgpack::object &error)
 	typedef std::tuple<int, std::string> CodeWithMsg;
 	CodeWithMsg codeWithMsg;
 	error.convert(&codeWithMsg);
-	m_status = STATUS_ERROR;
 	m_error_code = static_cast<ServerSideError>(std::get<0>(codeWithMsg));
 	m_error_msg = std::get<1>(codeWithMsg);
+	m_status.store(STATUS_ERROR, std::memory_order_release);
+	notify();
+}
+
+void AsyncCallCtx::setError(ServerSideError code, const std::string &msg)
+{
+	if (m_status != STATUS_WAIT) {
+		throw func_call_error("already finishded");
+	}
+	boost::mutex::scoped_lock lock(m_mutex);
+	m_error_code = code;
+	m_error_msg = msg;
+	m_status.store(STATUS_ERROR, std::memory_order_release);
 	notify();
 }
  ServerSideError AsyncCallCtx::getErrorCode() const
@@ -60,14 +76,46 @@ void AsyncCallCtx::setError(const ::msgpack::object &error)
 }
 
 TcpConnection::TcpConnection(boost::asio::io_service& io_service):
+	_ioService(io_service),
 	_socket(io_service),
-	_unpacker()
+	_connectionStatus(connection_none),
+	_unpacker(),
+	_reading(false),
+	_readPause(0),
+	_writing(false),
+	_pendingBytes(0),
+	_writeLimit(0),
+	_closeAfterWrite(false),
+	_protocolError(false),
+	_connecting(false),
+	_lastActivity(CoarseClock::now()),
+	_busyPollUs(0),
+	_reads(0),
+	_writes(0),
+	_bytesRead(0),
+	_bytesWritten(0)
 {
 }
 
-TcpConnection::TcpConnection(tcp::socket socket):
+TcpConnection::TcpConnection(boost::asio::io_service& io_service, tcp::socket socket):
+	_ioService(io_service),
 	_socket(std::move(socket)),
-	_unpacker()
+	_connectionStatus(connection_none),
+	_unpacker(),
+	_reading(false),
+	_readPause(0),
+	_writing(false),
+	_pendingBytes(0),
+	_writeLimit(0),
+	_closeAfterWrite(false),
+	_protocolError(false),
+	_connecting(false),
+	_lastActivity(CoarseClock::now()),
+	_busyPollUs(0),
+	_reads(0),
+	_writes(0),
+	_bytesRead(0),
+	_bytesWritten(0)
 {
 }
 
@@ -82,6 +130,10 @@ ConnectionStatus TcpConnection::getConnectionStatus() const
 
 void TcpConnection::asyncConnect(const boost::asio::ip::tcp::endpoint &endpoint)
 {
+	{
+		std::lock_guard<std::mutex> lock(_writeMtx);
+		_connecting = true;
+	}
 	setConnectionStatus(connection_connecting);
 	auto self = shared_from_this();
 	_socket.async_connect(endpoint, [this, self](const boost::system::error_code &error)
@@ -94,17 +146,41 @@ void TcpConnection::asyncConnect(const boost::asio::ip::tcp::endpoint &endpoint)
 		}
 		else
 		{
+			boost::system::error_code ec;
+			_socket.set_option(tcp::no_delay(true), ec);
+			if (_busyPollUs)
+				::msgpack::rpc::setBusyPoll(_socket, _busyPollUs, ec);
 			startRead();
+
+			// send what was queued while connecting
+			bool queued;
+			{
+				std::lock_guard<std::mutex> lock(_writeMtx);
+				_connecting = false;
+				queued = !_writing && hasQueuedWrites();
+				if (queued)
+					_writing = true;
+			}
+			if (queued)
+				doWrite();
 		}
 	});
 }
 
 void TcpConnection::asyncRead()
 {
+	if (_reading || _readPause)
+		return;
+
+	_reading = true;
+	// what is left after the last message may be a few bytes, reading into
+	// that would take a syscall for every few bytes under load
+	_unpacker.reserve_buffer(READ_CHUNK_BYTES);
 	auto self = shared_from_this();
 	_socket.async_read_some(boost::asio::buffer(_unpacker.buffer(), _unpacker.buffer_capacity()),
 		[this, self](const boost::system::error_code &error, size_t bytes_transferred)
 		{
+			_reading = false;
 			if (error)
 			{
 				if (_netErrorHandler)
@@ -114,6 +190,15 @@ void TcpConnection::asyncRead()
 			}
 			else
 			{
+				_lastActivity = CoarseClock::now();
+				++_reads;
+				_bytesRead += bytes_transferred;
+				if (_protocolError)
+				{
+					// the peer broke the protocol, what it sends now is read until it closes and dropped
+					asyncRead();
+					return;
+				}
 				_unpacker.buffer_consumed(bytes_transferred);
 				try
 				{
@@ -128,19 +213,25 @@ void TcpConnection::asyncRead()
 				{
 					auto msg = error_notify(error.what());
 					asyncWrite(msg);
-					// no more read
-					// todo: close after write
+					// no more messages, the rest of the input is dropped
+					_protocolError = true;
+					closeAfterWrite();
 					return;
 				}
 				catch (...)
 				{
 					auto msg = error_notify("unknown error");
 					asyncWrite(msg);
-					// no more read
-					// todo: close after write
+					// no more messages, the rest of the input is dropped
+					_protocolError = true;
+					closeAfterWrite();
 					return;
 				}
 
+				// the peer does not read its responses, stop reading its requests
+				if (_writeLimit && getPendingBytes() >= _writeLimit)
+					_readPause |= pause_write_backlog;
+
 				// read loop
 				//if (pac->message_size() > 100)
 				//	*pac = unpacker();	// ͷŲbuffer			// pac->bufferͷţյappendbuffer
@@ -149,21 +240,157 @@ void TcpConnection::asyncRead()
 		});
 }
 
-void TcpConnection::asyncWrite(std::shared_ptr<msgpack::sbuffer> msg)
+void TcpConnection::asyncWrite(std::shared_ptr<msgpack::sbuffer> msg, WriteHandler onWritten, WritePriority priority)
+{
+	if (_relay)
+	{
+		if (_connectionStatus == connection_connected)
+			_relay(msg, priority);
+		if (onWritten)
+			onWritten(boost::system::error_code());
+		return;
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(_writeMtx);
+		_pendingBytes += msg->size();
+		_lanes[priority].push_back(PendingWrite{ msg, onWritten });
+		if (_writing || _connecting)
+			return;
+		_writing = true;
+	}
+	doWrite();
+}
+
+void TcpConnection::postWrite(std::shared_ptr<msgpack::sbuffer> msg, WriteHandler onWritten, WritePriority priority)
 {
 	auto self = shared_from_this();
-	_socket.async_write_some(boost::asio::buffer(msg->data(), msg->size()), 		
-		[this, self, msg](const boost::system::error_code& error, size_t bytes_transferred)
+	_ioService.post([self, msg, onWritten, priority]()
+	{
+		self->asyncWrite(msg, onWritten, priority);
+	});
+}
+
+bool TcpConnection::hasQueuedWrites() const
+{
+	for (auto& lane : _lanes)
+	{
+		if (!lane.empty())
+			return true;
+	}
+	return false;
+}
+
+void TcpConnection::doWrite()
+{
+	// one write of what is queued, by lane, bulk only up to a batch
+	std::vector<boost::asio::const_buffer> buffers;
+	{
+		std::lock_guard<std::mutex> lock(_writeMtx);
+		size_t bulkBytes = 0;
+		for (int priority = priority_high; priority < priority_count; ++priority)
 		{
-			if (error)
+			auto& lane = _lanes[priority];
+			while (!lane.empty())
 			{
-				if (_netErrorHandler)
-					_netErrorHandler(error);
-				setConnectionStatus(connection_error);
+				size_t size = lane.front().msg->size();
+				if (priority == priority_bulk && bulkBytes && bulkBytes + size > BULK_BATCH_BYTES)
+					break;
+				if (priority == priority_bulk)
+					bulkBytes += size;
+				_inFlight.push_back(std::move(lane.front()));
+				lane.pop_front();
 			}
+		}
+		buffers.reserve(_inFlight.size());
+		for (auto& write : _inFlight)
+			buffers.push_back(boost::asio::buffer(write.msg->data(), write.msg->size()));
+	}
+
+	auto self = shared_from_this();
+	boost::asio::async_write(_socket, buffers,
+		[this, self](const boost::system::error_code& error, size_t bytes_transferred)
+		{
+			++_writes;
+			_bytesWritten += bytes_transferred;
+			onWriteDone(error);
 		});
 }
 
+void TcpConnection::onWriteDone(const boost::system::error_code& error)
+{
+	std::vector<WriteHandler> handlers;
+	bool more = false;
+	bool closing = false;
+	{
+		std::lock_guard<std::mutex> lock(_writeMtx);
+		// on error everything queued is lost
+		if (error)
+		{
+			for (auto& lane : _lanes)
+			{
+				std::move(lane.begin(), lane.end(), std::back_inserter(_inFlight));
+				lane.clear();
+			}
+		}
+		for (auto& write : _inFlight)
+		{
+			_pendingBytes -= write.msg->size();
+			if (write.onWritten)
+				handlers.push_back(std::move(write.onWritten));
+		}
+		_inFlight.clear();
+		more = !error && hasQueuedWrites();
+		_writing = more;
+		closing = !more && _closeAfterWrite;
+	}
+
+	for (auto& handler : handlers)
+		handler(error);
+
+	if (error)
+	{
+		if (_netErrorHandler)
+			_netErrorHandler(error);
+		setConnectionStatus(connection_error);
+		return;
+	}
+
+	if (closing)
+	{
+		shutdownSend();
+		return;
+	}
+
+	if (more)
+		doWrite();
+
+	// backlog drained to half the limit, read again
+	if ((_readPause & pause_write_backlog) && getPendingBytes() <= _writeLimit / 2)
+		resumeRead(pause_write_backlog);
+}
+
+void TcpConnection::pauseRead(ReadPauseReason reason)
+{
+	_readPause |= reason;
+}
+
+void TcpConnection::resumeRead(ReadPauseReason reason)
+{
+	if (!(_readPause & reason))
+		return;
+
+	_readPause &= ~reason;
+	if (_connectionStatus == connection_connected)
+		asyncRead();
+}
+
+void TcpConnection::startRelay(WriteRelay relay)
+{
+	_relay = relay;
+	setConnectionStatus(connection_connected);
+}
+
 void TcpConnection::startRead()
 {
 	setConnectionStatus(connection_connected);
@@ -175,6 +402,36 @@ void TcpConnection::close()
 	setConnectionStatus(connection_none);
 }
 
+void TcpConnection::closeAfterWrite()
+{
+	bool idle;
+	{
+		std::lock_guard<std::mutex> lock(_writeMtx);
+		if (_closeAfterWrite)
+			return;
+		_closeAfterWrite = true;
+		idle = !_writing && !hasQueuedWrites();
+	}
+	if (idle)
+		shutdownSend();
+}
+
+void TcpConnection::shutdownSend()
+{
+	// half close and read on until the peer closes, so queued data is not lost to a reset.
+	// after a protocol error what is read is dropped, not parsed
+	boost::system::error_code ec;
+	_socket.shutdown(boost::asio::socket_base::shutdown_send, ec);
+	if (ec)
+	{
+		setConnectionStatus(connection_none);
+		return;
+	}
+	_readPause = 0;
+	if (_connectionStatus == connection_connected)
+		asyncRead();
+}
+
 void TcpConnection::setConnectionStatus(ConnectionStatus status)
 {
 	if (_connectionStatus == status)
@@ -1,6 +1,12 @@
 #pragma once
 
 #include "Asio.h"
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
 
 namespace msgpack {
 namespace rpc {
@@ -11,6 +17,27 @@ struct func_call_error : public std::runtime_error
 };
 
 
+/// How AsyncCallCtx::sync() waits for the reply: poll the status for spinUs,
+/// then yield the thread for yieldUs, then sleep until the reply wakes it.
+/// A reply on loopback comes back in microseconds, sooner than a sleep and a
+/// wakeup are over; spinning keeps a core busy for as long as it lasts.
+struct WaitStrategy
+{
+	uint32_t spinUs = 0;
+	uint32_t yieldUs = 0;
+
+	/// sleep right away, for calls that take long or threads that must not burn cpu
+	static WaitStrategy park() { return WaitStrategy(); }
+
+	static WaitStrategy spinThenPark(uint32_t spinUs, uint32_t yieldUs = 0)
+	{
+		WaitStrategy strategy;
+		strategy.spinUs = spinUs;
+		strategy.yieldUs = yieldUs;
+		return strategy;
+	}
+};
+
 class AsyncCallCtx
 {
 public:
@@ -21,7 +48,7 @@ public:
 		STATUS_ERROR,
 	};
 private:
-	STATUS_TYPE m_status;
+	std::atomic<STATUS_TYPE> m_status;	// stored last, after the result, polled by sync() without the lock
 	ServerSideError m_error_code;
 	std::string m_error_msg;
 	::msgpack::object m_result;
@@ -38,16 +65,23 @@ public:
 
 	void setResult(const ::msgpack::object &result);
 	void setError(const ::msgpack::object &error);
+	void setError(ServerSideError code, const std::string &msg);
 
 	bool isError() const { return m_status == STATUS_ERROR; }
 	ServerSideError getErrorCode() const;
+	const std::string& getErrorMessage() const { return m_error_msg; }
 
 
 	// blocking
-	AsyncCallCtx& sync()
+	AsyncCallCtx& sync(const WaitStrategy& strategy = WaitStrategy())
 	{
+		if (strategy.spinUs || strategy.yieldUs)
+			pollUntil(strategy);
+
+		// the status is stored, then the callback runs, both under m_mutex. Taking
+		// it even when the spin saw the status returns after the callback, as parking does
 		boost::mutex::scoped_lock lock(m_mutex);
-		if (m_status == STATUS_WAIT) {
+		while (m_status == STATUS_WAIT) {
 			m_cond.wait(m_mutex);
 		}
 		return *this;
@@ -78,6 +112,25 @@ public:
 	std::string string() const;
 
 private:
+	// until the status is set or the spin and yield time is over
+	void pollUntil(const WaitStrategy& strategy)
+	{
+		auto spinEnd = std::chrono::steady_clock::now() + std::chrono::microseconds(strategy.spinUs);
+		auto yieldEnd = spinEnd + std::chrono::microseconds(strategy.yieldUs);
+		while (m_status.load(std::memory_order_acquire) == STATUS_WAIT) {
+			auto now = std::chrono::steady_clock::now();
+			if (now < spinEnd) {
+				cpuRelax();
+			}
+			else if (now < yieldEnd) {
+				std::this_thread::yield();
+			}
+			else {
+				return;
+			}
+		}
+	}
+
 	void notify()
 	{
 		if (m_callback) {
@@ -111,9 +164,33 @@ inline std::shared_ptr<msgpack::sbuffer> error_notify(const std::string &msg)
 		msg
 		);
 	// result
-	auto sbuf = std::make_shared<msgpack::sbuffer>();
-	msgpack::pack(*sbuf, notify);
-	return sbuf;
+	return packExact(notify);
+}
+
+/// heartbeat, "ping" is answered with "pong"
+inline std::shared_ptr<msgpack::sbuffer> heartbeat_notify(const std::string &method)
+{
+	MsgNotify<std::string, std::tuple<>> notify(method, std::tuple<>());
+	return packExact(notify);
+}
+
+/// sent to every session when the server drains, deadlineMs is the time left before it closes
+inline std::shared_ptr<msgpack::sbuffer> going_away_notify(uint32_t deadlineMs)
+{
+	MsgNotify<std::string, std::tuple<uint32_t>> notify(
+		// method
+		"going_away",
+		// params
+		std::make_tuple(deadlineMs)
+		);
+	return packExact(notify);
+}
+
+/// issued by the server when a session begins, presented again with session_resume after a reconnect
+inline std::shared_ptr<msgpack::sbuffer> session_token_notify(const std::string &token)
+{
+	MsgNotify<std::string, std::tuple<std::string>> notify("session_token", std::make_tuple(token));
+	return packExact(notify);
 }
 
 enum ConnectionStatus
@@ -124,16 +201,52 @@ enum ConnectionStatus
 	connection_error,
 };
 
+/// Outbound lanes of a connection. Each write takes every queued high and
+/// normal message, in that order, and bulk ones up to BULK_BATCH_BYTES but
+/// at least one, so a high message waits for at most the write in progress
+/// instead of for everything queued. Messages are never split, the stream has
+/// no framing below the message, so producers of bulk messages keep each one
+/// within TcpConnection::BULK_MESSAGE_BYTES, as lobby_list pages do. A high
+/// message then waits for at most BULK_BATCH_BYTES of bulk.
+enum WritePriority
+{
+	priority_high,		// game state, turns and timers, heartbeats
+	priority_normal,	// replies and notifies
+	priority_bulk,		// pages of lists, history
+	priority_count,
+};
+
+/// completed socket operations of a connection, each one is a syscall or more
+struct IoStats
+{
+	uint64_t reads = 0;
+	uint64_t writes = 0;		// async_writes, each carries every message queued when it started
+	uint64_t bytesRead = 0;
+	uint64_t bytesWritten = 0;
+};
+
 typedef std::function<void(boost::system::error_code error)> NetErrorHandler;
 typedef std::function<void(ConnectionStatus)> ConnectionHandler;
+typedef std::function<void(const boost::system::error_code&)> WriteHandler;
+typedef std::function<void(std::shared_ptr<msgpack::sbuffer>, WritePriority)> WriteRelay;
 
 class TcpConnection : public std::enable_shared_from_this<TcpConnection>
 {
 public:
 	typedef std::function<void(const object &, std::shared_ptr<TcpConnection>)> MsgHandler;
 
+	enum { BULK_MESSAGE_BYTES = 16 * 1024 };	// the most a producer puts in one bulk message
+	enum { BULK_BATCH_BYTES = 64 * 1024 };		// bulk taken by one write
+
+	/// why reading is paused, reading resumes when no reason is left
+	enum ReadPauseReason
+	{
+		pause_write_backlog = 0x01,
+		pause_admission = 0x02,
+	};
+
 	TcpConnection(boost::asio::io_service& io_service);
-	TcpConnection(boost::asio::ip::tcp::socket);
+	TcpConnection(boost::asio::io_service& io_service, boost::asio::ip::tcp::socket socket);
 
 	virtual ~TcpConnection();
 
@@ -141,21 +254,74 @@ public:
 
 	void asyncRead();
 
-	void asyncWrite(std::shared_ptr<msgpack::sbuffer> msg);
+	/// queue msg, onWritten is called once msg is on the wire or failed.
+	/// while connecting msg waits and goes out once connected.
+	void asyncWrite(std::shared_ptr<msgpack::sbuffer> msg, WriteHandler onWritten = WriteHandler(),
+		WritePriority priority = priority_normal);
+
+	/// asyncWrite from any thread, the write is started on the io thread
+	void postWrite(std::shared_ptr<msgpack::sbuffer> msg, WriteHandler onWritten = WriteHandler(),
+		WritePriority priority = priority_normal);
 
 	void startRead();
+	void pauseRead(ReadPauseReason reason);
+	void resumeRead(ReadPauseReason reason);
 
 	void close();
 
+	/// no socket, every write is handed to relay, which may be called from any thread.
+	/// stands in on this node for a session connected to another one.
+	void startRelay(WriteRelay relay);
+	bool isRelay() const;
+
+	/// flush queued writes, then half close and wait for the peer to close
+	void closeAfterWrite();
+
 	ConnectionStatus getConnectionStatus() const;
 
+	boost::asio::io_service& getIoService();
+
+	/// pause reading when more than maxPendingBytes are queued, 0 means unlimited
+	void setWriteLimit(size_t maxPendingBytes);
+	size_t getPendingBytes() const;
+
+	/// SO_BUSY_POLL for the socket once connected, 0 leaves it off
+	void setBusyPoll(uint32_t us);
+
+	IoStats getIoStats() const;
+
+	/// CoarseClock tick of the last received data
+	uint64_t getLastActivity() const;
+
+	/// set once by the server session before reading starts, empty on clients
+	void setResumeToken(const std::string& token);
+	const std::string& getResumeToken() const;
+
+	/// who the peer proved to be, say the account of a player that logged in,
+	/// empty until then. Set and read by the handlers of its session.
+	void setIdentity(const std::string& identity);
+	const std::string& getIdentity() const;
+
 	void setMsgHandler(const MsgHandler& handler);
 	void setConnectionHandler(const ConnectionHandler& handler);
 	void setNetErrorHandler(const NetErrorHandler& handler);
 
 private:
+	struct PendingWrite
+	{
+		std::shared_ptr<msgpack::sbuffer> msg;
+		WriteHandler onWritten;
+	};
+
+	enum { READ_CHUNK_BYTES = 64 * 1024 };	// room made in the unpacker before each read
+
 	void setConnectionStatus(ConnectionStatus status);
+	bool hasQueuedWrites() const;
+	void doWrite();
+	void onWriteDone(const boost::system::error_code& error);
+	void shutdownSend();
 
+	boost::asio::io_service& _ioService;
 	boost::asio::ip::tcp::socket _socket;
 
 	ConnectionStatus _connectionStatus;
@@ -164,8 +330,92 @@ private:
 	ConnectionHandler _connectionHandler;
 	NetErrorHandler _netErrorHandler;
 	unpacker _unpacker;
+
+	bool _reading;
+	int _readPause;						// ReadPauseReason bits
+
+	mutable std::mutex _writeMtx;		// asyncWrite may be called out of the io thread
+	std::deque<PendingWrite> _lanes[priority_count];	// by WritePriority
+	std::vector<PendingWrite> _inFlight;	// taken from the lanes for the running async_write
+	bool _writing;
+	size_t _pendingBytes;
+	size_t _writeLimit;
+	bool _closeAfterWrite;
+	bool _protocolError;				// io thread, input is only read to see the peer close
+	bool _connecting;					// guarded by _writeMtx, writes wait for the connect
+	uint64_t _lastActivity;
+	uint32_t _busyPollUs;
+	std::string _resumeToken;
+	std::string _identity;
+	WriteRelay _relay;
+
+	std::atomic<uint64_t> _reads;
+	std::atomic<uint64_t> _writes;
+	std::atomic<uint64_t> _bytesRead;
+	std::atomic<uint64_t> _bytesWritten;
 };
 
+inline bool TcpConnection::isRelay() const
+{
+	return static_cast<bool>(_relay);
+}
+
+inline boost::asio::io_service& TcpConnection::getIoService()
+{
+	return _ioService;
+}
+
+inline uint64_t TcpConnection::getLastActivity() const
+{
+	return _lastActivity;
+}
+
+inline void TcpConnection::setResumeToken(const std::string& token)
+{
+	_resumeToken = token;
+}
+
+inline const std::string& TcpConnection::getResumeToken() const
+{
+	return _resumeToken;
+}
+
+inline void TcpConnection::setIdentity(const std::string& identity)
+{
+	_identity = identity;
+}
+
+inline const std::string& TcpConnection::getIdentity() const
+{
+	return _identity;
+}
+
+inline size_t TcpConnection::getPendingBytes() const
+{
+	std::lock_guard<std::mutex> lock(_writeMtx);
+	return _pendingBytes;
+}
+
+inline IoStats TcpConnection::getIoStats() const
+{
+	IoStats stats;
+	stats.reads = _reads;
+	stats.writes = _writes;
+	stats.bytesRead = _bytesRead;
+	stats.bytesWritten = _bytesWritten;
+	return stats;
+}
+
+inline void TcpConnection::setBusyPoll(uint32_t us)
+{
+	_busyPollUs = us;
+}
+
+inline void TcpConnection::setWriteLimit(size_t maxPendingBytes)
+{
+	_writeLimit = maxPendingBytes;
+}
+
 inline void TcpConnection::setMsgHandler(const MsgHandler& handler)
 {
 	_msgHandler = handler;
@@ -1,7 +1,11 @@
 #pragma once
 #include "TcpServer.h"
+#include <algorithm>
 #include "TcpSession.h"
 #include "SessionManager.h"
+#include "CoarseClock.h"
+#include "TimerWheel.h"
+#include "IoLoop.h"
 
 namespace msgpack {
 namespace rpc {
@@ -10,17 +14,35 @@ using boost::asio::io_service;
 using boost::asio::ip::tcp;
 
 TcpServer::TcpServer(io_service& ios, short port):
-	_ioService(ios),
-	_socket(ios),
-	_acceptor(ios, tcp::endpoint(tcp::v4(), port))
+	TcpServer(ios, tcp::endpoint(tcp::v4(), port), ServerOptions())
 {
 } 
 
 TcpServer::TcpServer(io_service& ios, const tcp::endpoint& endpoint):
+	TcpServer(ios, endpoint, ServerOptions())
+{
+}
+
+TcpServer::TcpServer(io_service& ios, const tcp::endpoint& endpoint, const ServerOptions& options):
 	_ioService(ios),
-	_socket(ios),
-	_acceptor(ios, endpoint)
+	_options(options),
+	_acceptor(ios),
+	_dispatcher(std::make_shared<Dispatcher>()),
+	_sessions(std::make_shared<SessionManager>()),
+	_pingIntervalMs(0),
+	_idleTimeoutMs(0),
+	_acceptRetry(ios),
+	_parkedAccepts(0),
+	_accepted(0),
+	_acceptErrors(0),
+	_lastAcceptError(0)
 {
+	_acceptor.open(endpoint.protocol());
+	_acceptor.set_option(tcp::acceptor::reuse_address(_options.reuseAddress));
+	if (_options.receiveBufferSize > 0)
+		_acceptor.set_option(boost::asio::socket_base::receive_buffer_size(_options.receiveBufferSize));
+	_acceptor.bind(endpoint);
+	_acceptor.listen(_options.backlog);
 }
 
 TcpServer::~TcpServer()
@@ -29,37 +51,132 @@ TcpServer::~TcpServer()
 
 void TcpServer::setDispatcher(std::shared_ptr<Dispatcher> disp)
 {
-	_dispatcher = disp;
+	// sessions share one dispatcher, the default one stays if disp is empty
+	if (disp)
+		_dispatcher = disp;
+}
+
+void TcpServer::setAdmissionLimits(const AdmissionLimits& limits)
+{
+	_admission = std::make_shared<AdmissionControl>(limits);
+}
+
+void TcpServer::setHeartbeat(uint32_t pingIntervalMs, uint32_t idleTimeoutMs)
+{
+	_pingIntervalMs = pingIntervalMs;
+	_idleTimeoutMs = idleTimeoutMs;
 }
 
 void TcpServer::start()
 {
-	startAccept();
+	CoarseClock::start(_ioService);
+	for (size_t i = 0; i < std::max<size_t>(_options.pendingAccepts, 1); ++i)
+		startAccept();
 }
 
 void TcpServer::stop()
 {
-	_acceptor.close();
+	// the acceptor and its pending accepts belong to the io thread
+	_ioService.post([this]()
+	{
+		boost::system::error_code ec;
+		_acceptor.close(ec);
+		_acceptRetry.cancel(ec);
+	});
 }
 
-void TcpServer::startAccept()
+void TcpServer::drain(std::chrono::milliseconds deadline, std::function<void()> onDrained)
 {
-	auto pSession = std::make_shared<TcpSession>(_ioService, _dispatcher ? _dispatcher : std::make_shared<Dispatcher>());
+	_ioService.post([this, deadline, onDrained]()
+	{
+		boost::system::error_code ec;
+		_acceptor.close(ec);
+		_acceptRetry.cancel(ec);
+		_sessions->drainAll(_ioService, deadline, onDrained);
+	});
+}
 
-	_acceptor.async_accept(_socket, [this, pSession](const boost::system::error_code& error)
+void TcpServer::startAccept()
+{
+	auto socket = std::make_shared<tcp::socket>(_ioService);
+	_acceptor.async_accept(*socket, [this, socket](const boost::system::error_code& error)
 	{
-		if (error)
+		if (error == boost::asio::error::operation_aborted)
 		{
-			// log.error
+			// acceptor closed by stop() or drain()
+			return;
 		}
-		else
+		else if (error)
 		{
-			SessionManager::instance()->start(pSession);
-			pSession->begin(std::move(_socket));
+			// out of descriptors or memory, say, accepting again at once would only spin
+			++_acceptErrors;
+			_lastAcceptError = error.value();
+			retryAccept();
+			return;
 		}
 
+		++_accepted;
+		onAccept(std::move(*socket));
 		startAccept();
 	});
 }
 
+void TcpServer::retryAccept()
+{
+	// the accepts that fail meanwhile wait on the same timer
+	if (_parkedAccepts++)
+		return;
+
+	_acceptRetry.expires_from_now(std::chrono::milliseconds(_options.acceptRetryMs));
+	_acceptRetry.async_wait([this](const boost::system::error_code& error)
+	{
+		if (error)
+		{
+			// cancelled by stop() or drain()
+			return;
+		}
+
+		size_t parked = _parkedAccepts;
+		_parkedAccepts = 0;
+		if (!_acceptor.is_open())
+			return;
+		for (size_t i = 0; i < parked; ++i)
+			startAccept();
+	});
+}
+
+ServerStats TcpServer::getStats() const
+{
+	ServerStats stats;
+	stats.accepted = _accepted;
+	stats.acceptErrors = _acceptErrors;
+	stats.lastAcceptError = _lastAcceptError;
+	return stats;
+}
+
+void TcpServer::onAccept(tcp::socket socket)
+{
+	// a failing option is not worth dropping the connection
+	boost::system::error_code ec;
+	if (_options.noDelay)
+		socket.set_option(tcp::no_delay(true), ec);
+	if (_options.keepAlive)
+		socket.set_option(boost::asio::socket_base::keep_alive(true), ec);
+	if (_options.sendBufferSize > 0)
+		socket.set_option(boost::asio::socket_base::send_buffer_size(_options.sendBufferSize), ec);
+	if (_options.receiveBufferSize > 0)
+		socket.set_option(boost::asio::socket_base::receive_buffer_size(_options.receiveBufferSize), ec);
+	if (_options.busyPollUs > 0)
+		setBusyPoll(socket, _options.busyPollUs, ec);
+
+	auto pSession = std::make_shared<TcpSession>(_ioService, _dispatcher);
+	pSession->setAdmission(_admission);
+	pSession->setManager(_sessions);
+	if (_pingIntervalMs || _idleTimeoutMs)
+		pSession->setHeartbeat(TimerWheel::forService(_ioService), _pingIntervalMs, _idleTimeoutMs);
+
+	_sessions->start(pSession);
+	pSession->begin(std::move(socket));
+}
+
 } }
\ No newline at end of file
@@ -1,30 +1,105 @@
 #pragma once
 #include <memory>
+#include <chrono>
+#include <atomic>
 #include <boost/asio.hpp>
+#include <boost/asio/steady_timer.hpp>
 #include "Dispatcher.h"
+#include "Admission.h"
 
 namespace msgpack {
 namespace rpc {
 
+class SessionManager;
+
+/// Listen and accepted socket tuning. Buffer sizes of 0 keep the system default.
+struct ServerOptions
+{
+	int backlog = boost::asio::socket_base::max_connections;
+	bool reuseAddress = true;
+	bool noDelay = true;				// TCP_NODELAY, do not hold back small messages
+	bool keepAlive = false;				// SO_KEEPALIVE
+	int sendBufferSize = 0;				// SO_SNDBUF
+	int receiveBufferSize = 0;			// SO_RCVBUF, also set on the listener so it applies to the handshake
+	size_t pendingAccepts = 4;			// accepts kept outstanding at once
+	uint32_t busyPollUs = 0;			// SO_BUSY_POLL, with an io thread that busy polls, see runIoLoop
+	uint32_t acceptRetryMs = 100;		// wait after an accept failed, say out of descriptors, before the next
+};
+
+struct ServerStats
+{
+	uint64_t accepted = 0;
+	uint64_t acceptErrors = 0;			// accepts that failed, each one waited acceptRetryMs
+	int lastAcceptError = 0;			// system error code of the last of them
+};
+
 class TcpServer
 {
 public:
 	TcpServer(boost::asio::io_service& ios, short port);
 	TcpServer(boost::asio::io_service& ios, const boost::asio::ip::tcp::endpoint& endpoint);
+	TcpServer(boost::asio::io_service& ios, const boost::asio::ip::tcp::endpoint& endpoint, const ServerOptions& options);
 	virtual ~TcpServer();
 
 	void start();
+
+	/// stop accepting, from any thread, done on the io thread
 	void stop();
 
+	/// stop accepting, let the sessions of this server finish within deadline,
+	/// then call onDrained. from any thread, the work is posted to the io thread of the server.
+	void drain(std::chrono::milliseconds deadline, std::function<void()> onDrained = std::function<void()>());
+
 	void setDispatcher(std::shared_ptr<Dispatcher> disp);
 
+	/// shed load above these limits, must be set before start()
+	void setAdmissionLimits(const AdmissionLimits& limits);
+	std::shared_ptr<AdmissionControl> getAdmission() const;
+
+	/// ping sessions idle for pingIntervalMs, close them after idleTimeoutMs, 0 disables
+	void setHeartbeat(uint32_t pingIntervalMs, uint32_t idleTimeoutMs);
+
+	const ServerOptions& getOptions() const;
+
+	/// the sessions this server accepted and that are still open
+	std::shared_ptr<SessionManager> getSessions() const;
+
+	ServerStats getStats() const;
+
 private:
 	void startAccept();
+	void retryAccept();
+	void onAccept(boost::asio::ip::tcp::socket socket);
 
 	boost::asio::io_service& _ioService;
-	boost::asio::ip::tcp::socket _socket;
+	ServerOptions _options;
 	boost::asio::ip::tcp::acceptor _acceptor;
 	std::shared_ptr<Dispatcher> _dispatcher;
+	std::shared_ptr<AdmissionControl> _admission;
+	std::shared_ptr<SessionManager> _sessions;
+	uint32_t _pingIntervalMs;
+	uint32_t _idleTimeoutMs;
+
+	boost::asio::steady_timer _acceptRetry;
+	size_t _parkedAccepts;				// failed accepts waiting on _acceptRetry, io thread only
+	std::atomic<uint64_t> _accepted;
+	std::atomic<uint64_t> _acceptErrors;
+	std::atomic<int> _lastAcceptError;
 };
 
+inline std::shared_ptr<AdmissionControl> TcpServer::getAdmission() const
+{
+	return _admission;
+}
+
+inline const ServerOptions& TcpServer::getOptions() const
+{
+	return _options;
+}
+
+inline std::shared_ptr<SessionManager> TcpServer::getSessions() const
+{
+	return _sessions;
+}
+
 } }
\ No newline at end of file
@@ -1,6 +1,8 @@
 #include "TcpSession.h"
 #include <functional>	// std::bind
+#include <random>
 #include "SessionManager.h"
+#include "CoarseClock.h"
 
 namespace msgpack {
 namespace rpc {
@@ -14,6 +16,21 @@ uint32_t RequestFactory::nextMsgid()
 	return _nextMsgid++;
 }
 
+/// 128 random bits as hex, guessing one means guessing them all
+static std::string newResumeToken()
+{
+	static const char digits[] = "0123456789abcdef";
+	std::random_device device;
+	std::string token;
+	for (int i = 0; i < 4; ++i)
+	{
+		uint32_t word = device();
+		for (int j = 0; j < 8; ++j, word >>= 4)
+			token += digits[word & 15];
+	}
+	return token;
+}
+
 TcpSession::TcpSession(boost::asio::io_service& ios, std::shared_ptr<Dispatcher> disp):
 	_ioService(ios),
 	_dispatcher(disp)
@@ -23,29 +40,188 @@ TcpSession::TcpSession(boost::asio::io_service& ios, std::shared_ptr<Dispatcher>
 void TcpSession::setDispatcher(std::shared_ptr<Dispatcher> disp)
 {
 	_dispatcher = disp;
+	_rateState = RateState();
 }
 
-void TcpSession::begin(tcp::socket socket)
+void TcpSession::setAdmission(std::shared_ptr<AdmissionControl> admission)
 {
-	_connection = std::make_shared<TcpConnection>(std::move(socket));
+	_admission = admission;
+	if (_connection)
+		_connection->setWriteLimit(_admission ? _admission->limits().maxPendingWriteBytes : 0);
+}
 
-	_connection->setMsgHandler(std::bind(&TcpSession::processMsg, shared_from_this(), _1, _2));	// std::bindصֵʧ
-	_connection->setNetErrorHandler(std::bind(&TcpSession::netErrorHandler, shared_from_this(), _1));
-	_connection->setConnectionHandler(_connectionCallback);
+void TcpSession::setManager(std::shared_ptr<SessionManager> manager)
+{
+	_manager = manager;
+}
+
+void TcpSession::begin(tcp::socket socket)
+{
+	auto connection = std::make_shared<TcpConnection>(_ioService, std::move(socket));
+	watch(connection);
+	if (_admission)
+		connection->setWriteLimit(_admission->limits().maxPendingWriteBytes);
+	{
+		std::lock_guard<std::mutex> lock(_mtxRequest);
+		_connection = connection;
+		_linkUp = true;
+		_resumeToken = newResumeToken();
+		_connection->setResumeToken(_resumeToken);
+	}
 
 	_connection->startRead();
+	_connection->asyncWrite(session_token_notify(_connection->getResumeToken()));
+
+	if (_wheel && (_pingIntervalMs || _idleTimeoutMs))
+		scheduleIdleCheck(_pingIntervalMs ? _pingIntervalMs : _idleTimeoutMs);
 }
 
 void TcpSession::asyncConnect(const boost::asio::ip::tcp::endpoint& endpoint)
 {
-	_connection = std::make_shared<TcpConnection>(_ioService);
+	auto connection = std::make_shared<TcpConnection>(_ioService);
+	connection->setBusyPoll(_busyPollUs);
+	watch(connection);
+	if (_admission)
+		connection->setWriteLimit(_admission->limits().maxPendingWriteBytes);
+	{
+		std::lock_guard<std::mutex> lock(_mtxRequest);
+		_connection = connection;
+		_linkUp = true;
+	}
+
+	connection->asyncConnect(endpoint);
+}
+
+void TcpSession::watch(const std::shared_ptr<TcpConnection>& connection)
+{
+	// a replaced connection may still report its end, it is told apart by raw
+	auto self = shared_from_this();
+	TcpConnection* raw = connection.get();
+	connection->setMsgHandler(std::bind(&TcpSession::processMsg, self, _1, _2));	// std::bindصֵʧ
+	connection->setNetErrorHandler([self, raw](boost::system::error_code error)
+	{
+		self->netErrorHandler(error);
+		self->onConnectionLost(raw);
+	});
+	connection->setConnectionHandler([self](ConnectionStatus status)
+	{
+		if (self->_connectionCallback)
+			self->_connectionCallback(status);
+	});
+}
+
+void TcpSession::onConnectionLost(TcpConnection* connection)
+{
+	std::vector<std::shared_ptr<AsyncCallCtx>> failed;
+	std::shared_ptr<TcpConnection> lost;
+	{
+		std::lock_guard<std::mutex> lock(_mtxRequest);
+		if (!_linkUp || connection != _connection.get())
+			return;
+		_linkUp = false;
+		lost = _connection;
+
+		// whether the server saw a call is unknown, only idempotent ones may go again
+		for (auto it = _mapRequest.begin(); it != _mapRequest.end();)
+		{
+			if (_holdCalls && it->second.request)
+			{
+				it->second.sent = false;
+				++it;
+			}
+			else
+			{
+				failed.push_back(it->second.call);
+				it = _mapRequest.erase(it);
+			}
+		}
+	}
+	failCalls(failed);
+	if (_dispatcher)
+		_dispatcher->connection_closed(lost);
+
+	if (_disconnectCallback)
+		_disconnectCallback();
+}
+
+void TcpSession::failCalls(std::vector<std::shared_ptr<AsyncCallCtx>>& calls)
+{
+	_failedCalls += calls.size();
+	for (auto& call : calls)
+		call->setError(error_connection_lost, "connection lost");
+}
+
+void TcpSession::setConnectionHandler(ConnectionHandler handler)
+{
+	_connectionCallback = handler;
+}
+
+void TcpSession::setDisconnectHandler(std::function<void()> handler)
+{
+	_disconnectCallback = handler;
+}
+
+void TcpSession::setWaitStrategy(const WaitStrategy& strategy)
+{
+	_waitStrategy = strategy;
+}
 
-	_connection->setMsgHandler(std::bind(&TcpSession::processMsg, shared_from_this(), _1, _2));	// std::bindصֵʧ
-	_connection->setNetErrorHandler(std::bind(&TcpSession::netErrorHandler, shared_from_this(), _1));
-	_connection->setConnectionHandler(_connectionCallback);
+void TcpSession::setBusyPoll(uint32_t us)
+{
+	_busyPollUs = us;
+}
+
+void TcpSession::setIdempotent(const std::string& method)
+{
+	std::lock_guard<std::mutex> lock(_mtxRequest);
+	_idempotent.insert(method);
+}
+
+void TcpSession::setHoldCalls(bool hold)
+{
+	std::vector<std::shared_ptr<AsyncCallCtx>> failed;
+	{
+		std::lock_guard<std::mutex> lock(_mtxRequest);
+		_holdCalls = hold;
+		if (hold)
+			return;
+		for (auto it = _mapRequest.begin(); it != _mapRequest.end();)
+		{
+			if (!it->second.sent)
+			{
+				failed.push_back(it->second.call);
+				it = _mapRequest.erase(it);
+			}
+			else
+				++it;
+		}
+	}
+	failCalls(failed);
+}
 
-	_connection->asyncConnect(endpoint);
+void TcpSession::replay()
+{
+	std::vector<std::shared_ptr<msgpack::sbuffer>> requests;
+	std::shared_ptr<TcpConnection> connection;
+	{
+		std::lock_guard<std::mutex> lock(_mtxRequest);
+		if (!_linkUp)
+			return;
+		connection = _connection;
+		// in msgid order, the order they were made in
+		for (auto& entry : _mapRequest)
+		{
+			if (!entry.second.sent)
+			{
+				entry.second.sent = true;
+				requests.push_back(entry.second.request);
+			}
+		}
+	}
 
+	_replayedCalls += requests.size();
+	for (auto& request : requests)
+		connection->asyncWrite(request);
 }
 
 void TcpSession::stop()
@@ -56,6 +232,84 @@ void TcpSession::stop()
 void TcpSession::close()
 {
 	_connection->close();
+	onConnectionLost(_connection.get());
+}
+
+void TcpSession::setHeartbeat(std::shared_ptr<TimerWheel> wheel, uint32_t pingIntervalMs, uint32_t idleTimeoutMs)
+{
+	_wheel = wheel;
+	_pingIntervalMs = pingIntervalMs;
+	_idleTimeoutMs = idleTimeoutMs;
+}
+
+void TcpSession::scheduleIdleCheck(uint32_t delayMs)
+{
+	// weak, a closed session simply drops out of the wheel
+	std::weak_ptr<TcpSession> weak = shared_from_this();
+	_wheel->schedule(delayMs, [weak]()
+	{
+		if (auto self = weak.lock())
+			self->checkIdle();
+	});
+}
+
+void TcpSession::checkIdle()
+{
+	if (!_connection || _connection->getConnectionStatus() != connection_connected)
+		return;
+
+	uint64_t idleMs = (CoarseClock::now() - _connection->getLastActivity()) * CoarseClock::TICK_MS;
+	if (_idleTimeoutMs && idleMs >= _idleTimeoutMs)
+	{
+		// dead peer, reap it
+		leaveManager();
+		_connection->close();
+		return;
+	}
+
+	uint32_t next = _pingIntervalMs ? _pingIntervalMs : _idleTimeoutMs;
+	if (_pingIntervalMs)
+	{
+		if (idleMs >= _pingIntervalMs)
+			_connection->asyncWrite(heartbeat_notify("ping"), WriteHandler(), priority_high);
+		else
+			next = static_cast<uint32_t>(_pingIntervalMs - idleMs);
+	}
+	if (_idleTimeoutMs)
+		next = std::min(next, static_cast<uint32_t>(_idleTimeoutMs - idleMs));
+
+	scheduleIdleCheck(next);
+}
+
+void TcpSession::closeGracefully()
+{
+	if (_connection)
+		_connection->closeAfterWrite();
+}
+
+void TcpSession::drain(uint32_t deadlineMs)
+{
+	_draining = true;
+	if (_connection && _connection->getConnectionStatus() == connection_connected)
+		_connection->asyncWrite(going_away_notify(deadlineMs), WriteHandler(), priority_high);
+}
+
+bool TcpSession::isIdle()
+{
+	if (_inflight)
+		return false;
+	{
+		std::lock_guard<std::mutex> lock(_mtxRequest);
+		if (!_mapRequest.empty())
+			return false;
+	}
+	return !_connection || _connection->getPendingBytes() == 0;
+}
+
+std::string TcpSession::getResumeToken()
+{
+	std::lock_guard<std::mutex> lock(_mtxRequest);
+	return _resumeToken;
 }
 
 bool TcpSession::isConnected()
@@ -65,7 +319,13 @@ bool TcpSession::isConnected()
 
 void TcpSession::netErrorHandler(boost::system::error_code & error)
 {
-	SessionManager::instance()->stop(shared_from_this());
+	leaveManager();
+}
+
+void TcpSession::leaveManager()
+{
+	if (auto manager = _manager.lock())
+		manager->stop(shared_from_this());
 }
 
 void TcpSession::processMsg(const object &msg, std::shared_ptr<TcpConnection> TcpConnection)
@@ -74,46 +334,168 @@ void TcpSession::processMsg(const object &msg, std::shared_ptr<TcpConnection> Tc
 	msg.convert(&rpc);
 	switch (rpc.type) {
 	case MSG_TYPE_REQUEST:
-		_dispatcher->dispatch(msg, TcpConnection);
+		processRequest(msg, TcpConnection);
 		break;
 
 	case MSG_TYPE_RESPONSE:
 	{
 		MsgResponse<object, object> res;
 		msg.convert(&res);
-		auto found = _mapRequest.find(res.msgid);
-		if (found != _mapRequest.end()) {
-			if (res.error.type == msgpack::type::NIL) {
-				found->second->setResult(res.result);
-			}
-			else if (res.error.type == msgpack::type::BOOLEAN) {
-				bool isError;
-				res.error.convert(&isError);
-				if (isError) {
-					found->second->setError(res.result);
-				}
-				else {
-					found->second->setResult(res.result);
-				}
+		std::shared_ptr<AsyncCallCtx> call;
+		{
+			std::lock_guard<std::mutex> lock(_mtxRequest);
+			auto found = _mapRequest.find(res.msgid);
+			if (found == _mapRequest.end()) {
+				throw client_error("no request for response");
 			}
-			// _mapRequest.erase(found);
+			call = found->second.call;
+			_mapRequest.erase(found);
 		}
-		else {
-			throw client_error("no request for response");
+		if (res.error.type == msgpack::type::NIL) {
+			call->setResult(res.result);
+		}
+		else if (res.error.type == msgpack::type::BOOLEAN) {
+			bool isError;
+			res.error.convert(&isError);
+			if (isError) {
+				call->setError(res.result);
+			}
+			else {
+				call->setResult(res.result);
+			}
 		}
 	}
 	break;
 
 	case MSG_TYPE_NOTIFY:
-	{
-		MsgNotify<object, object> req;
-		msg.convert(&req);
-	}
-	break;
+		processNotify(msg, TcpConnection);
+		break;
 
 	default:
 		throw client_error("rpc type error");
 	}
 }
 
+void TcpSession::processRequest(const object &msg, std::shared_ptr<TcpConnection> connection)
+{
+	MsgRequest<object, object> req;
+	msg.convert(&req);
+
+	if (_draining)
+	{
+		connection->asyncWrite(msgerror("server draining", error_server_draining).to_msg(req.msgid));
+		return;
+	}
+
+	if (!_dispatcher->check_rate(req.method, _rateState))
+	{
+		connection->asyncWrite(msgerror("rate limited", error_rate_limited).to_msg(req.msgid));
+		return;
+	}
+
+	if (!admit(connection))
+	{
+		// reply fast and stop reading until the backlog drains
+		auto self = shared_from_this();
+		connection->pauseRead(TcpConnection::pause_admission);
+		connection->asyncWrite(msgerror("server overloaded", error_server_overloaded).to_msg(req.msgid),
+			[this, self](const boost::system::error_code&) { resumeAdmission(); });
+		return;
+	}
+
+	auto self = shared_from_this();
+	try
+	{
+		_dispatcher->dispatch(req, connection, [this, self](const boost::system::error_code&) { release(); });
+	}
+	catch (...)
+	{
+		release();
+		throw;
+	}
+}
+
+void TcpSession::processNotify(const object &msg, std::shared_ptr<TcpConnection> connection)
+{
+	MsgNotify<object, object> req;
+	msg.convert(&req);
+
+	// any data counts as activity, only ping needs an answer
+	if (req.method.type != msgpack::type::STR)
+		return;
+	std::string method(req.method.via.str.ptr, req.method.via.str.size);
+	if (method == "ping")
+	{
+		connection->asyncWrite(heartbeat_notify("pong"), WriteHandler(), priority_high);
+	}
+	else if (method == "session_token")
+	{
+		std::tuple<std::string> token;
+		req.param.convert(&token);
+		std::lock_guard<std::mutex> lock(_mtxRequest);
+		_resumeToken = std::get<0>(token);
+	}
+	else
+	{
+		_dispatcher->dispatch_notify(method, req.param, connection);
+	}
+}
+
+bool TcpSession::admit(const std::shared_ptr<TcpConnection>& connection)
+{
+	if (!_admission)
+	{
+		++_inflight;
+		return true;
+	}
+
+	const AdmissionLimits& limits = _admission->limits();
+	if ((limits.maxInflightRequests && _inflight >= limits.maxInflightRequests)
+		|| (limits.maxPendingWriteBytes && connection->getPendingBytes() >= limits.maxPendingWriteBytes)
+		|| !_admission->tryAcquire())
+	{
+		_admission->onRejected();
+		return false;
+	}
+	++_inflight;
+	return true;
+}
+
+void TcpSession::release()
+{
+	--_inflight;
+	if (_admission)
+	{
+		_admission->release();
+		resumeAdmission();
+	}
+}
+
+void TcpSession::resumeAdmission()
+{
+	const AdmissionLimits& limits = _admission->limits();
+	if (!_connection || _waitingServer)
+		return;
+	// over its own limit, the release of one of its requests comes back here
+	if (limits.maxInflightRequests && _inflight >= limits.maxInflightRequests)
+		return;
+
+	if (limits.maxServerWork && _admission->getWork() >= limits.maxServerWork)
+	{
+		// the work is of other sessions, the release that brings it under the limit wakes this one
+		_waitingServer = true;
+		auto self = shared_from_this();
+		_admission->whenBelowLimit([this, self]()
+		{
+			_ioService.post([this, self]()
+			{
+				_waitingServer = false;
+				resumeAdmission();
+			});
+		});
+		return;
+	}
+	_connection->resumeRead(TcpConnection::pause_admission);
+}
+
 } }
\ No newline at end of file
@@ -1,11 +1,18 @@
 #pragma once
 #include "TcpConnection.h"
 #include "Dispatcher.h"
+#include "Admission.h"
+#include "TimerWheel.h"
 #include <memory>	// enable_shared_from_this 
+#include <mutex>
+#include <set>
+#include <atomic>
 
 namespace msgpack {
 namespace rpc {
 
+class SessionManager;
+
 class RequestFactory
 {
 public:
@@ -24,12 +31,61 @@ public:
 
 	void setDispatcher(std::shared_ptr<Dispatcher> disp);
 
+	/// limits for this session, admission is shared by the sessions of one server
+	void setAdmission(std::shared_ptr<AdmissionControl> admission);
+
+	/// the sessions of the server that accepted this one, told when it ends
+	void setManager(std::shared_ptr<SessionManager> manager);
+
+	/// ping after pingIntervalMs without data, close after idleTimeoutMs, 0 disables.
+	/// checks run on wheel, which must belong to the io loop of this session.
+	void setHeartbeat(std::shared_ptr<TimerWheel> wheel, uint32_t pingIntervalMs, uint32_t idleTimeoutMs);
+
+	/// status changes of every connection the session makes, on the io thread
+	void setConnectionHandler(ConnectionHandler handler);
+
+	/// called once per lost connection after its calls are settled, on the io thread
+	/// unless close() lost it
+	void setDisconnectHandler(std::function<void()> handler);
+
+	/// calls of method have no side effects worth guarding, they may be sent twice
+	void setIdempotent(const std::string& method);
+
+	/// while holding, calls of idempotent methods outlive a lost connection and
+	/// are sent again by replay(), other calls fail with error_connection_lost.
+	/// holding no more fails the calls held.
+	void setHoldCalls(bool hold);
+
+	/// send the held calls over the current connection, asyncConnect first
+	void replay();
+
+	/// how syncCall waits for its reply, parks right away by default
+	void setWaitStrategy(const WaitStrategy& strategy);
+
+	/// SO_BUSY_POLL for the connections asyncConnect makes from now on
+	void setBusyPoll(uint32_t us);
+
+	uint64_t getReplayedCalls() const { return _replayedCalls; }
+	uint64_t getFailedCalls() const { return _failedCalls; }
+
 	void begin(boost::asio::ip::tcp::socket socket);
 	void asyncConnect(const boost::asio::ip::tcp::endpoint& endpoint);
 
 	void stop();
 	void close();
 
+	/// flush queued writes before closing
+	void closeGracefully();
+
+	/// send going_away and refuse new requests, in-flight ones still complete
+	void drain(uint32_t deadlineMs);
+
+	/// nothing in flight in either direction and nothing left to write
+	bool isIdle();
+
+	/// issued by the server when the session begins, a client has it once session_token arrived
+	std::string getResumeToken();
+
 	bool isConnected();
 	void netErrorHandler(boost::system::error_code &error);
 
@@ -40,6 +96,10 @@ public:
 	template<typename... TArgs>
 	std::shared_ptr<AsyncCallCtx> asyncCall(OnAsyncCall callback, const std::string& method, TArgs... args);
 
+	/// fire and forget, false if there is no connection to send it on
+	template<typename... TArgs>
+	bool notify(const std::string& method, TArgs... args);
+
 	// syncCall
 	template<typename... TArgs>
 	void syncCall(const std::string& method, TArgs... args);
@@ -52,15 +112,57 @@ private:
 	std::shared_ptr<AsyncCallCtx> asyncSend(const MsgRequest<std::string, TArg>& msgreq, OnAsyncCall callback = OnAsyncCall());
 
 	void processMsg(const object& msg, std::shared_ptr<TcpConnection> TcpConnection);
+	void processRequest(const object& msg, std::shared_ptr<TcpConnection> connection);
+
+	void processNotify(const object& msg, std::shared_ptr<TcpConnection> connection);
+	void watch(const std::shared_ptr<TcpConnection>& connection);
+	void onConnectionLost(TcpConnection* connection);
+	void failCalls(std::vector<std::shared_ptr<AsyncCallCtx>>& calls);
+	void scheduleIdleCheck(uint32_t delayMs);
+	void checkIdle();
+	void leaveManager();
+
+	bool admit(const std::shared_ptr<TcpConnection>& connection);
+	void release();
+	void resumeAdmission();
 
 	boost::asio::io_service& _ioService;
 	RequestFactory _reqFactory;
 
-	std::shared_ptr<TcpConnection> _connection;
-	std::map<uint32_t, std::shared_ptr<AsyncCallCtx>> _mapRequest;	// Ҫмɾ
+	struct PendingCall
+	{
+		std::shared_ptr<AsyncCallCtx> call;
+		std::shared_ptr<msgpack::sbuffer> request;	// idempotent calls only, to send again
+		bool sent;
+	};
+
+	std::shared_ptr<TcpConnection> _connection;	// replaced under _mtxRequest
+	std::map<uint32_t, PendingCall> _mapRequest;	// Ҫмɾ
+	std::mutex _mtxRequest;
+
+	bool _linkUp = {false};		// _connection is connecting or connected, guarded by _mtxRequest
+	bool _holdCalls = {false};
+	std::set<std::string> _idempotent;
+	WaitStrategy _waitStrategy;
+	uint32_t _busyPollUs = {0};
+	std::function<void()> _disconnectCallback;
+	std::atomic<uint64_t> _replayedCalls = {0};
+	std::atomic<uint64_t> _failedCalls = {0};
 
 	ConnectionHandler _connectionCallback;
 	std::shared_ptr<Dispatcher> _dispatcher;
+
+	RateState _rateState;
+	std::shared_ptr<AdmissionControl> _admission;
+	std::weak_ptr<SessionManager> _manager;	// null for client sessions
+	size_t _inflight = {0};		// requests dispatched but not answered yet
+	bool _waitingServer = {false};	// reading paused until the server work drops
+	bool _draining = {false};
+	std::string _resumeToken;	// guarded by _mtxRequest, a client learns it from the io thread
+
+	std::shared_ptr<TimerWheel> _wheel;
+	uint32_t _pingIntervalMs = {0};
+	uint32_t _idleTimeoutMs = {0};
 };
 
 // inline defination
@@ -84,12 +186,29 @@ inline std::shared_ptr<AsyncCallCtx> TcpSession::asyncCall(OnAsyncCall callback,
 	return asyncSend(request, callback);
 }
 
+template<typename... TArgs>
+inline bool TcpSession::notify(const std::string& method, TArgs... args)
+{
+	std::shared_ptr<TcpConnection> connection;
+	{
+		std::lock_guard<std::mutex> lock(_mtxRequest);
+		if (_linkUp)
+			connection = _connection;
+	}
+	if (!connection)
+		return false;
+
+	MsgNotify<std::string, std::tuple<TArgs...>> msg(method, std::tuple<TArgs...>(args...));
+	connection->asyncWrite(packExact(msg));
+	return true;
+}
+
 template<typename... TArgs>
 inline void TcpSession::syncCall(const std::string& method, TArgs... args)
 {
 	auto request = _reqFactory.create(method, args...);
 	auto call = TcpSession::asyncSend(request);
-	call->sync();
+	call->sync(_waitStrategy);
 }
 
 template<typename R, typename... TArgs>
@@ -97,22 +216,54 @@ inline R& TcpSession::syncCall(R *value, const std::string& method, TArgs... arg
 {
 	auto request = _reqFactory.create(method, args...);
 	auto call = TcpSession::asyncSend(request);
-	call->sync().convert(value);
+	call->sync(_waitStrategy).convert(value);
 	return *value;
 }
 
 template<typename TArg>
 inline std::shared_ptr<AsyncCallCtx> TcpSession::asyncSend(const MsgRequest<std::string, TArg>& msgreq, OnAsyncCall callback)
 {
-	auto sbuf = std::make_shared<msgpack::sbuffer>();
-	::msgpack::pack(*sbuf, msgreq);
+	// a large request is packed in one go, not regrown on the way
+	auto sbuf = packExact(msgreq);
 
 	std::stringstream ss;
 	ss << msgreq.method << msgreq.param;
 	auto req = std::make_shared<AsyncCallCtx>(ss.str(), callback);
-	_mapRequest.insert(std::make_pair(msgreq.msgid, req));
+	std::shared_ptr<TcpConnection> connection;
+	// the callback runs from setError, it may call again, so not under the lock
+	ServerSideError failed = success;
+	{
+		std::lock_guard<std::mutex> lock(_mtxRequest);
+		PendingCall pending = { req, nullptr, _linkUp };
+		if (_idempotent.count(msgreq.method))
+			pending.request = sbuf;
+
+		if (_admission && _admission->limits().maxInflightRequests
+			&& _mapRequest.size() >= _admission->limits().maxInflightRequests)
+		{
+			// fail fast instead of queuing
+			failed = error_server_overloaded;
+		}
+		else if (!_linkUp && !(_holdCalls && pending.request))
+		{
+			// no connection and none coming for this call, do not leave the caller waiting
+			++_failedCalls;
+			failed = error_connection_lost;
+		}
+		else
+		{
+			_mapRequest.insert(std::make_pair(msgreq.msgid, pending));
+			if (_linkUp)
+				connection = _connection;
+		}
+	}
 
-	_connection->asyncWrite(sbuf);
+	if (failed == error_server_overloaded)
+		req->setError(failed, "too many requests in flight");
+	else if (failed == error_connection_lost)
+		req->setError(failed, "not connected");
+	else if (connection)
+		connection->asyncWrite(sbuf);
 
 	return req;
 }
@@ -0,0 +1,97 @@
+#include "TimerWheel.h"
+#include <algorithm>
+#include <map>
+#include <mutex>
+
+namespace msgpack {
+namespace rpc {
+
+TimerWheel::TimerWheel(boost::asio::io_service& ios, uint32_t tickMs, size_t slots):
+	_ioService(ios),
+	_timer(ios),
+	_tickMs(tickMs),
+	_slots(slots),
+	_cursor(0),
+	_size(0),
+	_running(false)
+{
+}
+
+std::shared_ptr<TimerWheel> TimerWheel::forService(boost::asio::io_service& ios)
+{
+	// weak, the pending tick handler keeps a running wheel alive
+	static std::mutex mtx;
+	static std::map<boost::asio::io_service*, std::weak_ptr<TimerWheel>> wheels;
+
+	std::lock_guard<std::mutex> lock(mtx);
+	auto wheel = wheels[&ios].lock();
+	if (!wheel)
+	{
+		wheel = std::make_shared<TimerWheel>(ios);
+		wheel->start();
+		wheels[&ios] = wheel;
+	}
+	return wheel;
+}
+
+void TimerWheel::start()
+{
+	if (_running)
+		return;
+
+	_running = true;
+	_nextTick = std::chrono::steady_clock::now() + std::chrono::milliseconds(_tickMs);
+	asyncTick();
+}
+
+void TimerWheel::stop()
+{
+	_running = false;
+	boost::system::error_code ec;
+	_timer.cancel(ec);
+}
+
+void TimerWheel::schedule(uint32_t delayMs, Callback cb)
+{
+	size_t ticks = std::max<size_t>(1, (delayMs + _tickMs - 1) / _tickMs);
+	size_t slot = (_cursor + ticks) % _slots.size();
+	_slots[slot].push_back(Entry{ (ticks - 1) / _slots.size(), std::move(cb) });
+	++_size;
+}
+
+void TimerWheel::asyncTick()
+{
+	// absolute deadlines, a late tick does not push the following ones back
+	auto self = shared_from_this();
+	_timer.expires_at(_nextTick);
+	_timer.async_wait([this, self](const boost::system::error_code& error)
+	{
+		if (error || !_running)
+			return;
+
+		onTick();
+		_nextTick += std::chrono::milliseconds(_tickMs);
+		asyncTick();
+	});
+}
+
+void TimerWheel::onTick()
+{
+	_cursor = (_cursor + 1) % _slots.size();
+
+	std::vector<Entry> due;
+	due.swap(_slots[_cursor]);
+	for (auto& entry : due)
+	{
+		if (entry.rounds)
+		{
+			--entry.rounds;
+			_slots[_cursor].push_back(std::move(entry));
+			continue;
+		}
+		--_size;
+		entry.cb();
+	}
+}
+
+} }
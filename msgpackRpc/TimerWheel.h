@@ -0,0 +1,66 @@
+#pragma once
+#include <memory>
+#include <vector>
+#include <functional>
+#include <boost/asio.hpp>
+#include <boost/asio/steady_timer.hpp>
+
+namespace msgpack {
+namespace rpc {
+
+/// Hashed timer wheel driven by one coarse timer per io loop, so thousands
+/// of sessions can be timed without a timer each. Callbacks run on the io
+/// thread and schedule() must be called from it as well.
+class TimerWheel : public std::enable_shared_from_this<TimerWheel>
+{
+public:
+	typedef std::function<void()> Callback;
+
+	static const uint32_t DEFAULT_TICK_MS = 250;
+	static const size_t DEFAULT_SLOTS = 512;
+
+	TimerWheel(boost::asio::io_service& ios, uint32_t tickMs = DEFAULT_TICK_MS, size_t slots = DEFAULT_SLOTS);
+
+	/// The wheel of this io loop, created and started on first use.
+	static std::shared_ptr<TimerWheel> forService(boost::asio::io_service& ios);
+
+	void start();
+	void stop();
+
+	/// run cb once after delayMs, rounded up to whole ticks
+	void schedule(uint32_t delayMs, Callback cb);
+
+	uint32_t getTickMs() const;
+	size_t size() const;
+
+private:
+	struct Entry
+	{
+		size_t rounds;
+		Callback cb;
+	};
+
+	void asyncTick();
+	void onTick();
+
+	boost::asio::io_service& _ioService;
+	boost::asio::steady_timer _timer;
+	uint32_t _tickMs;
+	std::vector<std::vector<Entry>> _slots;
+	size_t _cursor;
+	size_t _size;
+	bool _running;
+	std::chrono::steady_clock::time_point _nextTick;
+};
+
+inline uint32_t TimerWheel::getTickMs() const
+{
+	return _tickMs;
+}
+
+inline size_t TimerWheel::size() const
+{
+	return _size;
+}
+
+} }